@@ -0,0 +1,1575 @@
+//
+// bench.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <iostream>
+#include <iomanip>
+#include <exception>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <chrono>
+#include <stdexcept>
+#include <cfloat>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "common.h"
+#include "camera.h"
+#include "film.h"
+#include "isect.h"
+#include "material.h"
+#include "ray.h"
+#include "primitive.h"
+#include "scene.h"
+#include "mesh.h"
+#include "bvh.h"
+#include "spheres.h"
+#include "packet.h"
+#include "sampler.h"
+#include "tonemap.h"
+#include "image.h"
+#include "checkpoint.h"
+#include "tracer.h"
+
+///
+/// @brief Generate a set of camera rays through random points on the film.
+///
+static std::vector<Ray> CreateRays(size_t num_rays)
+{
+    Camera camera = Camera::Create(
+        kCameraEye,
+        kCameraCtr,
+        kCameraUp,
+        kCameraFov,
+        (Real) kFilmWidth / kFilmHeight,
+        kCameraFocus,
+        kCameraAperture);
+    Sampler sampler = Sampler::Create(Sampler::Random, kRandomSeed);
+
+    std::vector<Ray> rays(num_rays);
+    for (auto &ray : rays) {
+        Vec2 u1 = sampler.Rand2d();
+        Vec2 u2 = sampler.Rand2d();
+        ray = camera.rayto(u1, u2);
+    }
+    return rays;
+}
+
+///
+/// @brief Return the elapsed time in seconds since the specified start time.
+///
+static double Elapsed(const std::chrono::steady_clock::time_point &start)
+{
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+///
+/// @brief Pin the calling thread to the specified cpu, so the benchmarks are
+/// not perturbed by thread migration. Return false if the thread could not be
+/// pinned, or if pinning is not supported by the platform.
+///
+static bool PinThread(size_t cpu)
+{
+#if defined(__linux__)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    return pthread_setaffinity_np(
+        pthread_self(), sizeof(cpu_set_t), &cpuset) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+///
+/// @brief Timing of a kernel, in nanoseconds per operation, and the relative
+/// spread of the measurements around the median.
+///
+struct Timing {
+    double ns_op;
+    double spread;
+};
+
+///
+/// @brief Measure the time per operation of a kernel, called with no arguments
+/// and executing num_ops operations per call. The kernel returns a value that
+/// depends on all its results, so the compiler can not remove the work.
+///
+/// The kernel is called once to warm up the caches and the branch predictors,
+/// and to find how many calls make a repetition that runs for at least a few
+/// milliseconds, well above the clock resolution. The repetitions are then
+/// timed, and the median is insensitive to the occasional interrupt. The
+/// spread is the interquartile range relative to the median.
+///
+template<typename Kernel>
+static Timing Measure(size_t num_ops, Kernel kernel)
+{
+    static const size_t kNumRepeats = 15;
+    static const double kMinTime = 0.01;
+    static volatile double sink = 0.0;
+
+    auto start = std::chrono::steady_clock::now();
+    sink = sink + (double) kernel();
+    double warmup = std::max(Elapsed(start), 1.0e-9);
+    size_t num_calls = std::max<size_t>(1, (size_t) (kMinTime / warmup) + 1);
+
+    std::vector<double> elapsed(kNumRepeats);
+    for (auto &it : elapsed) {
+        start = std::chrono::steady_clock::now();
+        for (size_t k = 0; k < num_calls; ++k) {
+            sink = sink + (double) kernel();
+        }
+        it = Elapsed(start) / num_calls;
+    }
+    std::sort(elapsed.begin(), elapsed.end());
+
+    double median = elapsed[kNumRepeats / 2];
+    double q1 = elapsed[kNumRepeats / 4];
+    double q3 = elapsed[(3 * kNumRepeats) / 4];
+    Timing timing;
+    timing.ns_op = 1.0e9 * median / num_ops;
+    timing.spread = (q3 - q1) / median;
+    return timing;
+}
+
+///
+/// @brief Compare the bvh closest-hit query with the linear scan over the world
+/// as the number of grid cells grows. Both queries must return the same hits.
+///
+static void BenchBvh()
+{
+    static const int32_t kCells[] = {1, 2, 5, 10, 20, 50};
+    static const size_t kNumRays = 1 << 14;
+    const Real t_min = 0.001;
+    const Real t_max = kRealMax;
+    const std::vector<Ray> rays = CreateRays(kNumRays);
+
+    std::cout << "bvh vs linear, " << kNumRays << " camera rays\n"
+              << std::setw(6) << "cells"
+              << std::setw(10) << "spheres"
+              << std::setw(12) << "build(ms)"
+              << std::setw(8) << "nodes"
+              << std::setw(8) << "depth"
+              << std::setw(14) << "linear(Mr/s)"
+              << std::setw(12) << "bvh(Mr/s)"
+              << std::setw(10) << "speedup"
+              << std::setw(12) << "nodes/ray"
+              << std::setw(12) << "tests/ray"
+              << std::setw(12) << "any(Mr/s)"
+              << std::setw(12) << "any nodes"
+              << std::setw(10) << "mismatch" << "\n";
+
+    for (int32_t cells : kCells) {
+        std::vector<Primitive> world =
+            Scene::Generate(cells, 0, kRandomSeed).m_primitives;
+        Bvh bvh = Bvh::Create(world);
+
+        std::vector<Real> t_linear(rays.size(), -1.0);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rays.size(); ++i) {
+            Isect isect;
+            if (Primitive::Intersect(world, rays[i], t_min, t_max, isect)) {
+                t_linear[i] = isect.t;
+            }
+        }
+        double linear_time = Elapsed(start);
+
+        Bvh::Stats stats = {};
+        std::vector<Real> t_bvh(rays.size(), -1.0);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rays.size(); ++i) {
+            Isect isect;
+            if (Bvh::Intersect(
+                    bvh, world, rays[i], t_min, t_max, isect, &stats)) {
+                t_bvh[i] = isect.t;
+            }
+        }
+        double bvh_time = Elapsed(start);
+
+        // Any-hit query over the same interval, as used by shadow rays.
+        Bvh::Stats any_stats = {};
+        std::vector<bool> occluded(rays.size());
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rays.size(); ++i) {
+            occluded[i] = Bvh::Occluded(
+                bvh, rays[i], t_min, t_max, &any_stats);
+        }
+        double any_time = Elapsed(start);
+
+        size_t mismatch = 0;
+        for (size_t i = 0; i < rays.size(); ++i) {
+            mismatch += (t_linear[i] != t_bvh[i]);
+            mismatch += (occluded[i] != (t_linear[i] >= 0));
+        }
+
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(6) << cells
+                  << std::setw(10) << world.size()
+                  << std::setw(12) << 1.0e3 * bvh.m_build_time
+                  << std::setw(8) << bvh.m_nodes.size()
+                  << std::setw(8) << bvh.m_max_depth
+                  << std::setw(14) << 1.0e-6 * rays.size() / linear_time
+                  << std::setw(12) << 1.0e-6 * rays.size() / bvh_time
+                  << std::setw(10) << linear_time / bvh_time
+                  << std::setw(12) << (double) stats.num_nodes / stats.num_rays
+                  << std::setw(12) << (double) stats.num_leaf_tests / stats.num_rays
+                  << std::setw(12) << 1.0e-6 * rays.size() / any_time
+                  << std::setw(12)
+                  << (double) any_stats.num_nodes / any_stats.num_rays
+                  << std::setw(10) << mismatch << "\n";
+    }
+}
+
+///
+/// @brief Check the vector sphere kernel against the scalar reference over
+/// random sub-ranges of the sphere store, and compare their throughput on the
+/// brute-force query over the whole world. Throw if any result differs.
+///
+static void BenchSpheres()
+{
+    static const int32_t kCells[] = {1, 5, 20};
+    static const size_t kNumRays = 1 << 12;
+    static const size_t kNumRanges = 1 << 16;
+    const Real t_min = 0.001;
+    const Real t_max = kRealMax;
+    const std::vector<Ray> rays = CreateRays(kNumRays);
+    Sampler sampler = Sampler::Create(Sampler::Random, kRandomSeed);
+
+    std::cout << "sphere kernel, " << Spheres::kWidth << " lanes, "
+              << kNumRays << " camera rays\n"
+              << std::setw(6) << "cells"
+              << std::setw(10) << "spheres"
+              << std::setw(14) << "scalar(Mr/s)"
+              << std::setw(14) << "vector(Mr/s)"
+              << std::setw(10) << "speedup"
+              << std::setw(10) << "mismatch" << "\n";
+
+    for (int32_t cells : kCells) {
+        std::vector<Primitive> world =
+            Scene::Generate(cells, 0, kRandomSeed).m_primitives;
+        Spheres spheres = Spheres::Create(world);
+
+        // Compare both kernels over random ranges, as in bvh leaves.
+        size_t mismatch = 0;
+        for (size_t k = 0; k < kNumRanges; ++k) {
+            const Ray &ray = rays[k % rays.size()];
+            size_t begin = sampler.Rand1d() * spheres.m_size;
+            size_t end = std::min(begin + 1 + (size_t) (16 * sampler.Rand1d()),
+                spheres.m_size);
+            Real t_ref, t_vec;
+            uint32_t id_ref, id_vec;
+            bool hit_ref = Spheres::IntersectScalar(
+                spheres, begin, end, ray, t_min, t_max, t_ref, id_ref);
+            bool hit_vec = Spheres::Intersect(
+                spheres, begin, end, ray, t_min, t_max, t_vec, id_vec);
+            if (hit_ref != hit_vec ||
+                (hit_ref && (t_ref != t_vec || id_ref != id_vec))) {
+                mismatch++;
+            }
+        }
+
+        // Compare both kernels over the whole world.
+        Real t;
+        double elapsed[2];
+        uint32_t id;
+        size_t hits[2] = {};
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &ray : rays) {
+            hits[0] += Spheres::IntersectScalar(
+                spheres, 0, spheres.m_size, ray, t_min, t_max, t, id);
+        }
+        elapsed[0] = Elapsed(start);
+
+        start = std::chrono::steady_clock::now();
+        for (const auto &ray : rays) {
+            hits[1] += Spheres::Intersect(
+                spheres, 0, spheres.m_size, ray, t_min, t_max, t, id);
+        }
+        elapsed[1] = Elapsed(start);
+        mismatch += (hits[0] != hits[1]);
+
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(6) << cells
+                  << std::setw(10) << world.size()
+                  << std::setw(14) << 1.0e-6 * rays.size() / elapsed[0]
+                  << std::setw(14) << 1.0e-6 * rays.size() / elapsed[1]
+                  << std::setw(10) << elapsed[0] / elapsed[1]
+                  << std::setw(10) << mismatch << "\n";
+
+        if (mismatch > 0) {
+            throw std::runtime_error("sphere kernel differs from reference");
+        }
+    }
+}
+
+///
+/// @brief Compare the primary visibility cost of single camera rays with ray
+/// packets over square blocks of film pixels. Both must return the same hits.
+///
+static void BenchPackets()
+{
+    static const int32_t kCells[] = {3, 10, 50};
+    const Real t_max = kRealMax;
+
+    // Generate camera rays over the film, grouped in packets of pixel blocks.
+    Camera camera = Camera::Create(
+        kCameraEye,
+        kCameraCtr,
+        kCameraUp,
+        kCameraFov,
+        (double) kFilmWidth / kFilmHeight,
+        kCameraFocus,
+        kCameraAperture);
+    Film film = Film::Create(kFilmWidth, kFilmHeight);
+    Sampler sampler = Sampler::Create(Sampler::Random, kRandomSeed);
+
+    std::vector<Packet> packets;
+    for (const auto &block :
+         Film::Tiles(film.m_width, film.m_height, kPacketSize)) {
+        Packet packet;
+        packet.count = 0;
+        for (uint32_t y = block.y0; y < block.y1; ++y) {
+            for (uint32_t x = block.x0; x < block.x1; ++x) {
+                Vec2 u1 = sampler.Rand2d();
+                Vec2 u2 = sampler.Rand2d();
+                packet.rays[packet.count++] =
+                    camera.rayto(film.sample(x, y, u1), u2);
+            }
+        }
+        packets.push_back(packet);
+    }
+    const size_t num_rays = kFilmWidth * kFilmHeight;
+
+    std::cout << "packets vs single rays, " << Packet::kSize << " rays/packet, "
+              << num_rays << " camera rays\n"
+              << std::setw(6) << "cells"
+              << std::setw(10) << "spheres"
+              << std::setw(14) << "single(Mr/s)"
+              << std::setw(14) << "packet(Mr/s)"
+              << std::setw(10) << "speedup"
+              << std::setw(12) << "nodes/ray"
+              << std::setw(14) << "nodes/packet"
+              << std::setw(10) << "mismatch" << "\n";
+
+    for (int32_t cells : kCells) {
+        std::vector<Primitive> world =
+            Scene::Generate(cells, 0, kRandomSeed).m_primitives;
+        Bvh bvh = Bvh::Create(world);
+
+        Bvh::Stats single_stats = {};
+        std::vector<Real> t_single;
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &packet : packets) {
+            for (size_t i = 0; i < packet.count; ++i) {
+                Isect isect;
+                bool hit = Bvh::Intersect(bvh, world, packet.rays[i],
+                    0, t_max, isect, &single_stats);
+                t_single.push_back(hit ? isect.t : -1.0);
+            }
+        }
+        double single_time = Elapsed(start);
+
+        Bvh::Stats packet_stats = {};
+        std::vector<Packet> traced(packets);
+        start = std::chrono::steady_clock::now();
+        for (auto &packet : traced) {
+            Bvh::Intersect(bvh, world, packet, 0, t_max, &packet_stats);
+        }
+        double packet_time = Elapsed(start);
+
+        size_t mismatch = 0;
+        size_t k = 0;
+        for (const auto &packet : traced) {
+            for (size_t i = 0; i < packet.count; ++i, ++k) {
+                Real t = packet.hits[i] ? packet.isects[i].t : -1.0;
+                mismatch += (t != t_single[k]);
+            }
+        }
+
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(6) << cells
+                  << std::setw(10) << world.size()
+                  << std::setw(14) << 1.0e-6 * num_rays / single_time
+                  << std::setw(14) << 1.0e-6 * num_rays / packet_time
+                  << std::setw(10) << single_time / packet_time
+                  << std::setw(12)
+                  << (double) single_stats.num_nodes / single_stats.num_rays
+                  << std::setw(14)
+                  << (double) packet_stats.num_nodes / packets.size()
+                  << std::setw(10) << mismatch << "\n";
+
+        if (mismatch > 0) {
+            throw std::runtime_error("packet hits differ from single rays");
+        }
+    }
+}
+
+///
+/// @brief Compare the ray throughput of the path and wavefront integrators
+/// on a single thread, as the number of glass, metal and diffuse spheres in
+/// the scene grows.
+///
+static void BenchIntegrators()
+{
+    static const int32_t kCells[] = {3, 10, 20};
+    static const char *kNames[] = {"path", "wavefront"};
+    static const uint32_t kIntegrators[] = {
+        TracerDesc::IntegratorPath,
+        TracerDesc::IntegratorWavefront};
+
+    std::cout << "path vs wavefront integrator, "
+              << kFilmWidth << "x" << kFilmHeight << " film, 4 spp\n"
+              << std::setw(6) << "cells"
+              << std::setw(10) << "spheres"
+              << std::setw(12) << "integrator"
+              << std::setw(12) << "time(s)"
+              << std::setw(12) << "Mrays"
+              << std::setw(10) << "Mrays/s" << "\n";
+
+    for (int32_t cells : kCells) {
+        for (size_t k = 0; k < 2; ++k) {
+            TracerDesc desc;
+            desc.NumSamples = 4;
+            desc.NumThreads = 1;
+            desc.NumCells = cells;
+            desc.Integrator = kIntegrators[k];
+            desc.Headless = true;
+
+            Tracer tracer;
+            tracer.Initialize(desc);
+            auto start = std::chrono::steady_clock::now();
+            while (!tracer.IsComplete()) {
+                tracer.Sample();
+            }
+            double elapsed = Elapsed(start);
+            tracer.Cleanup();
+
+            std::cout << std::fixed << std::setprecision(2)
+                      << std::setw(6) << cells
+                      << std::setw(10) << tracer.mScene.m_primitives.size()
+                      << std::setw(12) << kNames[k]
+                      << std::setw(12) << elapsed
+                      << std::setw(12) << 1.0e-6 * tracer.mNumRays
+                      << std::setw(10) << 1.0e-6 * tracer.mNumRays / elapsed
+                      << "\n";
+        }
+    }
+}
+
+///
+/// @brief Sample the direct light from emitters that subtend ever smaller
+/// cones above a diffuse point, down to cones too narrow to represent in
+/// single precision. Throw if the light pdf, the light sample or the weight
+/// of an emitter hit with bsdf sampling is not finite.
+///
+static void BenchLights()
+{
+    static const Real kRatios[] = {1.0e-1, 1.0e-3, 1.0e-4, 1.0e-6, 1.0e-20};
+    constexpr size_t kNumSamples = 1000;
+    constexpr Real kDistance = 10.0;
+
+    std::cout << "direct light from small emitters, "
+              << kNumSamples << " samples\n"
+              << std::setw(12) << "radius/dist"
+              << std::setw(14) << "light pdf"
+              << std::setw(14) << "mean Ld"
+              << std::setw(14) << "bsdf weight"
+              << std::setw(10) << "finite" << "\n";
+
+    for (Real ratio : kRatios) {
+        Tracer tracer;
+        Scene &scene = tracer.mScene;
+        uint32_t diffuse = scene.add(Material::CreateDiffuse({0.5, 0.5, 0.5}));
+        uint32_t emitter = scene.add(Material::CreateEmitter({1.0, 1.0, 1.0}));
+        scene.add({0.0, 0.0, kDistance}, ratio * kDistance, emitter);
+
+        Isect isect;
+        isect.t = 1.0;
+        isect.p = {0.0, 0.0, 0.0};
+        isect.n = {0.0, 0.0, 1.0};
+        isect.wo = {0.0, 0.0, 1.0};
+        isect.error = 0.0;
+        isect.material = diffuse;
+        const Material &material = scene.m_materials[diffuse];
+
+        Sampler sampler = Sampler::Create(Sampler::Random, kRandomSeed);
+        Color sum = {0.0, 0.0, 0.0};
+        bool finite = true;
+        for (size_t i = 0; i < kNumSamples; ++i) {
+            Ray shadow;
+            Real t_max;
+            Color Ld;
+            if (tracer.SampleLight(
+                    isect, material, sampler, shadow, t_max, Ld)) {
+                finite = finite && std::isfinite(Ld.r) &&
+                    std::isfinite(Ld.g) && std::isfinite(Ld.b);
+                sum += Ld;
+            }
+        }
+        Real pdf = tracer.LightPdf(isect.p, 0);
+        Real weight = tracer.EmitterWeight(
+            isect.p, Sampler::CosineHemispherePdf(1.0), 0);
+        finite = finite && std::isfinite(pdf) && std::isfinite(weight);
+
+        std::cout << std::scientific << std::setprecision(2)
+                  << std::setw(12) << ratio
+                  << std::setw(14) << pdf
+                  << std::setw(14) << sum.r / kNumSamples
+                  << std::setw(14) << weight
+                  << std::setw(10) << (finite ? "yes" : "no") << "\n";
+        if (!finite) {
+            throw std::runtime_error("direct light is not finite");
+        }
+    }
+    std::cout << "\n";
+}
+
+///
+/// @brief Check the Philox generator against the known answers of the
+/// reference implementation, and compare the vectorized variant with the
+/// scalar sampler. Measure the variate throughput of both, against the
+/// sequential engine the sampler used before.
+///
+static void BenchSampler()
+{
+    static const size_t kNumPixels = 1 << 16;
+    static const uint32_t kNumDimensions = 16;
+
+    // Known answer tests of Philox4x32-10, from Random123.
+    static const uint32_t kCounters[3][4] = {
+        {0x00000000, 0x00000000, 0x00000000, 0x00000000},
+        {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+        {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}};
+    static const uint64_t kKeys[3] = {
+        0x0000000000000000ull,
+        0xffffffffffffffffull,
+        0x299f31d0a4093822ull};
+    static const uint32_t kResults[3][4] = {
+        {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8},
+        {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd},
+        {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}};
+    size_t kat_errors = 0;
+    for (size_t k = 0; k < 3; ++k) {
+        uint32_t result[4];
+        Sampler::Philox(kCounters[k], kKeys[k], result);
+        for (size_t i = 0; i < 4; ++i) {
+            kat_errors += (result[i] != kResults[k][i]);
+        }
+    }
+
+    // Sequential engine baseline.
+    math::random_engine engine(kRandomSeed);
+    math::random_uniform<double> urand;
+    std::vector<double> sequential(kNumPixels * kNumDimensions);
+    auto start = std::chrono::steady_clock::now();
+    for (auto &u : sequential) {
+        u = urand(engine, 0.0, 1.0);
+    }
+    double engine_time = Elapsed(start);
+
+    // Scalar counter based sampler, one sample per pixel. Accumulate the
+    // moments of the variates, and the correlation of neighbouring pixels.
+    Sampler sampler = Sampler::Create(Sampler::Random, kRandomSeed);
+    std::vector<Real> scalar(kNumPixels * kNumDimensions);
+    start = std::chrono::steady_clock::now();
+    for (uint32_t p = 0; p < kNumPixels; ++p) {
+        sampler.start(p, 0);
+        for (uint32_t d = 0; d < kNumDimensions; ++d) {
+            scalar[p * kNumDimensions + d] = sampler.Rand1d();
+        }
+    }
+    double scalar_time = Elapsed(start);
+
+    double mean = 0.0, var = 0.0, cov = 0.0;
+    for (size_t i = 0; i < scalar.size(); ++i) {
+        double u = scalar[i] - 0.5;
+        mean += u;
+        var += u * u;
+        if (i + kNumDimensions < scalar.size()) {
+            cov += u * (scalar[i + kNumDimensions] - 0.5);
+        }
+    }
+    mean = 0.5 + mean / scalar.size();
+    var = var / scalar.size();
+    double corr = cov / (scalar.size() - kNumDimensions) / var;
+
+    // Vectorized sampler, kLanes pixels per call.
+    std::vector<Real> vector(kNumPixels * kNumDimensions);
+    start = std::chrono::steady_clock::now();
+    for (uint32_t p = 0; p < kNumPixels; p += Sampler::kLanes) {
+        uint64_t pixel[Sampler::kLanes];
+        for (size_t l = 0; l < Sampler::kLanes; ++l) {
+            pixel[l] = p + (uint64_t) l;
+        }
+        for (uint32_t d = 0; d < kNumDimensions; d += 4) {
+            Real u[4][Sampler::kLanes];
+            Sampler::Rand4d(sampler, pixel, 0, d, u);
+            for (size_t l = 0; l < Sampler::kLanes; ++l) {
+                for (size_t k = 0; k < 4; ++k) {
+                    vector[(p + l) * kNumDimensions + d + k] = u[k][l];
+                }
+            }
+        }
+    }
+    double vector_time = Elapsed(start);
+
+    size_t mismatch = 0;
+    for (size_t i = 0; i < scalar.size(); ++i) {
+        mismatch += (scalar[i] != vector[i]);
+    }
+
+    // Skip ahead to a distant dimension, and compare with the scalar stream.
+    sampler.start(kNumPixels - 1, 0);
+    sampler.seek(kNumDimensions - 1);
+    mismatch += (sampler.Rand1d() != scalar.back());
+
+    // Pixels past 2^32, in films too large for a 32-bit index, have their own
+    // streams, the same in the scalar and the vectorized generators.
+    uint64_t pixel[Sampler::kLanes];
+    for (size_t l = 0; l < Sampler::kLanes; ++l) {
+        pixel[l] = ((uint64_t) 1 << 32) + l;
+    }
+    Real u[4][Sampler::kLanes];
+    Sampler::Rand4d(sampler, pixel, 0, 0, u);
+    for (size_t l = 0; l < Sampler::kLanes; ++l) {
+        sampler.start(pixel[l], 0);
+        mismatch += (sampler.Rand1d() != u[0][l]);
+        mismatch += (u[0][l] == scalar[l * kNumDimensions]);
+    }
+
+    const double num_variates = 1.0e-6 * kNumPixels * kNumDimensions;
+    std::cout << "sampler, philox4x32-10, " << Sampler::kLanes << " lanes, "
+              << kNumPixels << " pixels x " << kNumDimensions << " dimensions\n"
+              << std::fixed << std::setprecision(2)
+              << std::setw(14) << "engine(Mu/s)"
+              << std::setw(14) << "scalar(Mu/s)"
+              << std::setw(14) << "vector(Mu/s)"
+              << std::setw(10) << "mean"
+              << std::setw(10) << "var"
+              << std::setw(10) << "corr"
+              << std::setw(6) << "kat"
+              << std::setw(10) << "mismatch" << "\n"
+              << std::setw(14) << num_variates / engine_time
+              << std::setw(14) << num_variates / scalar_time
+              << std::setw(14) << num_variates / vector_time
+              << std::setprecision(4)
+              << std::setw(10) << mean
+              << std::setw(10) << var
+              << std::setw(10) << corr
+              << std::setw(6) << (kat_errors == 0 ? "ok" : "fail")
+              << std::setw(10) << mismatch
+              << "\n\n";
+}
+
+///
+/// @brief Compare the convergence of the sampler types on a 2d integral with a
+/// known value, the area of the quarter disk. Each pixel is an independent
+/// estimate, from its own randomization of the sequence. Report the root mean
+/// square error over the pixels, for the pixel and the first bounce dimensions.
+///
+static void BenchSamplerConvergence()
+{
+    static const char *kNames[Sampler::NumTypes] = {"random", "sobol", "halton"};
+    static const uint32_t kNumPixels = 1 << 12;
+    static const uint32_t kCounts[] = {4, 16, 64, 256};
+    static const size_t kNumCounts = sizeof(kCounts) / sizeof(kCounts[0]);
+    static const uint32_t kDimensions[] = {0, kCameraDimensions};
+    const double kArea = 0.25 * M_PI;
+
+    std::cout << "sampler convergence, quarter disk area, "
+              << kNumPixels << " pixels\n"
+              << std::setw(8) << "sampler"
+              << std::setw(6) << "dim";
+    for (uint32_t count : kCounts) {
+        std::cout << std::setw(10) << count;
+    }
+    std::cout << std::setw(12) << "time(ms)" << "\n";
+
+    for (uint32_t type = 0; type < Sampler::NumTypes; ++type) {
+        for (uint32_t dimension : kDimensions) {
+            Sampler sampler = Sampler::Create(type, kRandomSeed);
+            std::vector<double> sum(kNumPixels, 0.0);
+            std::vector<double> error(kNumCounts, 0.0);
+            uint32_t n = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t k = 0; k < kNumCounts; ++k) {
+                for (; n < kCounts[k]; ++n) {
+                    for (uint32_t p = 0; p < kNumPixels; ++p) {
+                        sampler.start(p, n);
+                        sampler.seek(dimension);
+                        Vec2 u = sampler.Rand2d();
+                        sum[p] += (u.x * u.x + u.y * u.y < 1) ? 1.0 : 0.0;
+                    }
+                }
+                for (uint32_t p = 0; p < kNumPixels; ++p) {
+                    double e = sum[p] / n - kArea;
+                    error[k] += e * e;
+                }
+                error[k] = std::sqrt(error[k] / kNumPixels);
+            }
+            double elapsed = Elapsed(start);
+
+            std::cout << std::setw(8) << kNames[type]
+                      << std::setw(6) << dimension
+                      << std::scientific << std::setprecision(2);
+            for (double e : error) {
+                std::cout << std::setw(10) << e;
+            }
+            std::cout << std::fixed
+                      << std::setw(12) << 1.0e3 * elapsed << "\n";
+        }
+    }
+    std::cout << "\n";
+}
+
+///
+/// @brief Print the timing of a kernel, in ns/op and in millions of operations
+/// per second, which are rays per second for the ray kernels.
+///
+static void PrintTiming(const char *name, const Timing &timing)
+{
+    std::cout << std::fixed << std::setprecision(2)
+              << std::setw(24) << name
+              << std::setw(12) << timing.ns_op
+              << std::setw(12) << 1.0e3 / timing.ns_op
+              << std::setw(10) << 100.0 * timing.spread << "\n";
+}
+
+///
+/// @brief Measure the hot kernels of the tracer on fixed inputs: the sphere
+/// intersection, the closest hit over the whole world, the scattering of each
+/// material type, the sampler warps, the camera rays and the film resolve.
+///
+static void BenchKernels()
+{
+    static const size_t kNumOps = 1 << 16;
+    static const char *kMaterialNames[] = {
+        "Scatter(diffuse)",
+        "Scatter(conductor)",
+        "Scatter(dielectric)",
+        "Scatter(emitter)"};
+    const Real t_min = 0.001;
+    const Real t_max = kRealMax;
+
+    // Fixed inputs, generated once so every run measures the same work.
+    const std::vector<Ray> rays = CreateRays(kNumOps);
+    Sampler sampler = Sampler::Create(Sampler::Random, kRandomSeed);
+    std::vector<Vec2> u1(kNumOps);
+    std::vector<Vec2> u2(kNumOps);
+    for (size_t i = 0; i < kNumOps; ++i) {
+        u1[i] = sampler.Rand2d();
+        u2[i] = sampler.Rand2d();
+    }
+
+    Scene scene = Scene::Generate(kNumCells, 0, kRandomSeed);
+    const std::vector<Primitive> &world = scene.m_primitives;
+    const Primitive sphere = Primitive::Create(Vec3{0, 1, 0}, 1.0, 0);
+
+    // Intersections of the camera rays with the world, to scatter from.
+    std::vector<Isect> isects;
+    for (const auto &ray : rays) {
+        Isect isect;
+        if (Primitive::Intersect(world, ray, t_min, t_max, isect)) {
+            isects.push_back(isect);
+        }
+    }
+    if (isects.empty()) {
+        throw std::runtime_error("no camera ray hits the world");
+    }
+
+    const Material materials[] = {
+        Material::CreateDiffuse(Color{0.5, 0.5, 0.5}),
+        Material::CreateConductor(Color{0.7, 0.6, 0.5}),
+        Material::CreateDielectric(1.5),
+        Material::CreateEmitter(Color{1.0, 1.0, 1.0})};
+    static_assert(sizeof(materials) / sizeof(materials[0]) ==
+        Material::NumTypes, "a material type is not benchmarked");
+
+    std::cout << "tracer kernels, " << kNumOps << " ops, cpu "
+              << (PinThread(0) ? "pinned" : "not pinned") << "\n"
+              << std::setw(24) << "kernel"
+              << std::setw(12) << "ns/op"
+              << std::setw(12) << "Mops/s"
+              << std::setw(10) << "spread%" << "\n";
+
+    PrintTiming("Intersect(sphere)", Measure(kNumOps, [&] () {
+        Real sum = 0, t;
+        for (const auto &ray : rays) {
+            if (Primitive::Intersect(sphere, ray, t_min, t_max, t)) {
+                sum += t;
+            }
+        }
+        return sum;
+    }));
+
+    PrintTiming("Intersect(world)", Measure(kNumOps, [&] () {
+        Real sum = 0;
+        Isect isect;
+        for (const auto &ray : rays) {
+            if (Primitive::Intersect(world, ray, t_min, t_max, isect)) {
+                sum += isect.t;
+            }
+        }
+        return sum;
+    }));
+
+    for (uint32_t type = 0; type < Material::NumTypes; ++type) {
+        const Material &material = materials[type];
+        PrintTiming(kMaterialNames[type], Measure(kNumOps, [&] () {
+            Real sum = 0;
+            Vec3 wi;
+            Color bsdf;
+            Real pdf;
+            for (size_t i = 0; i < kNumOps; ++i) {
+                const Isect &isect = isects[i % isects.size()];
+                if (Isect::Scatter(
+                        isect, material, u1[i], isect.wo, wi, bsdf, pdf)) {
+                    sum += wi.x + bsdf.r + pdf;
+                }
+            }
+            return sum;
+        }));
+    }
+
+    PrintTiming("Rand2d", Measure(kNumOps, [&] () {
+        Real sum = 0;
+        for (size_t i = 0; i < kNumOps; ++i) {
+            Vec2 u = sampler.Rand2d();
+            sum += u.x + u.y;
+        }
+        return sum;
+    }));
+
+    PrintTiming("UniformSphere", Measure(kNumOps, [&] () {
+        Real sum = 0;
+        for (const auto &u : u1) {
+            sum += Sampler::UniformSphere(u).z;
+        }
+        return sum;
+    }));
+
+    PrintTiming("UniformHemisphere", Measure(kNumOps, [&] () {
+        Real sum = 0;
+        for (const auto &u : u1) {
+            sum += Sampler::UniformHemisphere(u).z;
+        }
+        return sum;
+    }));
+
+    PrintTiming("CosineHemisphere", Measure(kNumOps, [&] () {
+        Real sum = 0;
+        for (const auto &u : u1) {
+            sum += Sampler::CosineHemisphere(u).z;
+        }
+        return sum;
+    }));
+
+    PrintTiming("UniformCone", Measure(kNumOps, [&] () {
+        Real sum = 0;
+        for (const auto &u : u1) {
+            sum += Sampler::UniformCone(u, 0.9).z;
+        }
+        return sum;
+    }));
+
+    PrintTiming("UniformDisk", Measure(kNumOps, [&] () {
+        Real sum = 0;
+        for (const auto &u : u1) {
+            sum += Sampler::UniformDisk(u).x;
+        }
+        return sum;
+    }));
+
+    PrintTiming("UniformTriangle", Measure(kNumOps, [&] () {
+        Real sum = 0;
+        for (const auto &u : u1) {
+            sum += Sampler::UniformTriangle(u).x;
+        }
+        return sum;
+    }));
+
+    Camera camera = Camera::Create(
+        kCameraEye,
+        kCameraCtr,
+        kCameraUp,
+        kCameraFov,
+        (Real) kFilmWidth / kFilmHeight,
+        kCameraFocus,
+        kCameraAperture);
+    PrintTiming("Camera::rayto", Measure(kNumOps, [&] () {
+        Real sum = 0;
+        for (size_t i = 0; i < kNumOps; ++i) {
+            sum += camera.rayto(u1[i], u2[i]).d.x;
+        }
+        return sum;
+    }));
+
+    // The film resolve converts every film pixel, so each op is a pixel.
+    TracerDesc desc;
+    desc.NumSamples = 1;
+    desc.NumThreads = 1;
+    desc.Headless = true;
+    Tracer tracer;
+    tracer.Initialize(desc);
+    tracer.Sample();
+    std::vector<uint8_t> bitmap(3 * tracer.mFilm.m_pixels.size(), 0);
+    PrintTiming("Resolve(pixel)", Measure(tracer.mFilm.m_pixels.size(), [&] () {
+        tracer.Resolve(bitmap.data());
+        return bitmap[bitmap.size() / 2];
+    }));
+    tracer.Cleanup();
+    std::cout << "\n";
+}
+
+///
+/// @brief Check the vector tone map encoder against the scalar reference, and
+/// each tone curve against its transfer function in double precision. Compare
+/// the single thread throughput of the tone map resolve of a 4K film with the
+/// scalar loop it replaced. Throw if any code differs.
+///
+static void BenchResolve()
+{
+    static const uint32_t kWidth = 3840;
+    static const uint32_t kHeight = 2160;
+    static const size_t kNumValues = 1 << 20;
+    static const char *kCurveNames[ToneMap::NumCurves] = {
+        "sqrt", "srgb", "aces"};
+
+    // Film with random radiance and sample counts, a few out of range values.
+    Sampler sampler = Sampler::Create(Sampler::Random, kRandomSeed);
+    Film film = Film::Create(kWidth, kHeight);
+    for (size_t i = 0; i < film.m_pixels.size(); ++i) {
+        film.m_counts[i] = 1 + (uint32_t) (4 * sampler.Rand1d());
+        for (auto &channel : film.m_pixels[i].data) {
+            channel = 1.5 * film.m_counts[i] * sampler.Rand1d();
+        }
+    }
+    std::vector<float> values(kNumValues);
+    std::vector<int32_t> offsets(kNumValues);
+    for (size_t k = 0; k < kNumValues; ++k) {
+        values[k] = (float) (2.0 * sampler.Rand1d() - 0.25);
+        offsets[k] = (int32_t) (256 * sampler.Rand1d());
+    }
+    values[0] = std::numeric_limits<float>::quiet_NaN();
+    values[1] = std::numeric_limits<float>::infinity();
+    values[2] = -std::numeric_limits<float>::infinity();
+
+    // Scalar loop of the resolve before the tone map, clamped to [0,1].
+    std::vector<uint8_t> bitmap(3 * film.m_pixels.size());
+    Timing legacy = Measure(film.m_pixels.size(), [&] () {
+        uint8_t *px = &bitmap[0];
+        for (size_t i = 0; i < film.m_pixels.size(); ++i) {
+            Color color = film.m_pixels[i];
+            color /= (Real) std::max(film.m_counts[i], 1u);
+            *px++ = static_cast<uint8_t>(
+                255.0 * std::sqrt(std::min(color.r, (Real) 1)));
+            *px++ = static_cast<uint8_t>(
+                255.0 * std::sqrt(std::min(color.g, (Real) 1)));
+            *px++ = static_cast<uint8_t>(
+                255.0 * std::sqrt(std::min(color.b, (Real) 1)));
+        }
+        return bitmap[bitmap.size() / 2];
+    });
+
+    std::cout << "tone map resolve, " << kWidth << "x" << kHeight
+              << " film, 1 thread\n"
+              << std::setw(10) << "curve"
+              << std::setw(8) << "dither"
+              << std::setw(12) << "ns/pixel"
+              << std::setw(12) << "Mpixels/s"
+              << std::setw(10) << "speedup"
+              << std::setw(10) << "max err"
+              << std::setw(10) << "mismatch" << "\n";
+    std::cout << std::fixed << std::setprecision(2)
+              << std::setw(10) << "legacy"
+              << std::setw(8) << "off"
+              << std::setw(12) << legacy.ns_op
+              << std::setw(12) << 1.0e3 / legacy.ns_op
+              << std::setw(10) << 1.0
+              << std::setw(10) << "-"
+              << std::setw(10) << "-" << "\n";
+
+    for (uint32_t curve = 0; curve < ToneMap::NumCurves; ++curve) {
+        for (bool dither : {false, true}) {
+            ToneMap tonemap = ToneMap::Create(curve, dither, 1.0f);
+
+            // Compare the vector and scalar encoders.
+            std::vector<uint8_t> codes[2];
+            codes[0].resize(kNumValues);
+            codes[1].resize(kNumValues);
+            ToneMap::EncodeScalar(tonemap, values.data(), offsets.data(),
+                kNumValues, codes[0].data());
+            ToneMap::Encode(tonemap, values.data(), offsets.data(),
+                kNumValues, codes[1].data());
+            size_t mismatch = 0;
+            for (size_t k = 0; k < kNumValues; ++k) {
+                mismatch += (codes[0][k] != codes[1][k]);
+            }
+
+            // Compare the codes with the transfer function. The rounding
+            // error is at most half a code, except in the darkest table
+            // entries of the sqrt curve, where its slope is unbounded.
+            Timing timing = Measure(film.m_pixels.size(), [&] () {
+                ToneMap::Resolve(tonemap, film, 0, kHeight, bitmap.data());
+                return bitmap[bitmap.size() / 2];
+            });
+            double max_error = 0.0;
+            for (size_t i = 0; i < film.m_pixels.size() && !dither; ++i) {
+                for (size_t c = 0; c < 3; ++c) {
+                    double x = (double) (float) (film.m_pixels[i].data[c] /
+                        (Real) film.m_counts[i]);
+                    if (curve == ToneMap::ACES) {
+                        x = (x * (2.51 * x + 0.03)) /
+                            (x * (2.43 * x + 0.59) + 0.14);
+                    }
+                    x = std::min(x, 1.0);
+                    double y = (curve == ToneMap::Sqrt) ? std::sqrt(x)
+                        : (x <= 0.0031308) ? 12.92 * x
+                        : 1.055 * std::pow(x, 1.0 / 2.4) - 0.055;
+                    max_error = std::max(max_error,
+                        std::abs(255.0 * y - bitmap[3 * i + c]));
+                }
+            }
+
+            std::cout << std::fixed << std::setprecision(2)
+                      << std::setw(10) << kCurveNames[curve]
+                      << std::setw(8) << (dither ? "on" : "off")
+                      << std::setw(12) << timing.ns_op
+                      << std::setw(12) << 1.0e3 / timing.ns_op
+                      << std::setw(10) << legacy.ns_op / timing.ns_op
+                      << std::setw(10);
+            if (dither) {
+                std::cout << "-";
+            } else {
+                std::cout << max_error;
+            }
+            std::cout << std::setw(10) << mismatch << "\n";
+
+            if (mismatch > 0 || max_error >= 1.0) {
+                throw std::runtime_error("tone map differs from reference");
+            }
+        }
+    }
+    std::cout << "\n";
+}
+
+///
+/// @brief Check that the tiles streamed to the image writers during an
+/// adaptive render make the same files as saving the complete film, in each
+/// image format, and measure the time to save the film. Throw if any file
+/// differs.
+///
+static void BenchImages()
+{
+    static const char *kExtensions[ImageFile::NumFormats] = {
+        ".ppm", ".png", ".pfm", ".exr"};
+
+    TracerDesc desc;
+    desc.FilmWidth = 480;
+    desc.FilmHeight = 270;
+    desc.NumSamples = 32;
+    desc.MinSamples = 4;
+    desc.NoiseThreshold = 0.1;
+    desc.NumThreads = 1;
+    desc.Headless = true;
+    Tracer tracer;
+    tracer.Initialize(desc);
+
+    // Stream the completed tiles to a writer for each format, from the same
+    // state of the written tiles, and count the tiles written before the
+    // final pass.
+    std::vector<std::unique_ptr<ImageWriter>> writers;
+    for (auto ext : kExtensions) {
+        writers.push_back(std::make_unique<ImageWriter>(
+            std::string("bench_stream") + ext,
+            desc.FilmWidth,
+            desc.FilmHeight,
+            tracer.mToneMap));
+    }
+    size_t num_early = 0;
+    while (!tracer.IsComplete()) {
+        tracer.Sample();
+        std::vector<uint8_t> written = tracer.mTileWritten;
+        if (tracer.IsComplete()) {
+            num_early = std::count(written.begin(), written.end(), 1);
+        }
+        for (auto &writer : writers) {
+            tracer.mTileWritten = written;
+            tracer.Stream(*writer);
+        }
+    }
+    for (auto &writer : writers) {
+        writer->finish();
+    }
+
+    auto read = [] (const std::string &filename) {
+        std::ifstream file(filename, std::ios::in | std::ios::binary);
+        std::stringstream bytes;
+        bytes << file.rdbuf();
+        return bytes.str();
+    };
+
+    std::cout << "image output, " << desc.FilmWidth << "x" << desc.FilmHeight
+              << " film, " << tracer.mNumSamples << " adaptive passes, "
+              << num_early << "/" << tracer.mTiles.size()
+              << " tiles streamed before the final pass\n"
+              << std::setw(10) << "format"
+              << std::setw(12) << "ns/pixel"
+              << std::setw(12) << "MB/s"
+              << std::setw(12) << "bytes"
+              << std::setw(10) << "match" << "\n";
+    const size_t num_pixels = tracer.mFilm.m_pixels.size();
+    for (size_t format = 0; format < ImageFile::NumFormats; ++format) {
+        const std::string saved = std::string("bench_save") +
+            kExtensions[format];
+        Timing timing = Measure(num_pixels, [&] () {
+            tracer.Save(saved);
+            return 0;
+        });
+        const std::string streamed = std::string("bench_stream") +
+            kExtensions[format];
+        const std::string bytes = read(saved);
+        const bool match = (bytes == read(streamed));
+        std::remove(saved.c_str());
+        std::remove(streamed.c_str());
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(10) << kExtensions[format] + 1
+                  << std::setw(12) << timing.ns_op
+                  << std::setw(12)
+                  << bytes.size() / (1.0e-3 * timing.ns_op * num_pixels)
+                  << std::setw(12) << bytes.size()
+                  << std::setw(10) << (match ? "yes" : "no") << "\n";
+        if (!match) {
+            throw std::runtime_error("streamed image differs from saved");
+        }
+    }
+    tracer.Cleanup();
+    std::cout << "\n";
+}
+
+///
+/// @brief Compare the time of a checkpoint with the time of a sample pass, and
+/// check that an adaptive render resumed from a checkpoint ends with the same
+/// film as an uninterrupted one. Throw if the films differ.
+///
+static void BenchCheckpoint()
+{
+    static const size_t kNumPasses = 12;
+    static const size_t kResumePass = 7;
+
+    TracerDesc desc;
+    desc.FilmWidth = 960;
+    desc.FilmHeight = 540;
+    desc.NumSamples = kNumPasses;
+    desc.MinSamples = 4;
+    desc.NoiseThreshold = 0.1;
+    desc.NumThreads = 1;
+    desc.Headless = true;
+
+    // Uninterrupted render, checkpointed at the resume pass.
+    Tracer tracer;
+    tracer.Initialize(desc);
+    double pass_time = 0.0;
+    double checkpoint_time = 0.0;
+    {
+        Checkpoint checkpoint("bench_checkpoint.bin", tracer);
+        while (!tracer.IsComplete()) {
+            auto start = std::chrono::steady_clock::now();
+            tracer.Sample();
+            pass_time += Elapsed(start);
+            if (tracer.mNumSamples == kResumePass) {
+                start = std::chrono::steady_clock::now();
+                checkpoint.save(tracer);
+                checkpoint_time = Elapsed(start);
+            }
+        }
+    }
+
+    // Render resumed from the checkpoint, with a different number of threads.
+    desc.NumThreads = 3;
+    Tracer resumed;
+    resumed.Initialize(desc);
+    {
+        Checkpoint checkpoint("bench_checkpoint.bin", resumed);
+        if (!checkpoint.load(resumed)) {
+            throw std::runtime_error("checkpoint not committed");
+        }
+        while (!resumed.IsComplete()) {
+            resumed.Sample();
+        }
+        checkpoint.remove();
+    }
+
+    const Film &a = tracer.mFilm;
+    const Film &b = resumed.mFilm;
+    const bool match =
+        tracer.mNumSamples == resumed.mNumSamples &&
+        a.m_num_converged == b.m_num_converged &&
+        a.m_counts == b.m_counts &&
+        a.m_converged == b.m_converged &&
+        std::memcmp(a.m_pixels.data(), b.m_pixels.data(),
+            a.m_pixels.size() * sizeof(Color)) == 0 &&
+        std::memcmp(a.m_moments.data(), b.m_moments.data(),
+            a.m_moments.size() * sizeof(Real)) == 0;
+    std::cout << std::fixed << std::setprecision(2)
+              << "checkpoint, " << desc.FilmWidth << "x" << desc.FilmHeight
+              << " film, " << tracer.mNumSamples << " adaptive passes\n"
+              << "  pass " << 1.0e3 * pass_time / tracer.mNumSamples
+              << " ms, checkpoint " << 1.0e3 * checkpoint_time << " ms, "
+              << "resumed at pass " << kResumePass << ", match "
+              << (match ? "yes" : "no") << "\n\n";
+    tracer.Cleanup();
+    resumed.Cleanup();
+    if (!match) {
+        throw std::runtime_error("resumed film differs from uninterrupted");
+    }
+}
+
+///
+/// @brief Compare an in-memory render with an out-of-core render of the same
+/// film, one tile at a time in tile films, and check that both save the same
+/// image. Throw if the images differ.
+///
+static void BenchTiles()
+{
+    TracerDesc desc;
+    desc.FilmWidth = 960;
+    desc.FilmHeight = 540;
+    desc.NumSamples = 8;
+    desc.Headless = true;
+
+    auto read = [] (const std::string &filename) {
+        std::ifstream file(filename, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), {});
+    };
+
+    // In-memory render, saved once complete.
+    Tracer tracer;
+    tracer.Initialize(desc);
+    auto start = std::chrono::steady_clock::now();
+    while (!tracer.IsComplete()) {
+        tracer.Sample();
+    }
+    tracer.Save("bench_film.pfm");
+    const double film_time = Elapsed(start);
+    const size_t film_size = tracer.mFilm.m_pixels.size() * Film::kPixelSize;
+    tracer.Cleanup();
+
+    // Out-of-core render, with no film memory.
+    desc.FilmMemory = 0;
+    Tracer tiled;
+    tiled.Initialize(desc);
+    start = std::chrono::steady_clock::now();
+    {
+        ImageWriter writer("bench_tiles.pfm",
+            desc.FilmWidth, desc.FilmHeight, tiled.mToneMap);
+        tiled.RenderTiles(writer);
+        writer.finish();
+    }
+    const double tiles_time = Elapsed(start);
+    const size_t tiles_size = tiled.mTileFilms.size() *
+        tiled.mTileFilms[0].m_pixels.size() * Film::kPixelSize;
+    tiled.Cleanup();
+
+    const bool match = (read("bench_film.pfm") == read("bench_tiles.pfm"));
+    std::remove("bench_film.pfm");
+    std::remove("bench_tiles.pfm");
+    std::cout << std::fixed << std::setprecision(2)
+              << "tiles, " << desc.FilmWidth << "x" << desc.FilmHeight
+              << " film, " << desc.NumSamples << " passes\n"
+              << "  in-memory " << 1.0e3 * film_time << " ms, "
+              << (film_size >> 10) << " KB film\n"
+              << "  out-of-core " << 1.0e3 * tiles_time << " ms, "
+              << (tiles_size >> 10) << " KB tile films, "
+              << tiled.mTiles.size() << " tiles, match "
+              << (match ? "yes" : "no") << "\n\n";
+    if (!match) {
+        throw std::runtime_error("out-of-core image differs from in-memory");
+    }
+}
+
+///
+/// @brief Compare the time to generate a scene with the time to load it from a
+/// binary scene file, and check that the binary and text scene files load
+/// the scene they were saved from. Throw if a loaded scene differs.
+///
+static void BenchScene()
+{
+    auto same = [] (const Scene &a, const Scene &b) {
+        auto vec3 = [] (const Vec3 &u, const Vec3 &v) {
+            return u.x == v.x && u.y == v.y && u.z == v.z;
+        };
+        auto color = [] (const Color &u, const Color &v) {
+            return u.r == v.r && u.g == v.g && u.b == v.b;
+        };
+        bool match =
+            vec3(a.m_view.eye, b.m_view.eye) &&
+            vec3(a.m_view.ctr, b.m_view.ctr) &&
+            vec3(a.m_view.up, b.m_view.up) &&
+            a.m_view.fov == b.m_view.fov &&
+            a.m_view.focus == b.m_view.focus &&
+            a.m_view.aperture == b.m_view.aperture &&
+            a.m_materials.size() == b.m_materials.size() &&
+            a.m_primitives.size() == b.m_primitives.size() &&
+            a.m_lights == b.m_lights;
+        for (size_t i = 0; match && i < a.m_materials.size(); ++i) {
+            const Material &u = a.m_materials[i];
+            const Material &v = b.m_materials[i];
+            match = u.type == v.type && color(u.rho, v.rho) &&
+                u.ior == v.ior && color(u.Le, v.Le);
+        }
+        for (size_t i = 0; match && i < a.m_primitives.size(); ++i) {
+            const Primitive &u = a.m_primitives[i];
+            const Primitive &v = b.m_primitives[i];
+            match = vec3(u.centre, v.centre) && u.radius == v.radius &&
+                u.material == v.material;
+        }
+        return match;
+    };
+
+    std::cout << "scene files\n"
+              << std::setw(10) << "cells"
+              << std::setw(12) << "spheres"
+              << std::setw(14) << "generate ms"
+              << std::setw(12) << "load ms"
+              << std::setw(12) << "text ms"
+              << std::setw(10) << "match" << "\n";
+    for (int32_t cells : {11, 100, 500}) {
+        auto start = std::chrono::steady_clock::now();
+        Scene scene = Scene::Generate(cells, 4, kRandomSeed);
+        const double generate_time = Elapsed(start);
+
+        scene.save("bench_scene.rtws");
+        Scene binary = Scene::Load("bench_scene.rtws");
+        std::remove("bench_scene.rtws");
+        bool match = same(scene, binary);
+
+        // Compile the text scene file of the smaller scenes.
+        double text_time = 0.0;
+        if (cells <= 100) {
+            scene.save("bench_scene.txt");
+            Scene text = Scene::Load("bench_scene.txt");
+            std::remove("bench_scene.txt");
+            text_time = text.m_load_time;
+            match = match && same(scene, text);
+        }
+
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(10) << cells
+                  << std::setw(12) << scene.m_primitives.size()
+                  << std::setw(14) << 1.0e3 * generate_time
+                  << std::setw(12) << 1.0e3 * binary.m_load_time
+                  << std::setw(12) << 1.0e3 * text_time
+                  << std::setw(10) << (match ? "yes" : "no") << "\n";
+        if (!match) {
+            throw std::runtime_error("loaded scene differs from saved");
+        }
+    }
+    std::cout << "\n";
+}
+
+///
+/// @brief Compare the time to import an OBJ mesh with the time to load it
+/// from its binary cache, and the closest hits of the mesh hierarchy with a
+/// linear scan of the triangles. The mesh is a sphere of quads, split into
+/// triangles by the importer, and the rays are aimed at random points in its
+/// bounding box. Throw if the cached mesh or any hit differs.
+///
+static void BenchMesh()
+{
+    static const uint32_t kSegments[] = {32, 128, 512};
+    static const size_t kNumRays = 1 << 14;
+    static const size_t kLinearTests = (size_t) 1 << 26;
+    const std::string filename = "bench_mesh.obj";
+    math::random_engine rng(kRandomSeed);
+    math::random_uniform<float> dist;
+    std::vector<Ray> rays(kNumRays);
+    for (auto &ray : rays) {
+        Vec3 target{
+            (Real) (2.0 * dist(rng) - 1.0),
+            (Real) (2.0 * dist(rng) - 1.0),
+            (Real) (2.0 * dist(rng) - 1.0)};
+        ray = Ray{kCameraEye, math::normalize(target - kCameraEye)};
+    }
+
+    // Write a unit sphere of n latitude and 2n longitude segments.
+    auto write = [&] (const uint32_t n) {
+        std::ofstream file(filename);
+        file << std::setprecision(std::numeric_limits<double>::max_digits10);
+        for (uint32_t j = 1; j < n; ++j) {
+            double theta = M_PI * j / n;
+            for (uint32_t i = 0; i < 2 * n; ++i) {
+                double phi = M_PI * i / n;
+                file << "v " << std::sin(theta) * std::cos(phi)
+                     << " " << std::cos(theta)
+                     << " " << std::sin(theta) * std::sin(phi) << "\n";
+            }
+        }
+        file << "v 0 1 0\nv 0 -1 0\n";
+        const uint32_t top = 2 * n * (n - 1) + 1;
+        auto index = [n] (uint32_t j, uint32_t i) {
+            return 2 * n * (j - 1) + i % (2 * n) + 1;
+        };
+        for (uint32_t i = 0; i < 2 * n; ++i) {
+            file << "f " << top << " " << index(1, i + 1)
+                 << " " << index(1, i) << "\n";
+            file << "f " << top + 1 << " " << index(n - 1, i)
+                 << " " << index(n - 1, i + 1) << "\n";
+        }
+        for (uint32_t j = 1; j + 1 < n; ++j) {
+            for (uint32_t i = 0; i < 2 * n; ++i) {
+                file << "f " << index(j, i) << " " << index(j, i + 1)
+                     << " " << index(j + 1, i + 1)
+                     << " " << index(j + 1, i) << "\n";
+            }
+        }
+    };
+
+    std::cout << "mesh, " << kNumRays << " rays\n"
+              << std::setw(10) << "triangles"
+              << std::setw(12) << "import ms"
+              << std::setw(12) << "cache ms"
+              << std::setw(10) << "nodes"
+              << std::setw(12) << "bvh(Mr/s)"
+              << std::setw(10) << "speedup"
+              << std::setw(12) << "nodes/ray"
+              << std::setw(12) << "tests/ray"
+              << std::setw(10) << "mismatch" << "\n";
+    for (uint32_t n : kSegments) {
+        write(n);
+        std::remove(Mesh::CacheName(filename).c_str());
+        auto start = std::chrono::steady_clock::now();
+        Mesh imported = Mesh::Load(filename, 0, 1, Vec3{0, 0, 0});
+        const double import_time = Elapsed(start);
+        start = std::chrono::steady_clock::now();
+        Mesh mesh = Mesh::Load(filename, 0, 1, Vec3{0, 0, 0});
+        const double cache_time = Elapsed(start);
+
+        size_t mismatch = 0;
+        mismatch += imported.m_cached || !mesh.m_cached;
+        mismatch += imported.m_vertices.size() != mesh.m_vertices.size() ||
+            std::memcmp(imported.m_vertices.data(), mesh.m_vertices.data(),
+                mesh.m_vertices.size() * sizeof(Vec3)) != 0;
+        mismatch += imported.m_triangles != mesh.m_triangles;
+        mismatch += imported.m_nodes.size() != mesh.m_nodes.size() ||
+            std::memcmp(imported.m_nodes.data(), mesh.m_nodes.data(),
+                mesh.m_nodes.size() * sizeof(Bvh::Node)) != 0;
+
+        Bvh::Stats stats = {};
+        std::vector<Real> t_bvh(rays.size(), -1.0);
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < rays.size(); ++i) {
+            Real t;
+            uint32_t id;
+            if (Mesh::Intersect(
+                    mesh, rays[i], 0, kRealMax, t, id, &stats)) {
+                t_bvh[i] = t;
+            }
+        }
+        const double bvh_time = Elapsed(start);
+
+        // Scan the triangles for a subset of the rays of the larger meshes.
+        const size_t num_linear = std::min(
+            rays.size(), std::max<size_t>(1, kLinearTests / mesh.size()));
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < num_linear; ++i) {
+            Real t_hit = kRealMax;
+            bool is_a_hit = false;
+            for (size_t k = 0; k < mesh.size(); ++k) {
+                const uint32_t *triangle = &mesh.m_triangles[3 * k];
+                Real t;
+                if (Mesh::Intersect(
+                        mesh.m_vertices[triangle[0]],
+                        mesh.m_vertices[triangle[1]],
+                        mesh.m_vertices[triangle[2]],
+                        rays[i], 0, t_hit, t)) {
+                    t_hit = t;
+                    is_a_hit = true;
+                }
+            }
+            mismatch += (is_a_hit ? t_hit : -1.0) != t_bvh[i];
+        }
+        const double linear_time = Elapsed(start);
+
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(10) << mesh.size()
+                  << std::setw(12) << 1.0e3 * import_time
+                  << std::setw(12) << 1.0e3 * cache_time
+                  << std::setw(10) << mesh.m_nodes.size()
+                  << std::setw(12) << 1.0e-6 * rays.size() / bvh_time
+                  << std::setw(10)
+                  << (linear_time / num_linear) / (bvh_time / rays.size())
+                  << std::setw(12) << (double) stats.num_nodes / rays.size()
+                  << std::setw(12)
+                  << (double) stats.num_leaf_tests / rays.size()
+                  << std::setw(10) << mismatch << "\n";
+        if (mismatch > 0) {
+            throw std::runtime_error("mesh cache or hits differ");
+        }
+    }
+    std::remove(filename.c_str());
+    std::remove(Mesh::CacheName(filename).c_str());
+    std::cout << "\n";
+}
+
+///
+/// @brief main benchmark client.
+///
+/// Run the benchmarks named in the command line, or all of them if no name is
+/// given, e.g. raytrace_bench kernels bvh.
+///
+int main(int argc, char const *argv[])
+{
+    struct Bench {
+        const char *name;
+        void (*run)();
+    };
+    static const Bench kBenches[] = {
+        {"kernels", BenchKernels},
+        {"resolve", BenchResolve},
+        {"images", BenchImages},
+        {"checkpoint", BenchCheckpoint},
+        {"tiles", BenchTiles},
+        {"scene", BenchScene},
+        {"mesh", BenchMesh},
+        {"sampler", BenchSampler},
+        {"convergence", BenchSamplerConvergence},
+        {"spheres", BenchSpheres},
+        {"bvh", BenchBvh},
+        {"packets", BenchPackets},
+        {"integrators", BenchIntegrators},
+        {"lights", BenchLights}};
+
+    try {
+        for (const auto &bench : kBenches) {
+            bool selected = (argc < 2);
+            for (int i = 1; i < argc; ++i) {
+                selected |= (std::strcmp(argv[i], bench.name) == 0);
+            }
+            if (selected) {
+                bench.run();
+            }
+        }
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,755 @@
+//
+// bvh.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include "common.h"
+#include "ray.h"
+#include "isect.h"
+#include "primitive.h"
+#include "spheres.h"
+#include "bvh.h"
+
+/// ---------------------------------------------------------------------------
+/// @brief Return the surface area of the bounding box.
+///
+Real Bounds::area() const
+{
+    Real dx = std::max(hi[0] - lo[0], (Real) 0);
+    Real dy = std::max(hi[1] - lo[1], (Real) 0);
+    Real dz = std::max(hi[2] - lo[2], (Real) 0);
+    return (Real) 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+///
+/// @brief Return the axis of the largest bounding box extent.
+///
+uint32_t Bounds::largest_axis() const
+{
+    Real dx = hi[0] - lo[0];
+    Real dy = hi[1] - lo[1];
+    Real dz = hi[2] - lo[2];
+    if (dx > dy && dx > dz) {
+        return 0;
+    }
+    return (dy > dz) ? 1 : 2;
+}
+
+///
+/// @brief Return the bounding box of two boxes or a box and a point.
+///
+Bounds Bounds::Union(const Bounds &a, const Bounds &b)
+{
+    Bounds result;
+    for (int k = 0; k < 3; ++k) {
+        result.lo[k] = std::min(a.lo[k], b.lo[k]);
+        result.hi[k] = std::max(a.hi[k], b.hi[k]);
+    }
+    return result;
+}
+
+Bounds Bounds::Union(const Bounds &a, const Real p[3])
+{
+    Bounds result;
+    for (int k = 0; k < 3; ++k) {
+        result.lo[k] = std::min(a.lo[k], p[k]);
+        result.hi[k] = std::max(a.hi[k], p[k]);
+    }
+    return result;
+}
+
+///
+/// @brief Return an empty bounding box.
+///
+Bounds Bounds::Empty()
+{
+    return {{kRealMax, kRealMax, kRealMax}, {-kRealMax, -kRealMax, -kRealMax}};
+}
+
+///
+/// @brief Return the bounding box of a primitive.
+///
+Bounds Bounds::Create(const Primitive &primitive)
+{
+    const Vec3 &c = primitive.centre;
+    const Real r = primitive.radius;
+    return {{c.x - r, c.y - r, c.z - r}, {c.x + r, c.y + r, c.z + r}};
+}
+
+///
+/// @brief Compute the box-ray intersection using the slab method. The inverse
+/// ray direction is computed once per ray by the caller.
+///
+bool Bounds::Intersect(
+    const Bounds &bounds,
+    const Real o[3],
+    const Real inv_d[3],
+    const Real t_min,
+    const Real t_max)
+{
+    Real t0 = t_min;
+    Real t1 = t_max;
+    for (int k = 0; k < 3; ++k) {
+        Real t_near = (bounds.lo[k] - o[k]) * inv_d[k];
+        Real t_far = (bounds.hi[k] - o[k]) * inv_d[k];
+        if (t_near > t_far) {
+            std::swap(t_near, t_far);
+        }
+        t0 = t_near > t0 ? t_near : t0;
+        t1 = t_far < t1 ? t_far : t1;
+        if (t0 > t1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+///
+/// @brief Conservative box intersection test of a set of rays with origins in
+/// [o_lo, o_hi] and inverse directions in [inv_lo, inv_hi].
+///
+/// Along each coherent axis, the slab entry and exit distances of every ray
+/// are bounded by the interval products of (lo - o) and (hi - o) with the
+/// inverse direction. If the largest lower bound of the entry distances is
+/// beyond the smallest upper bound of the exit distances, no ray in the set
+/// can intersect the box.
+///
+bool Bounds::Intersect(
+    const Bounds &bounds,
+    const Real o_lo[3],
+    const Real o_hi[3],
+    const Real inv_lo[3],
+    const Real inv_hi[3],
+    const bool coherent[3],
+    const Real t_min,
+    const Real t_max)
+{
+    auto product_lo = [] (Real a0, Real a1, Real b0, Real b1) {
+        return std::min(std::min(a0 * b0, a0 * b1), std::min(a1 * b0, a1 * b1));
+    };
+    auto product_hi = [] (Real a0, Real a1, Real b0, Real b1) {
+        return std::max(std::max(a0 * b0, a0 * b1), std::max(a1 * b0, a1 * b1));
+    };
+
+    Real t0 = t_min;
+    Real t1 = t_max;
+    for (int k = 0; k < 3; ++k) {
+        if (!coherent[k]) {
+            continue;
+        }
+        Real near = inv_lo[k] > 0.0 ? bounds.lo[k] : bounds.hi[k];
+        Real far = inv_lo[k] > 0.0 ? bounds.hi[k] : bounds.lo[k];
+        Real t_near = product_lo(
+            near - o_hi[k], near - o_lo[k], inv_lo[k], inv_hi[k]);
+        Real t_far = product_hi(
+            far - o_hi[k], far - o_lo[k], inv_lo[k], inv_hi[k]);
+        t0 = t_near > t0 ? t_near : t0;
+        t1 = t_far < t1 ? t_far : t1;
+        if (t0 > t1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// ---------------------------------------------------------------------------
+/// @brief Bvh build parameters and primitive build records.
+///
+namespace {
+
+static const uint32_t kNumBins = 16;          // number of sah bins per axis
+static const uint32_t kMaxLeafSize = 8;       // maximum primitives per leaf
+static const uint32_t kMaxSahDepth = 48;      // median split below this depth
+static const double kTraversalCost = 1.0;     // node traversal cost
+static const double kIntersectCost = 1.0;     // primitive intersection cost
+
+// The median splits below kMaxSahDepth halve the item count, so the depth of
+// a hierarchy over at most 2^32 items stays below the traversal stack size.
+static_assert(kMaxSahDepth + 32 < Bvh::kStackSize, "bvh traversal stack");
+
+static double KernelSteps(const size_t count, const size_t width)
+{
+    return (double) ((count + width - 1) / width);
+}
+
+struct BuildItem {
+    Bounds bounds;
+    Real centroid[3];
+    uint32_t index;
+};
+
+struct Builder {
+    std::vector<BuildItem> &items;
+    Bvh &bvh;
+    size_t width;               // primitives tested per kernel step
+
+    uint32_t Build(size_t begin, size_t end, size_t depth);
+    size_t Split(size_t begin, size_t end, size_t depth, uint32_t &axis);
+};
+
+///
+/// @brief Build the subtree over the items [begin, end) and return the index
+/// of its root node.
+///
+uint32_t Builder::Build(size_t begin, size_t end, size_t depth)
+{
+    uint32_t index = bvh.m_nodes.size();
+    bvh.m_nodes.push_back({});
+    bvh.m_max_depth = std::max(bvh.m_max_depth, depth);
+
+    Bounds bounds = Bounds::Empty();
+    for (size_t i = begin; i < end; ++i) {
+        bounds = Bounds::Union(bounds, items[i].bounds);
+    }
+    bvh.m_nodes[index].bounds = bounds;
+
+    uint32_t axis = 0;
+    size_t mid = Split(begin, end, depth, axis);
+    if (mid == begin) {
+        // Create a leaf node with the item range.
+        bvh.m_nodes[index].offset = bvh.m_indices.size();
+        bvh.m_nodes[index].count = end - begin;
+        bvh.m_nodes[index].axis = 0;
+        for (size_t i = begin; i < end; ++i) {
+            bvh.m_indices.push_back(items[i].index);
+        }
+        bvh.m_num_leaves++;
+        return index;
+    }
+
+    // Create an interior node with the first child following its parent.
+    Build(begin, mid, depth + 1);
+    uint32_t second = Build(mid, end, depth + 1);
+    bvh.m_nodes[index].offset = second;
+    bvh.m_nodes[index].count = 0;
+    bvh.m_nodes[index].axis = axis;
+    return index;
+}
+
+///
+/// @brief Partition the items [begin, end) and return the split position.
+/// Return begin if the items should be kept in a leaf.
+///
+/// Bin the item centroids along each axis and evaluate the surface area
+/// heuristic cost of splitting between each pair of bins:
+///  C = C_trav + C_isect * (A_l * K(N_l) + A_r * K(N_r)) / A
+/// where K(N) = ceil(N / W) is the number of kernel steps needed to test N
+/// primitives, W primitives at a time.
+/// If no split is cheaper than a leaf, C_leaf = C_isect * K(N), and the leaf is
+/// small enough, return a leaf. Below a maximum depth, or if the centroids
+/// cannot be binned, split the items at the median.
+///
+size_t Builder::Split(size_t begin, size_t end, size_t depth, uint32_t &axis)
+{
+    const size_t count = end - begin;
+    if (count == 1) {
+        return begin;
+    }
+
+    Bounds centroids = Bounds::Empty();
+    Bounds bounds = Bounds::Empty();
+    for (size_t i = begin; i < end; ++i) {
+        centroids = Bounds::Union(centroids, items[i].centroid);
+        bounds = Bounds::Union(bounds, items[i].bounds);
+    }
+    axis = centroids.largest_axis();
+
+    double best_cost = DBL_MAX;
+    uint32_t best_axis = 0;
+    uint32_t best_bin = 0;
+    if (depth < kMaxSahDepth) {
+        for (uint32_t k = 0; k < 3; ++k) {
+            Real extent = centroids.hi[k] - centroids.lo[k];
+            if (extent <= 0.0) {
+                continue;
+            }
+
+            // Accumulate the bounds and counts of each bin.
+            Bounds bin_bounds[kNumBins];
+            size_t bin_count[kNumBins] = {};
+            std::fill(bin_bounds, bin_bounds + kNumBins, Bounds::Empty());
+            const Real scale = kNumBins / extent;
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t bin = (items[i].centroid[k] - centroids.lo[k]) * scale;
+                bin = std::min(bin, kNumBins - 1);
+                bin_bounds[bin] = Bounds::Union(bin_bounds[bin], items[i].bounds);
+                bin_count[bin]++;
+            }
+
+            // Sweep from the right to compute the right side areas and counts,
+            // and from the left to evaluate the cost of each split plane.
+            Real right_area[kNumBins];
+            size_t right_count[kNumBins];
+            Bounds right = Bounds::Empty();
+            size_t num_right = 0;
+            for (uint32_t b = kNumBins - 1; b > 0; --b) {
+                right = Bounds::Union(right, bin_bounds[b]);
+                num_right += bin_count[b];
+                right_area[b] = right.area();
+                right_count[b] = num_right;
+            }
+
+            Bounds left = Bounds::Empty();
+            size_t num_left = 0;
+            for (uint32_t b = 0; b < kNumBins - 1; ++b) {
+                left = Bounds::Union(left, bin_bounds[b]);
+                num_left += bin_count[b];
+                if (num_left == 0 || right_count[b + 1] == 0) {
+                    continue;
+                }
+                double cost = left.area() * KernelSteps(num_left, width) +
+                    right_area[b + 1] * KernelSteps(right_count[b + 1], width);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = k;
+                    best_bin = b;
+                }
+            }
+        }
+    }
+
+    if (best_cost < DBL_MAX) {
+        // Compare the best split with the leaf cost.
+        Real area = bounds.area();
+        double split_cost = kTraversalCost +
+            kIntersectCost * (area > 0.0 ? best_cost / area : count);
+        double leaf_cost = kIntersectCost * KernelSteps(count, width);
+        if (count <= kMaxLeafSize && leaf_cost <= split_cost) {
+            return begin;
+        }
+
+        // Partition the items at the best split plane.
+        const Real lo = centroids.lo[best_axis];
+        const Real scale = kNumBins / (centroids.hi[best_axis] - lo);
+        auto it = std::partition(
+            items.begin() + begin,
+            items.begin() + end,
+            [&] (const BuildItem &item) {
+                uint32_t bin = (item.centroid[best_axis] - lo) * scale;
+                return std::min(bin, kNumBins - 1) <= best_bin;
+            });
+        axis = best_axis;
+        return it - items.begin();
+    }
+
+    // No binned split is available. Keep small ranges in a leaf and split
+    // large ranges at the median centroid along the largest axis.
+    if (count <= kMaxLeafSize) {
+        return begin;
+    }
+    size_t mid = begin + count / 2;
+    std::nth_element(
+        items.begin() + begin,
+        items.begin() + mid,
+        items.begin() + end,
+        [&] (const BuildItem &a, const BuildItem &b) {
+            return a.centroid[axis] < b.centroid[axis];
+        });
+    return mid;
+}
+
+///
+/// @brief Build the hierarchy nodes and the leaf indices over the items, for
+/// a kernel testing width primitives at a time.
+///
+void Build(std::vector<BuildItem> &items, const size_t width, Bvh &bvh)
+{
+    bvh.m_nodes.reserve(2 * items.size());
+    bvh.m_indices.reserve(items.size());
+    Builder builder{items, bvh, width};
+    builder.Build(0, items.size(), 0);
+}
+
+} // namespace
+
+/// ---------------------------------------------------------------------------
+/// @brief Bvh factory function. Build the hierarchy over the primitives.
+///
+Bvh Bvh::Create(const std::vector<Primitive> &primitives)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    Bvh bvh;
+    bvh.m_spheres.m_size = 0;
+    bvh.m_num_leaves = 0;
+    bvh.m_max_depth = 0;
+    bvh.m_build_time = 0.0;
+    if (primitives.empty()) {
+        return bvh;
+    }
+
+    std::vector<BuildItem> items(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        const Vec3 &c = primitives[i].centre;
+        items[i].bounds = Bounds::Create(primitives[i]);
+        items[i].centroid[0] = c.x;
+        items[i].centroid[1] = c.y;
+        items[i].centroid[2] = c.z;
+        items[i].index = i;
+    }
+
+    Build(items, Spheres::kWidth, bvh);
+    bvh.m_spheres = Spheres::Create(primitives, bvh.m_indices);
+
+    auto end = std::chrono::steady_clock::now();
+    bvh.m_build_time = std::chrono::duration<double>(end - start).count();
+    return bvh;
+}
+
+///
+/// @brief Bvh factory function. Build the hierarchy over a collection of
+/// shapes given by their bounding boxes, tested one at a time. The leaves
+/// refer to the shapes by their indices, and the sphere store is empty.
+///
+Bvh Bvh::Create(const std::vector<Bounds> &bounds)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    Bvh bvh;
+    bvh.m_spheres.m_size = 0;
+    bvh.m_num_leaves = 0;
+    bvh.m_max_depth = 0;
+    bvh.m_build_time = 0.0;
+    if (bounds.empty()) {
+        return bvh;
+    }
+
+    std::vector<BuildItem> items(bounds.size());
+    for (size_t i = 0; i < bounds.size(); ++i) {
+        items[i].bounds = bounds[i];
+        for (int k = 0; k < 3; ++k) {
+            items[i].centroid[k] =
+                (Real) 0.5 * (bounds[i].lo[k] + bounds[i].hi[k]);
+        }
+        items[i].index = i;
+    }
+    Build(items, 1, bvh);
+
+    auto end = std::chrono::steady_clock::now();
+    bvh.m_build_time = std::chrono::duration<double>(end - start).count();
+    return bvh;
+}
+
+///
+/// @brief Compute the line parameter and primitive index of the closest hit.
+///
+/// Traverse the hierarchy depth-first using a stack of nodes. At each interior
+/// node, visit first the child on the near side of the split axis, and push the
+/// far child on the stack. The ray range is shortened after each hit, so far
+/// nodes behind the closest hit are culled by the box-ray test.
+///
+bool Bvh::Intersect(
+    const Bvh &bvh,
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Real &t,
+    uint32_t &id,
+    Stats *stats)
+{
+    if (bvh.m_nodes.empty()) {
+        return false;
+    }
+
+    const Real o[3] = {ray.o.x, ray.o.y, ray.o.z};
+    const Real inv_d[3] = {
+        (Real) 1 / ray.d.x, (Real) 1 / ray.d.y, (Real) 1 / ray.d.z};
+    const bool dir_neg[3] = {inv_d[0] < 0.0, inv_d[1] < 0.0, inv_d[2] < 0.0};
+
+    size_t num_nodes = 0;
+    size_t num_leaf_tests = 0;
+
+    bool is_a_hit = false;
+    Real t_hit = t_max;
+    uint32_t id_hit = 0;
+    uint32_t stack[kStackSize];
+    size_t top = 0;
+    uint32_t current = 0;
+    while (true) {
+        const Node &node = bvh.m_nodes[current];
+        num_nodes++;
+        if (Bounds::Intersect(node.bounds, o, inv_d, t_min, t_hit)) {
+            if (node.count > 0) {
+                Real t;
+                uint32_t id;
+                num_leaf_tests += node.count;
+                if (Spheres::Intersect(
+                        bvh.m_spheres,
+                        node.offset,
+                        node.offset + node.count,
+                        ray,
+                        t_min,
+                        t_hit,
+                        t,
+                        id)) {
+                    is_a_hit = true;
+                    t_hit = t;
+                    id_hit = id;
+                }
+            } else if (dir_neg[node.axis]) {
+                stack[top++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[top++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+
+        if (top == 0) {
+            break;
+        }
+        current = stack[--top];
+    }
+
+    if (stats != nullptr) {
+        stats->num_rays++;
+        stats->num_nodes += num_nodes;
+        stats->num_leaf_tests += num_leaf_tests;
+    }
+
+    t = t_hit;
+    id = id_hit;
+    return is_a_hit;
+}
+
+///
+/// @brief Compute the closest primitive-ray intersection. The geometric
+/// properties are computed once, for the closest primitive only.
+///
+bool Bvh::Intersect(
+    const Bvh &bvh,
+    const std::vector<Primitive> &primitives,
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Isect &isect,
+    Stats *stats)
+{
+    Real t;
+    uint32_t id;
+    if (Intersect(bvh, ray, t_min, t_max, t, id, stats)) {
+        Primitive::GetIsect(primitives[id], ray, t, isect);
+        return true;
+    }
+    return false;
+}
+
+///
+/// @brief Any-hit query for shadow rays. Traverse the hierarchy with a fixed
+/// interval, and return as soon as a leaf has a hit inside it. The children
+/// are visited in the same front to back order as the closest-hit query, so
+/// near occluders end the traversal early.
+///
+bool Bvh::Occluded(
+    const Bvh &bvh,
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Stats *stats)
+{
+    if (bvh.m_nodes.empty()) {
+        return false;
+    }
+
+    const Real o[3] = {ray.o.x, ray.o.y, ray.o.z};
+    const Real inv_d[3] = {
+        (Real) 1 / ray.d.x, (Real) 1 / ray.d.y, (Real) 1 / ray.d.z};
+    const bool dir_neg[3] = {inv_d[0] < 0.0, inv_d[1] < 0.0, inv_d[2] < 0.0};
+
+    size_t num_nodes = 0;
+    size_t num_leaf_tests = 0;
+
+    bool is_a_hit = false;
+    uint32_t stack[kStackSize];
+    size_t top = 0;
+    uint32_t current = 0;
+    while (true) {
+        const Node &node = bvh.m_nodes[current];
+        num_nodes++;
+        if (Bounds::Intersect(node.bounds, o, inv_d, t_min, t_max)) {
+            if (node.count > 0) {
+                Real t;
+                uint32_t id;
+                num_leaf_tests += node.count;
+                if (Spheres::Intersect(
+                        bvh.m_spheres,
+                        node.offset,
+                        node.offset + node.count,
+                        ray,
+                        t_min,
+                        t_max,
+                        t,
+                        id)) {
+                    is_a_hit = true;
+                    break;
+                }
+            } else if (dir_neg[node.axis]) {
+                stack[top++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[top++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+
+        if (top == 0) {
+            break;
+        }
+        current = stack[--top];
+    }
+
+    if (stats != nullptr) {
+        stats->num_rays++;
+        stats->num_nodes += num_nodes;
+        stats->num_leaf_tests += num_leaf_tests;
+    }
+    return is_a_hit;
+}
+
+///
+/// @brief Compute the closest primitive-ray intersections of a ray packet.
+///
+/// Traverse the hierarchy once for the whole packet. At each node, the packet
+/// is first tested with interval bounds over its ray origins and inverse
+/// directions, so that nodes missed by every ray are culled with a single
+/// test. Leaves are then tested one ray at a time with the vector kernel.
+/// Children are visited in the order given by the first ray in the packet.
+///
+void Bvh::Intersect(
+    const Bvh &bvh,
+    const std::vector<Primitive> &primitives,
+    Packet &packet,
+    const Real t_min,
+    const Real t_max,
+    Stats *stats)
+{
+    const size_t count = packet.count;
+    for (size_t i = 0; i < count; ++i) {
+        packet.hits[i] = false;
+    }
+    if (bvh.m_nodes.empty() || count == 0) {
+        return;
+    }
+
+    // Compute the ray origins and inverse directions and their bounds.
+    Real o[Packet::kSize][3];
+    Real inv_d[Packet::kSize][3];
+    Real t_hit[Packet::kSize];
+    uint32_t id_hit[Packet::kSize];
+    Real o_lo[3] = {kRealMax, kRealMax, kRealMax};
+    Real o_hi[3] = {-kRealMax, -kRealMax, -kRealMax};
+    Real inv_lo[3] = {kRealMax, kRealMax, kRealMax};
+    Real inv_hi[3] = {-kRealMax, -kRealMax, -kRealMax};
+    for (size_t i = 0; i < count; ++i) {
+        const Ray &ray = packet.rays[i];
+        o[i][0] = ray.o.x;
+        o[i][1] = ray.o.y;
+        o[i][2] = ray.o.z;
+        inv_d[i][0] = (Real) 1 / ray.d.x;
+        inv_d[i][1] = (Real) 1 / ray.d.y;
+        inv_d[i][2] = (Real) 1 / ray.d.z;
+        t_hit[i] = t_max;
+        for (int k = 0; k < 3; ++k) {
+            o_lo[k] = std::min(o_lo[k], o[i][k]);
+            o_hi[k] = std::max(o_hi[k], o[i][k]);
+            inv_lo[k] = std::min(inv_lo[k], inv_d[i][k]);
+            inv_hi[k] = std::max(inv_hi[k], inv_d[i][k]);
+        }
+    }
+
+    bool coherent[3];
+    for (int k = 0; k < 3; ++k) {
+        coherent[k] = (inv_lo[k] > 0.0 || inv_hi[k] < 0.0) &&
+            std::isfinite(inv_lo[k]) && std::isfinite(inv_hi[k]);
+    }
+    const bool dir_neg[3] = {
+        inv_d[0][0] < 0.0, inv_d[0][1] < 0.0, inv_d[0][2] < 0.0};
+
+    size_t num_nodes = 0;
+    size_t num_leaf_tests = 0;
+    Real t_far = t_max;
+
+    uint32_t stack[kStackSize];
+    size_t top = 0;
+    uint32_t current = 0;
+    while (true) {
+        const Node &node = bvh.m_nodes[current];
+        num_nodes++;
+        if (Bounds::Intersect(node.bounds, o_lo, o_hi, inv_lo, inv_hi,
+                coherent, t_min, t_far)) {
+            if (node.count > 0) {
+                bool update = false;
+                for (size_t i = 0; i < count; ++i) {
+                    if (!Bounds::Intersect(
+                            node.bounds, o[i], inv_d[i], t_min, t_hit[i])) {
+                        continue;
+                    }
+                    Real t;
+                    uint32_t id;
+                    num_leaf_tests += node.count;
+                    if (Spheres::Intersect(
+                            bvh.m_spheres,
+                            node.offset,
+                            node.offset + node.count,
+                            packet.rays[i],
+                            t_min,
+                            t_hit[i],
+                            t,
+                            id)) {
+                        packet.hits[i] = true;
+                        t_hit[i] = t;
+                        id_hit[i] = id;
+                        update = true;
+                    }
+                }
+
+                // Shorten the packet range to the farthest closest hit.
+                if (update) {
+                    t_far = 0.0;
+                    for (size_t i = 0; i < count; ++i) {
+                        t_far = std::max(t_far, t_hit[i]);
+                    }
+                }
+            } else if (dir_neg[node.axis]) {
+                stack[top++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[top++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+
+        if (top == 0) {
+            break;
+        }
+        current = stack[--top];
+    }
+
+    if (stats != nullptr) {
+        stats->num_rays += count;
+        stats->num_nodes += num_nodes;
+        stats->num_leaf_tests += num_leaf_tests;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (packet.hits[i]) {
+            Primitive::GetIsect(
+                primitives[id_hit[i]], packet.rays[i], t_hit[i], packet.isects[i]);
+        }
+    }
+}
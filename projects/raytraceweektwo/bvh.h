@@ -0,0 +1,146 @@
+//
+// bvh.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <vector>
+#include "common.h"
+#include "ray.h"
+#include "isect.h"
+#include "primitive.h"
+#include "spheres.h"
+#include "packet.h"
+
+///
+/// @brief Axis-aligned bounding box, [lo, hi].
+///
+struct Bounds {
+    Real lo[3];
+    Real hi[3];
+
+    // Return the surface area of the bounding box.
+    Real area() const;
+
+    // Return the axis of the largest bounding box extent.
+    uint32_t largest_axis() const;
+
+    // Return the bounding box of two boxes or a box and a point.
+    static Bounds Union(const Bounds &a, const Bounds &b);
+    static Bounds Union(const Bounds &a, const Real p[3]);
+
+    // Return an empty bounding box.
+    static Bounds Empty();
+
+    // Return the bounding box of a primitive.
+    static Bounds Create(const Primitive &primitive);
+
+    // Compute the box-ray intersection using the inverse ray direction.
+    static bool Intersect(
+        const Bounds &bounds,
+        const Real o[3],
+        const Real inv_d[3],
+        const Real t_min,
+        const Real t_max);
+
+    // Conservative box intersection test of a set of rays with origins and
+    // inverse directions bounded by intervals. Only the coherent axes, where
+    // every ray direction has the same sign, are tested.
+    static bool Intersect(
+        const Bounds &bounds,
+        const Real o_lo[3],
+        const Real o_hi[3],
+        const Real inv_lo[3],
+        const Real inv_hi[3],
+        const bool coherent[3],
+        const Real t_min,
+        const Real t_max);
+};
+
+///
+/// @brief Bounding volume hierarchy over a collection of primitives, built
+/// with a binned surface area heuristic. Nodes are stored in depth-first
+/// order, with the first child of an interior node following its parent.
+/// The spheres are stored in leaf order, so each leaf tests a contiguous range
+/// of the sphere store with the vector kernel.
+///
+struct Bvh {
+    // Bvh node with an offset to the primitive indices (leaf) or to the second
+    // child (interior). Leaf nodes have a non-zero primitive count.
+    struct Node {
+        Bounds bounds;
+        uint32_t offset;
+        uint16_t count;
+        uint16_t axis;
+    };
+
+    // Traversal statistics.
+    struct Stats {
+        size_t num_rays;
+        size_t num_nodes;           // number of nodes visited
+        size_t num_leaf_tests;      // number of primitive-ray tests
+    };
+
+    // Size of the traversal stack, a bound on the depth of the hierarchy.
+    static const size_t kStackSize = 128;
+
+    std::vector<Node> m_nodes;
+    std::vector<uint32_t> m_indices;
+    Spheres m_spheres;
+
+    // Build statistics.
+    size_t m_num_leaves;
+    size_t m_max_depth;
+    double m_build_time;
+
+    // Compute the line parameter and primitive index of the closest hit.
+    static bool Intersect(
+        const Bvh &bvh,
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Real &t,
+        uint32_t &id,
+        Stats *stats = nullptr);
+
+    // Compute the closest primitive-ray intersection.
+    static bool Intersect(
+        const Bvh &bvh,
+        const std::vector<Primitive> &primitives,
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Isect &isect,
+        Stats *stats = nullptr);
+
+    // Return true if the ray hits any primitive in the interval (t_min, t_max),
+    // and stop traversal at the first hit.
+    static bool Occluded(
+        const Bvh &bvh,
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Stats *stats = nullptr);
+
+    // Compute the closest primitive-ray intersections of a ray packet.
+    static void Intersect(
+        const Bvh &bvh,
+        const std::vector<Primitive> &primitives,
+        Packet &packet,
+        const Real t_min,
+        const Real t_max,
+        Stats *stats = nullptr);
+
+    // Bvh factory functions, over the spheres of a collection of primitives,
+    // or over shapes given by their bounding boxes.
+    static Bvh Create(const std::vector<Primitive> &primitives);
+    static Bvh Create(const std::vector<Bounds> &bounds);
+};
+
+#endif // BVH_H_
@@ -20,22 +20,22 @@
 /// fov angle invariant in the scaling.
 ///
 Camera Camera::Create(
-    const math::vec3d &eye,
-    const math::vec3d &ctr,
-    const math::vec3d &up,
-    double fov,
-    double aspect,
-    double focus,
-    double aperture)
+    const Vec3 &eye,
+    const Vec3 &ctr,
+    const Vec3 &up,
+    Real fov,
+    Real aspect,
+    Real focus,
+    Real aperture)
 {
     Camera camera;
 
-    camera.m_ortho = math::orthod::create_from_wv(eye - ctr, up);
+    camera.m_ortho = Ortho::create_from_wv(eye - ctr, up);
     camera.m_eye = eye;
 
-    double half_theta = 0.5 * fov * M_PI / 180.0;
-    double viewport_height = 2.0 * std::tan(half_theta);
-    double viewport_width = aspect * viewport_height;
+    Real half_theta = 0.5 * fov * M_PI / 180.0;
+    Real viewport_height = 2.0 * std::tan(half_theta);
+    Real viewport_width = aspect * viewport_height;
 
     camera.m_width = focus * viewport_width;
     camera.m_height = focus * viewport_height;
@@ -54,26 +54,26 @@ Camera Camera::Create(
 /// The argument u2 represents two uniform random numbers used to sample a
 /// uniform disk.
 ///
-Ray Camera::rayto(const math::vec2d &u1, const math::vec2d &u2) const
+Ray Camera::rayto(const Vec2 &u1, const Vec2 &u2) const
 {
     // Clamp the normalized coordinates to [0,1] range.
-    double u = std::min(std::max(u1.x, 0.0), 1.0);
-    double v = std::min(std::max(u1.y, 0.0), 1.0);
+    Real u = std::min(std::max(u1.x, (Real) 0), (Real) 1);
+    Real v = std::min(std::max(u1.y, (Real) 0), (Real) 1);
 
     // Sample camera offset in the unit disk and projected to world space.
-    math::vec2d disk = Sampler::UniformDisk(u2);
-    math::vec3d offset_local{
+    Vec2 disk = Sampler::UniformDisk(u2);
+    Vec3 offset_local{
         m_radius * disk.x * std::cos(disk.y),
         m_radius * disk.x * std::sin(disk.y),
         0.0};
-    math::vec3d offset = m_ortho.local_to_world(offset_local);
+    Vec3 offset = m_ortho.local_to_world(offset_local);
 
     // Generate a point in camera space and project it to world space.
-    math::vec3d point_camera{
-        (u - 0.5) * m_width,
-        (v - 0.5) * m_height,
+    Vec3 point_camera{
+        (u - (Real) 0.5) * m_width,
+        (v - (Real) 0.5) * m_height,
         -m_depth};
-    math::vec3d point_world = m_ortho.local_to_world(point_camera);
+    Vec3 point_world = m_ortho.local_to_world(point_camera);
 
     // Return a ray with origin at the camera and direction d.
     return {m_eye + offset, math::normalize(point_world - offset)};
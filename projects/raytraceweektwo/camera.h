@@ -14,23 +14,23 @@
 #include "ray.h"
 
 struct Camera {
-    math::orthod m_ortho;         // orthonormal basis set
-    math::vec3d m_eye;            // eye position
-    double m_width;             // -1 <= width <= 1
-    double m_height;            // -1 <= height <= 1
-    double m_depth;             // 0 <= depth
-    double m_radius;            // lens radius
+    Ortho m_ortho;         // orthonormal basis set
+    Vec3 m_eye;            // eye position
+    Real m_width;          // -1 <= width <= 1
+    Real m_height;         // -1 <= height <= 1
+    Real m_depth;          // 0 <= depth
+    Real m_radius;         // lens radius
 
-    Ray rayto(const math::vec2d &u1, const math::vec2d &u2) const;
+    Ray rayto(const Vec2 &u1, const Vec2 &u2) const;
 
     static Camera Create(
-        const math::vec3d &eye,
-        const math::vec3d &ctr,
-        const math::vec3d &up,
-        double fov,
-        double aspect,
-        double focus,
-        double aperture);
+        const Vec3 &eye,
+        const Vec3 &ctr,
+        const Vec3 &up,
+        Real fov,
+        Real aspect,
+        Real focus,
+        Real aperture);
 };
 
 #endif // CAMERA_H_
@@ -0,0 +1,272 @@
+//
+// checkpoint.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <string>
+#include <stdexcept>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "tracer.h"
+#include "checkpoint.h"
+
+namespace {
+
+const char kMagic[8] = {'R', 'T', 'W', '2', 'C', 'K', 'P', 'T'};
+const uint32_t kVersion = 1;
+
+// The header occupies the first page, and each slot starts on a page.
+const size_t kPageSize = 4096;
+
+///
+/// @brief Offsets of the film buffers and the tile passes in a slot, largest
+/// elements first so each buffer is aligned.
+///
+struct Layout {
+    size_t pixels;
+    size_t moments;
+    size_t counts;
+    size_t passes;
+    size_t converged;
+    size_t size;
+};
+
+Layout SlotLayout(const size_t num_pixels, const size_t num_tiles)
+{
+    Layout layout;
+    layout.pixels = sizeof(Checkpoint::Slot);
+    layout.moments = layout.pixels + num_pixels * sizeof(Color);
+    layout.counts = layout.moments + num_pixels * sizeof(Real);
+    layout.passes = layout.counts + num_pixels * sizeof(uint32_t);
+    layout.converged = layout.passes + num_tiles * sizeof(uint32_t);
+    layout.size = layout.converged + num_pixels * sizeof(uint8_t);
+    layout.size = ((layout.size + kPageSize - 1) / kPageSize) * kPageSize;
+    return layout;
+}
+
+} // namespace
+
+/// ---------------------------------------------------------------------------
+/// @brief Open the checkpoint file of the render, or create it if it does not
+/// exist. The file is allocated in full when it is created, so writes to its
+/// pages never fail for lack of space. Throw if an existing file belongs to
+/// a render with different parameters.
+///
+Checkpoint::Checkpoint(const std::string &filename, const Tracer &tracer)
+    : m_filename(filename)
+    , m_fd(-1)
+    , m_data(nullptr)
+    , m_size(0)
+{
+    auto fail = [&] (const std::string &what) {
+        if (m_data != nullptr) {
+            munmap(m_data, m_size);
+        }
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+        throw std::runtime_error(what + " " + filename);
+    };
+
+    const Film &film = tracer.mFilm;
+    const Layout layout =
+        SlotLayout(film.m_pixels.size(), tracer.mTiles.size());
+    Header header = {};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.real_size = sizeof(Real);
+    header.width = film.m_width;
+    header.height = film.m_height;
+    header.num_tiles = tracer.mTiles.size();
+    header.params = Hash(tracer.mDesc);
+    header.slot_size = layout.size;
+    header.sequence = 0;
+    m_size = kPageSize + 2 * layout.size;
+
+    m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd < 0) {
+        fail("failed to open");
+    }
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) {
+        fail("failed to stat");
+    }
+    if (st.st_size == 0 && posix_fallocate(m_fd, 0, m_size) != 0) {
+        fail("failed to allocate");
+    }
+    if (st.st_size != 0 && (size_t) st.st_size != m_size) {
+        fail("checkpoint does not match the film of");
+    }
+
+    void *data = mmap(
+        nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (data == MAP_FAILED) {
+        fail("failed to map");
+    }
+    m_data = static_cast<uint8_t *>(data);
+
+    // A new file, or one stopped before its header was written, starts
+    // empty. Any other header must match the render.
+    Header *file_header = reinterpret_cast<Header *>(m_data);
+    const char kEmpty[sizeof(kMagic)] = {};
+    if (std::memcmp(file_header->magic, kEmpty, sizeof(kEmpty)) == 0) {
+        *file_header = header;
+    } else if (
+        std::memcmp(file_header->magic, kMagic, sizeof(kMagic)) != 0 ||
+        file_header->version != header.version ||
+        file_header->real_size != header.real_size ||
+        file_header->width != header.width ||
+        file_header->height != header.height ||
+        file_header->num_tiles != header.num_tiles ||
+        file_header->params != header.params ||
+        file_header->slot_size != header.slot_size) {
+        fail("checkpoint does not match the render parameters of");
+    }
+}
+
+///
+/// @brief Unmap and close the checkpoint file.
+///
+Checkpoint::~Checkpoint()
+{
+    if (m_data != nullptr) {
+        munmap(m_data, m_size);
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+}
+
+///
+/// @brief Copy the tracer state to the free slot, and commit it by updating
+/// the sequence number once the copy is complete. The pages are scheduled
+/// for writing without waiting for them.
+///
+void Checkpoint::save(const Tracer &tracer)
+{
+    Header *header = reinterpret_cast<Header *>(m_data);
+    const uint64_t sequence = header->sequence + 1;
+    uint8_t *slot = m_data + kPageSize + (sequence % 2) * header->slot_size;
+
+    const Film &film = tracer.mFilm;
+    const size_t num_pixels = film.m_pixels.size();
+    const Layout layout = SlotLayout(num_pixels, tracer.mTiles.size());
+    Slot state;
+    state.num_samples = tracer.mNumSamples;
+    state.num_rays = tracer.mNumRays;
+    state.num_converged = film.m_num_converged;
+    state.noise = (double) tracer.mNoise;
+    std::memcpy(slot, &state, sizeof(state));
+    std::memcpy(slot + layout.pixels, film.m_pixels.data(),
+        num_pixels * sizeof(Color));
+    std::memcpy(slot + layout.moments, film.m_moments.data(),
+        num_pixels * sizeof(Real));
+    std::memcpy(slot + layout.counts, film.m_counts.data(),
+        num_pixels * sizeof(uint32_t));
+    std::memcpy(slot + layout.passes, tracer.mTilePasses.data(),
+        tracer.mTilePasses.size() * sizeof(uint32_t));
+    std::memcpy(slot + layout.converged, film.m_converged.data(),
+        num_pixels * sizeof(uint8_t));
+
+    std::atomic_thread_fence(std::memory_order_release);
+    header->sequence = sequence;
+    msync(m_data, m_size, MS_ASYNC);
+}
+
+///
+/// @brief Copy the last committed checkpoint to the tracer. Return false,
+/// and leave the tracer unchanged, if no checkpoint was committed.
+///
+bool Checkpoint::load(Tracer &tracer) const
+{
+    const Header *header = reinterpret_cast<const Header *>(m_data);
+    if (header->sequence == 0) {
+        return false;
+    }
+    const uint8_t *slot =
+        m_data + kPageSize + (header->sequence % 2) * header->slot_size;
+
+    Film &film = tracer.mFilm;
+    const size_t num_pixels = film.m_pixels.size();
+    const Layout layout = SlotLayout(num_pixels, tracer.mTiles.size());
+    Slot state;
+    std::memcpy(&state, slot, sizeof(state));
+    std::memcpy(film.m_pixels.data(), slot + layout.pixels,
+        num_pixels * sizeof(Color));
+    std::memcpy(film.m_moments.data(), slot + layout.moments,
+        num_pixels * sizeof(Real));
+    std::memcpy(film.m_counts.data(), slot + layout.counts,
+        num_pixels * sizeof(uint32_t));
+    std::memcpy(tracer.mTilePasses.data(), slot + layout.passes,
+        tracer.mTilePasses.size() * sizeof(uint32_t));
+    std::memcpy(film.m_converged.data(), slot + layout.converged,
+        num_pixels * sizeof(uint8_t));
+    film.m_num_converged = state.num_converged;
+    tracer.mNumSamples = state.num_samples;
+    tracer.mNumRays = state.num_rays;
+    tracer.mNoise = (Real) state.noise;
+    return true;
+}
+
+///
+/// @brief Unmap, close and remove the checkpoint file.
+///
+void Checkpoint::remove()
+{
+    if (m_data != nullptr) {
+        munmap(m_data, m_size);
+        m_data = nullptr;
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    ::unlink(m_filename.c_str());
+}
+
+///
+/// @brief Return a 64-bit FNV-1a hash of the render parameters that determine
+/// the film. The number of samples only decides when the render completes,
+/// so a render can be resumed with more samples. The number of threads does
+/// not change the film, and the tone map only changes the output image. A
+/// scene file is identified by its name.
+///
+uint64_t Checkpoint::Hash(const TracerDesc &desc)
+{
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&] (const void *data, size_t size) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    };
+    mix(&desc.FilmWidth, sizeof(desc.FilmWidth));
+    mix(&desc.FilmHeight, sizeof(desc.FilmHeight));
+    mix(&desc.MaxSampleDepth, sizeof(desc.MaxSampleDepth));
+    mix(&desc.RouletteDepth, sizeof(desc.RouletteDepth));
+    mix(&desc.SplitFactor, sizeof(desc.SplitFactor));
+    mix(&desc.MinSamples, sizeof(desc.MinSamples));
+    mix(&desc.NoiseThreshold, sizeof(desc.NoiseThreshold));
+    mix(&desc.NoiseTarget, sizeof(desc.NoiseTarget));
+    mix(&desc.SamplerType, sizeof(desc.SamplerType));
+    mix(&desc.Seed, sizeof(desc.Seed));
+    mix(&desc.SceneSeed, sizeof(desc.SceneSeed));
+    mix(&desc.NumCells, sizeof(desc.NumCells));
+    mix(&desc.NumLights, sizeof(desc.NumLights));
+    mix(&desc.SkyScale, sizeof(desc.SkyScale));
+    mix(&desc.DirectLighting, sizeof(desc.DirectLighting));
+    mix(&desc.Accel, sizeof(desc.Accel));
+    mix(&desc.Packets, sizeof(desc.Packets));
+    mix(&desc.Integrator, sizeof(desc.Integrator));
+    mix(desc.SceneFile.data(), desc.SceneFile.size());
+    return hash;
+}
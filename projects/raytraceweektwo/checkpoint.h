@@ -0,0 +1,76 @@
+//
+// checkpoint.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <string>
+#include "common.h"
+
+struct Tracer;
+struct TracerDesc;
+
+///
+/// @brief Render checkpoint in a memory-mapped file. The file holds the film
+/// accumulation buffers, the sample pass counters and the last pass of each
+/// tile. Each variate is keyed by the seed, the pixel, the sample pass and the
+/// dimension within the sample, so the sample pass is all of the sampler
+/// state, and a render resumed from a checkpoint is identical to an
+/// uninterrupted one.
+///
+/// The file has two slots after its header. A checkpoint is copied into the
+/// slot that does not hold the last one, and is only committed by the update
+/// of the checkpoint sequence number in the header. A process stopped during
+/// a checkpoint then leaves the previous one intact. The pages are written
+/// back to the file by the kernel, and the render never waits for the disk.
+///
+struct Checkpoint {
+    // File header, followed by the two slots.
+    struct Header {
+        char magic[8];                      // file identifier
+        uint32_t version;                   // file layout version
+        uint32_t real_size;                 // size of a film value
+        uint32_t width;                     // film width in pixels
+        uint32_t height;                    // film height in pixels
+        uint64_t num_tiles;                 // number of film tiles
+        uint64_t params;                    // hash of the render parameters
+        uint64_t slot_size;                 // size of a slot in bytes
+        uint64_t sequence;                  // committed checkpoints
+    };
+
+    // Slot header, followed by the film buffers and the tile passes.
+    struct Slot {
+        uint64_t num_samples;               // sample passes in the film
+        uint64_t num_rays;                  // rays traced
+        uint64_t num_converged;             // converged pixels
+        double noise;                       // film error estimate
+    };
+
+    std::string m_filename;
+    int m_fd;
+    uint8_t *m_data;
+    size_t m_size;
+
+    Checkpoint(const std::string &filename, const Tracer &tracer);
+    ~Checkpoint();
+
+    // Copy the tracer state to the checkpoint, and commit it.
+    void save(const Tracer &tracer);
+
+    // Copy the last committed checkpoint, if any, to the tracer.
+    bool load(Tracer &tracer) const;
+
+    // Remove the checkpoint file, once the render is complete.
+    void remove();
+
+    // Return a hash of the render parameters that determine the film.
+    static uint64_t Hash(const TracerDesc &desc);
+};
+
+#endif // CHECKPOINT_H_
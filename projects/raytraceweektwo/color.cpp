@@ -22,7 +22,7 @@ const Color Color::Blue  = Color{0.0, 0.0, 1.0};
 ///
 /// @brief Clamp the specified color.
 ///
-Color Color::Clamp(const Color &color, const double lo, const double hi)
+Color Color::Clamp(const Color &color, const Real lo, const Real hi)
 {
     return {
         std::min(std::max(color.r, lo), hi),
@@ -30,3 +30,14 @@ Color Color::Clamp(const Color &color, const double lo, const double hi)
         std::min(std::max(color.b, lo), hi)
     };
 }
+
+///
+/// @brief Return the luminance of the specified color, using the Rec. 709
+/// primaries weights.
+///
+Real Color::Luminance(const Color &color)
+{
+    return (Real) 0.2126 * color.r +
+           (Real) 0.7152 * color.g +
+           (Real) 0.0722 * color.b;
+}
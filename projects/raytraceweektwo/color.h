@@ -10,14 +10,16 @@
 #ifndef COLOR_H_
 #define COLOR_H_
 
+#include "common.h"
+
 ///
 /// @brief Color tuple with unbounded red, green, and blue channel values.
 ///
 struct Color {
     // Color channels.
     union {
-        double data[3];
-        struct { double r, g, b; };
+        Real data[3];
+        struct { Real r, g, b; };
     };
 
     // Unary arithmetic vector operators.
@@ -27,10 +29,10 @@ struct Color {
     Color &operator/=(const Color &other);
 
     // Unary arithmetic scalar operators.
-    Color &operator+=(const double scalar);
-    Color &operator-=(const double scalar);
-    Color &operator*=(const double scalar);
-    Color &operator/=(const double scalar);
+    Color &operator+=(const Real scalar);
+    Color &operator-=(const Real scalar);
+    Color &operator*=(const Real scalar);
+    Color &operator/=(const Real scalar);
 
     // Unary plus/negation operators.
     Color operator+() const;
@@ -46,8 +48,11 @@ struct Color {
     // Clamp the specified color.
     static Color Clamp(
         const Color &color,
-        const double lo = 0.0,
-        const double hi = 1.0);
+        const Real lo = 0.0,
+        const Real hi = 1.0);
+
+    // Return the luminance of the specified color.
+    static Real Luminance(const Color &color);
 };
 
 /// ---------------------------------------------------------------------------
@@ -88,7 +93,7 @@ inline Color &Color::operator/=(const Color &other)
 /// ---------------------------------------------------------------------------
 /// @brief Unary arithmetic scalar operators.
 ///
-inline Color &Color::operator+=(const double scalar)
+inline Color &Color::operator+=(const Real scalar)
 {
     data[0] += scalar;
     data[1] += scalar;
@@ -96,7 +101,7 @@ inline Color &Color::operator+=(const double scalar)
     return *this;
 }
 
-inline Color &Color::operator-=(const double scalar)
+inline Color &Color::operator-=(const Real scalar)
 {
     data[0] -= scalar;
     data[1] -= scalar;
@@ -104,7 +109,7 @@ inline Color &Color::operator-=(const double scalar)
     return *this;
 }
 
-inline Color &Color::operator*=(const double scalar)
+inline Color &Color::operator*=(const Real scalar)
 {
     data[0] *= scalar;
     data[1] *= scalar;
@@ -112,7 +117,7 @@ inline Color &Color::operator*=(const double scalar)
     return *this;
 }
 
-inline Color &Color::operator/=(const double scalar)
+inline Color &Color::operator/=(const Real scalar)
 {
     data[0] /= scalar;
     data[1] /= scalar;
@@ -132,7 +137,7 @@ inline Color Color::operator+() const
 inline Color Color::operator-() const
 {
     Color result(*this);
-    result *= (double) (-1);
+    result *= (Real) (-1);
     return result;
 }
 
@@ -166,25 +171,25 @@ inline Color operator/(Color lhs, const Color &rhs)
 /// ---------------------------------------------------------------------------
 /// @brief Binary arithmetic operators between a vector and a scalar.
 ///
-inline Color operator+(Color lhs, const double scalar)
+inline Color operator+(Color lhs, const Real scalar)
 {
     lhs += scalar;
     return lhs;
 }
 
-inline Color operator-(Color lhs, const double scalar)
+inline Color operator-(Color lhs, const Real scalar)
 {
     lhs -= scalar;
     return lhs;
 }
 
-inline Color operator*(Color lhs, const double scalar)
+inline Color operator*(Color lhs, const Real scalar)
 {
     lhs *= scalar;
     return lhs;
 }
 
-inline Color operator/(Color lhs, const double scalar)
+inline Color operator/(Color lhs, const Real scalar)
 {
     lhs /= scalar;
     return lhs;
@@ -194,25 +199,25 @@ inline Color operator/(Color lhs, const double scalar)
 /// @brief Binary arithmetic operators between a scalar and a vector. Division is
 /// not implemented, because its not commutative.
 ///
-inline Color operator+(const double scalar, Color rhs)
+inline Color operator+(const Real scalar, Color rhs)
 {
     rhs += scalar;
     return rhs;
 }
 
-inline Color operator-(const double scalar, Color rhs)
+inline Color operator-(const Real scalar, Color rhs)
 {
     rhs -= scalar;
     return rhs;
 }
 
-inline Color operator*(const double scalar, Color rhs)
+inline Color operator*(const Real scalar, Color rhs)
 {
     rhs *= scalar;
     return rhs;
 }
 
-inline Color operator/(const double scalar, Color rhs)
+inline Color operator/(const Real scalar, Color rhs)
 {
     rhs /= scalar;
     return rhs;
@@ -10,19 +10,62 @@
 #ifndef COMMON_H_
 #define COMMON_H_
 
+#include <limits>
 #include "core/math/math.h"
 #include "core/graphics/graphics.h"
 
+// Scalar precision. The tracer computes in double precision, unless compiled
+// with RAYTRACE_FLOAT, which selects the single precision render path.
+#if defined(RAYTRACE_FLOAT)
+using Real = float;
+using Vec2 = math::vec2f;
+using Vec3 = math::vec3f;
+using Ortho = math::orthof;
+#else
+using Real = double;
+using Vec2 = math::vec2d;
+using Vec3 = math::vec3d;
+using Ortho = math::orthod;
+#endif
+static const Real kRealMax = std::numeric_limits<Real>::max();
+
+// Relative error bound of a computed intersection point, in units of the
+// largest coordinate magnitude of the intersected shape. Spawned rays are
+// offset along the surface normal by this bound.
+static const Real kRayOffset = 8 * std::numeric_limits<Real>::epsilon();
+
 // Model parameters.
 static const uint32_t kFilmWidth = 400;
 static const uint32_t kFilmHeight = 300;
-static const math::vec3d kCameraEye = {13.0, 2.0, 3.0};
-static const math::vec3d kCameraCtr = { 0.0, 0.0, 0.0};
-static const math::vec3d kCameraUp  = { 0.0, 1.0, 0.0};
-static const double kCameraFocus = math::norm(kCameraCtr - kCameraEye);
-static const double kCameraAperture = 0.25;
-static const double kCameraFov = 20.0;
+static const Vec3 kCameraEye = {13.0, 2.0, 3.0};
+static const Vec3 kCameraCtr = { 0.0, 0.0, 0.0};
+static const Vec3 kCameraUp  = { 0.0, 1.0, 0.0};
+static const Real kCameraFocus = math::norm(kCameraCtr - kCameraEye);
+static const Real kCameraAperture = 0.25;
+static const Real kCameraFov = 20.0;
 static const size_t kNumSamples = 128;
 static const size_t kMaxSampleDepth = 64;
+static const size_t kRouletteDepth = 8;
+static const size_t kSplitFactor = 1;
+static const size_t kMinSamples = 16;
+static const Real kNoiseThreshold = 0.0;
+static const Real kNoiseTarget = 0.0;
+static const Real kNoiseFloor = 0.05;
+static const int32_t kNumCells = 3;
+static const int32_t kNumLights = 0;
+static const Real kSkyScale = 1.0;
+static const Real kShadowOffset = 1.0e-3;       // shadow ray relative shortening
+static const uint64_t kRandomSeed = 1;
+static const uint32_t kTileSize = 16;
+static const uint32_t kWavefrontTileSize = 64;
+static const uint32_t kPacketSize = 4;
+static const size_t kNumPixelBuffers = 3;       // texture upload buffers
+static const Real kExposure = 1.0;              // radiance scale
+static const Real kExposureStep = 1.41421356;   // half a stop
+static const size_t kImageQueueSize = 64 << 20; // image writer queue bytes
+static const double kCheckpointInterval = 60.0; // seconds between checkpoints
+static const size_t kFilmMemory = (size_t) 4 << 30; // film budget in bytes
+static const uint32_t kCameraDimensions = 4;    // pixel and lens sample
+static const uint32_t kBounceDimensions = 8;    // bsdf, roulette and light sample
 
 #endif // COMMON_H_
@@ -3,6 +3,9 @@
 uniform float u_width;
 uniform float u_height;
 uniform sampler2D u_texsampler;
+uniform int u_display;          // 0 bitmap, 1 radiance
+uniform int u_curve;            // 0 sqrt, 1 srgb, 2 aces
+uniform float u_exposure;
 
 in vec4 vert_quad_normal;
 in vec4 vert_quad_color;
@@ -10,11 +13,36 @@ in vec2 vert_quad_texcoord;
 
 out vec4 frag_color;
 
+// sRGB transfer function.
+vec3 srgb(vec3 x)
+{
+    vec3 lo = 12.92 * x;
+    vec3 hi = 1.055 * pow(x, vec3(1.0 / 2.4)) - 0.055;
+    return mix(hi, lo, vec3(lessThanEqual(x, vec3(0.0031308))));
+}
+
+// ACES filmic fit by Krzysztof Narkowicz.
+vec3 aces(vec3 x)
+{
+    return (x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14);
+}
+
 void main()
 {
-    float gamma = 1.5;
-    frag_color = texture(u_texsampler, vert_quad_texcoord);
-    frag_color.r = pow(frag_color.r, gamma);
-    frag_color.g = pow(frag_color.g, gamma);
-    frag_color.b = pow(frag_color.b, gamma);
+    vec4 texel = texture(u_texsampler, vert_quad_texcoord);
+    if (u_display == 0) {
+        // The bitmap is already tone mapped by the cpu.
+        frag_color = vec4(texel.rgb, 1.0);
+        return;
+    }
+
+    // Normalize the radiance sums by the sample count of the pixel, scale by
+    // the exposure and map to the display with the tone curve.
+    vec3 color = u_exposure * texel.rgb / max(texel.a, 1.0);
+    color = max(color, vec3(0.0));
+    if (u_curve == 2) {
+        color = aces(color);
+    }
+    color = min(color, vec3(1.0));
+    frag_color = vec4(u_curve == 0 ? sqrt(color) : srgb(color), 1.0);
 }
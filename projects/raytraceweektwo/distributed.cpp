@@ -0,0 +1,263 @@
+//
+// distributed.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <iostream>
+#include <array>
+#include <vector>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
+#include <algorithm>
+#include <ctime>
+#include <cstdlib>
+#if defined(RAYTRACE_MPI)
+#include <mpi.h>
+#endif
+#include "common.h"
+#include "tracer.h"
+#include "distributed.h"
+
+namespace {
+
+///
+/// @brief Cpu time of the calling thread in seconds.
+///
+double ThreadTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double) ts.tv_sec + 1.0e-9 * (double) ts.tv_nsec;
+}
+
+} // namespace
+
+/// ---------------------------------------------------------------------------
+/// @brief Initialize MPI, if compiled in. Only the main thread makes MPI calls,
+/// the worker threads of the tracer never do. An MPI library without support
+/// for funneled threads aborts the job.
+///
+Distributed::Distributed()
+    : m_rank(0)
+    , m_size(1)
+    , m_time(0.0)
+{
+#if defined(RAYTRACE_MPI)
+    int provided;
+    MPI_Init_thread(nullptr, nullptr, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &m_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &m_size);
+    if (provided < MPI_THREAD_FUNNELED) {
+        if (m_rank == 0) {
+            std::cerr << "MPI library without MPI_THREAD_FUNNELED support, "
+                      << "needed by the tracer worker threads\n";
+        }
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+#endif
+}
+
+///
+/// @brief Finalize MPI, if compiled in.
+///
+Distributed::~Distributed()
+{
+#if defined(RAYTRACE_MPI)
+    MPI_Finalize();
+#endif
+}
+
+///
+/// @brief Abort every rank of the job after an error, so the other ranks do
+/// not wait forever for the failed one.
+///
+void Distributed::Abort()
+{
+#if defined(RAYTRACE_MPI)
+    if (m_size > 1) {
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+#endif
+}
+
+///
+/// @brief Number of tiles in the next range handed out, a quarter of the
+/// remaining tiles per rank. The ranges shrink as the render progresses, and
+/// the last ones are single tiles.
+///
+uint64_t Distributed::Chunk(uint64_t remaining) const
+{
+    return std::max<uint64_t>(1, remaining / (4 * (uint64_t) m_size));
+}
+
+///
+/// @brief Sample the tiles [begin, end) to completion with the worker threads
+/// of the tracer, and copy them to the tracer film. Return the cpu time of the
+/// workers spent sampling the tiles.
+///
+double Distributed::Sample(Tracer &tracer, uint64_t begin, uint64_t end)
+{
+    std::vector<double> times(tracer.mScheduler->size(), 0.0);
+    std::vector<size_t> passes(tracer.mScheduler->size(), 0);
+    tracer.mScheduler->Run(end - begin, [&] (size_t task, size_t worker) {
+        const double start = ThreadTime();
+        const Tile &tile = tracer.mTiles[begin + task];
+        passes[worker] = std::max(passes[worker],
+            tracer.RenderTile(tile, worker));
+        tracer.mFilm.copy(tracer.mTileFilms[worker]);
+        times[worker] += ThreadTime() - start;
+    });
+
+    tracer.mNumSamples = std::max(tracer.mNumSamples,
+        *std::max_element(passes.begin(), passes.end()));
+    double time = 0.0;
+    for (auto t : times) {
+        time += t;
+    }
+    return time;
+}
+
+///
+/// @brief Render the film tiles over the ranks of the job, and reduce the film,
+/// the number of rays and the number of passes to the master. Gather the
+/// tiles and the sampling cpu time of each rank in the master.
+///
+void Distributed::Render(Tracer &tracer)
+{
+#if defined(RAYTRACE_MPI)
+    auto start = std::chrono::steady_clock::now();
+    for (auto &stats : tracer.mThreadStats) {
+        stats.clear();
+    }
+    tracer.mFilm.clear();
+    tracer.mNumSamples = 0;
+    const uint64_t num_tiles = tracer.mTiles.size();
+    uint64_t tiles = 0;
+    double cpu_time = 0.0;
+
+    if (m_rank == 0) {
+        // Serve the pending requests between the tiles sampled by the master.
+        // Once every tile is handed out, wait for the requests left, and
+        // answer each with an empty range.
+        uint64_t next = 0;
+        int finished = 0;
+        while (next < num_tiles || finished < m_size - 1) {
+            MPI_Status status;
+            int flag = 1;
+            if (next < num_tiles) {
+                MPI_Iprobe(MPI_ANY_SOURCE, TagRequest, MPI_COMM_WORLD,
+                    &flag, &status);
+            } else {
+                MPI_Probe(MPI_ANY_SOURCE, TagRequest, MPI_COMM_WORLD,
+                    &status);
+            }
+            while (flag) {
+                MPI_Recv(nullptr, 0, MPI_BYTE, status.MPI_SOURCE, TagRequest,
+                    MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                uint64_t range[2] = {
+                    next, std::min(num_tiles, next + Chunk(num_tiles - next))};
+                next = range[1];
+                finished += (range[0] == range[1]) ? 1 : 0;
+                MPI_Send(range, 2, MPI_UINT64_T, status.MPI_SOURCE,
+                    TagAssign, MPI_COMM_WORLD);
+                if (next == num_tiles) {
+                    break;
+                }
+                MPI_Iprobe(MPI_ANY_SOURCE, TagRequest, MPI_COMM_WORLD,
+                    &flag, &status);
+            }
+
+            if (next < num_tiles) {
+                const uint64_t end =
+                    std::min(num_tiles, next + tracer.mScheduler->size());
+                cpu_time += Sample(tracer, next, end);
+                tiles += end - next;
+                next = end;
+            }
+        }
+    } else {
+        // Ask for the next range before sampling the current one.
+        uint64_t range[2];
+        uint64_t next_range[2];
+        MPI_Send(nullptr, 0, MPI_BYTE, 0, TagRequest, MPI_COMM_WORLD);
+        MPI_Recv(range, 2, MPI_UINT64_T, 0, TagAssign, MPI_COMM_WORLD,
+            MPI_STATUS_IGNORE);
+        while (range[0] < range[1]) {
+            MPI_Request request;
+            MPI_Irecv(next_range, 2, MPI_UINT64_T, 0, TagAssign,
+                MPI_COMM_WORLD, &request);
+            MPI_Send(nullptr, 0, MPI_BYTE, 0, TagRequest, MPI_COMM_WORLD);
+            cpu_time += Sample(tracer, range[0], range[1]);
+            tiles += range[1] - range[0];
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
+            range[0] = next_range[0];
+            range[1] = next_range[1];
+        }
+    }
+
+    // Merge the statistics of each worker into the render statistics.
+    for (auto &stats : tracer.mThreadStats) {
+        tracer.mNumRays += stats.num_rays;
+        tracer.mStats.merge(stats);
+    }
+
+    // Reduce the film buffers and the counters to the master, and gather the
+    // work of each rank. The reductions are issued together and complete in
+    // any order.
+    Film &film = tracer.mFilm;
+    const size_t num_pixels = film.m_pixels.size();
+    if (3 * num_pixels > (size_t) std::numeric_limits<int>::max()) {
+        throw std::runtime_error("film too large to reduce");
+    }
+    const MPI_Datatype real_type =
+        sizeof(Real) == sizeof(float) ? MPI_FLOAT : MPI_DOUBLE;
+    const bool root = (m_rank == 0);
+    uint64_t num_rays = tracer.mNumRays;
+    uint64_t num_passes = tracer.mNumSamples;
+    std::array<MPI_Request, 8> requests;    // 6 reductions and 2 gathers
+    size_t num_requests = 0;
+    auto reduce = [&] (
+        void *data,
+        size_t count,
+        MPI_Datatype type,
+        MPI_Op op) {
+        MPI_Ireduce(root ? MPI_IN_PLACE : data, data, (int) count, type, op,
+            0, MPI_COMM_WORLD, &requests.at(num_requests++));
+    };
+    reduce(film.m_pixels.data(), 3 * num_pixels, real_type, MPI_SUM);
+    reduce(film.m_moments.data(), num_pixels, real_type, MPI_SUM);
+    reduce(film.m_counts.data(), num_pixels, MPI_UINT32_T, MPI_SUM);
+    reduce(film.m_converged.data(), num_pixels, MPI_UINT8_T, MPI_SUM);
+    reduce(&num_rays, 1, MPI_UINT64_T, MPI_SUM);
+    reduce(&num_passes, 1, MPI_UINT64_T, MPI_MAX);
+
+    m_tiles.assign(m_size, 0);
+    m_cpu_times.assign(m_size, 0.0);
+    MPI_Igather(&tiles, 1, MPI_UINT64_T, m_tiles.data(), 1, MPI_UINT64_T,
+        0, MPI_COMM_WORLD, &requests.at(num_requests++));
+    MPI_Igather(&cpu_time, 1, MPI_DOUBLE, m_cpu_times.data(), 1, MPI_DOUBLE,
+        0, MPI_COMM_WORLD, &requests.at(num_requests++));
+    MPI_Waitall((int) num_requests, requests.data(), MPI_STATUSES_IGNORE);
+
+    if (root) {
+        tracer.mNumRays = num_rays;
+        tracer.mNumSamples = num_passes;
+        film.m_num_converged = std::count_if(
+            film.m_converged.begin(),
+            film.m_converged.end(),
+            [] (uint8_t converged) { return converged != 0; });
+        if (tracer.IsAdaptive()) {
+            // A zero threshold converges no pixel, and only returns the film
+            // error.
+            tracer.mNoise = film.converge(0);
+        }
+    }
+    m_time = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+#endif
+}
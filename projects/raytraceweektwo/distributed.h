@@ -0,0 +1,73 @@
+//
+// distributed.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef DISTRIBUTED_H_
+#define DISTRIBUTED_H_
+
+#include <vector>
+#include "common.h"
+
+struct Tracer;
+
+///
+/// @brief Distributed render of the film tiles over the ranks of an MPI job.
+/// The master rank hands out ranges of tiles on demand, and each rank samples
+/// its tiles to completion with its own worker threads. A fast rank asks for
+/// more tiles, so fast and slow ranks finish together. The ranges shrink as
+/// the tiles run out, to balance the end of the render.
+///
+/// Each rank asks for its next range before sampling the current one, so the
+/// request is served while it works. The master samples single tiles for each
+/// of its threads between requests. Once every tile is sampled, the films are
+/// reduced to the master with non-blocking reductions, issued together. Every
+/// pixel belongs to a single rank, so the reduced film is the film of a single
+/// rank rendering every tile.
+///
+/// MPI is only compiled in with RAYTRACE_MPI. Otherwise, the job is a single
+/// rank and the tracer renders on its own.
+///
+struct Distributed {
+    // Message tags.
+    enum : int {
+        TagRequest = 1,                     // rank asks for tiles
+        TagAssign                           // master assigns a tile range
+    };
+
+    int m_rank;                             // rank of the process
+    int m_size;                             // number of ranks
+    std::vector<uint64_t> m_tiles;          // tiles sampled by each rank
+    std::vector<double> m_cpu_times;        // sampling cpu time of each rank
+    double m_time;                          // render wall time
+
+    Distributed();
+    ~Distributed();
+
+    // Render the tiles over the ranks, and reduce the film to the master.
+    void Render(Tracer &tracer);
+
+    // Sample a range of tiles, and return the sampling cpu time.
+    double Sample(Tracer &tracer, uint64_t begin, uint64_t end);
+
+    // Number of tiles in the next range handed out.
+    uint64_t Chunk(uint64_t remaining) const;
+
+    // Abort every rank of the job after an error.
+    void Abort();
+
+    // Is MPI compiled in?
+    static constexpr bool Enabled() {
+#if defined(RAYTRACE_MPI)
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+
+#endif // DISTRIBUTED_H_
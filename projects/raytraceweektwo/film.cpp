@@ -8,7 +8,12 @@
 //
 
 #include <vector>
+#include <string>
+#include <fstream>
+#include <stdexcept>
 #include <cstdint>
+#include <cmath>
+#include <algorithm>
 #include "common.h"
 #include "color.h"
 #include "film.h"
@@ -18,56 +23,373 @@
 ///
 Film Film::Create(const uint32_t width, const uint32_t height)
 {
+    const size_t num_pixels = (size_t) width * height;
     Film film;
     film.m_width = width;
     film.m_height = height;
-    film.m_pixels.resize(width * height, Color::Black);
+    film.m_x0 = 0;
+    film.m_y0 = 0;
+    film.m_image_width = width;
+    film.m_image_height = height;
+    film.m_morton = false;
+    film.m_pixels.resize(num_pixels, Color::Black);
+    film.m_moments.resize(num_pixels, 0);
+    film.m_counts.resize(num_pixels, 0);
+    film.m_converged.resize(num_pixels, 0);
+    film.m_num_converged = 0;
     return film;
 }
 
+///
+/// @brief Create a film for the tiles of an image, with tiles of at most the
+/// specified size. The pixels are stored in Morton order over a square with
+/// the size rounded up to a power of two.
+///
+Film Film::CreateTile(
+    const uint32_t size,
+    const uint32_t image_width,
+    const uint32_t image_height)
+{
+    uint32_t storage = 1;
+    while (storage < size) {
+        storage *= 2;
+    }
+    const size_t num_pixels = (size_t) storage * storage;
+    Film film;
+    film.m_width = std::min(size, image_width);
+    film.m_height = std::min(size, image_height);
+    film.m_x0 = 0;
+    film.m_y0 = 0;
+    film.m_image_width = image_width;
+    film.m_image_height = image_height;
+    film.m_morton = true;
+    film.m_pixels.resize(num_pixels, Color::Black);
+    film.m_moments.resize(num_pixels, 0);
+    film.m_counts.resize(num_pixels, 0);
+    film.m_converged.resize(num_pixels, 0);
+    film.m_num_converged = 0;
+    return film;
+}
+
+///
+/// @brief Interleave the bits of the pixel coordinates in a tile, x in the
+/// even bits and y in the odd bits.
+///
+size_t Film::Morton(const uint32_t x, const uint32_t y)
+{
+    auto spread = [] (uint64_t v) {
+        v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+        v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+        v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    };
+    return (size_t) (spread(x) | (spread(y) << 1));
+}
+
 ///
 /// @brief Clear the film pixels.
 ///
 void Film::clear()
 {
     std::fill(m_pixels.begin(), m_pixels.end(), Color::Black);
+    std::fill(m_moments.begin(), m_moments.end(), 0);
+    std::fill(m_counts.begin(), m_counts.end(), 0);
+    std::fill(m_converged.begin(), m_converged.end(), 0);
+    m_num_converged = 0;
+}
+
+///
+/// @brief Move the window of a tile film to the tile, and clear its pixels.
+/// The tile must fit in the film storage.
+///
+void Film::window(const Tile &tile)
+{
+    m_x0 = tile.x0;
+    m_y0 = tile.y0;
+    m_width = tile.x1 - tile.x0;
+    m_height = tile.y1 - tile.y0;
+    clear();
 }
 
 ///
-/// @brief Set the film pixel to the specified color.
+/// @brief Copy the pixels in the window of a tile film to the film, sums,
+/// moments, counts and convergence. The film must cover the window, and the
+/// number of converged pixels of the film is left to the caller, so windows
+/// may be copied concurrently.
+///
+void Film::copy(const Film &tile)
+{
+    for (uint32_t y = tile.m_y0; y < tile.m_y0 + tile.m_height; ++y) {
+        for (uint32_t x = tile.m_x0; x < tile.m_x0 + tile.m_width; ++x) {
+            const size_t i = index(x, y);
+            const size_t j = tile.index(x, y);
+            m_pixels[i] = tile.m_pixels[j];
+            m_moments[i] = tile.m_moments[j];
+            m_counts[i] = tile.m_counts[j];
+            m_converged[i] = tile.m_converged[j];
+        }
+    }
+}
+
+///
+/// @brief Set the film pixel to the specified color, as a single sample.
 ///
 void Film::set(const uint32_t x, const uint32_t y, const Color &color)
 {
-    m_pixels[x + y * m_width] = color;
+    const size_t i = index(x, y);
+    const Real luminance = Color::Luminance(color);
+    m_pixels[i] = color;
+    m_moments[i] = luminance * luminance;
+    m_counts[i] = 1;
 }
 
 ///
-/// @brief Add the specified color the film pixel.
+/// @brief Add a sample with the specified color to the film pixel, and update
+/// the pixel second moment and sample count.
 ///
 void Film::add(const uint32_t x, const uint32_t y, const Color &color)
 {
-    m_pixels[x + y * m_width] += color;
+    const size_t i = index(x, y);
+    const Real luminance = Color::Luminance(color);
+    m_pixels[i] += color;
+    m_moments[i] += luminance * luminance;
+    m_counts[i]++;
+}
+
+///
+/// @brief Get the specified color of the film pixel, the mean of its samples.
+///
+Color Film::get(const uint32_t x, const uint32_t y) const
+{
+    const size_t i = index(x, y);
+    if (m_counts[i] == 0) {
+        return Color::Black;
+    }
+    return m_pixels[i] / (Real) m_counts[i];
+}
+
+///
+/// @brief Return the relative standard error of the film pixel mean luminance,
+/// estimated from the sample variance:
+///      error = sqrt(var / n) / (mean + floor)
+/// The noise floor keeps dark pixels from requiring unbounded sample counts.
+///
+Real Film::error(const uint32_t x, const uint32_t y) const
+{
+    const size_t i = index(x, y);
+    const Real n = (Real) m_counts[i];
+    if (n < 2) {
+        return kRealMax;
+    }
+    const Real mean = Color::Luminance(m_pixels[i]) / n;
+    const Real var = std::max(
+        (Real) 0, (m_moments[i] - n * mean * mean) / (n - 1));
+    return std::sqrt(var / n) / (mean + kNoiseFloor);
+}
+
+///
+/// @brief Has the film pixel converged?
+///
+bool Film::converged(const uint32_t x, const uint32_t y) const
+{
+    return m_converged[index(x, y)] != 0;
 }
 
 ///
-/// @brief Get the specified color of the film pixel.
+/// @brief Mark the pixels with an error below the threshold as converged, and
+/// return the root mean square error over every pixel in the film. Converged
+/// pixels keep their state and receive no further samples.
 ///
-const Color &Film::get(const uint32_t x, const uint32_t y) const
+/// The variance estimate of a single pixel is itself noisy, and pixels with an
+/// underestimated variance would stop early. A pixel only converges once the
+/// largest error in its 3x3 neighbourhood is below the threshold. A tile film
+/// only holds its own pixels, so the neighbourhood is clipped to the tile.
+///
+Real Film::converge(const Real threshold)
 {
-    return m_pixels[x + y * m_width];
+    std::vector<Real> errors((size_t) m_width * m_height);
+    double sum = 0.0;
+    for (uint32_t y = 0; y < m_height; ++y) {
+        for (uint32_t x = 0; x < m_width; ++x) {
+            const Real e = error(m_x0 + x, m_y0 + y);
+            errors[x + (size_t) y * m_width] = e;
+            sum += (double) e * e;
+        }
+    }
+
+    for (uint32_t y = 0; y < m_height; ++y) {
+        for (uint32_t x = 0; x < m_width; ++x) {
+            const size_t k = index(m_x0 + x, m_y0 + y);
+            if (m_converged[k] != 0) {
+                continue;
+            }
+            Real e = 0;
+            for (uint32_t j = (y > 0 ? y - 1 : 0);
+                 j < std::min(y + 2, m_height); ++j) {
+                for (uint32_t i = (x > 0 ? x - 1 : 0);
+                     i < std::min(x + 2, m_width); ++i) {
+                    e = std::max(e, errors[i + (size_t) j * m_width]);
+                }
+            }
+            if (e < threshold) {
+                m_converged[k] = 1;
+                m_num_converged++;
+            }
+        }
+    }
+    return (Real) std::sqrt(sum / ((double) m_width * m_height));
 }
 
 ///
-/// @brief Sample a point in the film pixel using normalized coordinates.
+/// @brief Sample a point in the film pixel using normalized image coordinates.
 /// @note For simplicity, return only the centre position of the pixel given
 /// by x and y.
 ///
-math::vec2d Film::sample(
+Vec2 Film::sample(
     const uint32_t x,
     const uint32_t y,
-    const math::vec2d &u) const
+    const Vec2 &u) const
+{
+    const Real w = (Real) m_image_width;
+    const Real h = (Real) m_image_height;
+    return Vec2{((Real) x + u.x) / w, ((Real) y + u.y) / h};
+}
+
+///
+/// @brief Return the radiance of a film region, the mean of the pixel samples
+/// with 3 values per pixel in row order.
+///
+std::vector<float> Film::radiance(const Tile &region) const
+{
+    std::vector<float> pixels;
+    pixels.reserve(3 * (size_t) (region.x1 - region.x0) *
+        (region.y1 - region.y0));
+    for (uint32_t y = region.y0; y < region.y1; ++y) {
+        for (uint32_t x = region.x0; x < region.x1; ++x) {
+            const Color color = get(x, y);
+            pixels.push_back((float) color.r);
+            pixels.push_back((float) color.g);
+            pixels.push_back((float) color.b);
+        }
+    }
+    return pixels;
+}
+
+///
+/// @brief Split an image into square tiles with the specified size, ordered
+/// by rows. Tiles on the right and top edges are clipped to the image.
+///
+std::vector<Tile> Film::Tiles(
+    const uint32_t width,
+    const uint32_t height,
+    const uint32_t size)
+{
+    std::vector<Tile> tiles;
+    for (uint32_t y = 0; y < height; y += size) {
+        for (uint32_t x = 0; x < width; x += size) {
+            tiles.push_back({
+                x,
+                y,
+                std::min(x + size, width),
+                std::min(y + size, height)});
+        }
+    }
+    return tiles;
+}
+
+/// ---------------------------------------------------------------------------
+/// @brief Load a film from a colour portable float map (PFM) file.
+///
+Film Film::Load(const std::string &filename)
 {
-    const double w = (double) m_width;
-    const double h = (double) m_height;
-    return math::vec2d{((double) x + u.x) / w, ((double) y + u.y) / h};
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("failed to open " + filename);
+    }
+
+    std::string magic;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    double byte_order = 0.0;
+    file >> magic >> width >> height >> byte_order;
+    file.get();     // single whitespace before the raster
+    if (!file || magic != "PF" || width == 0 || height == 0) {
+        throw std::runtime_error("invalid portable float map " + filename);
+    }
+    const bool swap = (byte_order < 0.0) != IsLittleEndian();
+
+    Film film = Create(width, height);
+    std::vector<float> row(3 * width);
+    for (uint32_t y = 0; y < height; ++y) {
+        file.read(reinterpret_cast<char *>(row.data()),
+            row.size() * sizeof(float));
+        if (!file) {
+            throw std::runtime_error("failed to read " + filename);
+        }
+        for (auto &value : row) {
+            if (!swap) {
+                break;
+            }
+            uint8_t *bytes = reinterpret_cast<uint8_t *>(&value);
+            std::swap(bytes[0], bytes[3]);
+            std::swap(bytes[1], bytes[2]);
+        }
+        for (uint32_t x = 0; x < width; ++x) {
+            film.set(x, y, Color{row[3 * x], row[3 * x + 1], row[3 * x + 2]});
+        }
+    }
+    return film;
+}
+
+///
+/// @brief Return true if the host byte order is little-endian. The scale in a
+/// portable float map header is negative for little-endian data and positive
+/// for big-endian data.
+///
+bool Film::IsLittleEndian()
+{
+    const uint16_t word = 1;
+    return *reinterpret_cast<const uint8_t *>(&word) == 1;
+}
+
+///
+/// @brief Compare the film pixels with the pixels of a reference film of the
+/// same size. Errors are accumulated over every channel in double precision.
+///
+FilmError Film::Compare(const Film &film, const Film &reference)
+{
+    if (film.m_width != reference.m_width ||
+        film.m_height != reference.m_height) {
+        throw std::runtime_error("film and reference sizes differ");
+    }
+
+    double sum_abs = 0.0;
+    double sum_sqr = 0.0;
+    double sum_ref = 0.0;
+    double max_abs = 0.0;
+    for (size_t i = 0; i < film.m_pixels.size(); ++i) {
+        const uint32_t x = i % film.m_width;
+        const uint32_t y = i / film.m_width;
+        const Color color = film.get(x, y);
+        const Color color_ref = reference.get(x, y);
+        for (size_t k = 0; k < 3; ++k) {
+            double value = color.data[k];
+            double ref = color_ref.data[k];
+            double error = std::abs(value - ref);
+            sum_abs += error;
+            sum_sqr += error * error;
+            sum_ref += ref * ref;
+            max_abs = std::max(max_abs, error);
+        }
+    }
+
+    const double count = 3.0 * film.m_pixels.size();
+    FilmError error;
+    error.rmse = std::sqrt(sum_sqr / count);
+    error.mean = sum_abs / count;
+    error.max = max_abs;
+    error.relative = sum_ref > 0.0 ? std::sqrt(sum_sqr / sum_ref) : 0.0;
+    return error;
 }
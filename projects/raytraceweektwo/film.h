@@ -11,38 +11,124 @@
 #define FILM_H_
 
 #include <vector>
+#include <string>
 #include "common.h"
 #include "color.h"
 
+///
+/// @brief Rectangular region of film pixels, [x0,x1) x [y0,y1).
+///
+struct Tile {
+    uint32_t x0, y0;
+    uint32_t x1, y1;
+};
+
+///
+/// @brief Error statistics of a film with respect to a reference film.
+///
+struct FilmError {
+    double rmse;            // root mean square error
+    double mean;            // mean absolute error
+    double max;             // maximum absolute error
+    double relative;        // rmse relative to the reference root mean square
+};
+
 ///
 /// @brief Maintain an array of pixels with a specified width and height.
 ///
+/// The film is a window onto the pixels of an image, addressed by their image
+/// coordinates. An image film covers the whole image, with the pixels stored
+/// in row order. A tile film covers a single tile at a time, and stores its
+/// pixels in Morton order over a square of power of two size, so the pixels
+/// of a block are close in memory.
+///
 struct Film {
+    // Storage size of a pixel, over all the pixel buffers.
+    static const size_t kPixelSize =
+        sizeof(Color) + sizeof(Real) + sizeof(uint32_t) + sizeof(uint8_t);
+
     // Member variables.
-    uint32_t m_width;
-    uint32_t m_height;
-    std::vector<Color> m_pixels;
+    uint32_t m_width;                       // window width
+    uint32_t m_height;                      // window height
+    uint32_t m_x0;                          // window origin in the image
+    uint32_t m_y0;
+    uint32_t m_image_width;                 // image width
+    uint32_t m_image_height;                // image height
+    bool m_morton;                          // pixels in Morton order?
+    std::vector<Color> m_pixels;            // sum of the pixel samples
+    std::vector<Real> m_moments;            // sum of squared sample luminance
+    std::vector<uint32_t> m_counts;         // number of pixel samples
+    std::vector<uint8_t> m_converged;       // pixel error below threshold?
+    size_t m_num_converged;                 // number of converged pixels
+
+    // Return the storage index of the pixel with the image coordinates.
+    size_t index(const uint32_t x, const uint32_t y) const {
+        const uint32_t i = x - m_x0;
+        const uint32_t j = y - m_y0;
+        return m_morton ? Morton(i, j) : i + (size_t) j * m_width;
+    }
 
     // Clear the film pixels.
     void clear();
 
-    // Set the film pixel to the specified color.
+    // Move the window of a tile film to the tile and clear its pixels.
+    void window(const Tile &tile);
+
+    // Copy the pixels in the window of a tile film to the film.
+    void copy(const Film &tile);
+
+    // Set the film pixel to the specified color, as a single sample.
     void set(const uint32_t x, const uint32_t y, const Color &color);
 
-    // Add the specified color the film pixel.
+    // Add a sample with the specified color to the film pixel.
     void add(const uint32_t x, const uint32_t y, const Color &color);
 
-    // Get the specified color of the film pixel.
-    const Color &get(const uint32_t x, const uint32_t y) const;
+    // Get the specified color of the film pixel, the mean of its samples.
+    Color get(const uint32_t x, const uint32_t y) const;
+
+    // Return the relative standard error of the film pixel mean.
+    Real error(const uint32_t x, const uint32_t y) const;
+
+    // Has the film pixel converged?
+    bool converged(const uint32_t x, const uint32_t y) const;
+
+    // Mark the pixels with an error below the threshold as converged and
+    // return the root mean square error over the film.
+    Real converge(const Real threshold);
 
     // Sample a point in the film pixel using normalized coordinates.
-    math::vec2d sample(
+    Vec2 sample(
         const uint32_t x,
         const uint32_t y,
-        const math::vec2d &u) const;
+        const Vec2 &u) const;
+
+    // Return the radiance of a film region, 3 values per pixel in row order.
+    std::vector<float> radiance(const Tile &region) const;
 
-    // Factory function.
+    // Interleave the bits of the pixel coordinates in a tile.
+    static size_t Morton(const uint32_t x, const uint32_t y);
+
+    // Split an image into square tiles with the specified size.
+    static std::vector<Tile> Tiles(
+        const uint32_t width,
+        const uint32_t height,
+        const uint32_t size);
+
+    // Factory functions of an image film and a tile film.
     static Film Create(const uint32_t width, const uint32_t height);
+    static Film CreateTile(
+        const uint32_t size,
+        const uint32_t image_width,
+        const uint32_t image_height);
+
+    // Load a film from a portable float map (PFM) file.
+    static Film Load(const std::string &filename);
+
+    // Return true if the host byte order, the PFM data order, is little-endian.
+    static bool IsLittleEndian();
+
+    // Compare the film pixels with a reference film.
+    static FilmError Compare(const Film &film, const Film &reference);
 };
 
 #endif // FILM_H_
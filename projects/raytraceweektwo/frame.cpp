@@ -0,0 +1,64 @@
+//
+// frame.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <vector>
+#include <atomic>
+#include "common.h"
+#include "frame.h"
+
+///
+/// @brief Create a triple buffer of empty frames, with a bitmap or radiance
+/// buffer of the specified size. The front frame is the initial frame, and
+/// the middle frame is not fresh.
+///
+FrameExchange::FrameExchange(
+    const size_t bitmap_size,
+    const size_t radiance_size,
+    const size_t num_tiles)
+    : m_middle(1)
+    , m_back(2)
+    , m_front(0)
+{
+    for (auto &frame : m_frames) {
+        frame.bitmap.assign(bitmap_size, 0);
+        frame.radiance.assign(radiance_size, 0.0f);
+        frame.passes.assign(num_tiles, 0);
+        frame.num_samples = 0;
+        frame.num_rays = 0;
+        frame.time = 0.0;
+        frame.stats.clear();
+    }
+}
+
+///
+/// @brief Publish the back frame as the fresh middle frame, and take the
+/// previous middle frame as the new back frame. The exchange releases the
+/// writes to the published frame to the consumer, and acquires the reads of
+/// the consumer from the frame it swapped into the middle.
+///
+void FrameExchange::publish()
+{
+    uint32_t middle = m_middle.exchange(
+        m_back | kFresh, std::memory_order_acq_rel);
+    m_back = middle & kIndex;
+}
+
+///
+/// @brief Acquire the middle frame as the new front frame, if it is fresh.
+/// Return false, and keep the current front frame, otherwise.
+///
+bool FrameExchange::acquire()
+{
+    if ((m_middle.load(std::memory_order_relaxed) & kFresh) == 0) {
+        return false;
+    }
+    uint32_t middle = m_middle.exchange(m_front, std::memory_order_acq_rel);
+    m_front = middle & kIndex;
+    return true;
+}
@@ -0,0 +1,68 @@
+//
+// frame.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <vector>
+#include <atomic>
+#include "common.h"
+#include "stats.h"
+
+///
+/// @brief Film frame, handed from the trace thread to the display. The frame
+/// holds either the resolved bitmap, or the raw film radiance resolved by the
+/// display. The counters are cumulative since the start of the trace, so the
+/// display can compute the work done between any two frames it has shown.
+///
+struct Frame {
+    std::vector<uint8_t> bitmap;            // resolved film
+    std::vector<float> radiance;            // film sums and sample counts
+    std::vector<uint32_t> passes;           // last sample pass of each tile
+    size_t num_samples;                     // sample passes in the film
+    size_t num_rays;                        // rays traced
+    double time;                            // trace wall time
+    Stats stats;                            // render statistics
+};
+
+///
+/// @brief Lock-free triple buffer of frames, with a single producer and a
+/// single consumer. The producer fills the back frame and publishes it by
+/// swapping it with the middle frame. The consumer acquires the most recent
+/// frame by swapping the front frame with the middle frame, if the middle
+/// frame is newer than the front frame. Neither side ever waits for the other,
+/// and frames published faster than they are acquired are dropped.
+///
+/// The middle frame index and a flag marking it as fresh share a single atomic
+/// word, so each swap is a single atomic exchange.
+///
+struct FrameExchange {
+    static const uint32_t kFresh = 4;
+    static const uint32_t kIndex = 3;
+
+    Frame m_frames[3];
+    std::atomic<uint32_t> m_middle;
+    uint32_t m_back;
+    uint32_t m_front;
+
+    FrameExchange(
+        const size_t bitmap_size,
+        const size_t radiance_size,
+        const size_t num_tiles);
+
+    // Producer side, the frame being filled and its publication.
+    Frame &back() { return m_frames[m_back]; }
+    void publish();
+
+    // Consumer side, acquire the most recent frame and access it.
+    bool acquire();
+    const Frame &front() const { return m_frames[m_front]; }
+};
+
+#endif // FRAME_H_
@@ -0,0 +1,632 @@
+//
+// image.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "common.h"
+#include "film.h"
+#include "tonemap.h"
+#include "image.h"
+
+namespace {
+
+// Largest payload of a stored deflate block.
+const size_t kBlockSize = 65535;
+
+// Stored deflate block header, a type byte with the final block flag and the
+// payload length with its complement.
+const size_t kBlockHeader = 5;
+
+// PNG trailer, the Adler-32 and CRC-32 checksums and the end chunk.
+const size_t kPngTrailer = 4 + 4 + 12;
+
+///
+/// @brief Append an integer to a byte string, in little-endian or big-endian
+/// byte order.
+///
+void PutLE(std::string &bytes, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        bytes.push_back((char) ((value >> (8 * i)) & 0xff));
+    }
+}
+
+void PutBE(std::string &bytes, uint64_t value, size_t size)
+{
+    for (size_t i = size; i > 0; --i) {
+        bytes.push_back((char) ((value >> (8 * (i - 1))) & 0xff));
+    }
+}
+
+///
+/// @brief Bit pattern of a float, to be stored in little-endian byte order.
+///
+uint32_t FloatBits(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+///
+/// @brief Update the CRC-32 checksum of the PNG chunks with count bytes.
+///
+uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t count)
+{
+    static const std::vector<uint32_t> table = [] () {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (size_t k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : (c >> 1);
+            }
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < count; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+///
+/// @brief Update the Adler-32 checksum of the zlib stream with count bytes.
+/// The sums are reduced every 5552 bytes, the largest count that cannot
+/// overflow them.
+///
+uint32_t Adler32(uint32_t adler, const uint8_t *data, size_t count)
+{
+    static const uint32_t kBase = 65521;
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    while (count > 0) {
+        size_t n = std::min<size_t>(count, 5552);
+        count -= n;
+        while (n-- > 0) {
+            a += *data++;
+            b += a;
+        }
+        a %= kBase;
+        b %= kBase;
+    }
+    return (b << 16) | a;
+}
+
+///
+/// @brief Append a PNG chunk with its length and checksum.
+///
+void PutChunk(std::string &bytes, const char *type, const std::string &data)
+{
+    std::string chunk(type);
+    chunk += data;
+    PutBE(bytes, data.size(), 4);
+    bytes += chunk;
+    PutBE(bytes, Crc32(0, (const uint8_t *) chunk.data(), chunk.size()), 4);
+}
+
+///
+/// @brief Append an OpenEXR header attribute.
+///
+void PutAttribute(
+    std::string &bytes,
+    const char *name,
+    const char *type,
+    const std::string &value)
+{
+    bytes += name;
+    bytes.push_back('\0');
+    bytes += type;
+    bytes.push_back('\0');
+    PutLE(bytes, value.size(), 4);
+    bytes += value;
+}
+
+///
+/// @brief Number of bytes in the PNG image data, a filter byte followed by
+/// the 8-bit codes of each row.
+///
+size_t PngDataSize(const uint32_t width, const uint32_t height)
+{
+    return (size_t) height * (1 + 3 * (size_t) width);
+}
+
+///
+/// @brief File offset of the byte at the specified offset in the PNG image
+/// data, past the headers of the stored blocks before it.
+///
+size_t PngOffset(const size_t data_offset, const size_t offset)
+{
+    return data_offset +
+        (offset / kBlockSize) * (kBlockHeader + kBlockSize) +
+        kBlockHeader +
+        offset % kBlockSize;
+}
+
+} // namespace
+
+/// ---------------------------------------------------------------------------
+/// @brief Create a closed image file, with no descriptor and no mapping.
+///
+ImageFile::ImageFile()
+    : m_format(PPM)
+    , m_width(0)
+    , m_height(0)
+    , m_fd(-1)
+    , m_data(nullptr)
+    , m_size(0)
+    , m_tonemap()
+    , m_data_offset(0)
+{}
+
+///
+/// @brief Move the file descriptor and the mapping, and leave the other file
+/// closed.
+///
+ImageFile::ImageFile(ImageFile &&other)
+    : m_format(other.m_format)
+    , m_width(other.m_width)
+    , m_height(other.m_height)
+    , m_filename(std::move(other.m_filename))
+    , m_fd(other.m_fd)
+    , m_data(other.m_data)
+    , m_size(other.m_size)
+    , m_tonemap(std::move(other.m_tonemap))
+    , m_codes(std::move(other.m_codes))
+    , m_values(std::move(other.m_values))
+    , m_data_offset(other.m_data_offset)
+{
+    other.m_fd = -1;
+    other.m_data = nullptr;
+}
+
+ImageFile &ImageFile::operator=(ImageFile &&other)
+{
+    if (this != &other) {
+        release();
+        m_format = other.m_format;
+        m_width = other.m_width;
+        m_height = other.m_height;
+        m_filename = std::move(other.m_filename);
+        m_fd = other.m_fd;
+        m_data = other.m_data;
+        m_size = other.m_size;
+        m_tonemap = std::move(other.m_tonemap);
+        m_codes = std::move(other.m_codes);
+        m_values = std::move(other.m_values);
+        m_data_offset = other.m_data_offset;
+        other.m_fd = -1;
+        other.m_data = nullptr;
+    }
+    return *this;
+}
+
+///
+/// @brief Unmap and close a file that was not closed, e.g. after an error.
+///
+ImageFile::~ImageFile()
+{
+    release();
+}
+
+///
+/// @brief Write a region of radiance values, 3 per pixel in row order. The
+/// film origin is the bottom-left corner. The rows of the portable float map
+/// run from bottom to top as well, and the rows of the other formats from top
+/// to bottom.
+///
+void ImageFile::write(const Tile &region, const float *pixels)
+{
+    const size_t width = region.x1 - region.x0;
+    const size_t num_values = 3 * width;
+    m_codes.resize(4 * num_values);
+    m_values.resize(num_values);
+
+    for (uint32_t y = region.y0; y < region.y1; ++y) {
+        const float *row = pixels + (y - region.y0) * num_values;
+        const size_t top = m_height - 1 - y;
+
+        if (m_format == PFM) {
+            const size_t offset = 3 * ((size_t) y * m_width + region.x0);
+            std::memcpy(m_data + m_data_offset + offset * sizeof(float),
+                row, num_values * sizeof(float));
+            continue;
+        }
+
+        if (m_format == EXR) {
+            // Each scanline block holds the B, G and R channels in turn, as
+            // little-endian floats, after its y coordinate and data size.
+            uint8_t *block = m_data + m_data_offset + top * (8 + 12 * m_width);
+            for (size_t c = 0; c < 3; ++c) {
+                uint8_t *bytes = block + 8 + 4 * (c * m_width + region.x0);
+                for (size_t x = 0; x < width; ++x) {
+                    uint32_t bits = FloatBits(row[3 * x + 2 - c]);
+                    for (size_t i = 0; i < 4; ++i) {
+                        *bytes++ = (uint8_t) ((bits >> (8 * i)) & 0xff);
+                    }
+                }
+            }
+            continue;
+        }
+
+        // Map the radiance with the tone map. The blocks of pixels do not
+        // cross the tiles of the rounding offsets.
+        const size_t kNoiseSize = ToneMap::kNoiseSize;
+        const int32_t *offsets =
+            &m_tonemap.m_offsets[(y % kNoiseSize) * 3 * kNoiseSize];
+        for (size_t k = 0; k < num_values; ++k) {
+            m_values[k] = row[k] * m_tonemap.m_exposure;
+        }
+        for (size_t x = region.x0; x < region.x1; ) {
+            const size_t n = std::min<size_t>(
+                region.x1 - x, kNoiseSize - x % kNoiseSize);
+            const size_t i = 3 * (x - region.x0);
+            ToneMap::Encode(
+                m_tonemap,
+                &m_values[i],
+                &offsets[3 * (x % kNoiseSize)],
+                3 * n,
+                &m_codes[i]);
+            x += n;
+        }
+
+        if (m_format == PPM) {
+            const size_t offset = 3 * (top * m_width + region.x0);
+            std::memcpy(m_data + m_data_offset + offset,
+                m_codes.data(), num_values);
+            continue;
+        }
+
+        // Copy the codes in pieces that do not cross a stored block.
+        size_t offset = top * (1 + 3 * (size_t) m_width) + 1 + 3 * region.x0;
+        for (size_t i = 0; i < num_values; ) {
+            const size_t n = std::min(
+                num_values - i, kBlockSize - offset % kBlockSize);
+            std::memcpy(m_data + PngOffset(m_data_offset, offset),
+                &m_codes[i], n);
+            offset += n;
+            i += n;
+        }
+    }
+}
+
+///
+/// @brief Write the trailing checksums of the PNG image data, and unmap and
+/// close the file. The Adler-32 checksum covers the uncompressed data of each
+/// block, and the CRC-32 checksum the whole chunk, from the chunk type and the
+/// zlib header before the data offset.
+///
+void ImageFile::close()
+{
+    if (m_data == nullptr) {
+        return;
+    }
+    if (m_format == PNG) {
+        const size_t size = PngDataSize(m_width, m_height);
+        const size_t num_blocks = (size + kBlockSize - 1) / kBlockSize;
+        uint8_t *chunk = m_data + m_data_offset - 6;
+        const size_t length = 6 + num_blocks * kBlockHeader + size;
+        uint32_t adler = 1;
+        for (size_t b = 0; b < num_blocks; ++b) {
+            const size_t n = std::min(kBlockSize, size - b * kBlockSize);
+            adler = Adler32(adler, m_data + m_data_offset +
+                b * (kBlockHeader + kBlockSize) + kBlockHeader, n);
+        }
+
+        std::string trailer;
+        PutBE(trailer, adler, 4);
+        uint32_t crc = Crc32(0, chunk, length);
+        crc = Crc32(crc, (const uint8_t *) trailer.data(), trailer.size());
+        PutBE(trailer, crc, 4);
+        PutChunk(trailer, "IEND", "");
+        std::memcpy(chunk + length, trailer.data(), trailer.size());
+    }
+
+    munmap(m_data, m_size);
+    m_data = nullptr;
+    if (::close(m_fd) != 0) {
+        m_fd = -1;
+        throw std::runtime_error("failed to write " + m_filename);
+    }
+    m_fd = -1;
+}
+
+///
+/// @brief Unmap and close the file, if it is open, without the trailing
+/// checksums.
+///
+void ImageFile::release()
+{
+    if (m_data != nullptr) {
+        munmap(m_data, m_size);
+        m_data = nullptr;
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+///
+/// @brief Return the format of a filename, given by its extension.
+///
+uint32_t ImageFile::Format(const std::string &filename)
+{
+    static const char *kExtensions[NumFormats] = {
+        ".ppm", ".png", ".pfm", ".exr"};
+    for (uint32_t format = 0; format < NumFormats; ++format) {
+        const std::string ext(kExtensions[format]);
+        if (filename.size() >= ext.size() &&
+            filename.compare(filename.size() - ext.size(), ext.size(), ext)
+                == 0) {
+            return format;
+        }
+    }
+    throw std::runtime_error("unknown image format " + filename);
+}
+
+///
+/// @brief Image file factory function. Allocate and map the file, and write
+/// the header of the format and the parts of the layout that do not depend
+/// on the pixels: the headers of the PNG stored blocks and the row filter
+/// bytes, or the OpenEXR offset table and scanline block headers. The file is
+/// allocated in full, so writes to its pages never fail for lack of space.
+///
+ImageFile ImageFile::Create(
+    const std::string &filename,
+    const uint32_t width,
+    const uint32_t height,
+    const ToneMap &tonemap)
+{
+    if (width == 0 || height == 0) {
+        throw std::runtime_error("invalid image size " + filename);
+    }
+
+    ImageFile image;
+    image.m_format = Format(filename);
+    image.m_width = width;
+    image.m_height = height;
+    image.m_filename = filename;
+    image.m_tonemap = tonemap;
+
+    std::string header;
+    if (image.m_format == PPM) {
+        header = "P6\n" + std::to_string(width) + " " +
+            std::to_string(height) + "\n255\n";
+    } else if (image.m_format == PFM) {
+        header = "PF\n" + std::to_string(width) + " " +
+            std::to_string(height) + "\n" +
+            (Film::IsLittleEndian() ? "-1.0" : "1.0") + "\n";
+    } else if (image.m_format == PNG) {
+        // Signature and header chunk, 8-bit RGB, no interlace. The image
+        // data chunk holds a zlib stream without compression.
+        const size_t size = PngDataSize(width, height);
+        const size_t num_blocks = (size + kBlockSize - 1) / kBlockSize;
+        const size_t length = 2 + num_blocks * kBlockHeader + size + 4;
+        if (length > 0x7fffffffu) {
+            throw std::runtime_error("image too large for PNG " + filename);
+        }
+        header = "\x89PNG\r\n\x1a\n";
+        std::string ihdr;
+        PutBE(ihdr, width, 4);
+        PutBE(ihdr, height, 4);
+        ihdr += std::string("\x08\x02\x00\x00\x00", 5);
+        PutChunk(header, "IHDR", ihdr);
+        PutBE(header, length, 4);
+        header += "IDAT\x78\x01";
+    } else {
+        // Single part scanline image, one line per block, no compression.
+        std::string channels;
+        for (const char *name : {"B", "G", "R"}) {
+            channels += name;
+            channels.push_back('\0');
+            PutLE(channels, 2, 4);              // float pixel type
+            PutLE(channels, 0, 4);              // linear flag and reserved
+            PutLE(channels, 1, 4);              // x sampling
+            PutLE(channels, 1, 4);              // y sampling
+        }
+        channels.push_back('\0');
+        std::string window;
+        PutLE(window, 0, 4);
+        PutLE(window, 0, 4);
+        PutLE(window, width - 1, 4);
+        PutLE(window, height - 1, 4);
+        std::string center;
+        PutLE(center, 0, 8);
+        std::string one;
+        PutLE(one, FloatBits(1.0f), 4);
+
+        PutLE(header, 20000630, 4);             // magic number
+        PutLE(header, 2, 4);                    // version, single part
+        PutAttribute(header, "channels", "chlist", channels);
+        PutAttribute(header, "compression", "compression", std::string(1, 0));
+        PutAttribute(header, "dataWindow", "box2i", window);
+        PutAttribute(header, "displayWindow", "box2i", window);
+        PutAttribute(header, "lineOrder", "lineOrder", std::string(1, 0));
+        PutAttribute(header, "pixelAspectRatio", "float", one);
+        PutAttribute(header, "screenWindowCenter", "v2f", center);
+        PutAttribute(header, "screenWindowWidth", "float", one);
+        header.push_back('\0');
+
+        const size_t block_size = 8 + 12 * (size_t) width;
+        const size_t data_offset = header.size() + 8 * (size_t) height;
+        for (uint32_t y = 0; y < height; ++y) {
+            PutLE(header, data_offset + y * block_size, 8);
+        }
+    }
+    image.m_data_offset = header.size();
+
+    // Allocate and map the file.
+    const size_t num_pixels = (size_t) width * height;
+    const size_t png_size = PngDataSize(width, height);
+    const size_t num_blocks = (png_size + kBlockSize - 1) / kBlockSize;
+    const size_t block_size = 8 + 12 * (size_t) width;
+    const size_t data_size[NumFormats] = {
+        3 * num_pixels,
+        num_blocks * kBlockHeader + png_size + kPngTrailer,
+        3 * num_pixels * sizeof(float),
+        height * block_size};
+    image.m_size = image.m_data_offset + data_size[image.m_format];
+
+    image.m_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (image.m_fd < 0) {
+        throw std::runtime_error("failed to open " + filename);
+    }
+    void *data = MAP_FAILED;
+    if (posix_fallocate(image.m_fd, 0, image.m_size) == 0) {
+        data = mmap(nullptr, image.m_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, image.m_fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("failed to allocate " + filename);
+    }
+    image.m_data = static_cast<uint8_t *>(data);
+    std::memcpy(image.m_data, header.data(), header.size());
+
+    if (image.m_format == PNG) {
+        for (size_t b = 0; b < num_blocks; ++b) {
+            const size_t n = std::min(kBlockSize, png_size - b * kBlockSize);
+            std::string block;
+            block.push_back((b + 1 == num_blocks) ? 1 : 0);
+            PutLE(block, n, 2);
+            PutLE(block, ~n & 0xffff, 2);
+            std::memcpy(image.m_data + image.m_data_offset +
+                b * (kBlockHeader + kBlockSize), block.data(), block.size());
+        }
+        const size_t stride = 1 + 3 * (size_t) width;
+        for (uint32_t y = 0; y < height; ++y) {
+            image.m_data[PngOffset(image.m_data_offset, y * stride)] = 0;
+        }
+    } else if (image.m_format == EXR) {
+        for (uint32_t y = 0; y < height; ++y) {
+            std::string block;
+            PutLE(block, y, 4);
+            PutLE(block, 12 * (size_t) width, 4);
+            std::memcpy(image.m_data + image.m_data_offset + y * block_size,
+                block.data(), block.size());
+        }
+    }
+    return image;
+}
+
+/// ---------------------------------------------------------------------------
+/// @brief Create the image file and start its writer thread.
+///
+ImageWriter::ImageWriter(
+    const std::string &filename,
+    const uint32_t width,
+    const uint32_t height,
+    const ToneMap &tonemap)
+    : m_image(ImageFile::Create(filename, width, height, tonemap))
+    , m_size(0)
+    , m_quit(false)
+{
+    m_thread = std::thread(&ImageWriter::Work, this);
+}
+
+///
+/// @brief Write the queued regions and wait for the writer thread to finish.
+///
+ImageWriter::~ImageWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_pushed.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+///
+/// @brief Queue a region of radiance values. Wait for the writer while the
+/// queue is full, unless it is empty, so a region larger than the queue is
+/// still written. Regions pushed after a write error are dropped.
+///
+void ImageWriter::push(const Tile &tile, std::vector<float> pixels)
+{
+    const size_t size = pixels.size() * sizeof(float);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_popped.wait(lock, [&] () {
+        return m_error || m_queue.empty() || m_size + size <= kImageQueueSize;
+    });
+    if (m_error) {
+        return;
+    }
+    m_queue.push_back(Region{tile, std::move(pixels)});
+    m_size += size;
+    m_pushed.notify_one();
+}
+
+///
+/// @brief Write the queued regions, close the file and rethrow any error of
+/// the writer thread.
+///
+void ImageWriter::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_pushed.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    if (m_error) {
+        std::rethrow_exception(m_error);
+    }
+}
+
+///
+/// @brief Writer thread main loop. Write the queued regions in order until
+/// the writer is finished and the queue is empty, then close the file. An
+/// error stops the writer and is kept for finish.
+///
+void ImageWriter::Work()
+{
+    try {
+        while (true) {
+            Region region;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_pushed.wait(lock, [&] () {
+                    return m_quit || !m_queue.empty();
+                });
+                if (m_queue.empty()) {
+                    break;
+                }
+                region = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+
+            m_image.write(region.tile, region.pixels.data());
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_size -= region.pixels.size() * sizeof(float);
+            }
+            m_popped.notify_all();
+        }
+        m_image.close();
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error = std::current_exception();
+        m_popped.notify_all();
+    }
+}
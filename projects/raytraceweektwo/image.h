@@ -0,0 +1,130 @@
+//
+// image.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "common.h"
+#include "film.h"
+#include "tonemap.h"
+
+///
+/// @brief Image file written in regions of pixels, in any order. The float
+/// formats store the radiance unclamped, and the 8-bit formats store the
+/// radiance mapped by the tone map.
+///
+/// Every format has a fixed layout, with each pixel at a known offset in the
+/// file. The file is allocated in full and mapped in memory when it is
+/// created, and each region is copied in place in the mapping. The pages are
+/// written back to the file by the kernel, so the image is never held in
+/// memory. The PNG image data is a zlib stream of stored deflate blocks, and
+/// its checksums are computed from the mapping when the file is closed.
+///
+/// An image file owns its descriptor and its mapping, and is moved but not
+/// copied. A file that is destroyed before it is closed is unmapped and
+/// closed without its checksums.
+///
+struct ImageFile {
+    // Image file formats.
+    enum : uint32_t {
+        PPM = 0,                // binary portable pixmap, 8-bit
+        PNG,                    // portable network graphics, 8-bit
+        PFM,                    // portable float map, 32-bit float
+        EXR,                    // OpenEXR scanlines, 32-bit float
+        NumFormats
+    };
+
+    uint32_t m_format;
+    uint32_t m_width;
+    uint32_t m_height;
+    std::string m_filename;
+    int m_fd;                               // file descriptor
+    uint8_t *m_data;                        // file mapping
+    size_t m_size;                          // file size
+    ToneMap m_tonemap;
+    std::vector<uint8_t> m_codes;           // 8-bit codes of a region row
+    std::vector<float> m_values;            // float values of a region row
+    size_t m_data_offset;                   // file offset of the pixel data
+
+    ImageFile();
+    ImageFile(ImageFile &&other);
+    ImageFile &operator=(ImageFile &&other);
+    ImageFile(const ImageFile &) = delete;
+    ImageFile &operator=(const ImageFile &) = delete;
+    ~ImageFile();
+
+    // Write a region of radiance values, 3 per pixel in row order.
+    void write(const Tile &region, const float *pixels);
+
+    // Write the trailing checksums, if any, and unmap and close the file.
+    // Closing a closed file does nothing.
+    void close();
+
+    // Unmap and close the file, without the trailing checksums.
+    void release();
+
+    // Return the format of a filename, given by its extension.
+    static uint32_t Format(const std::string &filename);
+
+    // Image file factory function.
+    static ImageFile Create(
+        const std::string &filename,
+        const uint32_t width,
+        const uint32_t height,
+        const ToneMap &tonemap);
+};
+
+///
+/// @brief Image file encoded by a background thread. Regions are queued with
+/// their radiance and written in the order they arrive, so the encoding
+/// overlaps the tracing of the film. The queue holds at most kImageQueueSize
+/// bytes of radiance, and push waits for the writer once it is full.
+///
+struct ImageWriter {
+    // Region of radiance values queued for the writer.
+    struct Region {
+        Tile tile;
+        std::vector<float> pixels;
+    };
+
+    ImageFile m_image;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_pushed;
+    std::condition_variable m_popped;
+    std::deque<Region> m_queue;
+    size_t m_size;
+    bool m_quit;
+    std::exception_ptr m_error;
+
+    ImageWriter(
+        const std::string &filename,
+        const uint32_t width,
+        const uint32_t height,
+        const ToneMap &tonemap);
+    ~ImageWriter();
+
+    // Queue a region of radiance values, 3 per pixel in row order.
+    void push(const Tile &tile, std::vector<float> pixels);
+
+    // Write the queued regions, close the file and rethrow any write error.
+    void finish();
+
+    // Writer thread main loop.
+    void Work();
+};
+
+#endif // IMAGE_H_
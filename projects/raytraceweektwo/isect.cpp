@@ -17,7 +17,7 @@
 /// ---------------------------------------------------------------------------
 /// @brief Return the absolute dot product |w.v|.
 ///
-double Isect::AbsDot(const math::vec3d &v, const math::vec3d &w)
+Real Isect::AbsDot(const Vec3 &v, const Vec3 &w)
 {
     return std::abs(math::dot(v, w));
 }
@@ -26,19 +26,19 @@ double Isect::AbsDot(const math::vec3d &v, const math::vec3d &w)
 /// @brief Are vectors wo and wi on the same hemisphere specified by normal n?
 ///
 bool Isect::SameHemisphere(
-    const math::vec3d &n,
-    const math::vec3d &wo,
-    math::vec3d &wi)
+    const Vec3 &n,
+    const Vec3 &wo,
+    Vec3 &wi)
 {
-    double cos_theta_o = math::dot(n, wo);
-    double cos_theta_i = math::dot(n, wi);
+    Real cos_theta_o = math::dot(n, wo);
+    Real cos_theta_i = math::dot(n, wi);
     return (cos_theta_o * cos_theta_i > 0.0);
 }
 
 ///
 /// @brief Orient w to lie on the same hemisphere specified by n.
 ///
-math::vec3d Isect::FaceForward(const math::vec3d &n, const math::vec3d &w)
+Vec3 Isect::FaceForward(const Vec3 &n, const Vec3 &w)
 {
     if (math::dot(n, w) < 0.0) {
         return -w;
@@ -49,7 +49,7 @@ math::vec3d Isect::FaceForward(const math::vec3d &n, const math::vec3d &w)
 ///
 /// @brief Return the direction vector from source towards the specified target.
 ///
-math::vec3d Isect::DirTo(const math::vec3d &source, const math::vec3d &target)
+Vec3 Isect::DirTo(const Vec3 &source, const Vec3 &target)
 {
     return math::normalize(target - source);
 }
@@ -59,11 +59,11 @@ math::vec3d Isect::DirTo(const math::vec3d &source, const math::vec3d &target)
 /// normal n, compute the incident vector wi that is reflected to wo.
 ///
 void Isect::Reflect(
-    const math::vec3d &n,
-    const math::vec3d &wo,
-    math::vec3d &wi)
+    const Vec3 &n,
+    const Vec3 &wo,
+    Vec3 &wi)
 {
-    wi = -wo + (2.0 * math::dot(n, wo)) * n;
+    wi = -wo + ((Real) 2 * math::dot(n, wo)) * n;
 }
 
 ///
@@ -74,25 +74,25 @@ void Isect::Reflect(
 /// outgoing vector medium and ni is the ior of the incident vector medium.
 ///
 bool Isect::Refract(
-    const double eta,
-    const math::vec3d &n,
-    const math::vec3d &wo,
-    math::vec3d &wi)
+    const Real eta,
+    const Vec3 &n,
+    const Vec3 &wo,
+    Vec3 &wi)
 {
     // Compute the trignometric components of wi using Snell's law and check
     // for the total internal reflection condition for transmission.
-    double cos_theta_o = math::dot(n, wo);
-    double cos2_theta_o = cos_theta_o * cos_theta_o;
-    double sin2_theta_o = std::max(0.0, 1.0 - cos2_theta_o);
+    Real cos_theta_o = math::dot(n, wo);
+    Real cos2_theta_o = cos_theta_o * cos_theta_o;
+    Real sin2_theta_o = std::max(0.0, 1.0 - cos2_theta_o);
 
-    double sin2_theta_i = eta * eta * sin2_theta_o;
+    Real sin2_theta_i = eta * eta * sin2_theta_o;
     if (sin2_theta_i > 1.0) {
         return false;
     }
 
-    double cos2_theta_i = std::max(0.0, 1.0 - sin2_theta_i);
-    double sign_theta_i = cos_theta_o < 0.0 ? 1.0 : -1.0;
-    double cos_theta_i = sign_theta_i * std::sqrt(cos2_theta_i);
+    Real cos2_theta_i = std::max(0.0, 1.0 - sin2_theta_i);
+    Real sign_theta_i = cos_theta_o < 0.0 ? 1.0 : -1.0;
+    Real cos_theta_i = sign_theta_i * std::sqrt(cos2_theta_i);
 
     // Compute wi from wo and the normal n
     wi = -eta * wo + (eta * cos_theta_o + cos_theta_i) * n;
@@ -105,9 +105,9 @@ bool Isect::Refract(
 /// to the surface normal (cos_theta = 0):
 ///      R = R0 + (1 - R0) * (1 - |cos(theta)|)^5
 ///
-Color Isect::SchlickConductor(const Color &R0, const double cos_theta_i)
+Color Isect::SchlickConductor(const Color &R0, const Real cos_theta_i)
 {
-    double c = std::min(std::max(1.0 - cos_theta_i, 0.0), 1.0);
+    Real c = std::min(std::max(1.0 - cos_theta_i, 0.0), 1.0);
     return R0 + (Color::White - R0) * (c * c * c * c * c);
 }
 
@@ -125,110 +125,173 @@ Color Isect::SchlickConductor(const Color &R0, const double cos_theta_i)
 /// then we need to use the angle of the outgoing direction with the normal and
 /// handle the case of total internal reflection.
 ///
-double Isect::SchlickDielectric(const double eta, const double cos_theta_i)
+Real Isect::SchlickDielectric(const Real eta, const Real cos_theta_i)
 {
-    double c = std::min(std::max(1.0 - cos_theta_i, 0.0), 1.0);
+    Real c = std::min(std::max(1.0 - cos_theta_i, 0.0), 1.0);
 
     if (eta < 1.0) {
-        double cos2_theta_i = cos_theta_i * cos_theta_i;
-        double sin2_theta_i = std::max(0.0, 1.0 - cos2_theta_i);
-        double sin2_theta_o = sin2_theta_i / (eta * eta);
+        Real cos2_theta_i = cos_theta_i * cos_theta_i;
+        Real sin2_theta_i = std::max(0.0, 1.0 - cos2_theta_i);
+        Real sin2_theta_o = sin2_theta_i / (eta * eta);
 
         if (sin2_theta_o > 1.0) {
             return 1.0;    // Total Internal Reflection
         }
 
-        double cos2_theta_o = std::max(0.0, 1.0 -  sin2_theta_o);
-        double cos_theta_o = std::sqrt(cos2_theta_o);
+        Real cos2_theta_o = std::max(0.0, 1.0 -  sin2_theta_o);
+        Real cos_theta_o = std::sqrt(cos2_theta_o);
         c = std::min(std::max(1.0 - cos_theta_o, 0.0), 1.0);
     }
 
-    double R0 = (1.0 - eta) / (1.0 + eta);
+    Real R0 = (1.0 - eta) / (1.0 + eta);
     R0 *= R0;
     return R0 + (1.0 - R0) * (c * c * c * c * c);
 }
 
 /// ---------------------------------------------------------------------------
-/// @brief Return the intersection indicident direction and scattering functions.
+/// @brief Diffuse material. Sample a random direction on the same hemisphere as
+/// the outgoing direction using a cosine distribution to favour variates close
+/// to the normal direction. The bsdf of a diffuse material is constant for
+/// every pair wi and wo, and equal to (reflectance / pi).
 ///
-bool Isect::Scatter(
+bool Isect::ScatterDiffuse(
     const Isect &isect,
-    const math::vec2d &u,
-    const math::vec3d &wo,
-    math::vec3d &wi,
+    const Material &material,
+    const Vec2 &u,
+    const Vec3 &wo,
+    Vec3 &wi,
     Color &bsdf,
-    double &pdf)
+    Real &pdf)
 {
-    // Diffuse material. Sample a random direction on the same hemisphere as the
-    // outgoing direction using a cosine distribution to favour variates close to
-    // the normal direction. The bsdf of a diffuse material is constant for every
-    // pair wi and wo, and equal to (reflectance / pi).
-    if (isect.material.type == Material::Diffuse) {
-        math::orthod uvw = math::orthod::create_from_w(isect.n);
-        wi = uvw.local_to_world(Sampler::CosineHemisphere(u));
-        if (!SameHemisphere(isect.n, wo, wi)) {
-            wi = -wi;
+    Ortho uvw = Ortho::create_from_w(isect.n);
+    wi = uvw.local_to_world(Sampler::CosineHemisphere(u));
+    if (!SameHemisphere(isect.n, wo, wi)) {
+        wi = -wi;
+    }
+    Real cos_theta_i = AbsDot(isect.n, wi);
+
+    bsdf = material.rho * M_1_PI;
+    pdf = Sampler::CosineHemispherePdf(cos_theta_i);
+    return true;
+}
+
+///
+/// @brief Conductor material. Compute the incident direction that is reflected
+/// into the outgoing direction. The associated pdf is a directional Dirac delta
+/// function, delta(wi - reflect(wo)).
+/// The bsdf of a conductor material contains the same directional Dirac delta
+/// function, delta(wi - reflect(wo)), thereby cancelling each other in the
+/// estimator for the outgoing radiance.
+/// The pdf is thus set to one, and the bsdf is set to be:
+///  reflectance / |cos(theta_i)|
+///
+bool Isect::ScatterConductor(
+    const Isect &isect,
+    const Material &material,
+    const Vec2 &u,
+    const Vec3 &wo,
+    Vec3 &wi,
+    Color &bsdf,
+    Real &pdf)
+{
+    Reflect(isect.n, wo, wi);
+    Real cos_theta_i = AbsDot(isect.n, wi);
+    Color R = SchlickConductor(material.rho, cos_theta_i);
+
+    bsdf = R / cos_theta_i;
+    pdf = 1.0;
+    return true;
+}
+
+///
+/// @brief Dielectric material. Here eta is the ratio of indices of refraction
+/// of outgoing to incident directions, eta = n_o / n_i, where n_o is the ior
+/// of the outgoing medium and n_i is the ior of the incident medium
+///
+bool Isect::ScatterDielectric(
+    const Isect &isect,
+    const Material &material,
+    const Vec2 &u,
+    const Vec3 &wo,
+    Vec3 &wi,
+    Color &bsdf,
+    Real &pdf)
+{
+    Real cos_theta_o = math::dot(isect.n, wo);
+    bool entering = cos_theta_o < 0.0;
+
+    Real eta_i = entering ? 1.0 : material.ior;
+    Real eta_o = entering ? material.ior : 1.0;
+    Real eta = eta_o / eta_i;
+
+    // Compute the Fresnel reflectance using Schlick approximation. Here, the
+    // incident direction is on the same hemisphere as the outgoing direction,
+    // with cos_theta_i = cos_theta_o, and with eta inverted because the ior
+    // of the incident medium is on the same side as the outgoing medium.
+    Real F = SchlickDielectric(1.0 / eta, std::abs(cos_theta_o));
+
+    if (u.x < F) {
+        Reflect(isect.n, wo, wi);
+        Real cos_theta_i = AbsDot(isect.n, wi);
+        Real R = F / cos_theta_i;
+
+        bsdf = Color::White * R;
+        pdf = F;
+    } else {
+        if (!Refract(eta, isect.n, wo, wi)) {
+            return false;
         }
-        double cos_theta_i = AbsDot(isect.n, wi);
+        Real cos_theta_i = AbsDot(isect.n, wi);
+        Real T = (1.0 - F) * eta * eta / cos_theta_i;
 
-        bsdf = isect.material.rho * M_1_PI;
-        pdf = Sampler::CosineHemispherePdf(cos_theta_i);
-        return true;
+        bsdf = Color::White * T;
+        pdf = 1.0 - F;
     }
+    return true;
+}
 
-    // Conductor material. Compute the incident direction that is reflected into
-    // the outgoing direction. The associated pdf is a directional Dirac delta
-    // function, delta(wi - reflect(wo)).
-    // The bsdf of a conductor material contains the same directional Dirac delta
-    // function, delta(wi - reflect(wo)), thereby cancelling each other in the
-    // estimator for the outgoing radiance.
-    // The pdf is thus set to one, and the bsdf is set to be:
-    //  reflectance / |cos(theta_i)|
-    if (isect.material.type == Material::Conductor) {
-        Reflect(isect.n, wo, wi);
-        double cos_theta_i = AbsDot(isect.n, wi);
-        Color R = SchlickConductor(isect.material.rho, cos_theta_i);
+///
+/// @brief Emitter material. Emitters are black bodies: they emit radiance and
+/// absorb all incident light, so no incident direction is scattered.
+///
+bool Isect::ScatterEmitter(
+    const Isect &isect,
+    const Material &material,
+    const Vec2 &u,
+    const Vec3 &wo,
+    Vec3 &wi,
+    Color &bsdf,
+    Real &pdf)
+{
+    return false;
+}
+
+///
+/// @brief Return the intersection indicident direction and scattering functions.
+///
+bool Isect::Scatter(
+    const Isect &isect,
+    const Material &material,
+    const Vec2 &u,
+    const Vec3 &wo,
+    Vec3 &wi,
+    Color &bsdf,
+    Real &pdf)
+{
+    if (material.type == Material::Diffuse) {
+        return ScatterDiffuse(isect, material, u, wo, wi, bsdf, pdf);
+    }
 
-        bsdf = R / cos_theta_i;
-        pdf = 1.0;
-        return true;
+    if (material.type == Material::Conductor) {
+        return ScatterConductor(isect, material, u, wo, wi, bsdf, pdf);
     }
 
-    // Dielectric material. Here eta is the ratio of indices of refraction of
-    // outgoing to incident directions, eta = n_o / n_i, where n_o is the ior
-    // of the outgoing medium and n_i is the ior of the incident medium
-    if (isect.material.type == Material::Dielectric) {
-        double cos_theta_o = math::dot(isect.n, wo);
-        bool entering = cos_theta_o < 0.0;
-
-        double eta_i = entering ? 1.0 : isect.material.ior;
-        double eta_o = entering ? isect.material.ior : 1.0;
-        double eta = eta_o / eta_i;
-
-        // Compute the Fresnel reflectance using Schlick approximation. Here, the
-        // incident direction is on the same hemisphere as the outgoing direction,
-        // with cos_theta_i = cos_theta_o, and with eta inverted because the ior
-        // of the incident medium is on the same side as the outgoing medium.
-        double F = SchlickDielectric(1.0 / eta, std::abs(cos_theta_o));
-
-        if (u.x < F) {
-            Reflect(isect.n, wo, wi);
-            double cos_theta_i = AbsDot(isect.n, wi);
-            double R = F / cos_theta_i;
-
-            bsdf = Color::White * R;
-            pdf = F;
-        } else {
-            if (!Refract(eta, isect.n, wo, wi)) {
-                return false;
-            }
-            double cos_theta_i = AbsDot(isect.n, wi);
-            double T = (1.0 - F) * eta * eta / cos_theta_i;
-
-            bsdf = Color::White * T;
-            pdf = 1.0 - F;
-        }
-        return true;
+    if (material.type == Material::Dielectric) {
+        return ScatterDielectric(isect, material, u, wo, wi, bsdf, pdf);
+    }
+
+    if (material.type == Material::Emitter) {
+        return ScatterEmitter(isect, material, u, wo, wi, bsdf, pdf);
     }
 
     return false;
@@ -236,16 +299,24 @@ bool Isect::Scatter(
 
 ///
 /// @brief Spawn a ray from the intersection point in the specified direction.
+/// The ray origin is offset along the normal, to the side of the surface the
+/// ray leaves from, by the error bound of the intersection point. The origin
+/// is then strictly on that side and the ray cannot hit the surface it was
+/// spawned from, without a minimum line parameter.
 ///
-Ray Isect::Spawn(const Isect &isect, const math::vec3d &dir)
+Ray Isect::Spawn(const Isect &isect, const Vec3 &dir)
 {
-    return {isect.p, math::normalize(dir)};
+    Vec3 offset = isect.n * isect.error;
+    if (math::dot(isect.n, dir) < 0) {
+        offset = -offset;
+    }
+    return {isect.p + offset, math::normalize(dir)};
 }
 
 ///
 /// @brief Spawn a ray from the intersection point towards the specified target.
 ///
-Ray Isect::SpawnTo(const Isect &isect, const math::vec3d &target)
+Ray Isect::SpawnTo(const Isect &isect, const Vec3 &target)
 {
-    return {isect.p, DirTo(isect.p, target)};
+    return Spawn(isect, target - isect.p);
 }
@@ -20,64 +20,103 @@
 /// parameter, position, normal, etc.
 ///
 struct Isect {
-    double t;
-    math::vec3d p;
-    math::vec3d n;
-    math::vec3d wo;
-    Material material;
+    Real t;
+    Vec3 p;
+    Vec3 n;
+    Vec3 wo;
+    Real error;             // bound on the position error along the normal
+    uint32_t material;      // material table index
 
     // Return the absolute dot product |w.v|.
-    static double AbsDot(const math::vec3d &v, const math::vec3d &w);
+    static Real AbsDot(const Vec3 &v, const Vec3 &w);
 
     // Are vectors wo and wi on the same hemisphere specified by normal n?
     static bool SameHemisphere(
-        const math::vec3d &n,
-        const math::vec3d &wo,
-        math::vec3d &wi);
+        const Vec3 &n,
+        const Vec3 &wo,
+        Vec3 &wi);
 
     // Orient w to lie on the same hemisphere specified by n.
-    static math::vec3d FaceForward(
-        const math::vec3d &n,
-        const math::vec3d &w);
+    static Vec3 FaceForward(
+        const Vec3 &n,
+        const Vec3 &w);
 
     // Return the direction vector from source towards the specified target.
-    static math::vec3d DirTo(
-        const math::vec3d &source,
-        const math::vec3d &target);
+    static Vec3 DirTo(
+        const Vec3 &source,
+        const Vec3 &target);
 
     // Compute the incident vector wi that is reflected to wo.
     static void Reflect(
-        const math::vec3d &n,
-        const math::vec3d &wo,
-        math::vec3d &wi);
+        const Vec3 &n,
+        const Vec3 &wo,
+        Vec3 &wi);
 
     // Compute the incident vector wi that is refracted to wo.
     static bool Refract(
-        const double eta,
-        const math::vec3d &n,
-        const math::vec3d &wo,
-        math::vec3d &wi);
+        const Real eta,
+        const Vec3 &n,
+        const Vec3 &wo,
+        Vec3 &wi);
 
     // Return the reflectance of a conductor using Schlick approximation.
-    static Color SchlickConductor(const Color &R0, const double cos_theta_i);
+    static Color SchlickConductor(const Color &R0, const Real cos_theta_i);
 
     // Return the reflectance of a dielectric using Schlick approximation.
-    static double SchlickDielectric(const double eta, const double cos_theta_i);
+    static Real SchlickDielectric(const Real eta, const Real cos_theta_i);
+
+    // Return the indicident direction and scattering functions of a material.
+    static bool ScatterDiffuse(
+        const Isect &isect,
+        const Material &material,
+        const Vec2 &u,
+        const Vec3 &wo,
+        Vec3 &wi,
+        Color &bsdf,
+        Real &pdf);
+
+    static bool ScatterConductor(
+        const Isect &isect,
+        const Material &material,
+        const Vec2 &u,
+        const Vec3 &wo,
+        Vec3 &wi,
+        Color &bsdf,
+        Real &pdf);
+
+    static bool ScatterDielectric(
+        const Isect &isect,
+        const Material &material,
+        const Vec2 &u,
+        const Vec3 &wo,
+        Vec3 &wi,
+        Color &bsdf,
+        Real &pdf);
+
+    static bool ScatterEmitter(
+        const Isect &isect,
+        const Material &material,
+        const Vec2 &u,
+        const Vec3 &wo,
+        Vec3 &wi,
+        Color &bsdf,
+        Real &pdf);
 
     // Return the intersection indicident direction and scattering functions.
     static bool Scatter(
         const Isect &isect,
-        const math::vec2d &u,
-        const math::vec3d &wo,
-        math::vec3d &wi,
+        const Material &material,
+        const Vec2 &u,
+        const Vec3 &wo,
+        Vec3 &wi,
         Color &bsdf,
-        double &pdf);
+        Real &pdf);
 
     // Spawn a ray from the intersection point in the specified direction.
-    static Ray Spawn(const Isect &isect, const math::vec3d &dir);
+    static Ray Spawn(const Isect &isect, const Vec3 &dir);
 
     // Spawn a ray from the intersection point towards the specified target.
-    static Ray SpawnTo(const Isect &isect, const math::vec3d &target);
+    static Ray SpawnTo(const Isect &isect, const Vec3 &target);
 };
 
 #endif // ISECT_H_
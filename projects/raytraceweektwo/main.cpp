@@ -9,10 +9,32 @@
 
 #include <iostream>
 #include <exception>
+#include <stdexcept>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <chrono>
+#include <algorithm>
 #include "common.h"
 #include "tracer.h"
+#include "checkpoint.h"
+#include "distributed.h"
 
 Tracer gTracer;
+TracerDesc gTracerDesc;
+std::ofstream gStatsFile;
+
+///
+/// @brief Append the render statistics of the frame to the statistics file,
+/// if any, and start the statistics of the next frame.
+///
+static void SaveStats(Stats &stats, size_t frame)
+{
+    if (gStatsFile.is_open()) {
+        stats.save(gStatsFile, frame);
+        stats.clear();
+    }
+}
 
 ///
 /// @brief Graphics callback functions.
@@ -27,6 +49,17 @@ void Graphics::OnKeyboard(int code, int scancode, int action, int mods)
     if (code == GLFW_KEY_ESCAPE && action == GLFW_RELEASE) {
         Graphics::Close();
     }
+
+    // Change the exposure of the radiance display by half a stop. The display
+    // resolves the film, so the change needs no work from the tracer.
+    if (gTracer.mDesc.Display == TracerDesc::DisplayRadiance &&
+        action != GLFW_RELEASE) {
+        if (code == GLFW_KEY_UP) {
+            gTracer.mGLExposure *= kExposureStep;
+        } else if (code == GLFW_KEY_DOWN) {
+            gTracer.mGLExposure /= kExposureStep;
+        }
+    }
 }
 
 void Graphics::OnMouseMove(double xpos, double ypos)
@@ -37,22 +70,33 @@ void Graphics::OnMouseButton(int button, int action, int mods)
 
 void Graphics::OnInitialize()
 {
-    gTracer.Initialize();
+    gTracer.Initialize(gTracerDesc);
 }
 
 void Graphics::OnTerminate()
 {
     gTracer.Cleanup();
+
+    // Report the display frame rate and the trace throughput, which are
+    // independent of each other.
+    std::cout << "display " << gTracer.mGLNumFrames << " frames, "
+              << gTracer.mGLNumFrames / std::max(gTracer.mGLTime, 1.0e-9)
+              << " fps, trace " << gTracer.mNumSamples << " passes, "
+              << gTracer.mNumSamples / std::max(gTracer.mTraceTime, 1.0e-9)
+              << " passes/s, "
+              << 1.0e-6 * gTracer.mNumRays /
+                 std::max(gTracer.mTraceTime, 1.0e-9)
+              << " Mrays/s\n";
 }
 
 void Graphics::OnUpdate()
 {
+    // Close the window once it has shown kMaxFrames sample passes.
     static const uint32_t kMaxFrames = 6;
-    static uint32_t FrameCount = 0;
-    if (++FrameCount >= kMaxFrames) {
+    gTracer.Update();
+    if (gTracer.mGLNumSamples >= kMaxFrames) {
         Graphics::Close();
     }
-    gTracer.Update();
 }
 
 void Graphics::OnRender()
@@ -61,6 +105,411 @@ void Graphics::OnRender()
     glClearDepth(1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     gTracer.Render();
+    SaveStats(gTracer.mGLStats, gTracer.mGLNumFrames - 1);
+}
+
+///
+/// @brief Parse the command line options into the tracer parameters.
+///
+static const char *kUsage =
+    "usage: raytraceweektwo [options]\n"
+    "  --headless           render offline without a window\n"
+    "  --width <n>          film width in pixels\n"
+    "  --height <n>         film height in pixels\n"
+    "  --spp <n>            number of samples per pixel\n"
+    "  --depth <n>          maximum path depth\n"
+    "  --rr-depth <n>       russian roulette start depth, 0 disables\n"
+    "  --split <n>          paths per primary hit (path integrator)\n"
+    "  --noise <e>          adaptive sampling pixel error threshold\n"
+    "  --target <e>         adaptive sampling film error target\n"
+    "  --min-spp <n>        samples per pixel before adaptive tests\n"
+    "  --threads <n>        number of worker threads\n"
+    "  --sampler <type>     random | sobol | halton\n"
+    "  --seed <n>           sampler random seed\n"
+    "  --scene-seed <n>     scene random seed\n"
+    "  --cells <n>          scene grid cells, (2n)^2 small spheres\n"
+    "  --lights <n>         number of small emitters in the scene\n"
+    "  --sky <s>            background radiance scale\n"
+    "  --nee <on|off>       sample emitters directly at diffuse hits\n"
+    "  --accel <type>       linear | bvh\n"
+    "  --packets            trace camera rays in packets\n"
+    "  --integrator <type>  path | wavefront\n"
+    "  --tone <curve>       tone curve, sqrt | srgb | aces\n"
+    "  --exposure <s>       radiance scale before the tone curve\n"
+    "  --dither <on|off>    blue noise dithering of the bitmap\n"
+    "  --display <mode>     window film display, radiance | bitmap\n"
+    "  --output <file>      headless output image, .ppm .png .pfm or .exr\n"
+    "  --compare <file>     report the headless image error against a PFM\n"
+    "  --stats <file>       write per frame render statistics as JSON lines\n"
+    "  --checkpoint <file>  headless checkpoint file, resumed if it exists\n"
+    "  --checkpoint-interval <s>  seconds between checkpoints\n"
+    "  --memory <MB>        film memory budget, larger films render by tiles\n"
+    "  --scene <file>       binary scene file, or text scene file with .txt\n"
+    "  --export <file>      save the scene as binary, or text with .txt\n";
+
+static void ParseArgs(
+    int argc,
+    char const *argv[],
+    TracerDesc &desc,
+    std::string &output,
+    std::string &reference,
+    std::string &stats,
+    std::string &checkpoint,
+    double &interval,
+    std::string &export_scene)
+{
+    auto value = [&] (int &i) -> std::string {
+        if (i + 1 >= argc) {
+            throw std::runtime_error(
+                std::string("missing value for ") + argv[i] + "\n" + kUsage);
+        }
+        return argv[++i];
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--headless") {
+            desc.Headless = true;
+        } else if (arg == "--width") {
+            desc.FilmWidth = std::stoul(value(i));
+        } else if (arg == "--height") {
+            desc.FilmHeight = std::stoul(value(i));
+        } else if (arg == "--spp") {
+            desc.NumSamples = std::stoul(value(i));
+        } else if (arg == "--depth") {
+            desc.MaxSampleDepth = std::stoul(value(i));
+        } else if (arg == "--rr-depth") {
+            desc.RouletteDepth = std::stoul(value(i));
+        } else if (arg == "--split") {
+            desc.SplitFactor = std::stoul(value(i));
+        } else if (arg == "--noise") {
+            desc.NoiseThreshold = std::stod(value(i));
+        } else if (arg == "--target") {
+            desc.NoiseTarget = std::stod(value(i));
+        } else if (arg == "--min-spp") {
+            desc.MinSamples = std::stoul(value(i));
+        } else if (arg == "--threads") {
+            desc.NumThreads = std::stoul(value(i));
+        } else if (arg == "--seed") {
+            desc.Seed = std::stoull(value(i));
+        } else if (arg == "--scene-seed") {
+            desc.SceneSeed = std::stoull(value(i));
+        } else if (arg == "--cells") {
+            desc.NumCells = std::stoi(value(i));
+        } else if (arg == "--lights") {
+            desc.NumLights = std::stoi(value(i));
+        } else if (arg == "--sky") {
+            desc.SkyScale = std::stod(value(i));
+        } else if (arg == "--nee") {
+            std::string nee = value(i);
+            if (nee == "on") {
+                desc.DirectLighting = true;
+            } else if (nee == "off") {
+                desc.DirectLighting = false;
+            } else {
+                throw std::runtime_error("unknown nee mode " + nee);
+            }
+        } else if (arg == "--accel") {
+            std::string accel = value(i);
+            if (accel == "linear") {
+                desc.Accel = TracerDesc::AccelLinear;
+            } else if (accel == "bvh") {
+                desc.Accel = TracerDesc::AccelBvh;
+            } else {
+                throw std::runtime_error("unknown accel " + accel);
+            }
+        } else if (arg == "--sampler") {
+            std::string sampler = value(i);
+            if (sampler == "random") {
+                desc.SamplerType = Sampler::Random;
+            } else if (sampler == "sobol") {
+                desc.SamplerType = Sampler::Sobol;
+            } else if (sampler == "halton") {
+                desc.SamplerType = Sampler::Halton;
+            } else {
+                throw std::runtime_error("unknown sampler " + sampler);
+            }
+        } else if (arg == "--integrator") {
+            std::string integrator = value(i);
+            if (integrator == "path") {
+                desc.Integrator = TracerDesc::IntegratorPath;
+            } else if (integrator == "wavefront") {
+                desc.Integrator = TracerDesc::IntegratorWavefront;
+            } else {
+                throw std::runtime_error("unknown integrator " + integrator);
+            }
+        } else if (arg == "--tone") {
+            std::string tone = value(i);
+            if (tone == "sqrt") {
+                desc.ToneCurve = ToneMap::Sqrt;
+            } else if (tone == "srgb") {
+                desc.ToneCurve = ToneMap::SRGB;
+            } else if (tone == "aces") {
+                desc.ToneCurve = ToneMap::ACES;
+            } else {
+                throw std::runtime_error("unknown tone curve " + tone);
+            }
+        } else if (arg == "--exposure") {
+            desc.Exposure = std::stod(value(i));
+        } else if (arg == "--display") {
+            std::string display = value(i);
+            if (display == "radiance") {
+                desc.Display = TracerDesc::DisplayRadiance;
+            } else if (display == "bitmap") {
+                desc.Display = TracerDesc::DisplayBitmap;
+            } else {
+                throw std::runtime_error("unknown display " + display);
+            }
+        } else if (arg == "--dither") {
+            std::string dither = value(i);
+            if (dither == "on") {
+                desc.Dither = true;
+            } else if (dither == "off") {
+                desc.Dither = false;
+            } else {
+                throw std::runtime_error("unknown dither mode " + dither);
+            }
+        } else if (arg == "--packets") {
+            desc.Packets = true;
+        } else if (arg == "--output") {
+            output = value(i);
+        } else if (arg == "--compare") {
+            reference = value(i);
+        } else if (arg == "--stats") {
+            stats = value(i);
+        } else if (arg == "--checkpoint") {
+            checkpoint = value(i);
+        } else if (arg == "--checkpoint-interval") {
+            interval = std::stod(value(i));
+        } else if (arg == "--scene") {
+            desc.SceneFile = value(i);
+        } else if (arg == "--export") {
+            export_scene = value(i);
+        } else if (arg == "--memory") {
+            desc.FilmMemory = (size_t) std::stoull(value(i)) << 20;
+        } else if (arg == "--help") {
+            std::cout << kUsage;
+            std::exit(EXIT_SUCCESS);
+        } else {
+            throw std::runtime_error("unknown option " + arg + "\n" + kUsage);
+        }
+    }
+
+    if (desc.FilmWidth == 0 || desc.FilmHeight == 0 || desc.NumSamples == 0 ||
+        desc.NumThreads == 0 || desc.MaxSampleDepth < 2) {
+        throw std::runtime_error("invalid film size, samples, depth or threads");
+    }
+    if (desc.SplitFactor == 0 || (desc.SplitFactor > 1 &&
+        desc.Integrator == TracerDesc::IntegratorWavefront)) {
+        throw std::runtime_error("invalid split factor for the integrator");
+    }
+    if (desc.NumLights < 0 || desc.SkyScale < 0) {
+        throw std::runtime_error("invalid number of lights or sky scale");
+    }
+    if (desc.Exposure <= 0) {
+        throw std::runtime_error("invalid exposure");
+    }
+    if (desc.NoiseThreshold < 0 || desc.NoiseTarget < 0 ||
+        desc.MinSamples < 2) {
+        throw std::runtime_error("invalid adaptive sampling parameters");
+    }
+    if (interval < 0) {
+        throw std::runtime_error("invalid checkpoint interval");
+    }
+    if (!stats.empty() && !Stats::Enabled()) {
+        throw std::runtime_error("render statistics require RAYTRACE_STATS");
+    }
+}
+
+///
+/// @brief Run all sample passes without an OpenGL context, as fast as possible,
+/// and save the resulting image. The completed tiles are written after each
+/// pass by the image writer thread, while the next pass is traced. Report the
+/// wall time and ray throughput and, given a reference image, the error of
+/// the film with respect to it.
+///
+/// Given a checkpoint file, the render resumes from its last checkpoint, if
+/// any, and checkpoints the film after each pass once the interval has
+/// elapsed. The file is removed once the image is saved.
+///
+/// A film over its memory budget is rendered out-of-core, one tile at a time,
+/// and written to the image as each tile completes. It is never held in full,
+/// so it can neither be checkpointed nor compared with a reference.
+///
+/// In an MPI job of several ranks, the tiles are rendered over the ranks and
+/// the master saves the reduced film and reports the render.
+///
+static void RunHeadless(
+    const TracerDesc &desc,
+    const std::string &output,
+    const std::string &reference,
+    const std::string &checkpoint_file,
+    const double interval,
+    Distributed &distributed)
+{
+    gTracer.Initialize(desc);
+    const bool out_of_core = gTracer.IsOutOfCore();
+    if (out_of_core && (!checkpoint_file.empty() || !reference.empty())) {
+        throw std::runtime_error(
+            "a film over its memory budget has no checkpoint or reference");
+    }
+    if (distributed.m_size > 1 && (out_of_core || !checkpoint_file.empty())) {
+        throw std::runtime_error(
+            "a distributed render has no checkpoint, and fits in memory");
+    }
+    std::unique_ptr<Checkpoint> checkpoint;
+    if (!checkpoint_file.empty()) {
+        checkpoint = std::make_unique<Checkpoint>(checkpoint_file, gTracer);
+        if (checkpoint->load(gTracer)) {
+            std::cout << "resumed " << checkpoint_file << " at pass "
+                      << gTracer.mNumSamples << "\n";
+        }
+    }
+    const size_t num_resumed_rays = gTracer.mNumRays;
+
+    auto start = std::chrono::steady_clock::now();
+    auto last_checkpoint = start;
+    size_t num_checkpoints = 0;
+    double checkpoint_time = 0.0;
+    if (distributed.m_size > 1) {
+        distributed.Render(gTracer);
+        if (distributed.m_rank == 0) {
+            gTracer.Save(output);
+        }
+    } else {
+        ImageWriter writer(
+            output, desc.FilmWidth, desc.FilmHeight, gTracer.mToneMap);
+        if (out_of_core) {
+            gTracer.RenderTiles(writer);
+            SaveStats(gTracer.mStats, 0);
+        }
+        while (!out_of_core && !gTracer.IsComplete()) {
+            gTracer.Sample();
+            gTracer.Stream(writer);
+            SaveStats(gTracer.mStats, gTracer.mNumSamples - 1);
+
+            auto now = std::chrono::steady_clock::now();
+            if (checkpoint && !gTracer.IsComplete() &&
+                std::chrono::duration<double>(now - last_checkpoint).count() >=
+                    interval) {
+                checkpoint->save(gTracer);
+                last_checkpoint = std::chrono::steady_clock::now();
+                checkpoint_time += std::chrono::duration<double>(
+                    last_checkpoint - now).count();
+                num_checkpoints++;
+            }
+        }
+        writer.finish();
+    }
+    auto end = std::chrono::steady_clock::now();
+    if (checkpoint) {
+        checkpoint->remove();
+    }
+    gTracer.Cleanup();
+    if (distributed.m_rank != 0) {
+        return;
+    }
+
+    static const char *kSamplerNames[Sampler::NumTypes] = {
+        "random", "sobol", "halton"};
+    double seconds = std::chrono::duration<double>(end - start).count();
+    std::cout << "film " << desc.FilmWidth << "x" << desc.FilmHeight
+              << ", spp " << desc.NumSamples
+              << ", depth " << desc.MaxSampleDepth
+              << ", rr-depth " << desc.RouletteDepth
+              << ", split " << desc.SplitFactor
+              << ", sampler " << kSamplerNames[desc.SamplerType]
+              << ", threads " << desc.NumThreads
+              << ", " << (sizeof(Real) == sizeof(float) ? "float" : "double")
+              << "\n"
+              << "world " << gTracer.mScene.m_primitives.size() << " primitives, "
+              << gTracer.mScene.m_materials.size() << " materials, "
+              << gTracer.mScene.m_lights.size() << " lights"
+              << (desc.DirectLighting ? " (nee)" : "");
+    if (!gTracer.mScene.m_meshes.empty()) {
+        std::cout << ", " << gTracer.mScene.m_meshes.size() << " meshes, "
+                  << gTracer.mScene.num_triangles() << " triangles";
+    }
+    if (!desc.SceneFile.empty()) {
+        std::cout << ", scene " << desc.SceneFile << " load "
+                  << 1.0e3 * gTracer.mScene.m_load_time << " ms";
+    }
+    if (desc.Accel == TracerDesc::AccelBvh) {
+        std::cout << ", bvh " << gTracer.mBvh.m_nodes.size() << " nodes, "
+                  << gTracer.mBvh.m_num_leaves << " leaves, "
+                  << "depth " << gTracer.mBvh.m_max_depth << ", "
+                  << "build " << 1.0e3 * gTracer.mBvh.m_build_time << " ms";
+    }
+    std::cout << "\n"
+              << "time " << seconds << " s, "
+              << "rays " << gTracer.mNumRays - num_resumed_rays << ", "
+              << 1.0e-6 * (gTracer.mNumRays - num_resumed_rays) / seconds
+              << " Mrays/s\n";
+    if (distributed.m_size > 1) {
+        // A single rank with as many threads would sample every tile in the
+        // sampling cpu time of all the ranks, shared by its threads.
+        double cpu_time = 0.0;
+        for (auto time : distributed.m_cpu_times) {
+            cpu_time += time;
+        }
+        const double speedup = cpu_time / desc.NumThreads / seconds;
+        std::cout << "ranks " << distributed.m_size << ", tiles";
+        for (auto tiles : distributed.m_tiles) {
+            std::cout << " " << tiles;
+        }
+        std::cout << ", speedup " << speedup << ", efficiency "
+                  << 100.0 * speedup / distributed.m_size
+                  << "% of one rank\n";
+    }
+    if (num_checkpoints > 0) {
+        std::cout << "checkpoints " << num_checkpoints << ", "
+                  << 1.0e3 * checkpoint_time / num_checkpoints
+                  << " ms each\n";
+    }
+    if (out_of_core) {
+        std::cout << "out-of-core " << gTracer.mTiles.size() << " tiles, "
+                  << gTracer.mNumSamples << " passes at most, "
+                  << (gTracer.mTileFilms.size() * Film::kPixelSize *
+                      gTracer.mTileFilms[0].m_pixels.size() >> 10)
+                  << " KB of tile films\n";
+    } else if (gTracer.IsAdaptive()) {
+        size_t num_samples = 0;
+        for (auto count : gTracer.mFilm.m_counts) {
+            num_samples += count;
+        }
+        const size_t num_pixels = gTracer.mFilm.m_pixels.size();
+        std::cout << "adaptive " << gTracer.mNumSamples << " passes, "
+                  << (double) num_samples / num_pixels << " mean spp, "
+                  << 100.0 * gTracer.mFilm.m_num_converged / num_pixels
+                  << "% converged, film error " << gTracer.mNoise << "\n";
+    }
+    std::cout << "saved " << output << "\n";
+
+    if (!reference.empty()) {
+        FilmError error = Film::Compare(gTracer.mFilm, Film::Load(reference));
+        std::cout << "error vs " << reference << ": "
+                  << "rmse " << error.rmse << ", "
+                  << "mean " << error.mean << ", "
+                  << "max " << error.max << ", "
+                  << "relative " << error.relative << "\n";
+    }
+}
+
+///
+/// @brief Save the scene of the tracer parameters, generated or loaded from
+/// its scene file, to a binary or text scene file. A text scene file is
+/// compiled to a binary one by loading and exporting it.
+///
+static void ExportScene(const TracerDesc &desc, const std::string &filename)
+{
+    Scene scene = desc.SceneFile.empty()
+        ? Scene::Generate(desc.NumCells, desc.NumLights, desc.SceneSeed)
+        : Scene::Load(desc.SceneFile);
+    scene.save(filename);
+    std::cout << "exported " << scene.m_primitives.size() << " primitives, "
+              << scene.m_materials.size() << " materials, "
+              << scene.m_lights.size() << " lights, "
+              << scene.m_meshes.size() << " meshes to " << filename << "\n";
 }
 
 ///
@@ -68,18 +517,47 @@ void Graphics::OnRender()
 ///
 int main(int argc, char const *argv[])
 {
-    Graphics::RenderDesc desc = {};
-    desc.WindowTitle = "raytraceweektwo";
-    desc.WindowWidth = 400;
-    desc.WindowHeight = 300;
-    desc.GLVersionMajor = 3;
-    desc.GLVersionMinor = 3;
-    desc.PollTimeout = 0.01;
-
+    Distributed distributed;
     try {
+        std::string output = "raytraceweektwo.ppm";
+        std::string reference;
+        std::string stats;
+        std::string checkpoint;
+        double interval = kCheckpointInterval;
+        std::string export_scene;
+        ParseArgs(argc, argv, gTracerDesc, output, reference, stats,
+            checkpoint, interval, export_scene);
+        if (!export_scene.empty()) {
+            ExportScene(gTracerDesc, export_scene);
+            return EXIT_SUCCESS;
+        }
+        if (!stats.empty()) {
+            gStatsFile.open(stats);
+            if (!gStatsFile) {
+                throw std::runtime_error("failed to open " + stats);
+            }
+        }
+
+        if (gTracerDesc.Headless) {
+            RunHeadless(gTracerDesc, output, reference, checkpoint, interval,
+                distributed);
+            return EXIT_SUCCESS;
+        }
+        if (distributed.m_size > 1) {
+            throw std::runtime_error("a distributed render runs headless");
+        }
+
+        Graphics::RenderDesc desc = {};
+        desc.WindowTitle = "raytraceweektwo";
+        desc.WindowWidth = gTracerDesc.FilmWidth;
+        desc.WindowHeight = gTracerDesc.FilmHeight;
+        desc.GLVersionMajor = 3;
+        desc.GLVersionMinor = 3;
+        desc.PollTimeout = 0.01;
         Graphics::RenderLoop(desc);
     } catch (std::exception& e) {
         std::cerr << e.what() << std::endl;
+        distributed.Abort();
         return EXIT_FAILURE;
     }
 
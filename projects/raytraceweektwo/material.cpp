@@ -39,7 +39,7 @@ Material Material::CreateConductor(const Color &rho)
 ///
 /// @brief Dielectric material factory function.
 ///
-Material Material::CreateDielectric(const double ior)
+Material Material::CreateDielectric(const Real ior)
 {
     return {
         Material::Dielectric,    // type
@@ -48,3 +48,16 @@ Material Material::CreateDielectric(const double ior)
         Color::Black,           // Le
     };
 }
+
+///
+/// @brief Emitter material factory function.
+///
+Material Material::CreateEmitter(const Color &Le)
+{
+    return {
+        Material::Emitter,      // type
+        Color::Black,           // rho
+        0.0,                    // ior
+        Le,                     // Le
+    };
+}
@@ -19,11 +19,13 @@ struct Material {
     enum : uint32_t {
         Diffuse = 0,
         Conductor,
-        Dielectric
+        Dielectric,
+        Emitter,
+        NumTypes
     };
     uint32_t type;          // material type
     Color rho;              // reflectance
-    double ior;             // index of refraction
+    Real ior;               // index of refraction
     Color Le;               // emitted radiance
 
     // Diffuse material.
@@ -33,7 +35,10 @@ struct Material {
     static Material CreateConductor(const Color &rho);
 
     // Dielectric material.
-    static Material CreateDielectric(const double ior);
+    static Material CreateDielectric(const Real ior);
+
+    // Emitter material.
+    static Material CreateEmitter(const Color &Le);
 };
 
 #endif // MATERIAL_H_
@@ -0,0 +1,696 @@
+//
+// mesh.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <initializer_list>
+#include <stdexcept>
+#include <limits>
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "ray.h"
+#include "isect.h"
+#include "bvh.h"
+#include "mesh.h"
+
+namespace {
+
+const char kMagic[8] = {'R', 'T', 'W', '2', 'M', 'E', 'S', 'H'};
+const uint32_t kVersion = 1;
+
+// Alignment of the arrays in the binary mesh cache.
+const size_t kArrayAlignment = 64;
+
+///
+/// @brief Binary mesh cache header. The counts and offsets have fixed sizes,
+/// independent of the size of Real. The source size and modification time
+/// identify the version of the OBJ file the cache was imported from.
+///
+struct Header {
+    char magic[8];                      // file identifier
+    uint32_t version;                   // file layout version
+    uint32_t real_size;                 // size of a vertex coordinate
+    uint64_t source_size;               // OBJ file size
+    int64_t source_time;                // OBJ modification time in ns
+    uint64_t num_vertices;              // array sizes
+    uint64_t num_triangles;
+    uint64_t num_nodes;
+    uint64_t vertices;                  // array offsets
+    uint64_t triangles;
+    uint64_t nodes;
+    uint64_t size;                      // file size
+};
+
+static_assert(sizeof(Vec3) == 3 * sizeof(Real), "vertex layout");
+
+///
+/// @brief Round a file offset up to the array alignment.
+///
+uint64_t Align(const uint64_t offset)
+{
+    return (offset + kArrayAlignment - 1) / kArrayAlignment * kArrayAlignment;
+}
+
+///
+/// @brief Return the size and the modification time of a file, or false if
+/// the file does not exist.
+///
+bool Stat(const std::string &filename, uint64_t &size, int64_t &time)
+{
+    struct stat st;
+    if (::stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+    size = st.st_size;
+    time = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+///
+/// @brief Load a binary mesh cache. The cache is mapped and its arrays are
+/// copied to the mesh, once the header, the array references and the
+/// hierarchy are found to be consistent with the file. Return false if the
+/// cache does not exist, is inconsistent, or was imported from another
+/// version of the OBJ file. Without the OBJ file, any consistent cache is
+/// used.
+///
+bool LoadCache(
+    const std::string &filename,
+    const bool has_source,
+    const uint64_t source_size,
+    const int64_t source_time,
+    Mesh &mesh)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Header)) {
+        ::close(fd);
+        return false;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    const size_t size = st.st_size;
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+    Header header;
+    std::memcpy(&header, bytes, sizeof(header));
+    auto fits = [&] (uint64_t offset, uint64_t count, size_t item) {
+        return offset % kArrayAlignment == 0 && offset <= size &&
+            count <= (size - offset) / item;
+    };
+    bool valid =
+        std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+        header.version == kVersion &&
+        header.real_size == sizeof(Real) &&
+        (!has_source || (header.source_size == source_size &&
+            header.source_time == source_time)) &&
+        header.size == size &&
+        header.num_vertices <= std::numeric_limits<uint32_t>::max() &&
+        header.num_triangles <= std::numeric_limits<uint32_t>::max() &&
+        header.num_nodes <= std::numeric_limits<uint32_t>::max() &&
+        fits(header.vertices, header.num_vertices, sizeof(Vec3)) &&
+        fits(header.triangles, header.num_triangles, 3 * sizeof(uint32_t)) &&
+        fits(header.nodes, header.num_nodes, sizeof(Bvh::Node));
+    if (valid) {
+        const Vec3 *vertices =
+            reinterpret_cast<const Vec3 *>(bytes + header.vertices);
+        const uint32_t *triangles =
+            reinterpret_cast<const uint32_t *>(bytes + header.triangles);
+        const Bvh::Node *nodes =
+            reinterpret_cast<const Bvh::Node *>(bytes + header.nodes);
+        mesh.m_vertices.assign(vertices, vertices + header.num_vertices);
+        mesh.m_triangles.assign(
+            triangles, triangles + 3 * header.num_triangles);
+        mesh.m_nodes.assign(nodes, nodes + header.num_nodes);
+    }
+    munmap(data, size);
+    if (!valid) {
+        return false;
+    }
+
+    // Check the vertex references and the node references. Interior nodes
+    // have a split axis and refer to a following node, so the traversal
+    // always ends, and their children are no deeper than the traversal stack.
+    // The depth of each node follows from its parents, which precede it.
+    for (const auto &index : mesh.m_triangles) {
+        if (index >= mesh.m_vertices.size()) {
+            return false;
+        }
+    }
+    std::vector<size_t> depth(mesh.m_nodes.size(), 0);
+    for (size_t i = 0; i < mesh.m_nodes.size(); ++i) {
+        const Bvh::Node &node = mesh.m_nodes[i];
+        if (node.count > 0) {
+            if ((size_t) node.offset + node.count > mesh.size()) {
+                return false;
+            }
+            continue;
+        }
+        if (node.axis >= 3 ||
+            node.offset <= i + 1 ||
+            node.offset >= mesh.m_nodes.size() ||
+            depth[i] + 1 > Bvh::kStackSize) {
+            return false;
+        }
+        depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+        depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+    }
+    return true;
+}
+
+} // namespace
+
+/// ---------------------------------------------------------------------------
+/// @brief Mesh factory function. Build the hierarchy over the triangle bounds,
+/// and store the triangles in the leaf order of the hierarchy.
+///
+Mesh Mesh::Create(
+    const std::vector<Vec3> &vertices,
+    const std::vector<uint32_t> &triangles,
+    const uint32_t material)
+{
+    Mesh mesh;
+    mesh.m_scale = 1;
+    mesh.m_at = Vec3{0, 0, 0};
+    mesh.m_material = material;
+    mesh.m_vertices = vertices;
+    mesh.m_cached = false;
+
+    const size_t num_triangles = triangles.size() / 3;
+    std::vector<Bounds> bounds(num_triangles, Bounds::Empty());
+    for (size_t i = 0; i < num_triangles; ++i) {
+        for (size_t j = 0; j < 3; ++j) {
+            const Vec3 &v = vertices[triangles[3 * i + j]];
+            const Real p[3] = {v.x, v.y, v.z};
+            bounds[i] = Bounds::Union(bounds[i], p);
+        }
+    }
+
+    Bvh bvh = Bvh::Create(bounds);
+    mesh.m_nodes = std::move(bvh.m_nodes);
+    mesh.m_triangles.resize(3 * num_triangles);
+    for (size_t i = 0; i < num_triangles; ++i) {
+        const uint32_t *triangle = &triangles[3 * bvh.m_indices[i]];
+        std::copy(triangle, triangle + 3, &mesh.m_triangles[3 * i]);
+    }
+    return mesh;
+}
+
+///
+/// @brief Load the mesh of an OBJ file from its binary cache. If the cache
+/// is missing or stale, import the OBJ file and write the cache. The cache
+/// is only an optimization, and a cache that cannot be written, e.g. in a
+/// read-only directory, only leaves the next load to import the file again.
+///
+/// Once loaded, the mesh is scaled and moved to its place in the scene.
+///
+Mesh Mesh::Load(
+    const std::string &filename,
+    const uint32_t material,
+    const Real scale,
+    const Vec3 &at)
+{
+    uint64_t source_size = 0;
+    int64_t source_time = 0;
+    const bool has_source = Stat(filename, source_size, source_time);
+    const std::string cache = CacheName(filename);
+
+    Mesh mesh;
+    if (LoadCache(cache, has_source, source_size, source_time, mesh)) {
+        mesh.m_scale = 1;
+        mesh.m_at = Vec3{0, 0, 0};
+        mesh.m_material = material;
+        mesh.m_cached = true;
+    } else {
+        if (!has_source) {
+            throw std::runtime_error("failed to open " + filename);
+        }
+        std::vector<Vec3> vertices;
+        std::vector<uint32_t> triangles;
+        ParseObj(filename, vertices, triangles);
+        mesh = Create(vertices, triangles, material);
+        try {
+            mesh.save(cache, source_size, source_time);
+        } catch (const std::runtime_error &) {
+        }
+    }
+    mesh.m_filename = filename;
+    mesh.transform(scale, at);
+    return mesh;
+}
+
+///
+/// @brief Scale and move the mesh vertices and its hierarchy bounds. Rounding
+/// preserves the order of the coordinates, so the transformed bounds still
+/// contain the transformed triangles.
+///
+void Mesh::transform(const Real scale, const Vec3 &at)
+{
+    if (!(scale > 0)) {
+        throw std::runtime_error("invalid mesh scale");
+    }
+    for (auto &v : m_vertices) {
+        v = v * scale + at;
+    }
+    const Real offset[3] = {at.x, at.y, at.z};
+    for (auto &node : m_nodes) {
+        for (int k = 0; k < 3; ++k) {
+            node.bounds.lo[k] = node.bounds.lo[k] * scale + offset[k];
+            node.bounds.hi[k] = node.bounds.hi[k] * scale + offset[k];
+        }
+    }
+    m_scale *= scale;
+    m_at = m_at * scale + at;
+}
+
+///
+/// @brief Write the mesh to a binary mesh cache, identified by the size and
+/// modification time of its OBJ file. The cache is written to a temporary
+/// file and renamed, so a concurrent load never maps a partial cache.
+///
+void Mesh::save(
+    const std::string &filename,
+    const uint64_t source_size,
+    const int64_t source_time) const
+{
+    Header header = {};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.real_size = sizeof(Real);
+    header.source_size = source_size;
+    header.source_time = source_time;
+    header.num_vertices = m_vertices.size();
+    header.num_triangles = size();
+    header.num_nodes = m_nodes.size();
+    header.vertices = Align(sizeof(Header));
+    header.triangles = Align(
+        header.vertices + m_vertices.size() * sizeof(Vec3));
+    header.nodes = Align(
+        header.triangles + m_triangles.size() * sizeof(uint32_t));
+    header.size = header.nodes + m_nodes.size() * sizeof(Bvh::Node);
+
+    const std::string temporary =
+        filename + ".tmp" + std::to_string(::getpid());
+    {
+        std::ofstream file(temporary, std::ios::out | std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("failed to open " + temporary);
+        }
+
+        // Write each array after the padding to its offset.
+        const char padding[kArrayAlignment] = {};
+        auto array = [&] (uint64_t offset, const void *data, size_t size) {
+            file.write(padding, offset - (uint64_t) file.tellp());
+            file.write(static_cast<const char *>(data), size);
+        };
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        array(header.vertices, m_vertices.data(),
+            m_vertices.size() * sizeof(Vec3));
+        array(header.triangles, m_triangles.data(),
+            m_triangles.size() * sizeof(uint32_t));
+        array(header.nodes, m_nodes.data(),
+            m_nodes.size() * sizeof(Bvh::Node));
+        file.close();
+        if (!file) {
+            ::unlink(temporary.c_str());
+            throw std::runtime_error("failed to write " + temporary);
+        }
+    }
+    if (::rename(temporary.c_str(), filename.c_str()) != 0) {
+        ::unlink(temporary.c_str());
+        throw std::runtime_error("failed to write " + filename);
+    }
+}
+
+/// ---------------------------------------------------------------------------
+/// @brief Compute the line parameter of a triangle-ray intersection, with the
+/// Moller-Trumbore test. The intersection point is o + t*d = v0 + u*e1 + v*e2
+/// for the triangle edges e1 = v1 - v0 and e2 = v2 - v0, and the barycentric
+/// coordinates u, v and the line parameter t are solved with Cramer's rule.
+/// Rays parallel to the triangle plane have a zero determinant and miss.
+///
+bool Mesh::Intersect(
+    const Vec3 &v0,
+    const Vec3 &v1,
+    const Vec3 &v2,
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Real &t)
+{
+    const Vec3 e1 = v1 - v0;
+    const Vec3 e2 = v2 - v0;
+    const Vec3 p = math::cross(ray.d, e2);
+    const Real det = math::dot(e1, p);
+    if (det == 0) {
+        return false;
+    }
+    const Real inv_det = (Real) 1 / det;
+
+    const Vec3 s = ray.o - v0;
+    const Real u = math::dot(s, p) * inv_det;
+    if (u < 0 || u > 1) {
+        return false;
+    }
+    const Vec3 q = math::cross(s, e1);
+    const Real v = math::dot(ray.d, q) * inv_det;
+    if (v < 0 || u + v > 1) {
+        return false;
+    }
+
+    t = math::dot(e2, q) * inv_det;
+    return t >= t_min && t <= t_max;
+}
+
+///
+/// @brief Compute the line parameter and triangle index of the closest hit.
+///
+/// The hierarchy is traversed as the bvh of the spheres, with each leaf
+/// testing its range of triangles one at a time. The traversal statistics
+/// only count the nodes and the triangles, since the ray is counted by the
+/// query of the spheres.
+///
+bool Mesh::Intersect(
+    const Mesh &mesh,
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Real &t,
+    uint32_t &id,
+    Bvh::Stats *stats)
+{
+    if (mesh.m_nodes.empty()) {
+        return false;
+    }
+
+    const Real o[3] = {ray.o.x, ray.o.y, ray.o.z};
+    const Real inv_d[3] = {
+        (Real) 1 / ray.d.x, (Real) 1 / ray.d.y, (Real) 1 / ray.d.z};
+    const bool dir_neg[3] = {inv_d[0] < 0.0, inv_d[1] < 0.0, inv_d[2] < 0.0};
+    const Vec3 *vertices = mesh.m_vertices.data();
+    const uint32_t *triangles = mesh.m_triangles.data();
+
+    size_t num_nodes = 0;
+    size_t num_leaf_tests = 0;
+
+    bool is_a_hit = false;
+    Real t_hit = t_max;
+    uint32_t id_hit = 0;
+    uint32_t stack[Bvh::kStackSize];
+    size_t top = 0;
+    uint32_t current = 0;
+    while (true) {
+        const Bvh::Node &node = mesh.m_nodes[current];
+        num_nodes++;
+        if (Bounds::Intersect(node.bounds, o, inv_d, t_min, t_hit)) {
+            if (node.count > 0) {
+                num_leaf_tests += node.count;
+                for (uint32_t i = node.offset; i < node.offset + node.count;
+                        ++i) {
+                    const uint32_t *triangle = triangles + 3 * i;
+                    Real t;
+                    if (Intersect(
+                            vertices[triangle[0]],
+                            vertices[triangle[1]],
+                            vertices[triangle[2]],
+                            ray,
+                            t_min,
+                            t_hit,
+                            t)) {
+                        is_a_hit = true;
+                        t_hit = t;
+                        id_hit = i;
+                    }
+                }
+            } else if (dir_neg[node.axis]) {
+                stack[top++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[top++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+
+        if (top == 0) {
+            break;
+        }
+        current = stack[--top];
+    }
+
+    if (stats != nullptr) {
+        stats->num_nodes += num_nodes;
+        stats->num_leaf_tests += num_leaf_tests;
+    }
+
+    t = t_hit;
+    id = id_hit;
+    return is_a_hit;
+}
+
+///
+/// @brief Any-hit query for shadow rays. Return as soon as a triangle is hit
+/// inside the interval.
+///
+bool Mesh::Occluded(
+    const Mesh &mesh,
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Bvh::Stats *stats)
+{
+    if (mesh.m_nodes.empty()) {
+        return false;
+    }
+
+    const Real o[3] = {ray.o.x, ray.o.y, ray.o.z};
+    const Real inv_d[3] = {
+        (Real) 1 / ray.d.x, (Real) 1 / ray.d.y, (Real) 1 / ray.d.z};
+    const bool dir_neg[3] = {inv_d[0] < 0.0, inv_d[1] < 0.0, inv_d[2] < 0.0};
+    const Vec3 *vertices = mesh.m_vertices.data();
+    const uint32_t *triangles = mesh.m_triangles.data();
+
+    size_t num_nodes = 0;
+    size_t num_leaf_tests = 0;
+
+    bool is_a_hit = false;
+    uint32_t stack[Bvh::kStackSize];
+    size_t top = 0;
+    uint32_t current = 0;
+    while (!is_a_hit) {
+        const Bvh::Node &node = mesh.m_nodes[current];
+        num_nodes++;
+        if (Bounds::Intersect(node.bounds, o, inv_d, t_min, t_max)) {
+            if (node.count > 0) {
+                num_leaf_tests += node.count;
+                for (uint32_t i = node.offset; i < node.offset + node.count;
+                        ++i) {
+                    const uint32_t *triangle = triangles + 3 * i;
+                    Real t;
+                    if (Intersect(
+                            vertices[triangle[0]],
+                            vertices[triangle[1]],
+                            vertices[triangle[2]],
+                            ray,
+                            t_min,
+                            t_max,
+                            t)) {
+                        is_a_hit = true;
+                        break;
+                    }
+                }
+                if (is_a_hit) {
+                    break;
+                }
+            } else if (dir_neg[node.axis]) {
+                stack[top++] = current + 1;
+                current = node.offset;
+                continue;
+            } else {
+                stack[top++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+
+        if (top == 0) {
+            break;
+        }
+        current = stack[--top];
+    }
+
+    if (stats != nullptr) {
+        stats->num_nodes += num_nodes;
+        stats->num_leaf_tests += num_leaf_tests;
+    }
+    return is_a_hit;
+}
+
+///
+/// @brief Store the geometric properties of the intersection with a triangle
+/// at parameter t.
+///
+/// The intersection point is interpolated from the triangle vertices with
+/// the barycentric coordinates of the hit, rather than computed from the ray.
+/// Its error is then bounded by a few roundings of the largest coordinate of
+/// the triangle, or of its edges which are at most twice as large,
+/// independent of the ray that found it. The normal is the geometric normal
+/// of the triangle, oriented by its winding.
+///
+void Mesh::GetIsect(
+    const Mesh &mesh,
+    const uint32_t id,
+    const Ray &ray,
+    const Real t,
+    Isect &isect)
+{
+    const uint32_t *triangle = &mesh.m_triangles[3 * id];
+    const Vec3 &v0 = mesh.m_vertices[triangle[0]];
+    const Vec3 &v1 = mesh.m_vertices[triangle[1]];
+    const Vec3 &v2 = mesh.m_vertices[triangle[2]];
+    const Vec3 e1 = v1 - v0;
+    const Vec3 e2 = v2 - v0;
+    const Vec3 p = math::cross(ray.d, e2);
+    const Real inv_det = (Real) 1 / math::dot(e1, p);
+    const Vec3 s = ray.o - v0;
+    const Vec3 q = math::cross(s, e1);
+    Real u = std::min(std::max(math::dot(s, p) * inv_det, (Real) 0), (Real) 1);
+    Real v = std::min(std::max(math::dot(ray.d, q) * inv_det, (Real) 0), 1 - u);
+
+    Real extent = 0;
+    for (const Vec3 *vertex : {&v0, &v1, &v2}) {
+        extent = std::max(extent, std::max(std::max(
+            std::abs(vertex->x), std::abs(vertex->y)), std::abs(vertex->z)));
+    }
+    isect.p = v0 + e1 * u + e2 * v;
+    isect.n = math::normalize(math::cross(e1, e2));
+    isect.wo = -ray.d;
+    isect.t = t;
+    isect.error = 2 * kRayOffset * extent;
+    isect.material = mesh.m_material;
+}
+
+/// ---------------------------------------------------------------------------
+/// @brief Parse a Wavefront OBJ file into vertices and triangles. Only the
+/// vertex positions and the faces are read, and the other statements, e.g.
+/// normals, texture coordinates, groups and materials, are ignored. Faces
+/// refer to their vertices by positive or negative (relative) indices, with
+/// any texture and normal indices, and polygons are split into triangle fans.
+/// Errors report the file and line of the statement.
+///
+void Mesh::ParseObj(
+    const std::string &filename,
+    std::vector<Vec3> &vertices,
+    std::vector<uint32_t> &triangles)
+{
+    std::ifstream file(filename);
+    if (!file) {
+        throw std::runtime_error("failed to open " + filename);
+    }
+
+    vertices.clear();
+    triangles.clear();
+    std::vector<uint32_t> face;
+    std::string line;
+    for (size_t number = 1; std::getline(file, line); ++number) {
+        auto fail = [&] (const std::string &what) {
+            throw std::runtime_error(
+                filename + ":" + std::to_string(number) + ": " + what);
+        };
+        const char *s = line.c_str();
+        while (std::isspace((unsigned char) *s)) {
+            ++s;
+        }
+        if (s[0] == 'v' && std::isspace((unsigned char) s[1])) {
+            Real xyz[3];
+            s += 1;
+            for (auto &x : xyz) {
+                char *end;
+                x = (Real) std::strtod(s, &end);
+                if (end == s) {
+                    fail("expected a number");
+                }
+                s = end;
+            }
+            if (vertices.size() == std::numeric_limits<uint32_t>::max()) {
+                fail("too many vertices");
+            }
+            vertices.push_back(Vec3{xyz[0], xyz[1], xyz[2]});
+
+        } else if (s[0] == 'f' && std::isspace((unsigned char) s[1])) {
+            face.clear();
+            s += 1;
+            while (true) {
+                while (std::isspace((unsigned char) *s)) {
+                    ++s;
+                }
+                if (*s == '\0' || *s == '#') {
+                    break;
+                }
+                char *end;
+                long index = std::strtol(s, &end, 10);
+                if (end == s) {
+                    fail("expected a vertex index");
+                }
+                if (index < 0) {
+                    index += (long) vertices.size();
+                } else {
+                    index -= 1;
+                }
+                if (index < 0 || index >= (long) vertices.size()) {
+                    fail("invalid vertex index");
+                }
+                face.push_back((uint32_t) index);
+
+                // Skip the texture and normal indices of the vertex.
+                s = end;
+                while (*s != '\0' && !std::isspace((unsigned char) *s)) {
+                    ++s;
+                }
+            }
+            if (face.size() < 3) {
+                fail("face with fewer than three vertices");
+            }
+            for (size_t k = 1; k + 1 < face.size(); ++k) {
+                triangles.push_back(face[0]);
+                triangles.push_back(face[k]);
+                triangles.push_back(face[k + 1]);
+            }
+        }
+    }
+    if (triangles.size() / 3 > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("too many triangles in " + filename);
+    }
+}
+
+///
+/// @brief Return the name of the binary cache of an OBJ file. The cache holds
+/// the values of the build size of Real, and each size has its own cache.
+///
+std::string Mesh::CacheName(const std::string &filename)
+{
+    return filename + (sizeof(Real) == sizeof(float) ? ".f32" : ".f64") +
+        ".mesh";
+}
@@ -0,0 +1,118 @@
+//
+// mesh.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef MESH_H_
+#define MESH_H_
+
+#include <vector>
+#include <string>
+#include "common.h"
+#include "ray.h"
+#include "isect.h"
+#include "bvh.h"
+
+///
+/// @brief Triangle mesh with a single material. The vertex positions are
+/// shared by the triangles, which refer to them by index. The triangles are
+/// stored in the leaf order of the mesh hierarchy, so each leaf tests a
+/// contiguous range of triangles.
+///
+/// A mesh is imported from a Wavefront OBJ file. The importer writes the
+/// vertices, the triangles and the hierarchy to a binary cache next to the
+/// OBJ file, and later loads map the cache and copy each array in a single
+/// block, with no parsing and no hierarchy build. A cache imported from
+/// another version of the OBJ file is rebuilt.
+///
+/// A mesh instance is scaled and moved to its place in the scene after it is
+/// loaded. The scale is uniform and positive, so the hierarchy bounds are
+/// transformed with the vertices and the hierarchy is not rebuilt.
+///
+struct Mesh {
+    std::string m_filename;                 // OBJ file
+    Real m_scale;                           // instance scale
+    Vec3 m_at;                              // instance translation
+    uint32_t m_material;                    // material table index
+    std::vector<Vec3> m_vertices;           // vertex positions
+    std::vector<uint32_t> m_triangles;      // vertex indices, 3 per triangle
+    std::vector<Bvh::Node> m_nodes;         // triangle hierarchy
+    bool m_cached;                          // loaded from the binary cache?
+
+    // Return the number of triangles.
+    size_t size() const { return m_triangles.size() / 3; }
+
+    // Scale and move the mesh vertices and its hierarchy.
+    void transform(const Real scale, const Vec3 &at);
+
+    // Write the mesh to a binary mesh cache of the specified OBJ file.
+    void save(
+        const std::string &filename,
+        const uint64_t source_size,
+        const int64_t source_time) const;
+
+    // Compute the line parameter of a triangle-ray intersection.
+    static bool Intersect(
+        const Vec3 &v0,
+        const Vec3 &v1,
+        const Vec3 &v2,
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Real &t);
+
+    // Compute the line parameter and triangle index of the closest hit.
+    static bool Intersect(
+        const Mesh &mesh,
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Real &t,
+        uint32_t &id,
+        Bvh::Stats *stats = nullptr);
+
+    // Return true if the ray hits any triangle in the interval (t_min, t_max).
+    static bool Occluded(
+        const Mesh &mesh,
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Bvh::Stats *stats = nullptr);
+
+    // Store the geometric properties of the intersection at parameter t.
+    static void GetIsect(
+        const Mesh &mesh,
+        const uint32_t id,
+        const Ray &ray,
+        const Real t,
+        Isect &isect);
+
+    // Mesh factory function, over indexed triangles in any order.
+    static Mesh Create(
+        const std::vector<Vec3> &vertices,
+        const std::vector<uint32_t> &triangles,
+        const uint32_t material);
+
+    // Load a mesh from its binary cache, or import its OBJ file and write
+    // the cache.
+    static Mesh Load(
+        const std::string &filename,
+        const uint32_t material,
+        const Real scale,
+        const Vec3 &at);
+
+    // Parse a Wavefront OBJ file into vertices and triangles.
+    static void ParseObj(
+        const std::string &filename,
+        std::vector<Vec3> &vertices,
+        std::vector<uint32_t> &triangles);
+
+    // Return the name of the binary cache of an OBJ file.
+    static std::string CacheName(const std::string &filename);
+};
+
+#endif // MESH_H_
@@ -0,0 +1,30 @@
+//
+// packet.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef PACKET_H_
+#define PACKET_H_
+
+#include "common.h"
+#include "ray.h"
+#include "isect.h"
+
+///
+/// @brief Bundle of coherent rays, e.g. camera rays through a square block of
+/// film pixels, that are traced through the world together.
+///
+struct Packet {
+    static const size_t kSize = kPacketSize * kPacketSize;
+
+    size_t count;                   // number of rays in the packet
+    Ray rays[kSize];                // packet rays
+    Isect isects[kSize];            // closest intersection of each ray
+    bool hits[kSize];               // does the ray intersect the world?
+};
+
+#endif // PACKET_H_
@@ -14,52 +14,56 @@
 #include "common.h"
 #include "ray.h"
 #include "isect.h"
-#include "material.h"
 
 ///
-/// @brief A primitive is a geometric shape with a specified material.
-/// @note Only spheres are considered.
-/// @todo Extend shapes to disks, planes, meshes, etc.
+/// @brief A primitive is a geometric shape with a specified material, given by
+/// its index in the scene material table.
+/// @note Only spheres are considered. Triangle meshes share their vertices
+/// and are stored apart from the primitives, see Mesh.
+/// @todo Extend shapes to disks, planes, etc.
 ///
 struct Primitive {
     // Primitive geometry and material.
-    math::vec3d centre;
-    double radius;
-    Material material;
+    Vec3 centre;
+    Real radius;
+    uint32_t material;
 
     // Compute primitive-ray intersection.
     static bool Intersect(
         const Primitive &primitive,
         const Ray &ray,
-        const double t_min,
-        const double t_max,
-        double &t,
-        math::vec3d &n);
+        const Real t_min,
+        const Real t_max,
+        Real &t);
+
+    // Store the geometric properties of the intersection at parameter t.
+    static void GetIsect(
+        const Primitive &primitive,
+        const Ray &ray,
+        const Real t,
+        Isect &isect);
 
     // Compute primitive-ray intersection and store geometric properties.
     static bool Intersect(
         const Primitive &primitive,
         const Ray &ray,
-        const double t_min,
-        const double t_max,
+        const Real t_min,
+        const Real t_max,
         Isect &isect);
 
     // Compute the closest primitive-ray intersection.
     static bool Intersect(
         const std::vector<Primitive> &primitives,
         const Ray &ray,
-        const double t_min,
-        const double t_max,
+        const Real t_min,
+        const Real t_max,
         Isect &isect);
 
     // Primitive factory function with sphere geometry.
     static Primitive Create(
-        const math::vec3d &centre,
-        const double radius,
-        const Material &material);
-
-    // Generate a random collection of primitives.
-    static std::vector<Primitive> Generate(int32_t n_cells);
+        const Vec3 &centre,
+        const Real radius,
+        const uint32_t material);
 };
 
 #endif // PRIMITIVE_H_
@@ -16,9 +16,9 @@
 /// @brief Ray with origin at o and direction d, p(t) = o + t*d.
 ///
 struct Ray {
-    math::vec3d o;
-    math::vec3d d;
-    math::vec3d at(const double t) const { return (o + d*t); }
+    Vec3 o;
+    Vec3 d;
+    Vec3 at(const Real t) const { return (o + d*t); }
 };
 
 #endif // RAY_H_
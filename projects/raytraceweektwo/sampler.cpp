@@ -7,93 +7,535 @@
 // https://opensource.org/licenses/MIT.
 //
 
+#include <cmath>
+#include <algorithm>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 #include "common.h"
 #include "sampler.h"
 
 ///
-/// @brief Create a sampler object with the specified random number generator.
+/// @brief Philox4x32-10 round constants.
 ///
-Sampler Sampler::Create(
-    const math::random_engine &engine,
-    const math::random_uniform<double> &urand)
+namespace {
+constexpr uint32_t kPhiloxM0 = 0xD2511F53;
+constexpr uint32_t kPhiloxM1 = 0xCD9E8D57;
+constexpr uint32_t kPhiloxW0 = 0x9E3779B9;
+constexpr uint32_t kPhiloxW1 = 0xBB67AE85;
+constexpr uint32_t kPhiloxRounds = 10;
+constexpr uint32_t kInvalidBlock = ~0u;
+
+///
+/// @brief Sobol generator matrices of the first 4 dimensions, built at compile
+/// time from the primitive polynomials and initial direction numbers of Joe and
+/// Kuo. Column k of each matrix holds the direction number of the index bit k.
+///
+struct SobolMatrices {
+    uint32_t m[4][32];
+
+    constexpr SobolMatrices() : m{} {
+        const uint32_t degree[4] = {0, 1, 2, 3};
+        const uint32_t coeffs[4] = {0, 0, 1, 1};
+        const uint32_t init[4][3] = {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}};
+        for (uint32_t k = 0; k < 32; ++k) {
+            m[0][k] = 1u << (31 - k);
+        }
+        for (uint32_t d = 1; d < 4; ++d) {
+            const uint32_t s = degree[d];
+            for (uint32_t k = 0; k < 32; ++k) {
+                if (k < s) {
+                    m[d][k] = init[d][k] << (31 - k);
+                    continue;
+                }
+                uint32_t v = m[d][k - s] ^ (m[d][k - s] >> s);
+                for (uint32_t j = 1; j < s; ++j) {
+                    if ((coeffs[d] >> (s - 1 - j)) & 1) {
+                        v ^= m[d][k - j];
+                    }
+                }
+                m[d][k] = v;
+            }
+        }
+    }
+};
+constexpr SobolMatrices kSobolMatrices;
+
+///
+/// @brief The first primes, built at compile time. They are the bases of the
+/// Halton sequence dimensions. Dimensions beyond the table are random.
+///
+constexpr uint32_t kNumPrimes = 256;
+
+struct Primes {
+    uint32_t p[kNumPrimes];
+
+    constexpr Primes() : p{} {
+        uint32_t n = 0;
+        for (uint32_t k = 2; n < kNumPrimes; ++k) {
+            bool is_prime = true;
+            for (uint32_t i = 0; i < n && p[i] * p[i] <= k; ++i) {
+                if (k % p[i] == 0) {
+                    is_prime = false;
+                    break;
+                }
+            }
+            if (is_prime) {
+                p[n++] = k;
+            }
+        }
+    }
+};
+constexpr Primes kPrimes;
+
+///
+/// @brief Reverse the order of the bits of a 32-bit word.
+///
+uint32_t ReverseBits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+///
+/// @brief Nested uniform (Owen) scrambling of a 32-bit fixed point value. Each
+/// bit is flipped by a hash of the seed and the bits above it, computed with a
+/// Laine-Karras style hash on the reversed bits. See Burley, "Practical
+/// hash-based Owen scrambling", JCGT 2020.
+///
+uint32_t OwenScramble(uint32_t x, const uint32_t seed)
+{
+    x = ReverseBits(x);
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return ReverseBits(x);
+}
+
+///
+/// @brief Compute the 32-bit fixed point values of the 4d Sobol point of the
+/// index. The scrambled indices have random high bits, so the columns are
+/// selected with masks rather than branches.
+///
+void SobolSample(const uint32_t index, uint32_t x[4])
+{
+    uint32_t x0 = 0, x1 = 0, x2 = 0, x3 = 0;
+    for (uint32_t k = 0; k < 32; ++k) {
+        const uint32_t mask = 0u - ((index >> k) & 1);
+        x0 ^= kSobolMatrices.m[0][k] & mask;
+        x1 ^= kSobolMatrices.m[1][k] & mask;
+        x2 ^= kSobolMatrices.m[2][k] & mask;
+        x3 ^= kSobolMatrices.m[3][k] & mask;
+    }
+    x[0] = x0;
+    x[1] = x1;
+    x[2] = x2;
+    x[3] = x3;
+}
+
+///
+/// @brief Return the 32-bit fixed point value of the scrambled radical inverse
+/// of the index in the specified base. Each digit d is permuted into a*d+b,
+/// modulo the base, with a and b hashed from the seed, the digit position and
+/// the digits before it. This nested scrambling spreads the first samples over
+/// the unit interval even in the dimensions of large bases, where the plain
+/// radical inverses of small indices are all close to zero.
+///
+/// The digits are scrambled one by one down to a resolution of 2^-16, which
+/// keeps up to 65536 samples per pixel stratified. Past that, and past the last
+/// digit of the index, every digit is zero and the scrambled tail is uniform
+/// within the interval of the digits before it. The tail is drawn from a
+/// single hash of that prefix, rather than digit by digit.
+///
+uint32_t RadicalInverse(
+    uint32_t index,
+    const uint32_t base,
+    const uint64_t seed)
+{
+    // Map 32 random bits into [0,n) with a multiply instead of a division.
+    auto range = [] (const uint64_t bits, const uint32_t n) {
+        return (uint32_t) (((bits & 0xffffffff) * n) >> 32);
+    };
+
+    // Divide by the base with a reciprocal multiply. The quotient is at most
+    // one below the exact one, and is corrected with the remainder.
+    const double inv_base = 1.0 / base;
+    auto divide = [base, inv_base] (const uint32_t v, uint32_t &r) {
+        uint32_t q = (uint32_t) (v * inv_base);
+        r = v - q * base;
+        if (r >= base) {
+            q++;
+            r -= base;
+        }
+        return q;
+    };
+
+    const double resolution = std::ldexp(1.0, -16);
+    uint64_t reversed = 0;
+    double inv_base_n = 1.0;
+    uint64_t n = 0;
+    for (; index != 0 || inv_base_n > resolution; ++n) {
+        uint32_t digit;
+        uint32_t next = divide(index, digit);
+        uint64_t hash = Sampler::Hash(seed, (reversed << 6) | n);
+        uint32_t a = 1 + range(hash >> 32, base - 1);
+        uint32_t b = range(hash, base);
+        divide(a * digit + b, digit);
+        reversed = reversed * base + digit;
+        inv_base_n *= inv_base;
+        index = next;
+    }
+
+    uint64_t hash = Sampler::Hash(seed, (reversed << 6) | n);
+    double tail = std::ldexp((double) hash, -64);
+    double value = std::ldexp((reversed + tail) * inv_base_n, 32);
+    return (uint32_t) std::min(value, 4294967295.0);
+}
+} // namespace
+
+///
+/// @brief Create a sampler object of the specified type, with a random stream
+/// keyed by the seed. Samplers with equal seeds generate equal streams.
+///
+Sampler Sampler::Create(const uint32_t type, const uint64_t seed)
+{
+    Sampler sampler = {};
+    sampler.m_type = type;
+    sampler.m_key = Hash(seed, 0);
+    sampler.m_block = kInvalidBlock;
+    return sampler;
+}
+
+///
+/// @brief Start a new sample of a pixel. The next variate is the first
+/// dimension of the sample.
+///
+void Sampler::start(const uint64_t pixel, const uint32_t index)
+{
+    m_pixel = pixel;
+    m_index = index;
+    m_dimension = 0;
+    m_block = kInvalidBlock;
+}
+
+///
+/// @brief Skip ahead to the specified dimension of the current sample. The cost
+/// is constant, since the variates of each dimension are computed on demand.
+///
+void Sampler::seek(const uint32_t dimension)
+{
+    m_dimension = dimension;
+}
+
+void Sampler::skip(const uint32_t count)
+{
+    m_dimension += count;
+}
+
+///
+/// @brief Hash a key into the specified seed using the splitmix64 finalizer.
+/// Chained calls map a tuple of keys, e.g. (seed, pass, tile), into a well
+/// mixed seed for an independent random stream.
+///
+uint64_t Sampler::Hash(const uint64_t seed, const uint64_t key)
+{
+    uint64_t z = seed + 0x9e3779b97f4a7c15ull * (key + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+///
+/// @brief Philox4x32-10 block function. Map a 128-bit counter and a 64-bit key
+/// into 128 random bits, using 10 rounds of multiply-xor mixing. See Salmon et
+/// al., "Parallel random numbers: as easy as 1, 2, 3", SC11.
+///
+void Sampler::Philox(
+    const uint32_t counter[4],
+    const uint64_t key,
+    uint32_t result[4])
+{
+    uint32_t c0 = counter[0];
+    uint32_t c1 = counter[1];
+    uint32_t c2 = counter[2];
+    uint32_t c3 = counter[3];
+    uint32_t k0 = (uint32_t) key;
+    uint32_t k1 = (uint32_t) (key >> 32);
+    for (uint32_t round = 0; round < kPhiloxRounds; ++round) {
+        uint64_t p0 = (uint64_t) kPhiloxM0 * c0;
+        uint64_t p1 = (uint64_t) kPhiloxM1 * c2;
+        c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t) p1;
+        c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t) p0;
+        k0 += kPhiloxW0;
+        k1 += kPhiloxW1;
+    }
+    result[0] = c0;
+    result[1] = c1;
+    result[2] = c2;
+    result[3] = c3;
+}
+
+///
+/// @brief Philox4x32-10 block function over kLanes independent counters, stored
+/// as structure of arrays. With AVX2, each round runs on 8 lanes at once. The
+/// 32x32->64 bit products of the even and odd lanes come from two unsigned
+/// multiplies, and are blended back into the high and low halves.
+///
+#if defined(__AVX2__)
+static_assert(Sampler::kLanes == 8, "Philox kernel expects 8 lanes");
+
+void Sampler::Philox(
+    const uint32_t counter[4][kLanes],
+    const uint64_t key,
+    uint32_t result[4][kLanes])
 {
-    return {engine, urand};
+    auto load = [] (const uint32_t *p) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    };
+    auto store = [] (uint32_t *p, const __m256i a) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), a);
+    };
+
+    // Return the high and low halves of the 32x32->64 bit products.
+    auto mulhilo = [] (const __m256i m, const __m256i a, __m256i &lo) {
+        __m256i even = _mm256_mul_epu32(m, a);
+        __m256i odd = _mm256_mul_epu32(m, _mm256_srli_epi64(a, 32));
+        lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+        return _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+    };
+
+    __m256i c0 = load(counter[0]);
+    __m256i c1 = load(counter[1]);
+    __m256i c2 = load(counter[2]);
+    __m256i c3 = load(counter[3]);
+    const __m256i m0 = _mm256_set1_epi32((int32_t) kPhiloxM0);
+    const __m256i m1 = _mm256_set1_epi32((int32_t) kPhiloxM1);
+    uint32_t k0 = (uint32_t) key;
+    uint32_t k1 = (uint32_t) (key >> 32);
+    for (uint32_t round = 0; round < kPhiloxRounds; ++round) {
+        __m256i lo0, lo1;
+        __m256i hi0 = mulhilo(m0, c0, lo0);
+        __m256i hi1 = mulhilo(m1, c2, lo1);
+        c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1),
+            _mm256_set1_epi32((int32_t) k0));
+        c1 = lo1;
+        c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3),
+            _mm256_set1_epi32((int32_t) k1));
+        c3 = lo0;
+        k0 += kPhiloxW0;
+        k1 += kPhiloxW1;
+    }
+
+    store(result[0], c0);
+    store(result[1], c1);
+    store(result[2], c2);
+    store(result[3], c3);
 }
+#else
+void Sampler::Philox(
+    const uint32_t counter[4][kLanes],
+    const uint64_t key,
+    uint32_t result[4][kLanes])
+{
+    for (size_t l = 0; l < kLanes; ++l) {
+        const uint32_t c[4] = {
+            counter[0][l], counter[1][l], counter[2][l], counter[3][l]};
+        uint32_t r[4];
+        Philox(c, key, r);
+        for (size_t k = 0; k < 4; ++k) {
+            result[k][l] = r[k];
+        }
+    }
+}
+#endif
 
 ///
-/// @brief Rand1d 1-dimensional uniform variate.
+/// @brief Compute the random bits of 4 consecutive dimensions, starting at the
+/// dimension 4*block, of a pixel sample.
+///
+/// The Sobol sampler pads the sample with 4d Sobol points. Each block shuffles
+/// the sample index and Owen scrambles the point with seeds hashed from the
+/// pixel and the block, so different blocks and pixels are uncorrelated. The
+/// Halton sampler scrambles the digits of each dimension with seeds hashed from
+/// the pixel and the dimension, and falls back to random bits past the last
+/// prime base.
 ///
-double Sampler::Rand1d()
+void Sampler::Block(
+    const uint32_t type,
+    const uint64_t key,
+    const uint64_t pixel,
+    const uint32_t index,
+    const uint32_t block,
+    uint32_t bits[4])
 {
-    return m_urand(m_engine, 0.0, 1.0);
+    if (type == Sobol) {
+        uint64_t seed = Hash(Hash(key, pixel), block);
+        SobolSample(OwenScramble(index, (uint32_t) seed), bits);
+        for (uint32_t k = 0; k < 4; ++k) {
+            bits[k] = OwenScramble(bits[k], (uint32_t) Hash(seed, k + 1));
+        }
+        return;
+    }
+
+    if (type == Halton && 4 * block + 3 < kNumPrimes) {
+        uint64_t seed = Hash(key, pixel);
+        for (uint32_t k = 0; k < 4; ++k) {
+            const uint32_t dimension = 4 * block + k;
+            bits[k] = RadicalInverse(
+                index, kPrimes.p[dimension], Hash(seed, dimension));
+        }
+        return;
+    }
+
+    const uint32_t counter[4] = {
+        (uint32_t) pixel, index, block, (uint32_t) (pixel >> 32)};
+    Philox(counter, key, bits);
+}
+
+///
+/// @brief Convert random bits into a uniform variate in [0,1). Keep only as
+/// many high bits as the mantissa holds, so the result never rounds up to one.
+///
+Real Sampler::Uniform(const uint32_t bits)
+{
+    constexpr int kDigits = std::numeric_limits<Real>::digits;
+    constexpr int kBits = kDigits < 32 ? kDigits : 32;
+    constexpr Real kScale = (Real) 1 / (Real) (1ull << kBits);
+    return (Real) (bits >> (32 - kBits)) * kScale;
+}
+
+///
+/// @brief Compute 4 consecutive variates of the same sample in kLanes pixels.
+/// The dimension must be a multiple of 4, and the variates are equal to those
+/// returned by a sampler started at each pixel and seeking to the dimension.
+/// Only the random sampler runs on the vectorized generator.
+///
+void Sampler::Rand4d(
+    const Sampler &sampler,
+    const uint64_t pixel[kLanes],
+    const uint32_t index,
+    const uint32_t dimension,
+    Real u[4][kLanes])
+{
+    uint32_t bits[4][kLanes];
+    if (sampler.m_type == Random) {
+        uint32_t counter[4][kLanes];
+        for (size_t l = 0; l < kLanes; ++l) {
+            counter[0][l] = (uint32_t) pixel[l];
+            counter[1][l] = index;
+            counter[2][l] = dimension / 4;
+            counter[3][l] = (uint32_t) (pixel[l] >> 32);
+        }
+        Philox(counter, sampler.m_key, bits);
+    } else {
+        for (size_t l = 0; l < kLanes; ++l) {
+            uint32_t block[4];
+            Block(sampler.m_type, sampler.m_key, pixel[l], index,
+                dimension / 4, block);
+            for (size_t k = 0; k < 4; ++k) {
+                bits[k][l] = block[k];
+            }
+        }
+    }
+
+    for (size_t k = 0; k < 4; ++k) {
+        for (size_t l = 0; l < kLanes; ++l) {
+            u[k][l] = Uniform(bits[k][l]);
+        }
+    }
+}
+
+///
+/// @brief Rand1d 1-dimensional uniform variate. Each block holds the random
+/// bits of 4 consecutive dimensions, and is cached until the sample moves past
+/// it.
+///
+Real Sampler::Rand1d()
+{
+    const uint32_t block = m_dimension / 4;
+    if (block != m_block) {
+        Block(m_type, m_key, m_pixel, m_index, block, m_cache);
+        m_block = block;
+    }
+    return Uniform(m_cache[m_dimension++ % 4]);
 }
 
 ///
 /// @brief Sample 2-dimensional uniform variate.
 ///
-math::vec2d Sampler::Rand2d()
+Vec2 Sampler::Rand2d()
 {
-    return {m_urand(m_engine, 0.0, 1.0), m_urand(m_engine, 0.0, 1.0)};
+    Real u = Rand1d();
+    Real v = Rand1d();
+    return {u, v};
 }
 
 ///
 /// @brief Sample a unit sphere using a uniform distribution.
 ///
-math::vec3d Sampler::UniformSphere(const math::vec2d &u)
+Vec3 Sampler::UniformSphere(const Vec2 &u)
 {
-    double cos_theta = 1.0 - 2.0 * u.x;
-    double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta*cos_theta));
+    Real cos_theta = 1.0 - 2.0 * u.x;
+    Real sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta*cos_theta));
 
-    double phi = 2.0 * M_PI * u.y;
-    double sin_phi = std::sin(phi);
-    double cos_phi = std::cos(phi);
+    Real phi = 2.0 * M_PI * u.y;
+    Real sin_phi = std::sin(phi);
+    Real cos_phi = std::cos(phi);
 
     return {sin_theta*cos_phi, sin_theta*sin_phi, cos_theta};
 }
 
-double Sampler::UniformSpherePdf()
+Real Sampler::UniformSpherePdf()
 {
-    constexpr double pdf = 1.0 / (4.0 * M_PI);
+    constexpr Real pdf = 1.0 / (4.0 * M_PI);
     return pdf;
 }
 
 ///
 /// @brief Sample a unit hemisphere using a uniform distribution.
 ///
-math::vec3d Sampler::UniformHemisphere(const math::vec2d &u)
+Vec3 Sampler::UniformHemisphere(const Vec2 &u)
 {
-    double cos_theta = u.x;
-    double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta*cos_theta));
+    Real cos_theta = u.x;
+    Real sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta*cos_theta));
 
-    double phi = 2.0 * M_PI * u.y;
-    double sin_phi = std::sin(phi);
-    double cos_phi = std::cos(phi);
+    Real phi = 2.0 * M_PI * u.y;
+    Real sin_phi = std::sin(phi);
+    Real cos_phi = std::cos(phi);
 
     return {sin_theta*cos_phi, sin_theta*sin_phi, cos_theta};
 }
 
-double Sampler::UniformHemispherePdf()
+Real Sampler::UniformHemispherePdf()
 {
-    constexpr double pdf = 0.5 * M_1_PI;    // 2.0/(4.0*M_PI)
+    constexpr Real pdf = 0.5 * M_1_PI;    // 2.0/(4.0*M_PI)
     return pdf;
 }
 
 ///
 /// @brief Sample a unit hemisphere using a cosine distribution.
 ///
-math::vec3d Sampler::CosineHemisphere(const math::vec2d &u)
+Vec3 Sampler::CosineHemisphere(const Vec2 &u)
 {
-    double cos_theta = std::sqrt(u.x);
-    double sin_theta = std::sqrt(1.0 - u.x);
+    Real cos_theta = std::sqrt(u.x);
+    Real sin_theta = std::sqrt(1.0 - u.x);
 
-    double phi = 2.0 * M_PI * u.y;
-    double sin_phi = std::sin(phi);
-    double cos_phi = std::cos(phi);
+    Real phi = 2.0 * M_PI * u.y;
+    Real sin_phi = std::sin(phi);
+    Real cos_phi = std::cos(phi);
 
     return {sin_theta*cos_phi, sin_theta*sin_phi, cos_theta};
 }
 
-double Sampler::CosineHemispherePdf(const double cos_theta)
+Real Sampler::CosineHemispherePdf(const Real cos_theta)
 {
     return cos_theta > 0.0 ? cos_theta * M_1_PI : 0.0;
 }
@@ -101,54 +543,92 @@ double Sampler::CosineHemispherePdf(const double cos_theta)
 ///
 /// @brief Sample a cone using a uniform distribution.
 ///
-math::vec3d Sampler::UniformCone(
-    const math::vec2d &u,
-    const double cos_theta_max)
+Vec3 Sampler::UniformCone(
+    const Vec2 &u,
+    const Real cos_theta_max)
 {
-    double cos_theta = 1.0 - u.x * (1.0 - cos_theta_max);
-    double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta*cos_theta));
+    Real cos_theta = 1.0 - u.x * (1.0 - cos_theta_max);
+    Real sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta*cos_theta));
 
-    double phi = 2.0 * M_PI * u.y;
-    double sin_phi = std::sin(phi);
-    double cos_phi = std::cos(phi);
+    Real phi = 2.0 * M_PI * u.y;
+    Real sin_phi = std::sin(phi);
+    Real cos_phi = std::cos(phi);
 
     return {sin_theta*cos_phi, sin_theta*sin_phi, cos_theta};
 }
 
-double Sampler::UniformConePdf(const double cos_theta_max)
+Real Sampler::UniformConePdf(const Real cos_theta_max)
 {
-    constexpr double pdf = 1.0 / (2.0 * M_PI);
+    constexpr Real pdf = 1.0 / (2.0 * M_PI);
     return pdf / (1.0 - cos_theta_max);
 }
 
+///
+/// @brief Sample a cone with the specified cos and squared sin of its half
+/// angle using a uniform distribution. 1 - cos_theta_max is computed as
+/// sin2/(1 + cos), and the sin of the sample from 1 - cos_theta, without the
+/// cancellation that collapses narrow cones in single precision.
+///
+Vec3 Sampler::UniformCone(
+    const Vec2 &u,
+    const Real cos_theta_max,
+    const Real sin2_theta_max)
+{
+    Real one_minus_cos = u.x * sin2_theta_max / (1.0 + cos_theta_max);
+    Real cos_theta = 1.0 - one_minus_cos;
+    Real sin_theta = std::sqrt(
+        std::max(0.0, one_minus_cos * (2.0 - one_minus_cos)));
+
+    Real phi = 2.0 * M_PI * u.y;
+    Real sin_phi = std::sin(phi);
+    Real cos_phi = std::cos(phi);
+
+    return {sin_theta*cos_phi, sin_theta*sin_phi, cos_theta};
+}
+
+///
+/// @brief Return the pdf of a cone with the specified cos and squared sin of
+/// its half angle. A cone too narrow for its pdf to be represented has a
+/// zero pdf.
+///
+Real Sampler::UniformConePdf(
+    const Real cos_theta_max,
+    const Real sin2_theta_max)
+{
+    constexpr Real pdf = 1.0 / (2.0 * M_PI);
+    Real one_minus_cos = sin2_theta_max / (1.0 + cos_theta_max);
+    Real pdf_cone = pdf / one_minus_cos;
+    return std::isfinite(pdf_cone) ? pdf_cone : 0.0;
+}
+
 ///
 /// @brief Sample unit disk using a uniform distribution:
 ///  r = sqrt(u),
 ///  theta = 2*pi*u
 ///  pdf = 1 / pi;
 ///
-math::vec2d Sampler::UniformDisk(const math::vec2d &u)
+Vec2 Sampler::UniformDisk(const Vec2 &u)
 {
-    return math::vec2d{std::sqrt(u.x), 2.0 * M_PI * u.y};
+    return Vec2{std::sqrt(u.x), (Real) (2.0 * M_PI) * u.y};
 }
 
-double Sampler::UniformDiskPdf()
+Real Sampler::UniformDiskPdf()
 {
-    constexpr double pdf = M_1_PI;
+    constexpr Real pdf = M_1_PI;
     return pdf;
 }
 
 ///
 /// @brief Sample unit triangle using a uniform distribution.
 ///
-math::vec2d Sampler::UniformTriangle(const math::vec2d &u)
+Vec2 Sampler::UniformTriangle(const Vec2 &u)
 {
-    double r = std::sqrt(u.x);
-    return math::vec2d{1.0 - r, r*u.y};
+    Real r = std::sqrt(u.x);
+    return Vec2{(Real) 1 - r, r*u.y};
 }
 
-double Sampler::UniformTrianglePdf()
+Real Sampler::UniformTrianglePdf()
 {
-    constexpr double pdf = 2.0;
+    constexpr Real pdf = 2.0;
     return pdf;
 }
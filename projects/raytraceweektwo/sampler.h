@@ -15,45 +15,120 @@
 ///
 /// @brief Sample a hemisphere, disk, cone, triangle, etc.
 ///
+/// Uniform variates come from a counter based generator, Philox4x32-10. Each
+/// variate is a pure function of the stream key and a counter made of the
+/// 64-bit pixel index, the sample index and the dimension within the sample,
+/// so each pixel of a film of any size has its own stream. Any thread or
+/// process can reproduce any sample on its own, without shared state, and the
+/// image does not depend on the order in which pixels are rendered.
+///
+/// The low discrepancy samplers replace the random variates with the points of
+/// a Sobol or Halton sequence, indexed by the sample index and randomized per
+/// pixel. Each dimension of the sample has a fixed meaning, the pixel and lens
+/// first, then a fixed set of dimensions per bounce, so consecutive samples of
+/// a pixel stratify every 2d warp.
+///
 struct Sampler {
-    // Sampler random number generator.
-    math::random_engine m_engine;
-    math::random_uniform<double> m_urand;
+    // Sampler type.
+    enum : uint32_t {
+        Random = 0,             // Philox pseudo-random variates
+        Sobol,                  // Owen scrambled Sobol sequence
+        Halton,                 // nested random linear digit permutations
+        NumTypes
+    };
+
+    // Number of lanes of the vectorized generator.
+    static constexpr size_t kLanes = 8;
+
+    // Sampler counter based random number generator.
+    uint32_t m_type;            // sampler type
+    uint64_t m_key;             // stream key
+    uint64_t m_pixel;           // pixel index
+    uint32_t m_index;           // sample index
+    uint32_t m_dimension;       // next dimension in the sample
+    uint32_t m_block;           // dimension block of the cached variates
+    uint32_t m_cache[4];        // cached random bits of the block
+
+    // Start a new sample of a pixel, and skip ahead in the sample.
+    void start(const uint64_t pixel, const uint32_t index);
+    void seek(const uint32_t dimension);
+    void skip(const uint32_t count);
 
     // Sampler 1d and 2d uniform variates.
-    double Rand1d();
-    math::vec2d Rand2d();
+    Real Rand1d();
+    Vec2 Rand2d();
 
     // Sampler a unit sphere using a uniform distribution.
-    static math::vec3d UniformSphere(const math::vec2d &u);
-    static double UniformSpherePdf();
+    static Vec3 UniformSphere(const Vec2 &u);
+    static Real UniformSpherePdf();
 
     // Sampler a unit hemisphere using a uniform distribution.
-    static math::vec3d UniformHemisphere(const math::vec2d &u);
-    static double UniformHemispherePdf();
+    static Vec3 UniformHemisphere(const Vec2 &u);
+    static Real UniformHemispherePdf();
 
     // Sampler a unit hemisphere using a cosine distribution.
-    static math::vec3d CosineHemisphere(const math::vec2d &u);
-    static double CosineHemispherePdf(const double cos_theta);
+    static Vec3 CosineHemisphere(const Vec2 &u);
+    static Real CosineHemispherePdf(const Real cos_theta);
 
     // Sampler a cone using a uniform distribution.
-    static math::vec3d UniformCone(
-        const math::vec2d &u,
-        const double cos_theta_max);
-    static double UniformConePdf(const double cos_theta_max);
+    static Vec3 UniformCone(
+        const Vec2 &u,
+        const Real cos_theta_max);
+    static Vec3 UniformCone(
+        const Vec2 &u,
+        const Real cos_theta_max,
+        const Real sin2_theta_max);
+    static Real UniformConePdf(const Real cos_theta_max);
+    static Real UniformConePdf(
+        const Real cos_theta_max,
+        const Real sin2_theta_max);
 
     // Sampler unit disk using a uniform distribution.
-    static math::vec2d UniformDisk(const math::vec2d &u);
-    static double UniformDiskPdf();
+    static Vec2 UniformDisk(const Vec2 &u);
+    static Real UniformDiskPdf();
 
     // Sampler unit triangle using a uniform distribution.
-    static math::vec2d UniformTriangle(const math::vec2d &u);
-    static double UniformTrianglePdf();
+    static Vec2 UniformTriangle(const Vec2 &u);
+    static Real UniformTrianglePdf();
+
+    // Sampler factory function with a deterministic random stream.
+    static Sampler Create(const uint32_t type, const uint64_t seed);
+
+    // Hash a sequence of keys into a seed value.
+    static uint64_t Hash(const uint64_t seed, const uint64_t key);
+
+    // Philox4x32-10 block function and its vectorized variant, over kLanes
+    // independent counters stored as structure of arrays.
+    static void Philox(
+        const uint32_t counter[4],
+        const uint64_t key,
+        uint32_t result[4]);
+    static void Philox(
+        const uint32_t counter[4][kLanes],
+        const uint64_t key,
+        uint32_t result[4][kLanes]);
+
+    // Compute the random bits of 4 consecutive dimensions, starting at the
+    // dimension 4*block, of a pixel sample.
+    static void Block(
+        const uint32_t type,
+        const uint64_t key,
+        const uint64_t pixel,
+        const uint32_t index,
+        const uint32_t block,
+        uint32_t bits[4]);
+
+    // Convert random bits into a uniform variate in [0,1).
+    static Real Uniform(const uint32_t bits);
 
-    // Sampler factory function.
-    static Sampler Create(
-        const math::random_engine &engine,
-        const math::random_uniform<double> &urand);
+    // Compute 4 consecutive variates, starting at an aligned dimension, of the
+    // same sample in kLanes pixels.
+    static void Rand4d(
+        const Sampler &sampler,
+        const uint64_t pixel[kLanes],
+        const uint32_t index,
+        const uint32_t dimension,
+        Real u[4][kLanes]);
 };
 
 #endif // SAMPLER_H_
@@ -0,0 +1,847 @@
+//
+// scene.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "color.h"
+#include "material.h"
+#include "primitive.h"
+#include "ray.h"
+#include "isect.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "scene.h"
+
+namespace {
+
+const char kMagic[8] = {'R', 'T', 'W', '2', 'S', 'C', 'N', 'E'};
+const uint32_t kVersion = 2;
+
+// Alignment of the tables in the binary scene file.
+const size_t kTableAlignment = 64;
+
+///
+/// @brief Binary scene file header. The view and the table offsets have
+/// fixed sizes, independent of the size of Real. Version 2 appends the mesh
+/// table and the string table of the mesh file names, and a version 1 header
+/// is read as a scene without meshes.
+///
+struct Header {
+    char magic[8];                      // file identifier
+    uint32_t version;                   // file layout version
+    uint32_t real_size;                 // size of a scene value
+    double view[12];                    // eye, ctr, up, fov, focus, aperture
+    uint64_t num_materials;             // table sizes
+    uint64_t num_primitives;
+    uint64_t num_lights;
+    uint64_t materials;                 // table offsets
+    uint64_t primitives;
+    uint64_t lights;
+    uint64_t size;                      // file size
+    uint64_t num_meshes;                // version 2 tables
+    uint64_t num_chars;
+    uint64_t meshes;
+    uint64_t chars;
+};
+
+// Size of a version 1 header.
+const size_t kHeaderSizeV1 = offsetof(Header, num_meshes);
+
+///
+/// @brief Records of the material and primitive tables, for a size of Real.
+/// The records of the build size of Real have the layout of the scene types.
+///
+template<typename T>
+struct MaterialRecord {
+    uint32_t type;
+    T rho[3];
+    T ior;
+    T Le[3];
+};
+
+template<typename T>
+struct PrimitiveRecord {
+    T centre[3];
+    T radius;
+    uint32_t material;
+};
+
+///
+/// @brief Record of the mesh table, a mesh file name in the string table with
+/// the material and the placement of the mesh.
+///
+struct MeshRecord {
+    uint64_t filename;                  // file name offset in the strings
+    uint64_t filename_size;             // file name length
+    uint32_t material;
+    uint32_t reserved;
+    double scale;
+    double at[3];
+};
+
+static_assert(sizeof(MaterialRecord<Real>) == sizeof(Material) &&
+    offsetof(MaterialRecord<Real>, ior) == offsetof(Material, ior),
+    "material record layout");
+static_assert(sizeof(PrimitiveRecord<Real>) == sizeof(Primitive) &&
+    offsetof(PrimitiveRecord<Real>, material) == offsetof(Primitive, material),
+    "primitive record layout");
+
+///
+/// @brief Camera view of the generated scene, and default view of a text
+/// scene file.
+///
+Scene::View DefaultView()
+{
+    return {
+        kCameraEye,
+        kCameraCtr,
+        kCameraUp,
+        kCameraFov,
+        kCameraFocus,
+        kCameraAperture};
+}
+
+///
+/// @brief Return true if the filename has a .txt extension.
+///
+bool IsText(const std::string &filename)
+{
+    const std::string ext(".txt");
+    return filename.size() >= ext.size() &&
+        filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+///
+/// @brief Return the path of a file named in a scene file. A relative name is
+/// relative to the directory of the scene file, and the path is absolute, so
+/// a scene saved in another directory refers to the same file.
+///
+std::string Resolve(const std::string &name, const std::string &scene)
+{
+    if (!name.empty() && name[0] == '/') {
+        return name;
+    }
+    std::string path = name;
+    const size_t slash = scene.rfind('/');
+    if (slash != std::string::npos) {
+        path = scene.substr(0, slash + 1) + path;
+    }
+    if (path[0] != '/') {
+        char cwd[4096];
+        if (::getcwd(cwd, sizeof(cwd)) == nullptr) {
+            throw std::runtime_error("failed to resolve " + name);
+        }
+        path = std::string(cwd) + "/" + path;
+    }
+    return path;
+}
+
+///
+/// @brief Round a file offset up to the table alignment.
+///
+uint64_t Align(const uint64_t offset)
+{
+    return (offset + kTableAlignment - 1) / kTableAlignment * kTableAlignment;
+}
+
+///
+/// @brief Copy the material and primitive tables of a binary scene file. The
+/// records of the build size of Real are copied in a single block, and the
+/// records of the other size are converted one at a time.
+///
+template<typename T>
+void ReadTables(const uint8_t *data, const Header &header, Scene &scene)
+{
+    const auto *materials = reinterpret_cast<const MaterialRecord<T> *>(
+        data + header.materials);
+    const auto *primitives = reinterpret_cast<const PrimitiveRecord<T> *>(
+        data + header.primitives);
+    if (sizeof(T) == sizeof(Real)) {
+        scene.m_materials.assign(
+            reinterpret_cast<const Material *>(materials),
+            reinterpret_cast<const Material *>(materials) +
+                header.num_materials);
+        scene.m_primitives.assign(
+            reinterpret_cast<const Primitive *>(primitives),
+            reinterpret_cast<const Primitive *>(primitives) +
+                header.num_primitives);
+        return;
+    }
+
+    auto color = [] (const T *c) {
+        return Color{(Real) c[0], (Real) c[1], (Real) c[2]};
+    };
+    scene.m_materials.resize(header.num_materials);
+    for (size_t i = 0; i < header.num_materials; ++i) {
+        const MaterialRecord<T> &record = materials[i];
+        scene.m_materials[i] = {
+            record.type,
+            color(record.rho),
+            (Real) record.ior,
+            color(record.Le)};
+    }
+    scene.m_primitives.resize(header.num_primitives);
+    for (size_t i = 0; i < header.num_primitives; ++i) {
+        const PrimitiveRecord<T> &record = primitives[i];
+        scene.m_primitives[i] = Primitive::Create(
+            Vec3{
+                (Real) record.centre[0],
+                (Real) record.centre[1],
+                (Real) record.centre[2]},
+            (Real) record.radius,
+            record.material);
+    }
+}
+
+///
+/// @brief Load a binary scene file. The file is mapped and its tables are
+/// copied to the scene, once the header and the table references are found
+/// to be consistent with the file.
+///
+Scene LoadBinary(const std::string &filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("failed to open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < kHeaderSizeV1) {
+        ::close(fd);
+        throw std::runtime_error("truncated scene file " + filename);
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("failed to map " + filename);
+    }
+    const size_t size = st.st_size;
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+    Scene scene;
+    std::string error;
+    std::vector<MeshRecord> meshes;
+    std::vector<std::string> mesh_names;
+    Header header = {};
+    std::memcpy(&header, bytes, std::min(size, sizeof(header)));
+    if (header.version == 1) {
+        std::memset(reinterpret_cast<uint8_t *>(&header) + kHeaderSizeV1, 0,
+            sizeof(header) - kHeaderSizeV1);
+    }
+    const size_t material_size = header.real_size == sizeof(float)
+        ? sizeof(MaterialRecord<float>)
+        : sizeof(MaterialRecord<double>);
+    const size_t primitive_size = header.real_size == sizeof(float)
+        ? sizeof(PrimitiveRecord<float>)
+        : sizeof(PrimitiveRecord<double>);
+    auto fits = [&] (uint64_t offset, uint64_t count, size_t item) {
+        return offset % kTableAlignment == 0 && offset <= size &&
+            count <= (size - offset) / item;
+    };
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        (header.version != 1 && header.version != kVersion) ||
+        (header.real_size != sizeof(float) &&
+            header.real_size != sizeof(double))) {
+        error = "invalid scene file ";
+    } else if (header.size != size ||
+        (header.version == kVersion && size < sizeof(Header)) ||
+        !fits(header.materials, header.num_materials, material_size) ||
+        !fits(header.primitives, header.num_primitives, primitive_size) ||
+        !fits(header.lights, header.num_lights, sizeof(uint32_t)) ||
+        (header.num_meshes > 0 &&
+            (!fits(header.meshes, header.num_meshes, sizeof(MeshRecord)) ||
+            !fits(header.chars, header.num_chars, sizeof(char))))) {
+        error = "truncated scene file ";
+    } else {
+        const double *v = header.view;
+        scene.m_view = {
+            Vec3{(Real) v[0], (Real) v[1], (Real) v[2]},
+            Vec3{(Real) v[3], (Real) v[4], (Real) v[5]},
+            Vec3{(Real) v[6], (Real) v[7], (Real) v[8]},
+            (Real) v[9],
+            (Real) v[10],
+            (Real) v[11]};
+        if (header.real_size == sizeof(float)) {
+            ReadTables<float>(bytes, header, scene);
+        } else {
+            ReadTables<double>(bytes, header, scene);
+        }
+        // Copy the mesh records and their file names, to load the meshes
+        // once the file is unmapped.
+        const MeshRecord *records =
+            reinterpret_cast<const MeshRecord *>(bytes + header.meshes);
+        const char *chars =
+            reinterpret_cast<const char *>(bytes + header.chars);
+        for (size_t i = 0; i < header.num_meshes; ++i) {
+            const MeshRecord &record = records[i];
+            if (record.filename > header.num_chars ||
+                record.filename_size > header.num_chars - record.filename) {
+                error = "invalid mesh in ";
+                break;
+            }
+            meshes.push_back(record);
+            mesh_names.emplace_back(
+                chars + record.filename, record.filename_size);
+        }
+    }
+    munmap(data, size);
+    if (!error.empty()) {
+        throw std::runtime_error(error + filename);
+    }
+
+    // Check the material and primitive references.
+    for (const auto &primitive : scene.m_primitives) {
+        if (primitive.material >= scene.m_materials.size()) {
+            throw std::runtime_error("invalid material in " + filename);
+        }
+    }
+    for (const auto &material : scene.m_materials) {
+        if (material.type >= Material::NumTypes) {
+            throw std::runtime_error("invalid material type in " + filename);
+        }
+    }
+
+    // Rebuild the emitter table from the materials, as the scene does when a
+    // primitive is added, rather than trust the light table of the file.
+    for (size_t i = 0; i < scene.m_primitives.size(); ++i) {
+        const uint32_t material = scene.m_primitives[i].material;
+        if (scene.m_materials[material].type == Material::Emitter) {
+            scene.m_lights.push_back(static_cast<uint32_t>(i));
+        }
+    }
+
+    // Load the meshes from their binary caches.
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        const MeshRecord &record = meshes[i];
+        if (record.material >= scene.m_materials.size()) {
+            throw std::runtime_error("invalid material in " + filename);
+        }
+        scene.add(Mesh::Load(
+            Resolve(mesh_names[i], filename),
+            record.material,
+            (Real) record.scale,
+            Vec3{
+                (Real) record.at[0],
+                (Real) record.at[1],
+                (Real) record.at[2]}));
+    }
+    return scene;
+}
+
+///
+/// @brief Compile a text scene file. Errors report the file and line of the
+/// statement.
+///
+Scene LoadText(const std::string &filename)
+{
+    std::ifstream file(filename);
+    if (!file) {
+        throw std::runtime_error("failed to open " + filename);
+    }
+
+    static const char *kTypeNames[Material::NumTypes] = {
+        "diffuse", "conductor", "dielectric", "emitter"};
+    Scene scene;
+    scene.m_view = DefaultView();
+    std::map<std::string, uint32_t> materials;
+    std::string line;
+    for (size_t number = 1; std::getline(file, line); ++number) {
+        auto fail = [&] (const std::string &what) {
+            throw std::runtime_error(
+                filename + ":" + std::to_string(number) + ": " + what);
+        };
+        std::istringstream in(line.substr(0, line.find('#')));
+        auto real = [&] () {
+            double value;
+            if (!(in >> value)) {
+                fail("expected a number");
+            }
+            return (Real) value;
+        };
+        auto vec3 = [&] () {
+            Real x = real();
+            Real y = real();
+            Real z = real();
+            return Vec3{x, y, z};
+        };
+        auto color = [&] () {
+            Real r = real();
+            Real g = real();
+            Real b = real();
+            return Color{r, g, b};
+        };
+
+        std::string keyword;
+        if (!(in >> keyword)) {
+            continue;
+        }
+        if (keyword == "camera") {
+            std::string key;
+            while (in >> key) {
+                if (key == "eye") {
+                    scene.m_view.eye = vec3();
+                } else if (key == "ctr") {
+                    scene.m_view.ctr = vec3();
+                } else if (key == "up") {
+                    scene.m_view.up = vec3();
+                } else if (key == "fov") {
+                    scene.m_view.fov = real();
+                } else if (key == "focus") {
+                    scene.m_view.focus = real();
+                } else if (key == "aperture") {
+                    scene.m_view.aperture = real();
+                } else {
+                    fail("unknown camera key " + key);
+                }
+            }
+        } else if (keyword == "material") {
+            std::string name;
+            std::string type;
+            in >> name >> type;
+            if (name.empty() || materials.count(name) > 0) {
+                fail("missing or repeated material name " + name);
+            }
+            if (type == kTypeNames[Material::Diffuse]) {
+                materials[name] = scene.add(Material::CreateDiffuse(color()));
+            } else if (type == kTypeNames[Material::Conductor]) {
+                materials[name] = scene.add(Material::CreateConductor(color()));
+            } else if (type == kTypeNames[Material::Dielectric]) {
+                materials[name] = scene.add(Material::CreateDielectric(real()));
+            } else if (type == kTypeNames[Material::Emitter]) {
+                materials[name] = scene.add(Material::CreateEmitter(color()));
+            } else {
+                fail("unknown material type " + type);
+            }
+        } else if (keyword == "sphere") {
+            Vec3 centre = vec3();
+            Real radius = real();
+            std::string name;
+            in >> name;
+            auto it = materials.find(name);
+            if (it == materials.end()) {
+                fail("unknown material " + name);
+            }
+            scene.add(centre, radius, it->second);
+        } else if (keyword == "mesh") {
+            std::string name;
+            std::string material;
+            in >> name >> material;
+            auto it = materials.find(material);
+            if (name.empty() || it == materials.end()) {
+                fail("unknown material " + material);
+            }
+            Real scale = 1;
+            Vec3 at{0, 0, 0};
+            std::string key;
+            while (in >> key) {
+                if (key == "scale") {
+                    scale = real();
+                } else if (key == "at") {
+                    at = vec3();
+                } else {
+                    fail("unknown mesh key " + key);
+                }
+            }
+            if (!(scale > 0)) {
+                fail("mesh scale must be positive");
+            }
+            scene.add(Mesh::Load(
+                Resolve(name, filename), it->second, scale, at));
+        } else {
+            fail("unknown statement " + keyword);
+        }
+
+        std::string extra;
+        if (in >> extra) {
+            fail("unexpected " + extra);
+        }
+    }
+    return scene;
+}
+
+} // namespace
+
+///
+/// @brief Add a material to the table and return its index.
+///
+uint32_t Scene::add(const Material &material)
+{
+    m_materials.push_back(material);
+    return static_cast<uint32_t>(m_materials.size() - 1);
+}
+
+///
+/// @brief Add a sphere primitive with the specified material index. Spheres
+/// with an emitter material are added to the light list.
+///
+void Scene::add(const Vec3 &centre, const Real radius, const uint32_t material)
+{
+    if (m_materials[material].type == Material::Emitter) {
+        m_lights.push_back(static_cast<uint32_t>(m_primitives.size()));
+    }
+    m_primitives.push_back(Primitive::Create(centre, radius, material));
+}
+
+///
+/// @brief Add a triangle mesh. Its triangles follow the triangles of the
+/// meshes already in the scene.
+///
+void Scene::add(Mesh &&mesh)
+{
+    const size_t offset = num_triangles();
+    if (m_primitives.size() + offset + mesh.size() >
+            std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("too many triangles in " + mesh.m_filename);
+    }
+    m_mesh_offsets.push_back(static_cast<uint32_t>(offset));
+    m_meshes.push_back(std::move(mesh));
+}
+
+///
+/// @brief Return the number of triangles in the meshes.
+///
+size_t Scene::num_triangles() const
+{
+    if (m_meshes.empty()) {
+        return 0;
+    }
+    return m_mesh_offsets.back() + m_meshes.back().size();
+}
+
+///
+/// @brief Compute the line parameter and id of the closest triangle hit. Each
+/// mesh is tested with its own hierarchy, in the interval shortened by the
+/// hits of the previous meshes.
+///
+bool Scene::intersect_meshes(
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Real &t,
+    uint32_t &id,
+    Bvh::Stats *stats) const
+{
+    bool is_a_hit = false;
+    Real t_hit = t_max;
+    for (size_t k = 0; k < m_meshes.size(); ++k) {
+        uint32_t triangle;
+        if (Mesh::Intersect(
+                m_meshes[k], ray, t_min, t_hit, t, triangle, stats)) {
+            is_a_hit = true;
+            t_hit = t;
+            id = (uint32_t) (m_primitives.size() + m_mesh_offsets[k]) +
+                triangle;
+        }
+    }
+    t = t_hit;
+    return is_a_hit;
+}
+
+///
+/// @brief Return true if the ray hits any triangle in the interval.
+///
+bool Scene::occluded_meshes(
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Bvh::Stats *stats) const
+{
+    for (const auto &mesh : m_meshes) {
+        if (Mesh::Occluded(mesh, ray, t_min, t_max, stats)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+///
+/// @brief Store the geometric properties of the intersection with a primitive
+/// or a triangle at parameter t.
+///
+void Scene::get_isect(
+    const uint32_t id,
+    const Ray &ray,
+    const Real t,
+    Isect &isect) const
+{
+    if (id < m_primitives.size()) {
+        Primitive::GetIsect(m_primitives[id], ray, t, isect);
+        return;
+    }
+    const uint32_t triangle = id - m_primitives.size();
+    const size_t k = std::upper_bound(
+        m_mesh_offsets.begin(), m_mesh_offsets.end(), triangle) -
+        m_mesh_offsets.begin() - 1;
+    Mesh::GetIsect(m_meshes[k], triangle - m_mesh_offsets[k], ray, t, isect);
+}
+
+///
+/// @brief Return the material index of a primitive or a triangle.
+///
+uint32_t Scene::material(const uint32_t id) const
+{
+    if (id < m_primitives.size()) {
+        return m_primitives[id].material;
+    }
+    const uint32_t triangle = id - m_primitives.size();
+    const size_t k = std::upper_bound(
+        m_mesh_offsets.begin(), m_mesh_offsets.end(), triangle) -
+        m_mesh_offsets.begin() - 1;
+    return m_meshes[k].m_material;
+}
+
+/// ---------------------------------------------------------------------------
+/// @brief Generate a random collection of spheres. Equal seeds generate equal
+/// collections. Glass spheres share a single dielectric material.
+///
+Scene Scene::Generate(int32_t n_cells, int32_t n_lights, uint64_t seed)
+{
+    math::random_engine rng(seed);
+    math::random_uniform<float> dist;
+
+    Scene scene;
+    scene.m_view = DefaultView();
+    scene.m_load_time = 0.0;
+    uint32_t ground = scene.add(Material::CreateDiffuse(Color{0.5, 0.5, 0.5}));
+    uint32_t glass = scene.add(Material::CreateDielectric(1.5));
+    scene.add(Vec3{0.0, -1000.0 , 0.0}, 1000, ground);
+
+    for (int a = -n_cells; a < n_cells; a++) {
+        for (int b = -n_cells; b < n_cells; b++) {
+            Vec3 centre{
+                (Real) (a + 0.9*dist(rng)), 0.2, (Real) (b + 0.9*dist(rng))};
+            Vec3 point{4.0, 0.2, 0.0};
+
+            Real choose_mat = dist(rng);
+            if (math::norm(centre - point) > 0.9) {
+                if (choose_mat < 0.8) {
+                    // Diffuse sphere
+                    Color rho = Color{dist(rng), dist(rng), dist(rng)} *
+                                Color{dist(rng), dist(rng), dist(rng)};
+                    scene.add(centre, 0.2, scene.add(
+                        Material::CreateDiffuse(rho)));
+
+                } else if (choose_mat < 0.95) {
+                    // Conductor sphere
+                    Color rho = Color{0.5, 0.5, 0.5};
+                    rho += 0.5 * Color{dist(rng), dist(rng), dist(rng)};
+                    scene.add(centre, 0.2, scene.add(
+                        Material::CreateConductor(rho)));
+
+                } else {
+                    // Glass Sphere
+                    scene.add(centre, 0.2, glass);
+                }
+            }
+        }
+    }
+
+    scene.add(Vec3{0, 1, 0}, 1.0, glass);
+    scene.add(Vec3{-4, 1, 0}, 1.0, scene.add(
+        Material::CreateDiffuse(Color{0.4, 0.2, 0.1})));
+    scene.add(Vec3{4, 1, 0}, 1.0, scene.add(
+        Material::CreateConductor(Color{0.7, 0.6, 0.5})));
+
+    // Small emitters floating above the spheres. Their radiance is high for
+    // their size, so they dominate the lighting of the scene.
+    const Real extent = (Real) std::max(n_cells, 4);
+    for (int k = 0; k < n_lights; k++) {
+        Vec3 centre{
+            extent * (Real) (2.0*dist(rng) - 1.0),
+            (Real) (1.5 + 1.5*dist(rng)),
+            extent * (Real) (2.0*dist(rng) - 1.0)};
+        Color Le = Color{dist(rng), dist(rng), dist(rng)};
+        Le *= 0.5;
+        Le += 0.5;
+        Le *= 200.0;
+        scene.add(centre, 0.1, scene.add(Material::CreateEmitter(Le)));
+    }
+
+    return scene;
+}
+
+///
+/// @brief Load a binary scene file, or compile a text scene file with a .txt
+/// extension.
+///
+Scene Scene::Load(const std::string &filename)
+{
+    auto start = std::chrono::steady_clock::now();
+    Scene scene = IsText(filename) ? LoadText(filename) : LoadBinary(filename);
+    auto end = std::chrono::steady_clock::now();
+    scene.m_load_time = std::chrono::duration<double>(end - start).count();
+    return scene;
+}
+
+///
+/// @brief Save the scene to a binary scene file, or to a text scene file with
+/// a .txt extension. The text values are written with enough digits to
+/// compile back to the same scene.
+///
+void Scene::save(const std::string &filename) const
+{
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("failed to open " + filename);
+    }
+
+    if (IsText(filename)) {
+        static const char *kTypeNames[Material::NumTypes] = {
+            "diffuse", "conductor", "dielectric", "emitter"};
+        auto vec3 = [] (const Vec3 &v) {
+            std::ostringstream out;
+            out << std::setprecision(std::numeric_limits<Real>::max_digits10)
+                << v.x << " " << v.y << " " << v.z;
+            return out.str();
+        };
+        auto color = [] (const Color &c) {
+            std::ostringstream out;
+            out << std::setprecision(std::numeric_limits<Real>::max_digits10)
+                << c.r << " " << c.g << " " << c.b;
+            return out.str();
+        };
+
+        file << std::setprecision(std::numeric_limits<Real>::max_digits10)
+             << "# raytraceweektwo scene\n"
+             << "camera"
+             << " eye " << vec3(m_view.eye)
+             << " ctr " << vec3(m_view.ctr)
+             << " up " << vec3(m_view.up)
+             << " fov " << m_view.fov
+             << " focus " << m_view.focus
+             << " aperture " << m_view.aperture << "\n";
+        for (size_t i = 0; i < m_materials.size(); ++i) {
+            const Material &material = m_materials[i];
+            file << "material m" << i << " "
+                 << kTypeNames[material.type] << " ";
+            if (material.type == Material::Dielectric) {
+                file << material.ior << "\n";
+            } else if (material.type == Material::Emitter) {
+                file << color(material.Le) << "\n";
+            } else {
+                file << color(material.rho) << "\n";
+            }
+        }
+        for (const auto &primitive : m_primitives) {
+            file << "sphere " << vec3(primitive.centre) << " "
+                 << primitive.radius << " m" << primitive.material << "\n";
+        }
+        for (const auto &mesh : m_meshes) {
+            file << "mesh " << mesh.m_filename << " m" << mesh.m_material
+                 << " scale " << mesh.m_scale
+                 << " at " << vec3(mesh.m_at) << "\n";
+        }
+    } else {
+        Header header = {};
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.real_size = sizeof(Real);
+        const Vec3 *vectors[3] = {&m_view.eye, &m_view.ctr, &m_view.up};
+        for (size_t k = 0; k < 3; ++k) {
+            header.view[3 * k + 0] = (double) vectors[k]->x;
+            header.view[3 * k + 1] = (double) vectors[k]->y;
+            header.view[3 * k + 2] = (double) vectors[k]->z;
+        }
+        header.view[9] = (double) m_view.fov;
+        header.view[10] = (double) m_view.focus;
+        header.view[11] = (double) m_view.aperture;
+        header.num_materials = m_materials.size();
+        header.num_primitives = m_primitives.size();
+        header.num_lights = m_lights.size();
+        header.materials = Align(sizeof(Header));
+        header.primitives = Align(header.materials +
+            m_materials.size() * sizeof(MaterialRecord<Real>));
+        header.lights = Align(header.primitives +
+            m_primitives.size() * sizeof(PrimitiveRecord<Real>));
+
+        // Copy the materials and primitives to zero-initialised records, so
+        // the padding bytes of the records are written as zeros.
+        std::vector<MaterialRecord<Real>> materials(m_materials.size());
+        for (size_t i = 0; i < m_materials.size(); ++i) {
+            const Material &material = m_materials[i];
+            MaterialRecord<Real> &record = materials[i];
+            record.type = material.type;
+            record.rho[0] = material.rho.r;
+            record.rho[1] = material.rho.g;
+            record.rho[2] = material.rho.b;
+            record.ior = material.ior;
+            record.Le[0] = material.Le.r;
+            record.Le[1] = material.Le.g;
+            record.Le[2] = material.Le.b;
+        }
+        std::vector<PrimitiveRecord<Real>> primitives(m_primitives.size());
+        for (size_t i = 0; i < m_primitives.size(); ++i) {
+            const Primitive &primitive = m_primitives[i];
+            PrimitiveRecord<Real> &record = primitives[i];
+            record.centre[0] = primitive.centre.x;
+            record.centre[1] = primitive.centre.y;
+            record.centre[2] = primitive.centre.z;
+            record.radius = primitive.radius;
+            record.material = primitive.material;
+        }
+
+        // Store the mesh file names in the string table.
+        std::vector<MeshRecord> meshes(m_meshes.size());
+        std::string chars;
+        for (size_t i = 0; i < m_meshes.size(); ++i) {
+            const Mesh &mesh = m_meshes[i];
+            meshes[i].filename = chars.size();
+            meshes[i].filename_size = mesh.m_filename.size();
+            meshes[i].material = mesh.m_material;
+            meshes[i].reserved = 0;
+            meshes[i].scale = (double) mesh.m_scale;
+            meshes[i].at[0] = (double) mesh.m_at.x;
+            meshes[i].at[1] = (double) mesh.m_at.y;
+            meshes[i].at[2] = (double) mesh.m_at.z;
+            chars += mesh.m_filename;
+        }
+        header.num_meshes = meshes.size();
+        header.num_chars = chars.size();
+        header.meshes = Align(
+            header.lights + m_lights.size() * sizeof(uint32_t));
+        header.chars = Align(
+            header.meshes + meshes.size() * sizeof(MeshRecord));
+        header.size = header.chars + chars.size();
+
+        // Write each table after the padding to its offset.
+        const char padding[kTableAlignment] = {};
+        auto table = [&] (uint64_t offset, const void *data, size_t size) {
+            file.write(padding, offset - (uint64_t) file.tellp());
+            file.write(static_cast<const char *>(data), size);
+        };
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        table(header.materials, materials.data(),
+            materials.size() * sizeof(MaterialRecord<Real>));
+        table(header.primitives, primitives.data(),
+            primitives.size() * sizeof(PrimitiveRecord<Real>));
+        table(header.lights, m_lights.data(),
+            m_lights.size() * sizeof(uint32_t));
+        table(header.meshes, meshes.data(),
+            meshes.size() * sizeof(MeshRecord));
+        table(header.chars, chars.data(), chars.size());
+    }
+
+    if (!file) {
+        throw std::runtime_error("failed to write " + filename);
+    }
+}
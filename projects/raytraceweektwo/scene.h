@@ -0,0 +1,123 @@
+//
+// scene.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef SCENE_H_
+#define SCENE_H_
+
+#include <vector>
+#include <string>
+#include "common.h"
+#include "material.h"
+#include "primitive.h"
+#include "ray.h"
+#include "isect.h"
+#include "bvh.h"
+#include "mesh.h"
+
+///
+/// @brief A scene is a camera view, a collection of primitives, a collection of
+/// triangle meshes and a table of materials. Primitives, meshes and
+/// intersections refer to their material by its index in the table, so
+/// materials shared by many primitives are stored once.
+///
+/// Intersections are identified by the index of the primitive, followed by
+/// the triangles of each mesh, so the triangle ids start at the number of
+/// primitives. Emitter meshes are found by bsdf sampling, but are not sampled
+/// as lights.
+///
+/// A scene is stored in a binary scene file, a header followed by the material,
+/// primitive, light and mesh tables. The tables hold the records of the scene
+/// as laid out in memory, for the size of Real given in the header. The file
+/// is mapped and each table is copied in a single block, with no parsing. A
+/// build with another size of Real converts the records instead. The lights
+/// are found again from the emitter materials when the file is loaded. A mesh
+/// is stored as the name of its OBJ file, with its material and its
+/// placement, and is loaded from its binary mesh cache.
+///
+/// A text scene file has one statement per line, with # comments:
+///   camera eye <x y z> ctr <x y z> up <x y z> fov <f> focus <d> aperture <a>
+///   material <name> diffuse <r g b>
+///   material <name> conductor <r g b>
+///   material <name> dielectric <ior>
+///   material <name> emitter <r g b>
+///   sphere <x y z> <radius> <material name>
+///   mesh <OBJ file> <material name> [scale <s>] [at <x y z>]
+/// The camera keys may be given in any order, with the field of view in
+/// degrees, and default to the camera of the generated scene. A mesh file is
+/// found relative to the scene file, and is scaled and moved to its place.
+///
+struct Scene {
+    // Camera view of the scene. The aspect ratio is given by the film.
+    struct View {
+        Vec3 eye;
+        Vec3 ctr;
+        Vec3 up;
+        Real fov;
+        Real focus;
+        Real aperture;
+    };
+
+    View m_view;
+    std::vector<Material> m_materials;
+    std::vector<Primitive> m_primitives;
+    std::vector<uint32_t> m_lights;         // emitter primitive indices
+    std::vector<Mesh> m_meshes;
+    std::vector<uint32_t> m_mesh_offsets;   // first triangle of each mesh
+    double m_load_time;                     // scene file load time
+
+    // Add a material to the table and return its index.
+    uint32_t add(const Material &material);
+
+    // Add a sphere primitive with the specified material index.
+    void add(const Vec3 &centre, const Real radius, const uint32_t material);
+
+    // Add a triangle mesh.
+    void add(Mesh &&mesh);
+
+    // Return the number of triangles in the meshes.
+    size_t num_triangles() const;
+
+    // Compute the line parameter and id of the closest triangle hit.
+    bool intersect_meshes(
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Real &t,
+        uint32_t &id,
+        Bvh::Stats *stats = nullptr) const;
+
+    // Return true if the ray hits any triangle in the interval.
+    bool occluded_meshes(
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Bvh::Stats *stats = nullptr) const;
+
+    // Store the geometric properties of the intersection with a primitive or
+    // a triangle at parameter t.
+    void get_isect(
+        const uint32_t id,
+        const Ray &ray,
+        const Real t,
+        Isect &isect) const;
+
+    // Return the material index of a primitive or a triangle.
+    uint32_t material(const uint32_t id) const;
+
+    // Save the scene to a binary file, or to a text file with a .txt name.
+    void save(const std::string &filename) const;
+
+    // Generate a random collection of spheres, lit by small emitters.
+    static Scene Generate(int32_t n_cells, int32_t n_lights, uint64_t seed);
+
+    // Load a binary scene file, or compile a text scene file.
+    static Scene Load(const std::string &filename);
+};
+
+#endif // SCENE_H_
@@ -0,0 +1,145 @@
+//
+// scheduler.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <algorithm>
+#include "common.h"
+#include "scheduler.h"
+
+///
+/// @brief Create a thread pool with the specified number of workers.
+///
+Scheduler::Scheduler(size_t num_threads)
+    : m_queues(std::max<size_t>(num_threads, 1))
+    , m_generation(0)
+    , m_pending(0)
+    , m_busy(0)
+    , m_quit(false)
+{
+    for (size_t worker = 0; worker < m_queues.size(); ++worker) {
+        m_threads.emplace_back(&Scheduler::Work, this, worker);
+    }
+}
+
+///
+/// @brief Signal the workers to quit and wait for them to finish.
+///
+Scheduler::~Scheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_start.notify_all();
+    for (auto &thread : m_threads) {
+        thread.join();
+    }
+}
+
+///
+/// @brief Run the tasks [0, num_tasks) and wait until all have completed.
+/// Each worker queue is initially assigned a contiguous range of tasks, so
+/// neighbouring tasks tend to run on the same thread unless they are stolen.
+///
+void Scheduler::Run(size_t num_tasks, const Task &task)
+{
+    if (num_tasks == 0) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [&] () { return m_busy == 0; });
+
+    const size_t num_queues = m_queues.size();
+    for (size_t worker = 0; worker < num_queues; ++worker) {
+        size_t begin = (worker * num_tasks) / num_queues;
+        size_t end = ((worker + 1) * num_tasks) / num_queues;
+        std::lock_guard<std::mutex> queue_lock(m_queues[worker].mutex);
+        for (size_t i = begin; i < end; ++i) {
+            m_queues[worker].tasks.push_back(i);
+        }
+    }
+    m_task = task;
+    m_pending = num_tasks;
+    m_generation++;
+    m_start.notify_all();
+
+    m_done.wait(lock, [&] () { return m_pending == 0 && m_busy == 0; });
+    m_task = nullptr;
+}
+
+///
+/// @brief Worker thread main loop. Wait for a new generation of tasks and
+/// process tasks until no queue has any tasks left.
+///
+void Scheduler::Work(size_t worker)
+{
+    size_t generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_start.wait(lock, [&] () {
+                return m_quit || m_generation != generation;
+            });
+            if (m_quit) {
+                return;
+            }
+            generation = m_generation;
+            m_busy++;
+        }
+
+        size_t task;
+        size_t completed = 0;
+        while (Pop(worker, task) || Steal(worker, task)) {
+            m_task(task, worker);
+            completed++;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending -= completed;
+            m_busy--;
+            if (m_busy == 0) {
+                m_done.notify_all();
+            }
+        }
+    }
+}
+
+///
+/// @brief Pop a task from the front of the worker queue.
+///
+bool Scheduler::Pop(size_t worker, size_t &task)
+{
+    Queue &queue = m_queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+    return true;
+}
+
+///
+/// @brief Steal a task from the back of another worker queue.
+///
+bool Scheduler::Steal(size_t worker, size_t &task)
+{
+    const size_t num_queues = m_queues.size();
+    for (size_t i = 1; i < num_queues; ++i) {
+        Queue &queue = m_queues[(worker + i) % num_queues];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
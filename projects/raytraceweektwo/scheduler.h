@@ -0,0 +1,65 @@
+//
+// scheduler.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "common.h"
+
+///
+/// @brief Work-stealing thread pool. Each worker owns a queue of task indices.
+/// Workers pop tasks from the front of their own queue and, once it is empty,
+/// steal tasks from the back of the other queues.
+///
+struct Scheduler {
+    // Task queue owned by a worker.
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    // Task function, called with the task and worker indices.
+    using Task = std::function<void(size_t, size_t)>;
+
+    std::vector<std::thread> m_threads;
+    std::vector<Queue> m_queues;
+    Task m_task;
+
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+    size_t m_generation;
+    size_t m_pending;
+    size_t m_busy;
+    bool m_quit;
+
+    explicit Scheduler(size_t num_threads);
+    ~Scheduler();
+
+    // Number of worker threads in the pool.
+    size_t size() const { return m_threads.size(); }
+
+    // Run the tasks [0, num_tasks) and wait until all have completed.
+    void Run(size_t num_tasks, const Task &task);
+
+    // Worker thread main loop.
+    void Work(size_t worker);
+
+    // Pop a task from the worker queue or steal one from another queue.
+    bool Pop(size_t worker, size_t &task);
+    bool Steal(size_t worker, size_t &task);
+};
+
+#endif // SCHEDULER_H_
@@ -0,0 +1,351 @@
+//
+// spheres.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <vector>
+#include <cmath>
+#include <numeric>
+#include <limits>
+#include <algorithm>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+#include "common.h"
+#include "ray.h"
+#include "primitive.h"
+#include "spheres.h"
+
+/// ---------------------------------------------------------------------------
+/// @brief Sphere store factory function, in primitive order.
+///
+Spheres Spheres::Create(const std::vector<Primitive> &primitives)
+{
+    std::vector<uint32_t> indices(primitives.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    return Create(primitives, indices);
+}
+
+///
+/// @brief Sphere store factory function, in the order given by the list of
+/// primitive indices. Empty spheres in the padding have an infinite negative
+/// squared radius and are never intersected.
+///
+Spheres Spheres::Create(
+    const std::vector<Primitive> &primitives,
+    const std::vector<uint32_t> &indices)
+{
+    Spheres spheres;
+    spheres.m_size = indices.size();
+
+    const size_t capacity = indices.size() + kWidth;
+    spheres.m_cx.resize(capacity, 0.0);
+    spheres.m_cy.resize(capacity, 0.0);
+    spheres.m_cz.resize(capacity, 0.0);
+    spheres.m_r2.resize(capacity, -INFINITY);
+    spheres.m_id.resize(capacity, 0);
+
+    for (size_t i = 0; i < indices.size(); ++i) {
+        const Primitive &primitive = primitives[indices[i]];
+        spheres.m_cx[i] = primitive.centre.x;
+        spheres.m_cy[i] = primitive.centre.y;
+        spheres.m_cz[i] = primitive.centre.z;
+        spheres.m_r2[i] = primitive.radius * primitive.radius;
+        spheres.m_id[i] = indices[i];
+    }
+    return spheres;
+}
+
+/// ---------------------------------------------------------------------------
+/// @brief Compute the closest sphere-ray intersection in the range [begin, end),
+/// one sphere at a time. Solve the same quadratic as Primitive::Intersect and
+/// keep the last sphere with the smallest line parameter.
+///
+bool Spheres::IntersectScalar(
+    const Spheres &spheres,
+    const size_t begin,
+    const size_t end,
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Real &t,
+    uint32_t &id)
+{
+    const Real a = math::dot(ray.d, ray.d);
+    bool is_a_hit = false;
+    Real t_hit = t_max;
+    for (size_t i = begin; i < end; ++i) {
+        Real ocx = ray.o.x - spheres.m_cx[i];
+        Real ocy = ray.o.y - spheres.m_cy[i];
+        Real ocz = ray.o.z - spheres.m_cz[i];
+        Real b = ray.d.x * ocx + ray.d.y * ocy + ray.d.z * ocz;
+        Real c = (ocx * ocx + ocy * ocy + ocz * ocz) - spheres.m_r2[i];
+
+        Real discriminant = b*b - a*c;
+        if (discriminant < 0.0) {
+            continue;
+        }
+        discriminant = std::sqrt(discriminant);
+
+        Real t_root = -(b + discriminant) / a;
+        if (t_root < t_min) {
+            t_root = -(b - discriminant) / a;
+        }
+        if (t_root < t_min || t_root > t_hit) {
+            continue;
+        }
+        is_a_hit = true;
+        t_hit = t_root;
+        id = spheres.m_id[i];
+    }
+    t = t_hit;
+    return is_a_hit;
+}
+
+/// ---------------------------------------------------------------------------
+/// @brief Vector lane operations of the sphere kernel, one set for each
+/// instruction set and scalar precision. Masks select the lanes where a
+/// comparison holds, and Select(mask, a, b) returns a in the selected lanes
+/// and b in the others. Sphere positions are kept in the scalar type,
+/// relative to the start of a chunk of at most kChunkSize spheres, so they
+/// are exact in single precision for scenes of any size.
+///
+namespace {
+
+#if defined(__AVX__)
+// Largest number of sphere positions that are exact in the scalar type.
+const size_t kChunkSize = (size_t) 1 << std::numeric_limits<Real>::digits;
+#endif
+
+#if defined(__AVX512F__) && defined(RAYTRACE_FLOAT)
+struct Lanes {
+    using Vec = __m512;
+    using Mask = __mmask16;
+    static Vec Set1(float x) { return _mm512_set1_ps(x); }
+    static Vec Load(const float *p) { return _mm512_loadu_ps(p); }
+    static void Store(float *p, Vec a) { _mm512_storeu_ps(p, a); }
+    static Vec Ramp() { return _mm512_set_ps(
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0); }
+    static Vec Add(Vec a, Vec b) { return _mm512_add_ps(a, b); }
+    static Vec Sub(Vec a, Vec b) { return _mm512_sub_ps(a, b); }
+    static Vec Mul(Vec a, Vec b) { return _mm512_mul_ps(a, b); }
+    static Vec Div(Vec a, Vec b) { return _mm512_div_ps(a, b); }
+    static Vec Max(Vec a, Vec b) { return _mm512_max_ps(a, b); }
+    static Vec Sqrt(Vec a) { return _mm512_sqrt_ps(a); }
+    static Mask Ge(Vec a, Vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+    static Mask Le(Vec a, Vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+    static Mask Lt(Vec a, Vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    static Mask And(Mask a, Mask b) { return a & b; }
+    static bool Any(Mask a) { return a != 0; }
+    static Vec Select(Mask m, Vec a, Vec b) { return _mm512_mask_blend_ps(m, b, a); }
+};
+#elif defined(__AVX512F__)
+struct Lanes {
+    using Vec = __m512d;
+    using Mask = __mmask8;
+    static Vec Set1(double x) { return _mm512_set1_pd(x); }
+    static Vec Load(const double *p) { return _mm512_loadu_pd(p); }
+    static void Store(double *p, Vec a) { _mm512_storeu_pd(p, a); }
+    static Vec Ramp() { return _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0); }
+    static Vec Add(Vec a, Vec b) { return _mm512_add_pd(a, b); }
+    static Vec Sub(Vec a, Vec b) { return _mm512_sub_pd(a, b); }
+    static Vec Mul(Vec a, Vec b) { return _mm512_mul_pd(a, b); }
+    static Vec Div(Vec a, Vec b) { return _mm512_div_pd(a, b); }
+    static Vec Max(Vec a, Vec b) { return _mm512_max_pd(a, b); }
+    static Vec Sqrt(Vec a) { return _mm512_sqrt_pd(a); }
+    static Mask Ge(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_GE_OQ); }
+    static Mask Le(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ); }
+    static Mask Lt(Vec a, Vec b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+    static Mask And(Mask a, Mask b) { return a & b; }
+    static bool Any(Mask a) { return a != 0; }
+    static Vec Select(Mask m, Vec a, Vec b) { return _mm512_mask_blend_pd(m, b, a); }
+};
+#elif defined(__AVX__) && defined(RAYTRACE_FLOAT)
+struct Lanes {
+    using Vec = __m256;
+    using Mask = __m256;
+    static Vec Set1(float x) { return _mm256_set1_ps(x); }
+    static Vec Load(const float *p) { return _mm256_loadu_ps(p); }
+    static void Store(float *p, Vec a) { _mm256_storeu_ps(p, a); }
+    static Vec Ramp() { return _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0); }
+    static Vec Add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+    static Vec Sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+    static Vec Mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+    static Vec Div(Vec a, Vec b) { return _mm256_div_ps(a, b); }
+    static Vec Max(Vec a, Vec b) { return _mm256_max_ps(a, b); }
+    static Vec Sqrt(Vec a) { return _mm256_sqrt_ps(a); }
+    static Mask Ge(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static Mask Le(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static Mask Lt(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static Mask And(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+    static bool Any(Mask a) { return _mm256_movemask_ps(a) != 0; }
+    static Vec Select(Mask m, Vec a, Vec b) { return _mm256_blendv_ps(b, a, m); }
+};
+#elif defined(__AVX__)
+struct Lanes {
+    using Vec = __m256d;
+    using Mask = __m256d;
+    static Vec Set1(double x) { return _mm256_set1_pd(x); }
+    static Vec Load(const double *p) { return _mm256_loadu_pd(p); }
+    static void Store(double *p, Vec a) { _mm256_storeu_pd(p, a); }
+    static Vec Ramp() { return _mm256_set_pd(3, 2, 1, 0); }
+    static Vec Add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+    static Vec Sub(Vec a, Vec b) { return _mm256_sub_pd(a, b); }
+    static Vec Mul(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+    static Vec Div(Vec a, Vec b) { return _mm256_div_pd(a, b); }
+    static Vec Max(Vec a, Vec b) { return _mm256_max_pd(a, b); }
+    static Vec Sqrt(Vec a) { return _mm256_sqrt_pd(a); }
+    static Mask Ge(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+    static Mask Le(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+    static Mask Lt(Vec a, Vec b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    static Mask And(Mask a, Mask b) { return _mm256_and_pd(a, b); }
+    static bool Any(Mask a) { return _mm256_movemask_pd(a) != 0; }
+    static Vec Select(Mask m, Vec a, Vec b) { return _mm256_blendv_pd(b, a, m); }
+};
+#endif
+
+#if defined(__AVX__)
+///
+/// @brief Compute the closest sphere-ray intersection in a chunk [begin, end)
+/// of at most kChunkSize spheres, Spheres::kWidth spheres at a time.
+///
+/// Each lane keeps the closest line parameter and sphere position, relative
+/// to the chunk start, found so far over its subset of spheres. Lanes past the
+/// end of the chunk are masked out. The lanes are then reduced to the smallest
+/// line parameter, and ties are broken by the largest sphere position, to
+/// match the scalar reference.
+///
+bool IntersectChunk(
+    const Spheres &spheres,
+    const size_t begin,
+    const size_t end,
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Real &t,
+    uint32_t &id)
+{
+    using L = Lanes;
+    const L::Vec ox = L::Set1(ray.o.x);
+    const L::Vec oy = L::Set1(ray.o.y);
+    const L::Vec oz = L::Set1(ray.o.z);
+    const L::Vec dx = L::Set1(ray.d.x);
+    const L::Vec dy = L::Set1(ray.d.y);
+    const L::Vec dz = L::Set1(ray.d.z);
+    const L::Vec a = L::Set1(math::dot(ray.d, ray.d));
+    const L::Vec tmin = L::Set1(t_min);
+    const L::Vec zero = L::Set1(0);
+    const L::Vec last = L::Set1((Real) (end - begin));
+    const L::Vec ramp = L::Ramp();
+    const size_t kWidth = Spheres::kWidth;
+
+    L::Vec t_hit = L::Set1(t_max);
+    L::Vec i_hit = L::Set1(-1);
+    for (size_t i = begin; i < end; i += kWidth) {
+        L::Vec index = L::Add(L::Set1((Real) (i - begin)), ramp);
+        L::Mask valid = L::Lt(index, last);
+
+        L::Vec ocx = L::Sub(ox, L::Load(&spheres.m_cx[i]));
+        L::Vec ocy = L::Sub(oy, L::Load(&spheres.m_cy[i]));
+        L::Vec ocz = L::Sub(oz, L::Load(&spheres.m_cz[i]));
+        L::Vec r2 = L::Load(&spheres.m_r2[i]);
+
+        L::Vec b = L::Add(L::Add(
+            L::Mul(dx, ocx),
+            L::Mul(dy, ocy)),
+            L::Mul(dz, ocz));
+        L::Vec c = L::Sub(L::Add(L::Add(
+            L::Mul(ocx, ocx),
+            L::Mul(ocy, ocy)),
+            L::Mul(ocz, ocz)), r2);
+        L::Vec disc = L::Sub(L::Mul(b, b), L::Mul(a, c));
+        L::Mask mask = L::And(valid, L::Ge(disc, zero));
+        if (!L::Any(mask)) {
+            continue;
+        }
+        disc = L::Sqrt(L::Max(disc, zero));
+
+        L::Vec t0 = L::Div(L::Sub(L::Sub(zero, b), disc), a);
+        L::Vec t1 = L::Div(L::Sub(disc, b), a);
+        L::Vec troot = L::Select(L::Ge(t0, tmin), t0, t1);
+
+        mask = L::And(mask, L::Ge(troot, tmin));
+        mask = L::And(mask, L::Le(troot, t_hit));
+        t_hit = L::Select(mask, troot, t_hit);
+        i_hit = L::Select(mask, index, i_hit);
+    }
+
+    Real t_lane[kWidth];
+    Real i_lane[kWidth];
+    L::Store(t_lane, t_hit);
+    L::Store(i_lane, i_hit);
+
+    Real i_best = -1;
+    Real t_best = t_max;
+    for (size_t k = 0; k < kWidth; ++k) {
+        if (i_lane[k] < 0) {
+            continue;
+        }
+        if (i_best < 0 || t_lane[k] < t_best ||
+            (t_lane[k] == t_best && i_lane[k] > i_best)) {
+            t_best = t_lane[k];
+            i_best = i_lane[k];
+        }
+    }
+    if (i_best < 0) {
+        return false;
+    }
+    t = t_best;
+    id = spheres.m_id[begin + (size_t) i_best];
+    return true;
+}
+#endif
+
+} // namespace
+
+/// ---------------------------------------------------------------------------
+/// @brief Compute the closest sphere-ray intersection in the range [begin, end),
+/// kWidth spheres at a time. The range is split in chunks of exact sphere
+/// positions, and each chunk only accepts hits as close as the closest hit so
+/// far, so a later sphere still wins a tie as in the scalar reference.
+///
+#if defined(__AVX__)
+bool Spheres::Intersect(
+    const Spheres &spheres,
+    const size_t begin,
+    const size_t end,
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Real &t,
+    uint32_t &id)
+{
+    bool is_a_hit = false;
+    Real t_hit = t_max;
+    for (size_t lo = begin; lo < end; lo += kChunkSize) {
+        const size_t hi = std::min(end, lo + kChunkSize);
+        if (IntersectChunk(spheres, lo, hi, ray, t_min, t_hit, t, id)) {
+            is_a_hit = true;
+            t_hit = t;
+        }
+    }
+    return is_a_hit;
+}
+#else
+bool Spheres::Intersect(
+    const Spheres &spheres,
+    const size_t begin,
+    const size_t end,
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Real &t,
+    uint32_t &id)
+{
+    return IntersectScalar(spheres, begin, end, ray, t_min, t_max, t, id);
+}
+#endif
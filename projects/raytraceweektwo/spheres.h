@@ -0,0 +1,74 @@
+//
+// spheres.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef SPHERES_H_
+#define SPHERES_H_
+
+#include <vector>
+#include "common.h"
+#include "ray.h"
+#include "primitive.h"
+
+///
+/// @brief Structure-of-arrays store of sphere centres, squared radii and ids.
+/// The id of each sphere is the index of the primitive it was created from.
+/// The arrays are padded with kWidth empty spheres, so the kernel can load a
+/// full vector past the end of any range and mask the trailing lanes.
+///
+struct Spheres {
+    // Number of spheres tested per instruction by the vector kernel. Single
+    // precision doubles the number of spheres per vector register.
+#if defined(__AVX512F__)
+    static const size_t kWidth = 64 / sizeof(Real);
+#elif defined(__AVX__)
+    static const size_t kWidth = 32 / sizeof(Real);
+#else
+    static const size_t kWidth = 1;
+#endif
+
+    std::vector<Real> m_cx;
+    std::vector<Real> m_cy;
+    std::vector<Real> m_cz;
+    std::vector<Real> m_r2;
+    std::vector<uint32_t> m_id;
+    size_t m_size;
+
+    // Compute the closest sphere-ray intersection in the range [begin, end),
+    // one sphere at a time. This is the reference implementation.
+    static bool IntersectScalar(
+        const Spheres &spheres,
+        const size_t begin,
+        const size_t end,
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Real &t,
+        uint32_t &id);
+
+    // Compute the closest sphere-ray intersection in the range [begin, end),
+    // kWidth spheres at a time.
+    static bool Intersect(
+        const Spheres &spheres,
+        const size_t begin,
+        const size_t end,
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Real &t,
+        uint32_t &id);
+
+    // Sphere store factory functions, in primitive order or in the order
+    // given by a list of primitive indices.
+    static Spheres Create(const std::vector<Primitive> &primitives);
+    static Spheres Create(
+        const std::vector<Primitive> &primitives,
+        const std::vector<uint32_t> &indices);
+};
+
+#endif // SPHERES_H_
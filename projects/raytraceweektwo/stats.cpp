@@ -0,0 +1,104 @@
+//
+// stats.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <ostream>
+#include "common.h"
+#include "material.h"
+#include "stats.h"
+
+///
+/// @brief Reset the statistics.
+///
+void Stats::clear()
+{
+    *this = Stats();
+}
+
+///
+/// @brief Apply a binary operation to each counter and timer of the
+/// statistics.
+///
+template<typename Op>
+static void Combine(Stats &stats, const Stats &other, Op op)
+{
+    op(stats.num_rays, other.num_rays);
+    op(stats.num_camera_rays, other.num_camera_rays);
+    op(stats.num_secondary_rays, other.num_secondary_rays);
+    op(stats.num_shadow_rays, other.num_shadow_rays);
+    op(stats.num_sphere_tests, other.num_sphere_tests);
+    op(stats.bvh.num_rays, other.bvh.num_rays);
+    op(stats.bvh.num_nodes, other.bvh.num_nodes);
+    op(stats.bvh.num_leaf_tests, other.bvh.num_leaf_tests);
+    for (uint32_t type = 0; type < Material::NumTypes; ++type) {
+        op(stats.num_hits[type], other.num_hits[type]);
+    }
+    op(stats.num_depth_cap, other.num_depth_cap);
+    for (size_t k = 0; k < Stats::kNumPathLengths; ++k) {
+        op(stats.path_lengths[k], other.path_lengths[k]);
+    }
+    op(stats.trace_time, other.trace_time);
+    op(stats.resolve_time, other.resolve_time);
+    op(stats.upload_time, other.upload_time);
+    op(stats.gpu_upload_time, other.gpu_upload_time);
+}
+
+///
+/// @brief Add the statistics of another thread or frame.
+///
+void Stats::merge(const Stats &other)
+{
+    Combine(*this, other, [] (auto &x, const auto &y) { x += y; });
+}
+
+///
+/// @brief Subtract earlier statistics from cumulative statistics, leaving the
+/// statistics of the interval between them.
+///
+void Stats::subtract(const Stats &other)
+{
+    Combine(*this, other, [] (auto &x, const auto &y) { x -= y; });
+}
+
+///
+/// @brief Write the statistics as a single line JSON object, so a sequence of
+/// frames is a JSON lines file. Sphere tests count the primitive tests of the
+/// linear query and of the bvh leaves. The path length histogram is indexed by
+/// the path depth at termination, and the last bin holds the longer paths.
+/// The gpu upload time is read back once the gpu has completed the upload,
+/// so it lags the frame of the upload by up to kNumPixelBuffers frames.
+///
+void Stats::save(std::ostream &os, const size_t frame) const
+{
+    static const char *kMaterialNames[Material::NumTypes] = {
+        "diffuse", "conductor", "dielectric", "emitter"};
+
+    os << "{\"frame\": " << frame
+       << ", \"rays\": " << num_rays
+       << ", \"camera_rays\": " << num_camera_rays
+       << ", \"secondary_rays\": " << num_secondary_rays
+       << ", \"shadow_rays\": " << num_shadow_rays
+       << ", \"sphere_tests\": " << num_sphere_tests + bvh.num_leaf_tests
+       << ", \"bvh_nodes\": " << bvh.num_nodes
+       << ", \"hits\": {";
+    for (uint32_t type = 0; type < Material::NumTypes; ++type) {
+        os << (type > 0 ? ", " : "")
+           << "\"" << kMaterialNames[type] << "\": " << num_hits[type];
+    }
+    os << "}, \"depth_cap\": " << num_depth_cap
+       << ", \"path_lengths\": [";
+    for (size_t k = 0; k < kNumPathLengths; ++k) {
+        os << (k > 0 ? ", " : "") << path_lengths[k];
+    }
+    os << "], \"time\": {"
+       << "\"trace\": " << trace_time
+       << ", \"resolve\": " << resolve_time
+       << ", \"upload\": " << upload_time
+       << ", \"gpu_upload\": " << gpu_upload_time
+       << "}}\n";
+}
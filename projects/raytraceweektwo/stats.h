@@ -0,0 +1,110 @@
+//
+// stats.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <ostream>
+#include <chrono>
+#include <algorithm>
+#include "common.h"
+#include "material.h"
+#include "bvh.h"
+
+///
+/// @brief Render statistics of a frame. Each worker thread counts into its own
+/// statistics, which the tracer merges into the frame statistics once the
+/// sample pass completes. The ray count is always kept, since the tracer
+/// reports its throughput. The other counters and the stage timers are only
+/// compiled in with RAYTRACE_STATS, and the macros below expand to nothing
+/// otherwise.
+///
+struct Stats {
+    static const size_t kNumPathLengths = 32;
+
+    size_t num_rays;                        // all rays traced
+    size_t num_camera_rays;                 // rays from the camera
+    size_t num_secondary_rays;              // rays from a bounce
+    size_t num_shadow_rays;                 // rays towards an emitter
+    size_t num_sphere_tests;                // sphere-ray tests, linear query
+    Bvh::Stats bvh;                         // bvh traversal
+    size_t num_hits[Material::NumTypes];    // closest hits by material type
+    size_t num_depth_cap;                   // paths over the maximum depth
+    size_t path_lengths[kNumPathLengths];   // path depth histogram
+    double trace_time;                      // sample pass wall time
+    double resolve_time;                    // film to bitmap wall time
+    double upload_time;                     // bitmap to texture wall time
+    double gpu_upload_time;                 // texture upload gpu time
+
+    // Are the counters and timers compiled in?
+    static constexpr bool Enabled() {
+#if defined(RAYTRACE_STATS)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Reset the statistics.
+    void clear();
+
+    // Add the statistics of another thread or frame.
+    void merge(const Stats &other);
+
+    // Subtract earlier statistics from cumulative statistics.
+    void subtract(const Stats &other);
+
+    // Write the statistics as a single line JSON object.
+    void save(std::ostream &os, const size_t frame) const;
+};
+
+///
+/// @brief Scoped timer, adding its lifetime in seconds to a stage timer.
+///
+struct StatsTimer {
+    double &m_time;
+    std::chrono::steady_clock::time_point m_start;
+
+    explicit StatsTimer(double &time)
+        : m_time(time)
+        , m_start(std::chrono::steady_clock::now()) {}
+    ~StatsTimer() {
+        auto end = std::chrono::steady_clock::now();
+        m_time += std::chrono::duration<double>(end - m_start).count();
+    }
+};
+
+///
+/// @brief Statistics macros, taking a pointer to the statistics. A null
+/// pointer disables the counters of the call.
+///
+#if defined(RAYTRACE_STATS)
+#define STATS_ADD(stats, counter, value) \
+    do { \
+        if ((stats) != nullptr) { \
+            (stats)->counter += (value); \
+        } \
+    } while (0)
+#define STATS_PATH(stats, depth) \
+    do { \
+        if ((stats) != nullptr) { \
+            (stats)->path_lengths[std::min<size_t>( \
+                (depth), Stats::kNumPathLengths - 1)]++; \
+        } \
+    } while (0)
+#define STATS_BVH(stats) ((stats) != nullptr ? &(stats)->bvh : nullptr)
+#define STATS_TIMER(stats, timer) StatsTimer stats_timer_##timer((stats)->timer)
+#else
+#define STATS_ADD(stats, counter, value) do {} while (0)
+#define STATS_PATH(stats, depth) do {} while (0)
+#define STATS_BVH(stats) nullptr
+#define STATS_TIMER(stats, timer) do {} while (0)
+#endif
+
+#endif // STATS_H_
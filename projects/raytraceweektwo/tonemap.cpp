@@ -0,0 +1,314 @@
+//
+// tonemap.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include "common.h"
+#include "color.h"
+#include "film.h"
+#include "tonemap.h"
+
+namespace {
+
+// Coefficients of the ACES filmic fit by Krzysztof Narkowicz,
+//  f(x) = x (a x + b) / (x (c x + d) + e).
+const float kAcesA = 2.51f;
+const float kAcesB = 0.03f;
+const float kAcesC = 2.43f;
+const float kAcesD = 0.59f;
+const float kAcesE = 0.14f;
+
+// Scale of a clamped value to its table index.
+const float kIndexScale = (float) (ToneMap::kTableSize - 1);
+
+} // namespace
+
+/// ---------------------------------------------------------------------------
+/// @brief Encode count channel values, one at a time. Each value is clamped
+/// to [0,1], after the ACES curve if any, and its code is looked up in the
+/// table. Negative and NaN values map to zero.
+///
+void ToneMap::EncodeScalar(
+    const ToneMap &tonemap,
+    const float *values,
+    const int32_t *offsets,
+    const size_t count,
+    uint8_t *codes)
+{
+    const bool aces = (tonemap.m_curve == ACES);
+    const int32_t *table = tonemap.m_table.data();
+    for (size_t k = 0; k < count; ++k) {
+        float x = values[k];
+        x = (x > 0.0f) ? x : 0.0f;
+        if (aces) {
+            x = (x * (kAcesA * x + kAcesB)) /
+                (x * (kAcesC * x + kAcesD) + kAcesE);
+        }
+        x = (x < 1.0f) ? x : 1.0f;
+        int32_t index = (int32_t) (x * kIndexScale + 0.5f);
+        codes[k] = (uint8_t) ((table[index] + offsets[k]) >> 8);
+    }
+}
+
+///
+/// @brief Encode count channel values, 32 at a time with AVX2. The table is
+/// read with gathers, and the 32-bit codes are packed to bytes. The operations
+/// match the scalar reference, so both produce the same codes. The trailing
+/// values are encoded by the scalar reference.
+///
+void ToneMap::Encode(
+    const ToneMap &tonemap,
+    const float *values,
+    const int32_t *offsets,
+    const size_t count,
+    uint8_t *codes)
+{
+    size_t k = 0;
+#if defined(__AVX2__)
+    const bool aces = (tonemap.m_curve == ACES);
+    const int *table = reinterpret_cast<const int *>(tonemap.m_table.data());
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 scale = _mm256_set1_ps(kIndexScale);
+    const __m256 a = _mm256_set1_ps(kAcesA);
+    const __m256 b = _mm256_set1_ps(kAcesB);
+    const __m256 c = _mm256_set1_ps(kAcesC);
+    const __m256 d = _mm256_set1_ps(kAcesD);
+    const __m256 e = _mm256_set1_ps(kAcesE);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    auto encode = [&] (size_t j) -> __m256i {
+        __m256 x = _mm256_max_ps(_mm256_loadu_ps(values + j), zero);
+        if (aces) {
+            __m256 num = _mm256_mul_ps(x,
+                _mm256_add_ps(_mm256_mul_ps(a, x), b));
+            __m256 den = _mm256_add_ps(_mm256_mul_ps(x,
+                _mm256_add_ps(_mm256_mul_ps(c, x), d)), e);
+            x = _mm256_div_ps(num, den);
+        }
+        x = _mm256_min_ps(x, one);
+        __m256i index = _mm256_cvttps_epi32(
+            _mm256_add_ps(_mm256_mul_ps(x, scale), half));
+        __m256i code = _mm256_i32gather_epi32(table, index, 4);
+        code = _mm256_add_epi32(code, _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(offsets + j)));
+        return _mm256_srli_epi32(code, 8);
+    };
+
+    for (; k + 32 <= count; k += 32) {
+        // Pack within 128-bit lanes, then restore the order of the dwords.
+        __m256i c01 = _mm256_packus_epi32(encode(k), encode(k + 8));
+        __m256i c23 = _mm256_packus_epi32(encode(k + 16), encode(k + 24));
+        __m256i bytes = _mm256_permutevar8x32_epi32(
+            _mm256_packus_epi16(c01, c23), order);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(codes + k), bytes);
+    }
+#endif
+    EncodeScalar(tonemap, values + k, offsets + k, count - k, codes + k);
+}
+
+///
+/// @brief Convert the film rows [y0, y1) to the bitmap. Each pixel is divided
+/// by its own number of samples and scaled by the exposure. The rows are
+/// converted in blocks of kNoiseSize pixels, aligned with the tiles of the
+/// rounding offsets.
+///
+void ToneMap::Resolve(
+    const ToneMap &tonemap,
+    const Film &film,
+    const uint32_t y0,
+    const uint32_t y1,
+    uint8_t *bitmap)
+{
+    alignas(32) float values[3 * kNoiseSize];
+    const uint32_t width = film.m_width;
+    for (uint32_t y = y0; y < y1; ++y) {
+        const int32_t *offsets =
+            &tonemap.m_offsets[(y % kNoiseSize) * 3 * kNoiseSize];
+        for (uint32_t x0 = 0; x0 < width; x0 += kNoiseSize) {
+            const size_t n = std::min<size_t>(kNoiseSize, width - x0);
+            const size_t i0 = (size_t) y * width + x0;
+            for (size_t p = 0; p < n; ++p) {
+                const Color &color = film.m_pixels[i0 + p];
+                Real inv = (Real) tonemap.m_exposure /
+                    (Real) std::max(film.m_counts[i0 + p], 1u);
+                values[3 * p + 0] = (float) (color.r * inv);
+                values[3 * p + 1] = (float) (color.g * inv);
+                values[3 * p + 2] = (float) (color.b * inv);
+            }
+            Encode(tonemap, values, offsets, 3 * n, bitmap + 3 * i0);
+        }
+    }
+}
+
+/// ---------------------------------------------------------------------------
+/// @brief Return a square tile of blue noise thresholds in [0,256), generated
+/// with the void-and-cluster method of Ulichney. The tile wraps around, so it
+/// can be repeated over the film without seams.
+///
+/// The energy of each cell is the sum of a Gaussian filter centred at every
+/// point of a binary pattern. The tightest cluster is the point with the
+/// highest energy, and the largest void the empty cell with the lowest one.
+/// A random initial pattern is relaxed by moving its tightest cluster to its
+/// largest void until the pattern is stable. The points of the initial pattern
+/// are then ranked by removing the tightest cluster, and the empty cells by
+/// filling the largest void. Each threshold is the rank of its cell.
+///
+std::vector<uint8_t> ToneMap::BlueNoise(const size_t size, uint64_t seed)
+{
+    const size_t n = size * size;
+    const float sigma = 1.5f;
+
+    // Gaussian filter over the wrapped offsets of the tile.
+    std::vector<float> filter(n);
+    for (size_t y = 0; y < size; ++y) {
+        for (size_t x = 0; x < size; ++x) {
+            float dx = (float) std::min(x, size - x);
+            float dy = (float) std::min(y, size - y);
+            filter[y * size + x] =
+                std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+        }
+    }
+
+    // Add or remove a point of the pattern and update the energy.
+    auto update = [&] (
+        std::vector<uint8_t> &pattern,
+        std::vector<float> &energy,
+        const size_t cell,
+        const bool add) {
+        pattern[cell] = add ? 1 : 0;
+        const float sign = add ? 1.0f : -1.0f;
+        const size_t cx = cell % size;
+        const size_t cy = cell / size;
+        for (size_t y = 0; y < size; ++y) {
+            const size_t row = ((cy + y) % size) * size;
+            for (size_t x = 0; x < size; ++x) {
+                energy[row + (cx + x) % size] += sign * filter[y * size + x];
+            }
+        }
+    };
+
+    // Return the point with the highest energy, or the empty cell with the
+    // lowest energy.
+    auto find = [&] (
+        const std::vector<uint8_t> &pattern,
+        const std::vector<float> &energy,
+        const bool cluster) {
+        size_t best = n;
+        for (size_t i = 0; i < n; ++i) {
+            if (pattern[i] == (cluster ? 1 : 0) &&
+                (best == n || (cluster ? energy[i] > energy[best]
+                                       : energy[i] < energy[best]))) {
+                best = i;
+            }
+        }
+        return best;
+    };
+
+    // Random initial pattern, with a tenth of the cells, relaxed until the
+    // tightest cluster is also the largest void.
+    math::random_engine rng(seed);
+    math::random_uniform<float> dist;
+    std::vector<uint8_t> pattern(n, 0);
+    std::vector<float> energy(n, 0.0f);
+    const size_t num_points = std::max<size_t>(n / 10, 1);
+    for (size_t count = 0; count < num_points; ) {
+        size_t cell = std::min((size_t) (dist(rng) * n), n - 1);
+        if (pattern[cell] == 0) {
+            update(pattern, energy, cell, true);
+            count++;
+        }
+    }
+    for (size_t iter = 0; iter < n; ++iter) {
+        size_t cluster = find(pattern, energy, true);
+        update(pattern, energy, cluster, false);
+        size_t hole = find(pattern, energy, false);
+        update(pattern, energy, hole, true);
+        if (hole == cluster) {
+            break;
+        }
+    }
+
+    // Rank the points of the initial pattern, then the empty cells.
+    std::vector<size_t> rank(n, 0);
+    {
+        std::vector<uint8_t> p = pattern;
+        std::vector<float> e = energy;
+        for (size_t count = num_points; count > 0; --count) {
+            size_t cluster = find(p, e, true);
+            update(p, e, cluster, false);
+            rank[cluster] = count - 1;
+        }
+    }
+    for (size_t count = num_points; count < n; ++count) {
+        size_t hole = find(pattern, energy, false);
+        update(pattern, energy, hole, true);
+        rank[hole] = count;
+    }
+
+    std::vector<uint8_t> noise(n);
+    for (size_t i = 0; i < n; ++i) {
+        noise[i] = (uint8_t) ((rank[i] * 256) / n);
+    }
+    return noise;
+}
+
+///
+/// @brief Tone map factory function. Tabulate the transfer function of the
+/// curve, and fill the rounding offsets of each channel in a block of pixels.
+/// Dithered channels read the blue noise tile at different shifts, so their
+/// errors are not correlated.
+///
+ToneMap ToneMap::Create(
+    const uint32_t curve,
+    const bool dither,
+    const float exposure)
+{
+    ToneMap tonemap;
+    tonemap.m_curve = curve;
+    tonemap.m_dither = dither;
+    tonemap.m_exposure = exposure;
+
+    tonemap.m_table.resize(kTableSize);
+    for (size_t i = 0; i < kTableSize; ++i) {
+        double x = (double) i / (kTableSize - 1);
+        double y;
+        if (curve == Sqrt) {
+            y = std::sqrt(x);
+        } else if (x <= 0.0031308) {
+            y = 12.92 * x;
+        } else {
+            y = 1.055 * std::pow(x, 1.0 / 2.4) - 0.055;
+        }
+        tonemap.m_table[i] = (int32_t) std::lround(255.0 * 256.0 * y);
+    }
+
+    tonemap.m_offsets.resize(kNoiseSize * 3 * kNoiseSize, 128);
+    if (dither) {
+        static const size_t kShift[3][2] = {{0, 0}, {19, 43}, {37, 11}};
+        std::vector<uint8_t> noise = BlueNoise(kNoiseSize, kRandomSeed);
+        for (size_t y = 0; y < kNoiseSize; ++y) {
+            for (size_t x = 0; x < kNoiseSize; ++x) {
+                for (size_t c = 0; c < 3; ++c) {
+                    size_t ny = (y + kShift[c][0]) % kNoiseSize;
+                    size_t nx = (x + kShift[c][1]) % kNoiseSize;
+                    tonemap.m_offsets[(y * kNoiseSize + x) * 3 + c] =
+                        noise[ny * kNoiseSize + nx];
+                }
+            }
+        }
+    }
+
+    return tonemap;
+}
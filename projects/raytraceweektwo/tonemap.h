@@ -0,0 +1,84 @@
+//
+// tonemap.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef TONEMAP_H_
+#define TONEMAP_H_
+
+#include <vector>
+#include "common.h"
+#include "film.h"
+
+///
+/// @brief Conversion of the film radiance to an 8-bit bitmap. Each channel
+/// value is clamped, mapped by a tone curve and quantized with a rounding
+/// offset. The offset is one half, or a blue noise threshold when dithering.
+///
+/// The transfer function of the curve is tabulated over [0,1] with a 16-bit
+/// index. Each entry holds the 8-bit code in 8.8 fixed point, so adding the
+/// 8-bit offset and shifting right quantizes the value. The radiance is scaled
+/// by the exposure, and the ACES curve maps it with a rational polynomial,
+/// before the sRGB table.
+///
+struct ToneMap {
+    // Tone curves.
+    enum : uint32_t {
+        Sqrt = 0,               // gamma 2 approximation
+        SRGB,                   // sRGB transfer function
+        ACES,                   // ACES filmic fit, then sRGB
+        NumCurves
+    };
+
+    // Table size and blue noise tile size. The resolve converts a row of the
+    // film in blocks of kNoiseSize pixels, each with the thresholds of a tile
+    // row.
+    static const size_t kTableSize = 1 << 16;
+    static const size_t kNoiseSize = 64;
+
+    uint32_t m_curve;
+    bool m_dither;
+    float m_exposure;                       // radiance scale
+    std::vector<int32_t> m_table;           // 8.8 fixed point code
+    std::vector<int32_t> m_offsets;         // rounding offset per channel
+
+    // Encode count channel values, one at a time. This is the reference
+    // implementation.
+    static void EncodeScalar(
+        const ToneMap &tonemap,
+        const float *values,
+        const int32_t *offsets,
+        const size_t count,
+        uint8_t *codes);
+
+    // Encode count channel values, using the vector instructions if any.
+    static void Encode(
+        const ToneMap &tonemap,
+        const float *values,
+        const int32_t *offsets,
+        const size_t count,
+        uint8_t *codes);
+
+    // Convert the film rows [y0, y1) to the bitmap.
+    static void Resolve(
+        const ToneMap &tonemap,
+        const Film &film,
+        const uint32_t y0,
+        const uint32_t y1,
+        uint8_t *bitmap);
+
+    // Return a tile of blue noise thresholds in [0,256).
+    static std::vector<uint8_t> BlueNoise(const size_t size, uint64_t seed);
+
+    // Tone map factory function.
+    static ToneMap Create(
+        const uint32_t curve,
+        const bool dither,
+        const float exposure);
+};
+
+#endif // TONEMAP_H_
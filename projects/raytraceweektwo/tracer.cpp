@@ -8,37 +8,84 @@
 //
 
 #include <vector>
+#include <string>
+#include <fstream>
+#include <stdexcept>
 #include <cfloat>
+#include <algorithm>
 #include "common.h"
 #include "tracer.h"
 
 ///
-/// @brief Create the tracer and associated objects.
+/// @brief Create the tracer and associated objects. In headless mode, no
+/// OpenGL objects are created and the tracer only maintains the film data.
+/// Otherwise, the trace thread is started and samples the film until it is
+/// complete, independent of the display loop.
 ///
-void Tracer::Initialize()
+void Tracer::Initialize(const TracerDesc &desc)
 {
     // Tracer data.
     {
+        mDesc = desc;
+        mScene = mDesc.SceneFile.empty()
+            ? Scene::Generate(mDesc.NumCells, mDesc.NumLights, mDesc.SceneSeed)
+            : Scene::Load(mDesc.SceneFile);
         mCamera = Camera::Create(
-            kCameraEye,
-            kCameraCtr,
-            kCameraUp,
-            kCameraFov,
-            (double) kFilmWidth / kFilmHeight,
-            kCameraFocus,
-            kCameraAperture);
-        mFilm = Film::Create(kFilmWidth, kFilmHeight);
+            mScene.m_view.eye,
+            mScene.m_view.ctr,
+            mScene.m_view.up,
+            mScene.m_view.fov,
+            (Real) mDesc.FilmWidth / mDesc.FilmHeight,
+            mScene.m_view.focus,
+            mScene.m_view.aperture);
+        const uint32_t tile_size =
+            mDesc.Integrator == TracerDesc::IntegratorWavefront
+                ? kWavefrontTileSize
+                : kTileSize;
+        mTiles = Film::Tiles(mDesc.FilmWidth, mDesc.FilmHeight, tile_size);
         mNumSamples = 0;
-        mSampler = Sampler::Create(math::make_random(),
-            math::random_uniform<double>());
-        mWorld = Primitive::Generate(3);
+        mNoise = kRealMax;
+        mNumRays = 0;
+        mTraceTime = 0.0;
+        mQuit = false;
+        if (mDesc.Accel == TracerDesc::AccelBvh) {
+            mBvh = Bvh::Create(mScene.m_primitives);
+        } else {
+            mSpheres = Spheres::Create(mScene.m_primitives);
+        }
+
+        // Create the thread pool with a sampler for each worker.
+        mScheduler = std::make_unique<Scheduler>(mDesc.NumThreads);
+        mSamplers.resize(mScheduler->size(), Sampler::Create(mDesc.SamplerType, mDesc.Seed));
+        mThreadStats.resize(mScheduler->size(), Stats());
+        if (mDesc.Integrator == TracerDesc::IntegratorWavefront) {
+            mWavefronts.resize(mScheduler->size());
+        }
+
+        // Create the film, unless it does not fit in its memory budget, and
+        // a tile film for each worker to render single tiles.
+        if (IsOutOfCore()) {
+            if (!mDesc.Headless || mDesc.NoiseTarget > 0) {
+                throw std::runtime_error(
+                    "a film over its memory budget is only rendered headless, "
+                    "without a noise target");
+            }
+            mFilm = Film::Create(0, 0);
+        } else {
+            mFilm = Film::Create(mDesc.FilmWidth, mDesc.FilmHeight);
+        }
+        mTileFilms.assign(mScheduler->size(), Film::CreateTile(
+            tile_size, mDesc.FilmWidth, mDesc.FilmHeight));
+
+        // Create the bitmap tone map.
+        mToneMap = ToneMap::Create(
+            mDesc.ToneCurve, mDesc.Dither, (float) mDesc.Exposure);
+        mTilePasses.assign(mTiles.size(), 0);
+        mTileWritten.assign(mTiles.size(), 0);
     }
 
     // OpenGL data.
-    {
-        // Create bitmap data.
-        mGLBitmap.resize(3 * kFilmWidth * kFilmHeight, 0);
-
+    if (!mDesc.Headless) {
         // Create a mesh over a rectangle.
         mGLMesh = Graphics::CreatePlane(
             "quad",                 // vertex attributes prefix name
@@ -49,14 +96,34 @@ void Tracer::Initialize()
             -1.0,                   // ylo
              1.0);                  // yhi
 
-        // Create the 2d-texture data store.
+        // Create the exchange of the frames published by the trace thread,
+        // with the bitmap or the radiance of the film.
+        const bool radiance = (mDesc.Display == TracerDesc::DisplayRadiance);
+        const size_t num_pixels = mFilm.m_pixels.size();
+        mExchange = std::make_unique<FrameExchange>(
+            radiance ? 0 : 3 * num_pixels,
+            radiance ? 4 * num_pixels : 0,
+            mTiles.size());
+
+        // Create the 2d-texture data store, initialized with an empty frame.
+        // The radiance display stores the film sums in rgb and the sample
+        // counts in alpha, as 32-bit floats.
+        Frame &frame = mExchange->back();
         Graphics::Texture2dCreateInfo info = {};
-        info.width = kFilmWidth;
-        info.height = kFilmHeight;
-        info.internalformat = GL_RGBA8;
-        info.pixelformat = GL_RGBA;
-        info.pixeltype = GL_UNSIGNED_BYTE;
-        info.pixels = NULL;
+        info.width = mDesc.FilmWidth;
+        info.height = mDesc.FilmHeight;
+        if (radiance) {
+            info.internalformat = GL_RGBA32F;
+            info.pixelformat = GL_RGBA;
+            info.pixeltype = GL_FLOAT;
+            info.pixels = frame.radiance.data();
+        } else {
+            info.internalformat = GL_RGB8;
+            info.pixelformat = GL_RGB;
+            info.pixeltype = GL_UNSIGNED_BYTE;
+            info.pixels = frame.bitmap.data();
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
         mGLTexture = Graphics::CreateTexture2d(info);
 
         glBindTexture(GL_TEXTURE_2D, mGLTexture);
@@ -65,6 +132,34 @@ void Tracer::Initialize()
         Graphics::SetTextureFilter(GL_TEXTURE_2D, GL_LINEAR, GL_LINEAR);
         glBindTexture(GL_TEXTURE_2D, 0);
 
+        // Create the pixel buffers streaming the frames to the texture, and
+        // the timer queries of their uploads.
+        glGenBuffers(kNumPixelBuffers, mGLPixelBuffers);
+        for (size_t k = 0; k < kNumPixelBuffers; ++k) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mGLPixelBuffers[k]);
+            glBufferData(
+                GL_PIXEL_UNPACK_BUFFER,
+                radiance
+                    ? frame.radiance.size() * sizeof(float)
+                    : frame.bitmap.size(),
+                NULL,
+                GL_STREAM_DRAW);
+            mGLFences[k] = 0;
+            mGLQueryPending[k] = false;
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glGenQueries(kNumPixelBuffers, mGLQueries);
+        mGLFrame = 0;
+
+        // Display state of the frames picked up from the trace thread.
+        mGLTilePasses.assign(mTiles.size(), 0);
+        mGLStats.clear();
+        mGLLastStats.clear();
+        mGLNumFrames = 0;
+        mGLNumSamples = 0;
+        mGLTime = 0.0;
+        mGLExposure = mDesc.Exposure;
+
         // Create the shader program object.
         std::vector<GLuint> shaders{
             Graphics::CreateShaderFromFile(GL_VERTEX_SHADER, "data/tracer.vert"),
@@ -79,6 +174,10 @@ void Tracer::Initialize()
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mGLMesh.ebo);
         SetVertexAttributes(mGLProgram, mGLMesh.attributes);
         glBindVertexArray(0);
+
+        // Trace on a thread of its own, publishing the frames to the display
+        // through the exchange.
+        mTraceThread = std::thread(&Tracer::Trace, this);
     }
 }
 
@@ -86,37 +185,417 @@ void Tracer::Initialize()
 /// @brief Destroy the tracer and associated objects.
 ///
 void Tracer::Cleanup()
-{}
+{
+    mQuit = true;
+    if (mTraceThread.joinable()) {
+        mTraceThread.join();
+    }
+    mScheduler.reset();
+
+    if (!mDesc.Headless) {
+        for (size_t k = 0; k < kNumPixelBuffers; ++k) {
+            if (mGLFences[k] != 0) {
+                glDeleteSync(mGLFences[k]);
+                mGLFences[k] = 0;
+            }
+        }
+        glDeleteQueries(kNumPixelBuffers, mGLQueries);
+        glDeleteBuffers(kNumPixelBuffers, mGLPixelBuffers);
+    }
+}
 
 ///
-/// @brief Update the tracer.
+/// @brief Acquire the most recent frame published by the trace thread, if any,
+/// and add the statistics of the work done since the previous frame to the
+/// display statistics. Never waits for the trace thread.
 ///
 void Tracer::Update()
 {
-    if (mNumSamples++ == kNumSamples) {
+    if (!mExchange->acquire()) {
         return;
     }
+    const Frame &frame = mExchange->front();
+    Stats stats = frame.stats;
+    stats.subtract(mGLLastStats);
+    mGLStats.merge(stats);
+    mGLLastStats = frame.stats;
+    mGLNumSamples = frame.num_samples;
+}
+
+///
+/// @brief Trace thread main loop. Add sample passes to the film until it is
+/// complete or the tracer is stopped. After each pass, resolve the film into
+/// the back frame of the exchange, or copy its radiance for the display to
+/// resolve, and publish it to the display with the cumulative sample pass,
+/// ray and statistics counters.
+///
+void Tracer::Trace()
+{
+    auto start = std::chrono::steady_clock::now();
+    while (!mQuit.load(std::memory_order_relaxed) && !IsComplete()) {
+        Sample();
+        Frame &frame = mExchange->back();
+        if (mDesc.Display == TracerDesc::DisplayRadiance) {
+            Snapshot(frame);
+        } else {
+            Resolve(frame.bitmap.data());
+        }
+        mTraceTime = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        frame.passes = mTilePasses;
+        frame.num_samples = mNumSamples;
+        frame.num_rays = mNumRays;
+        frame.time = mTraceTime;
+        frame.stats = mStats;
+        mExchange->publish();
+    }
+}
+
+///
+/// @brief Does the tracer sample the film adaptively, driven by the per-pixel
+/// error estimates?
+///
+bool Tracer::IsAdaptive() const
+{
+    return (mDesc.NoiseThreshold > 0 || mDesc.NoiseTarget > 0);
+}
+
+///
+/// @brief Does the film exceed the film memory budget? The film is then
+/// rendered out-of-core, one tile at a time.
+///
+bool Tracer::IsOutOfCore() const
+{
+    const size_t num_pixels = (size_t) mDesc.FilmWidth * mDesc.FilmHeight;
+    return num_pixels * Film::kPixelSize > mDesc.FilmMemory;
+}
+
+///
+/// @brief Has the tracer accumulated all the samples in the film? An adaptive
+/// tracer also completes once every pixel has converged, or once the film
+/// error is below the noise target.
+///
+bool Tracer::IsComplete() const
+{
+    if (mNumSamples >= mDesc.NumSamples) {
+        return true;
+    }
+    if (IsAdaptive() && mNumSamples >= mDesc.MinSamples) {
+        return (mFilm.m_num_converged == mFilm.m_pixels.size() ||
+                mNoise < mDesc.NoiseTarget);
+    }
+    return false;
+}
+
+///
+/// @brief Have all the pixels in the tile converged?
+///
+bool Tracer::IsConverged(const Tile &tile) const
+{
+    for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+        for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+            if (!mFilm.converged(x, y)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+///
+/// @brief Add a new sample to each pixel in the film.
+///
+/// The film tiles are processed in parallel by the scheduler workers. Each
+/// variate is keyed by the seed, the pixel, the sample pass and the dimension
+/// within the sample, with no other sampler state. The samples are then
+/// independent of the tile order and of the worker that processes each tile,
+/// and the film is identical for any number of threads.
+///
+/// Only tiles with pixels that have not converged are sampled. In adaptive
+/// mode, after the minimum number of samples, the pixels with an error below
+/// the noise threshold are marked as converged after each pass.
+///
+void Tracer::Sample()
+{
+    mActiveTiles.clear();
+    for (size_t k = 0; k < mTiles.size(); ++k) {
+        if (!IsConverged(mTiles[k])) {
+            mActiveTiles.push_back(k);
+            mTilePasses[k] = (uint32_t) mNumSamples + 1;
+        }
+    }
+
+    STATS_TIMER(&mStats, trace_time);
+    for (auto &stats : mThreadStats) {
+        stats.clear();
+    }
+    mScheduler->Run(mActiveTiles.size(), [&] (size_t task, size_t worker) {
+        const size_t k = mActiveTiles[task];
+        if (mDesc.Integrator == TracerDesc::IntegratorWavefront) {
+            mWavefronts[worker].Trace(*this, mFilm, mTiles[k], mNumSamples,
+                mSamplers[worker], mThreadStats[worker]);
+        } else {
+            SampleTile(mFilm, mTiles[k], mNumSamples,
+                mSamplers[worker], mThreadStats[worker]);
+        }
+    });
+
+    // Merge the statistics of each worker into the frame statistics.
+    for (auto &stats : mThreadStats) {
+        mNumRays += stats.num_rays;
+        mStats.merge(stats);
+    }
+    mNumSamples++;
 
-    // For each pixel in the film, generate a camera ray towards a random point
+    if (IsAdaptive() && mNumSamples >= mDesc.MinSamples) {
+        mNoise = mFilm.converge(mDesc.NoiseThreshold);
+    }
+}
+
+///
+/// @brief Render the film one tile at a time, when it exceeds its memory
+/// budget. Each worker samples a tile to completion in its own tile film,
+/// and queues its radiance to the image writer, which maps each tile into
+/// the image file once. Only a tile film per worker and the writer queue are
+/// held in memory.
+///
+/// The tile pixels draw the same samples as in the full film, so the image is
+/// identical to an in-memory render. The adaptive convergence test of a tile
+/// only sees its own pixels, and may stop pixels on the tile edges earlier.
+///
+void Tracer::RenderTiles(ImageWriter &writer)
+{
+    STATS_TIMER(&mStats, trace_time);
+    for (auto &stats : mThreadStats) {
+        stats.clear();
+    }
+    std::vector<size_t> passes(mScheduler->size(), 0);
+    mScheduler->Run(mTiles.size(), [&] (size_t task, size_t worker) {
+        const Tile &tile = mTiles[task];
+        passes[worker] = std::max(passes[worker], RenderTile(tile, worker));
+        writer.push(tile, mTileFilms[worker].radiance(tile));
+    });
+
+    // Merge the statistics of each worker into the render statistics.
+    for (auto &stats : mThreadStats) {
+        mNumRays += stats.num_rays;
+        mStats.merge(stats);
+    }
+    mNumSamples = *std::max_element(passes.begin(), passes.end());
+}
+
+///
+/// @brief Sample a tile to completion in the tile film of the worker, and
+/// return the number of passes. The passes stop once every pixel of the tile
+/// has converged, in adaptive mode.
+///
+size_t Tracer::RenderTile(const Tile &tile, const size_t worker)
+{
+    Film &film = mTileFilms[worker];
+    film.window(tile);
+    const size_t num_pixels = (size_t) film.m_width * film.m_height;
+    size_t pass = 0;
+    while (pass < mDesc.NumSamples && film.m_num_converged < num_pixels) {
+        if (mDesc.Integrator == TracerDesc::IntegratorWavefront) {
+            mWavefronts[worker].Trace(*this, film, tile, pass,
+                mSamplers[worker], mThreadStats[worker]);
+        } else {
+            SampleTile(film, tile, pass,
+                mSamplers[worker], mThreadStats[worker]);
+        }
+        pass++;
+        if (IsAdaptive() && pass >= mDesc.MinSamples) {
+            film.converge(mDesc.NoiseThreshold);
+        }
+    }
+    return pass;
+}
+
+///
+/// @brief Add a sample of the specified pass to each pixel in the tile of the
+/// film.
+///
+void Tracer::SampleTile(
+    Film &film,
+    const Tile &tile,
+    const size_t pass,
+    Sampler &sampler,
+    Stats &stats)
+{
+    if (mDesc.Packets) {
+        SampleTilePackets(film, tile, pass, sampler, stats);
+        return;
+    }
+
+    // For each pixel in the tile, generate a camera ray towards a random point
     // inside the pixel square. Compute the radiance along that ray and add it
-    // to the pixel.
-    for (size_t y = 0; y < kFilmHeight; ++y) {
-        for (size_t x = 0; x < kFilmWidth; ++x) {
-            math::vec2d u1 = mSampler.Rand2d();
-            math::vec2d u2 = mSampler.Rand2d();
-            Ray ray = mCamera.rayto(mFilm.sample(x, y, u1), u2);
-            mFilm.add(x, y, Radiance(ray));
+    // to the pixel. Each sample draws its variates from the counter of the
+    // pixel and the sample index, independent of the tile and the worker.
+    for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+        for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+            if (film.converged(x, y)) {
+                continue;
+            }
+            sampler.start(x + (uint64_t) y * mDesc.FilmWidth, pass);
+            Vec2 u1 = sampler.Rand2d();
+            Vec2 u2 = sampler.Rand2d();
+            Ray ray = mCamera.rayto(film.sample(x, y, u1), u2);
+            film.add(x, y, Radiance(ray, sampler, stats));
+        }
+    }
+}
+
+///
+/// @brief Add a new sample to each pixel in the tile, tracing the camera rays
+/// in packets over square blocks of pixels. Each path then continues as a
+/// single ray from the closest intersection of its camera ray, with the sampler
+/// state its camera ray left behind.
+///
+void Tracer::SampleTilePackets(
+    Film &film,
+    const Tile &tile,
+    const size_t pass,
+    Sampler &sampler,
+    Stats &stats)
+{
+    Packet packet;
+    uint32_t px[Packet::kSize];
+    uint32_t py[Packet::kSize];
+    Sampler samplers[Packet::kSize];
+    for (uint32_t by = tile.y0; by < tile.y1; by += kPacketSize) {
+        for (uint32_t bx = tile.x0; bx < tile.x1; bx += kPacketSize) {
+            uint32_t y1 = std::min(by + kPacketSize, tile.y1);
+            uint32_t x1 = std::min(bx + kPacketSize, tile.x1);
+
+            // Generate the camera rays through the block of pixels.
+            packet.count = 0;
+            for (uint32_t y = by; y < y1; ++y) {
+                for (uint32_t x = bx; x < x1; ++x) {
+                    if (film.converged(x, y)) {
+                        continue;
+                    }
+                    Sampler &s = samplers[packet.count];
+                    s = sampler;
+                    s.start(x + (uint64_t) y * mDesc.FilmWidth, pass);
+                    Vec2 u1 = s.Rand2d();
+                    Vec2 u2 = s.Rand2d();
+                    packet.rays[packet.count] =
+                        mCamera.rayto(film.sample(x, y, u1), u2);
+                    px[packet.count] = x;
+                    py[packet.count] = y;
+                    packet.count++;
+                }
+            }
+
+            // Trace the packet and continue each path on its own.
+            Intersect(packet, 0, kRealMax, &stats);
+            stats.num_rays += packet.count;
+            STATS_ADD(&stats, num_camera_rays, packet.count);
+            for (size_t i = 0; i < packet.count; ++i) {
+                film.add(px[i], py[i], Radiance(
+                    packet.rays[i],
+                    packet.hits[i],
+                    packet.isects[i],
+                    samplers[i],
+                    stats));
+            }
         }
     }
+}
 
-    // Update the bitmap.
-    uint8_t *px = &mGLBitmap[0];
-    for (auto color : mFilm.m_pixels) {
-        color /= (double) mNumSamples;
-        *px++ = static_cast<uint8_t>(255.0 * std::sqrt(color.r));
-        *px++ = static_cast<uint8_t>(255.0 * std::sqrt(color.g));
-        *px++ = static_cast<uint8_t>(255.0 * std::sqrt(color.b));
+///
+/// @brief Convert the film pixels to the specified bitmap with the tone map.
+/// The film is split in bands of kTileSize rows, converted in parallel by the
+/// workers.
+///
+void Tracer::Resolve(uint8_t *bitmap)
+{
+    if (mNumSamples == 0) {
+        return;
     }
+
+    STATS_TIMER(&mStats, resolve_time);
+    const uint32_t height = mFilm.m_height;
+    const size_t num_bands = (height + kTileSize - 1) / kTileSize;
+    mScheduler->Run(num_bands, [&] (size_t band, size_t worker) {
+        uint32_t y0 = (uint32_t) (band * kTileSize);
+        uint32_t y1 = std::min(y0 + (uint32_t) kTileSize, height);
+        ToneMap::Resolve(mToneMap, mFilm, y0, y1, bitmap);
+    });
+}
+
+///
+/// @brief Copy the film radiance to the frame, for the display to resolve.
+/// Each pixel holds its sample sums and its sample count, so the display
+/// normalizes adaptive pixels by their own counts. Only the tiles sampled
+/// since the frame was last filled are copied, in parallel by the workers.
+///
+void Tracer::Snapshot(Frame &frame)
+{
+    STATS_TIMER(&mStats, resolve_time);
+    std::vector<size_t> tiles;
+    for (size_t k = 0; k < mTiles.size(); ++k) {
+        if (frame.passes[k] != mTilePasses[k]) {
+            tiles.push_back(k);
+        }
+    }
+
+    mScheduler->Run(tiles.size(), [&] (size_t task, size_t worker) {
+        const Tile &tile = mTiles[tiles[task]];
+        for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+            for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+                const size_t i = (size_t) y * mFilm.m_width + x;
+                const Color &color = mFilm.m_pixels[i];
+                float *texel = &frame.radiance[4 * i];
+                texel[0] = (float) color.r;
+                texel[1] = (float) color.g;
+                texel[2] = (float) color.b;
+                texel[3] = (float) mFilm.m_counts[i];
+            }
+        }
+    });
+}
+
+///
+/// @brief Queue the tiles completed since the last call to the image writer.
+/// A tile is complete once all its pixels have converged, or once the film
+/// is complete. Runs of completed tiles along a tile row are queued as single
+/// regions, so the writer never holds more than a row of tiles at a time.
+///
+void Tracer::Stream(ImageWriter &writer)
+{
+    STATS_TIMER(&mStats, resolve_time);
+    const bool complete = IsComplete();
+    std::vector<size_t> tiles;
+    for (size_t k = 0; k < mTiles.size(); ++k) {
+        if (!mTileWritten[k] && (complete || IsConverged(mTiles[k]))) {
+            mTileWritten[k] = 1;
+            tiles.push_back(k);
+        }
+    }
+    for (const auto &region : TileRuns(tiles)) {
+        writer.push(region, mFilm.radiance(region));
+    }
+}
+
+///
+/// @brief Save the film to an image file, in the format given by the file
+/// extension: PPM or PNG mapped by the tone map, or PFM or OpenEXR with the
+/// radiance averaged over the samples of each pixel.
+///
+void Tracer::Save(const std::string &filename) const
+{
+    ImageFile image = ImageFile::Create(
+        filename, mFilm.m_width, mFilm.m_height, mToneMap);
+    std::vector<size_t> tiles(mTiles.size());
+    for (size_t k = 0; k < tiles.size(); ++k) {
+        tiles[k] = k;
+    }
+    for (const auto &region : TileRuns(tiles)) {
+        image.write(region, mFilm.radiance(region).data());
+    }
+    image.close();
 }
 
 ///
@@ -124,19 +603,18 @@ void Tracer::Update()
 ///
 void Tracer::Render()
 {
+    // Record the display frame pacing.
+    auto now = std::chrono::steady_clock::now();
+    if (mGLNumFrames++ == 0) {
+        mGLStartTime = now;
+    }
+    mGLTime = std::chrono::duration<double>(now - mGLStartTime).count();
+
     // Update the drawable state.
-    glBindTexture(GL_TEXTURE_2D, mGLTexture);
-    glTexImage2D(
-        GL_TEXTURE_2D,
-        0,                      // level of detail - 0 is base bitmap
-        GL_RGB8,                // texture internal format
-        kFilmWidth,             // texture width
-        kFilmHeight,            // texture height
-        0,                      // border parameter - must be 0 (legacy)
-        GL_RGB,                 // pixel format
-        GL_UNSIGNED_BYTE,       // type of the pixel data(GLubyte)
-        &mGLBitmap[0]);         // pointer to the pixel data
-    glBindTexture(GL_TEXTURE_2D, 0);
+    {
+        STATS_TIMER(&mGLStats, upload_time);
+        Upload();
+    }
 
     // Specify draw state modes.
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
@@ -158,13 +636,292 @@ void Tracer::Render()
 #endif
     GLenum texunit = 0;
     Graphics::SetUniform(mGLProgram, "u_texsampler", GL_SAMPLER_2D, &texunit);
+    GLint display = (GLint) mDesc.Display;
+    GLint curve = (GLint) mDesc.ToneCurve;
+    GLfloat exposure = (GLfloat) mGLExposure;
+    Graphics::SetUniform(mGLProgram, "u_display", GL_INT, &display);
+    Graphics::SetUniform(mGLProgram, "u_curve", GL_INT, &curve);
+    Graphics::SetUniform(mGLProgram, "u_exposure", GL_FLOAT, &exposure);
     Graphics::BindTexture(GL_TEXTURE_2D, GL_TEXTURE0 + texunit, mGLTexture);
     Graphics::RenderMesh(mGLMesh);
     glBindVertexArray(0);
     glUseProgram(0);
 }
 
+///
+/// @brief Stream the dirty regions of the front frame to the texture, through
+/// the next pixel buffer in a ring of kNumPixelBuffers. The texture storage is
+/// allocated once, and only updated with glTexSubImage2D.
+///
+/// The upload never waits for the gpu. A fence marks the completion of the
+/// upload from each buffer. If the gpu has not yet completed the previous
+/// upload from the next buffer, the upload is skipped and the dirty tiles are
+/// uploaded with the next frame. Otherwise, the buffer is free and is mapped
+/// without synchronization. The gpu time of each upload is measured with a
+/// timer query, and read back once the fence of its buffer has signaled.
+///
+void Tracer::Upload()
+{
+    const Frame &frame = mExchange->front();
+    std::vector<Tile> regions = DirtyRegions(frame);
+    if (regions.empty()) {
+        return;
+    }
+
+    const size_t k = mGLFrame % kNumPixelBuffers;
+    if (mGLFences[k] != 0) {
+        if (glClientWaitSync(mGLFences[k], 0, 0) == GL_TIMEOUT_EXPIRED) {
+            return;
+        }
+        glDeleteSync(mGLFences[k]);
+        mGLFences[k] = 0;
+    }
+    if (mGLQueryPending[k]) {
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(mGLQueries[k], GL_QUERY_RESULT, &elapsed);
+        mGLStats.gpu_upload_time += 1.0e-9 * elapsed;
+        mGLQueryPending[k] = false;
+    }
+
+    // Copy the dirty regions to the buffer, with the layout of the frame.
+    const bool radiance = (mDesc.Display == TracerDesc::DisplayRadiance);
+    const size_t pixel_size = radiance ? 4 * sizeof(float) : 3;
+    const uint8_t *pixels = radiance
+        ? reinterpret_cast<const uint8_t *>(frame.radiance.data())
+        : frame.bitmap.data();
+    const size_t stride = pixel_size * mFilm.m_width;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mGLPixelBuffers[k]);
+    uint8_t *data = static_cast<uint8_t *>(glMapBufferRange(
+        GL_PIXEL_UNPACK_BUFFER,
+        0,
+        stride * mFilm.m_height,
+        GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+    if (data == nullptr) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return;
+    }
+    for (const auto &region : regions) {
+        const size_t size = pixel_size * (region.x1 - region.x0);
+        for (uint32_t y = region.y0; y < region.y1; ++y) {
+            const size_t offset = y * stride + pixel_size * region.x0;
+            std::copy_n(pixels + offset, size, data + offset);
+        }
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    // Upload each region from its offset in the buffer.
+    const bool timed = Stats::Enabled();
+    if (timed) {
+        glBeginQuery(GL_TIME_ELAPSED, mGLQueries[k]);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, mFilm.m_width);
+    glBindTexture(GL_TEXTURE_2D, mGLTexture);
+    for (const auto &region : regions) {
+        const size_t offset = region.y0 * stride + pixel_size * region.x0;
+        glTexSubImage2D(
+            GL_TEXTURE_2D,
+            0,                          // level of detail - 0 is base bitmap
+            region.x0,                  // region offset
+            region.y0,
+            region.x1 - region.x0,      // region width
+            region.y1 - region.y0,      // region height
+            radiance ? GL_RGBA : GL_RGB,                // pixel format
+            radiance ? GL_FLOAT : GL_UNSIGNED_BYTE,     // pixel data type
+            reinterpret_cast<const void *>(offset));
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (timed) {
+        glEndQuery(GL_TIME_ELAPSED);
+        mGLQueryPending[k] = true;
+    }
+    mGLFences[k] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    mGLTilePasses = frame.passes;
+    mGLFrame++;
+}
+
+///
+/// @brief Return the regions of the frame covered by the tiles sampled since
+/// the last upload, whose last sample pass differs from the uploaded one. Runs
+/// of dirty tiles along a tile row are merged into a single region, and
+/// consecutive regions that span whole rows are merged into a single block.
+/// A film sampled everywhere is a single region.
+///
+std::vector<Tile> Tracer::DirtyRegions(const Frame &frame) const
+{
+    std::vector<size_t> tiles;
+    for (size_t k = 0; k < mTiles.size(); ++k) {
+        if (frame.passes[k] != mGLTilePasses[k]) {
+            tiles.push_back(k);
+        }
+    }
+
+    std::vector<Tile> blocks;
+    for (const auto &region : TileRuns(tiles)) {
+        const bool full = (region.x0 == 0 && region.x1 == mFilm.m_width);
+        if (full && !blocks.empty() &&
+            blocks.back().x0 == 0 &&
+            blocks.back().x1 == mFilm.m_width &&
+            blocks.back().y1 == region.y0) {
+            blocks.back().y1 = region.y1;
+        } else {
+            blocks.push_back(region);
+        }
+    }
+    return blocks;
+}
+
+///
+/// @brief Return the regions covered by the specified tiles, in increasing
+/// order, merging runs of adjacent tiles along a tile row into a single
+/// region.
+///
+std::vector<Tile> Tracer::TileRuns(const std::vector<size_t> &tiles) const
+{
+    std::vector<Tile> regions;
+    for (auto k : tiles) {
+        const Tile &tile = mTiles[k];
+        if (!regions.empty() &&
+            regions.back().y0 == tile.y0 &&
+            regions.back().x1 == tile.x0) {
+            regions.back().x1 = tile.x1;
+        } else {
+            regions.push_back(tile);
+        }
+    }
+    return regions;
+}
+
 /// ---------------------------------------------------------------------------
+/// @brief Compute the line parameter and primitive index of the closest
+/// intersection of the ray with the world, using the acceleration structure
+/// specified in the tracer parameters. The linear query tests every sphere
+/// in the world with the vector kernel. The meshes are always tested with
+/// their own hierarchies, in the interval shortened by the sphere hit.
+///
+bool Tracer::Intersect(
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Real &t,
+    uint32_t &id,
+    Stats *stats) const
+{
+    bool is_a_hit;
+    if (mDesc.Accel == TracerDesc::AccelBvh) {
+        is_a_hit = Bvh::Intersect(
+            mBvh, ray, t_min, t_max, t, id, STATS_BVH(stats));
+    } else {
+        STATS_ADD(stats, num_sphere_tests, mSpheres.m_size);
+        is_a_hit = Spheres::Intersect(
+            mSpheres, 0, mSpheres.m_size, ray, t_min, t_max, t, id);
+    }
+    if (!mScene.m_meshes.empty() && mScene.intersect_meshes(
+            ray, t_min, is_a_hit ? t : t_max, t, id, STATS_BVH(stats))) {
+        is_a_hit = true;
+    }
+    return is_a_hit;
+}
+
+///
+/// @brief Compute the closest intersection of the ray with the world.
+///
+bool Tracer::Intersect(
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Isect &isect,
+    Stats *stats) const
+{
+    Real t;
+    uint32_t id;
+    if (Intersect(ray, t_min, t_max, t, id, stats)) {
+        mScene.get_isect(id, ray, t, isect);
+        return true;
+    }
+    return false;
+}
+
+///
+/// @brief Compute the closest intersections of a packet of rays with the world.
+/// Without a bvh, the packet rays are intersected one at a time. The meshes
+/// are tested one ray at a time, after the spheres.
+///
+void Tracer::Intersect(
+    Packet &packet,
+    const Real t_min,
+    const Real t_max,
+    Stats *stats) const
+{
+    if (mDesc.Accel != TracerDesc::AccelBvh) {
+        for (size_t i = 0; i < packet.count; ++i) {
+            packet.hits[i] = Intersect(
+                packet.rays[i], t_min, t_max, packet.isects[i], stats);
+        }
+        return;
+    }
+
+    Bvh::Intersect(mBvh, mScene.m_primitives, packet, t_min, t_max,
+        STATS_BVH(stats));
+    if (mScene.m_meshes.empty()) {
+        return;
+    }
+    for (size_t i = 0; i < packet.count; ++i) {
+        const Ray &ray = packet.rays[i];
+        Real t;
+        uint32_t id;
+        if (mScene.intersect_meshes(ray, t_min,
+                packet.hits[i] ? packet.isects[i].t : t_max,
+                t, id, STATS_BVH(stats))) {
+            packet.hits[i] = true;
+            mScene.get_isect(id, ray, t, packet.isects[i]);
+        }
+    }
+}
+
+///
+/// @brief Return true if the ray hits any primitive in the interval. Without a
+/// bvh, the sphere store is scanned for the closest hit.
+///
+bool Tracer::Occluded(
+    const Ray &ray,
+    const Real t_min,
+    const Real t_max,
+    Stats *stats) const
+{
+    if (mDesc.Accel == TracerDesc::AccelBvh) {
+        if (Bvh::Occluded(mBvh, ray, t_min, t_max, STATS_BVH(stats))) {
+            return true;
+        }
+    } else {
+        Real t;
+        uint32_t id;
+        STATS_ADD(stats, num_sphere_tests, mSpheres.m_size);
+        if (Spheres::Intersect(
+                mSpheres, 0, mSpheres.m_size, ray, t_min, t_max, t, id)) {
+            return true;
+        }
+    }
+    return mScene.occluded_meshes(ray, t_min, t_max, STATS_BVH(stats));
+}
+
+///
+/// @brief Return the background radiance along a ray that misses the world.
+///
+Color Tracer::Background(const Ray &ray) const
+{
+    Real tx = 0.5 * (ray.d.x + 1.0);
+    Real ty = 0.5 * (ray.d.y + 1.0);
+    Color sky = Color{1.0, 1.0, 1.0} * (1.0 - tx - ty) +
+                Color{0.7, 0.7, 0.9} * tx +
+                Color{0.7, 0.9, 0.9} * ty;
+    return sky * mDesc.SkyScale;
+}
+
+///
 /// @brief Return the radiance along the primary ray using Monte Carlo
 /// integration by tracing a path through the world.
 ///
@@ -179,48 +936,279 @@ void Tracer::Render()
 /// reflected from light sources and radiance indirectly reflected from other
 /// surfaces in the world.
 ///
-Color Tracer::Radiance(Ray &ray)
+Color Tracer::Radiance(Ray &ray, Sampler &sampler, Stats &stats)
+{
+    Isect isect;
+    stats.num_rays++;
+    STATS_ADD(&stats, num_camera_rays, 1);
+    bool is_a_hit = Intersect(ray, 0, kRealMax, isect, &stats);
+    return Radiance(ray, is_a_hit, isect, sampler, stats);
+}
+
+///
+/// @brief Return the radiance along the primary ray, given the closest
+/// intersection of the primary ray with the world.
+///
+/// The path is split at the primary intersection into SplitFactor independent
+/// paths, and their radiance is averaged. This amortizes the camera ray and
+/// the primary intersection over several samples of the first bounce, where
+/// most of the variance of the estimate comes from.
+///
+Color Tracer::Radiance(
+    Ray &ray,
+    bool is_a_hit,
+    const Isect &primary,
+    Sampler &sampler,
+    Stats &stats)
+{
+    // Return the background color if no primitive is intersected.
+    if (!is_a_hit) {
+        STATS_PATH(&stats, 1);
+        return Background(ray);
+    }
+    STATS_ADD(&stats,
+        num_hits[mScene.m_materials[primary.material].type], 1);
+
+    Color L = Color::Black;
+    for (size_t k = 0; k < mDesc.SplitFactor; ++k) {
+        L += Scattered(primary, sampler, stats);
+    }
+    return L / (Real) mDesc.SplitFactor;
+}
+
+///
+/// @brief Return the radiance scattered at the intersection in its outgoing
+/// direction, by continuing the path from the intersection point.
+///
+/// At each diffuse hit, the direct light from one emitter is sampled with a
+/// shadow ray. The emitted radiance found by bsdf sampling from a diffuse hit
+/// is then weighted against that light sample with the power heuristic. Hits
+/// on emitters from the camera or from specular bounces keep a unit weight,
+/// since light sampling cannot reach those paths.
+///
+Color Tracer::Scattered(const Isect &hit, Sampler &sampler, Stats &stats)
 {
     Color L = Color::Black;         // path radiance
     Color beta = Color::White;      // path attenuation coefficient
-    size_t depth = 0;               // path depth
+    size_t depth = 1;               // path depth
+    Isect isect = hit;
+    uint32_t id = 0;                // primitive of the current hit
+    Vec3 origin{};                  // origin of the ray to the current hit
+    Real pdf_prev = 0;              // bsdf pdf of the ray to the current hit
+    bool weighted = false;          // weight the emission of the current hit
+    const uint32_t dimension = sampler.m_dimension;
     while (true) {
-        // Stop path tracing if we exceed the maximum path depth.
-        if (++depth >= kMaxSampleDepth) {
-            L = Color::Red;
-            break;
-        }
+        const Material &material = mScene.m_materials[isect.material];
+        const uint32_t bounce = dimension + (depth - 1) * kBounceDimensions;
 
-        // Compute closest intersection of ray with the world and return the
-        // background color if not primitive is intersected.
-        Isect isect;
-        double t_min = 0.001;
-        double t_max = DBL_MAX;
-        if (!Primitive::Intersect(mWorld, ray, t_min, t_max, isect)) {
-            // Return the background color if no intersection
-            double tx = 0.5 * (ray.d.x + 1.0);
-            double ty = 0.5 * (ray.d.y + 1.0);
-            Color background = Color{1.0, 1.0, 1.0} * (1.0 - tx - ty) +
-                               Color{0.7, 0.7, 0.9} * tx +
-                               Color{0.7, 0.9, 0.9} * ty;
-            L += beta * background;
-            break;
+        // Add the radiance emitted by the hit towards the path.
+        if (material.type == Material::Emitter) {
+            Real w = weighted ? EmitterWeight(origin, pdf_prev, id) : 1;
+            L += beta * material.Le * w;
         }
 
-        // Compute scattering direction and corresponding bsdf.
-        math::vec2d u = mSampler.Rand2d();
-        math::vec3d wo = isect.wo;
-        math::vec3d wi;
+        // Compute scattering direction and corresponding bsdf. Each bounce
+        // draws its variates from its own fixed set of sample dimensions.
+        sampler.seek(bounce);
+        Vec2 u = sampler.Rand2d();
+        Vec3 wo = isect.wo;
+        Vec3 wi;
         Color bsdf;
-        double pdf;
-        if (!Isect::Scatter(isect, u, wo, wi, bsdf, pdf)) {
+        Real pdf;
+        if (!Isect::Scatter(isect, material, u, wo, wi, bsdf, pdf)) {
             break;
         }
+
+        // Sample the direct light of an emitter at diffuse hits.
+        if (mDesc.DirectLighting && material.type == Material::Diffuse) {
+            Ray shadow;
+            Real t_max;
+            Color Ld;
+            sampler.seek(bounce + 3);
+            if (SampleLight(isect, material, sampler, shadow, t_max, Ld)) {
+                stats.num_rays++;
+                STATS_ADD(&stats, num_shadow_rays, 1);
+                if (!Occluded(shadow, 0, t_max, &stats)) {
+                    L += beta * Ld;
+                }
+            }
+        }
         beta *= bsdf * (Isect::AbsDot(isect.n, wi) / pdf);
 
         // Spawn a ray in the direction oposite the incident direction
-        ray = Isect::Spawn(isect, wi);
+        Ray ray = Isect::Spawn(isect, wi);
+        origin = ray.o;
+        pdf_prev = pdf;
+        weighted = mDesc.DirectLighting && material.type == Material::Diffuse;
+
+        // Stop path tracing if we exceed the maximum path depth, and keep the
+        // radiance gathered by the path.
+        if (++depth >= mDesc.MaxSampleDepth) {
+            STATS_ADD(&stats, num_depth_cap, 1);
+            break;
+        }
+
+        // Stop path tracing if the path does not survive russian roulette.
+        sampler.seek(bounce + 2);
+        if (!Roulette(depth, beta, sampler)) {
+            break;
+        }
+
+        // Compute closest intersection of ray with the world, and return the
+        // background color if no primitive is intersected.
+        stats.num_rays++;
+        STATS_ADD(&stats, num_secondary_rays, 1);
+        Real t;
+        if (!Intersect(ray, 0, kRealMax, t, id, &stats)) {
+            L += beta * Background(ray);
+            break;
+        }
+        mScene.get_isect(id, ray, t, isect);
+        STATS_ADD(&stats, num_hits[mScene.m_materials[isect.material].type], 1);
     }
+    STATS_PATH(&stats, depth);
 
+    // Move past the dimensions of the last bounce, so the next split path
+    // starts at a bounce boundary.
+    sampler.seek(dimension + depth * kBounceDimensions);
     return L;
 }
+
+///
+/// @brief Russian roulette. Beyond the roulette depth, terminate the path with
+/// probability 1 - p, where the survival probability p is the largest channel
+/// of the path attenuation, at most one. Surviving paths are reweighted by 1/p,
+/// so the estimate remains unbiased while low throughput paths end early.
+///
+bool Tracer::Roulette(const size_t depth, Color &beta, Sampler &sampler) const
+{
+    if (mDesc.RouletteDepth == 0 || depth <= mDesc.RouletteDepth) {
+        return true;
+    }
+
+    Real p = std::min((Real) 1, std::max(std::max(beta.r, beta.g), beta.b));
+    if (sampler.Rand1d() >= p) {
+        return false;
+    }
+    beta /= p;
+    return true;
+}
+
+///
+/// @brief Return the solid angle pdf of sampling the direction towards a point
+/// on the emitter sphere from the point p, including the probability of
+/// selecting the emitter. Points inside the sphere, emitter triangles, which
+/// are not sampled as lights, and scenes without lights have a zero pdf.
+///
+Real Tracer::LightPdf(const Vec3 &p, const uint32_t id) const
+{
+    if (mScene.m_lights.empty() || id >= mScene.m_primitives.size()) {
+        return 0;
+    }
+    const Primitive &light = mScene.m_primitives[id];
+    Vec3 oc = light.centre - p;
+    Real d2 = math::dot(oc, oc);
+    Real r2 = light.radius * light.radius;
+    if (d2 <= r2) {
+        return 0;
+    }
+    Real sin2_theta_max = r2 / d2;
+    Real cos_theta_max = std::sqrt(std::max((Real) 0, 1 - sin2_theta_max));
+    Real pdf = Sampler::UniformConePdf(cos_theta_max, sin2_theta_max);
+    return pdf / mScene.m_lights.size();
+}
+
+///
+/// @brief Sample the direct light at a diffuse hit. Select an emitter uniformly
+/// and sample a direction in the cone it subtends from the hit point. Return
+/// the shadow ray towards the emitter, the interval it must be unoccluded in,
+/// and the light contribution, weighted against bsdf sampling of the same
+/// direction with the power heuristic.
+///
+bool Tracer::SampleLight(
+    const Isect &isect,
+    const Material &material,
+    Sampler &sampler,
+    Ray &shadow,
+    Real &t_max,
+    Color &Ld) const
+{
+    const size_t num_lights = mScene.m_lights.size();
+    if (num_lights == 0) {
+        return false;
+    }
+
+    // Select the emitter and sample a direction inside its cone.
+    Real u_light = sampler.Rand1d();
+    Vec2 u = sampler.Rand2d();
+    size_t k = std::min((size_t) (u_light * num_lights), num_lights - 1);
+    const uint32_t id = mScene.m_lights[k];
+    const Primitive &light = mScene.m_primitives[id];
+    Vec3 oc = light.centre - isect.p;
+    Real d2 = math::dot(oc, oc);
+    Real r2 = light.radius * light.radius;
+    if (d2 <= r2) {
+        return false;
+    }
+    Real sin2_theta_max = r2 / d2;
+    Real cos_theta_max = std::sqrt(std::max((Real) 0, 1 - sin2_theta_max));
+    Real pdf_cone = Sampler::UniformConePdf(cos_theta_max, sin2_theta_max);
+    if (pdf_cone == 0) {
+        return false;
+    }
+    Ortho uvw = Ortho::create_from_w(oc);
+    Vec3 wi = uvw.local_to_world(
+        Sampler::UniformCone(u, cos_theta_max, sin2_theta_max));
+    if (!Isect::SameHemisphere(isect.n, isect.wo, wi)) {
+        return false;
+    }
+
+    // Find the emitter along the shadow ray, and stop the ray short of it.
+    shadow = Isect::Spawn(isect, wi);
+    Real t;
+    if (!Primitive::Intersect(light, shadow, 0, kRealMax, t)) {
+        return false;
+    }
+    t_max = t * ((Real) 1 - kShadowOffset);
+
+    // Weight the light sample against bsdf sampling.
+    Real cos_theta_i = Isect::AbsDot(isect.n, wi);
+    Real pdf_light = pdf_cone / num_lights;
+    Real pdf_bsdf = Sampler::CosineHemispherePdf(cos_theta_i);
+    Real w = PowerHeuristic(pdf_light, pdf_bsdf);
+    const Color &Le = mScene.m_materials[light.material].Le;
+    Ld = material.rho * Le * (M_1_PI * cos_theta_i * w / pdf_light);
+    return true;
+}
+
+///
+/// @brief Return the weight of the radiance emitted by an emitter hit with
+/// bsdf sampling, from a ray with origin o and bsdf pdf.
+///
+Real Tracer::EmitterWeight(
+    const Vec3 &o,
+    const Real pdf,
+    const uint32_t id) const
+{
+    return PowerHeuristic(pdf, LightPdf(o, id));
+}
+
+///
+/// @brief Power heuristic, with exponent two, of two sampling strategies with
+/// pdfs f and g. Return the weight of the strategy with pdf f. The weight is
+/// computed from the ratio of the pdfs, so the pdf of a small emitter far
+/// away does not overflow when squared.
+///
+Real Tracer::PowerHeuristic(const Real f, const Real g)
+{
+    if (f > g) {
+        Real r = g / f;
+        return 1 / (1 + r * r);
+    }
+    if (g > 0) {
+        Real r = f / g;
+        Real r2 = r * r;
+        return r2 / (1 + r2);
+    }
+    return 0;
+}
@@ -10,36 +10,210 @@
 #ifndef TRACER_H_
 #define TRACER_H_
 
+#include <string>
 #include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 #include "common.h"
 #include "camera.h"
 #include "color.h"
 #include "film.h"
+#include "frame.h"
+#include "image.h"
 #include "isect.h"
 #include "ray.h"
 #include "material.h"
 #include "primitive.h"
+#include "scene.h"
+#include "bvh.h"
+#include "packet.h"
 #include "sampler.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "tonemap.h"
+#include "wavefront.h"
+
+///
+/// @brief Tracer parameters. Default values are given by the model parameters.
+///
+struct TracerDesc {
+    // Acceleration structure used to compute ray-world intersections.
+    enum : uint32_t {
+        AccelLinear = 0,
+        AccelBvh
+    };
+
+    // Path integrator used to compute the film samples.
+    enum : uint32_t {
+        IntegratorPath = 0,
+        IntegratorWavefront
+    };
+
+    // Display of the film, resolved on the cpu to a bitmap, or uploaded as
+    // raw radiance and resolved by the fragment shader.
+    enum : uint32_t {
+        DisplayBitmap = 0,
+        DisplayRadiance
+    };
+
+    uint32_t FilmWidth = kFilmWidth;            // film width in pixels
+    uint32_t FilmHeight = kFilmHeight;          // film height in pixels
+    size_t NumSamples = kNumSamples;            // number of samples per pixel
+    size_t MaxSampleDepth = kMaxSampleDepth;    // maximum path depth
+    size_t RouletteDepth = kRouletteDepth;      // roulette start, 0 disables
+    size_t SplitFactor = kSplitFactor;          // paths per primary hit
+    size_t MinSamples = kMinSamples;            // samples before noise tests
+    Real NoiseThreshold = kNoiseThreshold;      // pixel error, 0 disables
+    Real NoiseTarget = kNoiseTarget;            // film error, 0 disables
+    size_t NumThreads =                         // number of worker threads
+        std::max(1u, std::thread::hardware_concurrency());
+    uint32_t SamplerType = Sampler::Random;     // sampler type
+    uint64_t Seed = kRandomSeed;                // sampler seed
+    uint64_t SceneSeed = kRandomSeed;           // scene seed
+    int32_t NumCells = kNumCells;               // scene grid cells
+    int32_t NumLights = kNumLights;             // scene small emitters
+    Real SkyScale = kSkyScale;                  // background radiance scale
+    bool DirectLighting = true;                 // next event estimation
+    uint32_t Accel = AccelBvh;                  // acceleration structure
+    bool Packets = false;                       // trace camera ray packets
+    uint32_t Integrator = IntegratorPath;       // path integrator
+    uint32_t ToneCurve = ToneMap::Sqrt;         // bitmap tone curve
+    bool Dither = false;                        // blue noise dithering
+    Real Exposure = kExposure;                  // radiance scale
+    uint32_t Display = DisplayRadiance;         // film display
+    bool Headless = false;                      // no OpenGL context
+    std::string SceneFile;                      // scene file, or generated
+    size_t FilmMemory = kFilmMemory;            // film memory budget in bytes
+};
 
 struct Tracer {
+    TracerDesc mDesc;
     Camera mCamera;
     Film mFilm;
-    Sampler mSampler;
+    std::vector<Tile> mTiles;
+    std::vector<size_t> mActiveTiles;
     size_t mNumSamples;
-    std::vector<Primitive> mWorld;
+    Real mNoise;
+    size_t mNumRays;
+    Scene mScene;
+    Spheres mSpheres;
+    Bvh mBvh;
+
+    std::unique_ptr<Scheduler> mScheduler;
+    std::vector<Sampler> mSamplers;
+    std::vector<Wavefront> mWavefronts;
+    Stats mStats;
+    std::vector<Stats> mThreadStats;
+    std::vector<uint32_t> mTilePasses;
+    std::vector<uint8_t> mTileWritten;
+    std::vector<Film> mTileFilms;
 
-    std::vector<uint8_t> mGLBitmap;
+    std::unique_ptr<FrameExchange> mExchange;
+    std::thread mTraceThread;
+    std::atomic<bool> mQuit;
+    double mTraceTime;
+
+    ToneMap mToneMap;
+    std::vector<uint32_t> mGLTilePasses;
+    Real mGLExposure;
+    Stats mGLStats;
+    Stats mGLLastStats;
+    size_t mGLNumFrames;
+    size_t mGLNumSamples;
+    std::chrono::steady_clock::time_point mGLStartTime;
+    double mGLTime;
     Graphics::Mesh mGLMesh;
     GLuint mGLTexture;
+    GLuint mGLPixelBuffers[kNumPixelBuffers];
+    GLsync mGLFences[kNumPixelBuffers];
+    GLuint mGLQueries[kNumPixelBuffers];
+    bool mGLQueryPending[kNumPixelBuffers];
+    size_t mGLFrame;
     GLuint mGLProgram;
     GLuint mGLVao;
 
-    void Initialize();
+    void Initialize(const TracerDesc &desc);
     void Cleanup();
     void Update();
     void Render();
+    void Upload();
+    std::vector<Tile> DirtyRegions(const Frame &frame) const;
+    std::vector<Tile> TileRuns(const std::vector<size_t> &tiles) const;
+    void Trace();
+
+    bool IsAdaptive() const;
+    bool IsOutOfCore() const;
+    bool IsComplete() const;
+    bool IsConverged(const Tile &tile) const;
+    void Sample();
+    void SampleTile(
+        Film &film,
+        const Tile &tile,
+        const size_t pass,
+        Sampler &sampler,
+        Stats &stats);
+    void SampleTilePackets(
+        Film &film,
+        const Tile &tile,
+        const size_t pass,
+        Sampler &sampler,
+        Stats &stats);
+    void Resolve(uint8_t *bitmap);
+    void Snapshot(Frame &frame);
+    void Stream(ImageWriter &writer);
+    void RenderTiles(ImageWriter &writer);
+    size_t RenderTile(const Tile &tile, const size_t worker);
+    void Save(const std::string &filename) const;
 
-    Color Radiance(Ray &ray);
+    bool Intersect(
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Real &t,
+        uint32_t &id,
+        Stats *stats = nullptr) const;
+    bool Intersect(
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Isect &isect,
+        Stats *stats = nullptr) const;
+    void Intersect(
+        Packet &packet,
+        const Real t_min,
+        const Real t_max,
+        Stats *stats = nullptr) const;
+    bool Occluded(
+        const Ray &ray,
+        const Real t_min,
+        const Real t_max,
+        Stats *stats = nullptr) const;
+    Color Background(const Ray &ray) const;
+    Real LightPdf(const Vec3 &p, const uint32_t id) const;
+    bool SampleLight(
+        const Isect &isect,
+        const Material &material,
+        Sampler &sampler,
+        Ray &shadow,
+        Real &t_max,
+        Color &Ld) const;
+    Real EmitterWeight(
+        const Vec3 &o,
+        const Real pdf,
+        const uint32_t id) const;
+    static Real PowerHeuristic(const Real f, const Real g);
+    Color Radiance(Ray &ray, Sampler &sampler, Stats &stats);
+    Color Radiance(
+        Ray &ray,
+        bool is_a_hit,
+        const Isect &primary,
+        Sampler &sampler,
+        Stats &stats);
+    Color Scattered(const Isect &hit, Sampler &sampler, Stats &stats);
+    bool Roulette(const size_t depth, Color &beta, Sampler &sampler) const;
 };
 
 #endif // TRACER_H_
@@ -0,0 +1,328 @@
+//
+// wavefront.cpp
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#include <vector>
+#include <cfloat>
+#include "common.h"
+#include "color.h"
+#include "film.h"
+#include "isect.h"
+#include "ray.h"
+#include "material.h"
+#include "primitive.h"
+#include "sampler.h"
+#include "stats.h"
+#include "tracer.h"
+#include "wavefront.h"
+
+///
+/// @brief Trace a sample of the pass for each pixel in the tile of the film.
+/// Run the wavefront stages until every path in the tile has terminated.
+///
+void Wavefront::Trace(
+    Tracer &tracer,
+    Film &film,
+    const Tile &tile,
+    const size_t pass,
+    Sampler &sampler,
+    Stats &stats)
+{
+    m_pass = (uint32_t) pass;
+    Generate(tracer, film, tile, sampler);
+    while (!m_active.empty()) {
+        Intersect(tracer, stats);
+        Miss(tracer, stats);
+        Sort(tracer, stats);
+        m_shadow_rays.clear();
+        m_shadow_t.clear();
+        m_shadow_Ld.clear();
+        m_shadow_path.clear();
+        for (uint32_t type = 0; type < Material::NumTypes; ++type) {
+            Shade(tracer, type, sampler, stats);
+        }
+        Shadow(tracer, stats);
+        Compact();
+    }
+
+    for (size_t i = 0; i < m_L.size(); ++i) {
+        film.add(m_x[i], m_y[i], m_L[i]);
+    }
+}
+
+/// ---------------------------------------------------------------------------
+/// @brief Generate a camera ray towards a random point inside each pixel square
+/// of the tile that has not converged, and make every path active.
+///
+void Wavefront::Generate(
+    const Tracer &tracer,
+    const Film &film,
+    const Tile &tile,
+    Sampler &sampler)
+{
+    size_t size = 0;
+    for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+        for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+            size += film.converged(x, y) ? 0 : 1;
+        }
+    }
+    m_ox.resize(size);
+    m_oy.resize(size);
+    m_oz.resize(size);
+    m_dx.resize(size);
+    m_dy.resize(size);
+    m_dz.resize(size);
+    m_beta.resize(size);
+    m_L.resize(size);
+    m_x.resize(size);
+    m_y.resize(size);
+    m_depth.resize(size);
+    m_dimension.resize(size);
+    m_pdf.resize(size);
+    m_weighted.resize(size);
+    m_t.resize(size);
+    m_id.resize(size);
+    m_active.resize(size);
+
+    uint32_t i = 0;
+    for (uint32_t y = tile.y0; y < tile.y1; ++y) {
+        for (uint32_t x = tile.x0; x < tile.x1; ++x) {
+            if (!film.converged(x, y)) {
+                m_x[i] = x;
+                m_y[i] = y;
+                ++i;
+            }
+        }
+    }
+
+    // Draw the 4 camera variates of kLanes paths at a time with the vectorized
+    // generator. The last batch repeats its last pixel in the unused lanes.
+    const uint32_t width = tracer.mDesc.FilmWidth;
+    const uint32_t index = m_pass;
+    for (size_t begin = 0; begin < size; begin += Sampler::kLanes) {
+        const size_t count = std::min(Sampler::kLanes, size - begin);
+        uint64_t pixel[Sampler::kLanes];
+        for (size_t l = 0; l < Sampler::kLanes; ++l) {
+            size_t j = begin + std::min(l, count - 1);
+            pixel[l] = m_x[j] + (uint64_t) m_y[j] * width;
+        }
+        Real u[4][Sampler::kLanes];
+        Sampler::Rand4d(sampler, pixel, index, 0, u);
+
+        for (size_t l = 0; l < count; ++l) {
+            size_t j = begin + l;
+            Vec2 u1{u[0][l], u[1][l]};
+            Vec2 u2{u[2][l], u[3][l]};
+            Ray ray = tracer.mCamera.rayto(
+                film.sample(m_x[j], m_y[j], u1), u2);
+            m_ox[j] = ray.o.x;
+            m_oy[j] = ray.o.y;
+            m_oz[j] = ray.o.z;
+            m_dx[j] = ray.d.x;
+            m_dy[j] = ray.d.y;
+            m_dz[j] = ray.d.z;
+            m_beta[j] = Color::White;
+            m_L[j] = Color::Black;
+            m_depth[j] = 1;
+            m_dimension[j] = kCameraDimensions;
+            m_pdf[j] = 0;
+            m_weighted[j] = 0;
+            m_active[j] = (uint32_t) j;
+        }
+    }
+}
+
+///
+/// @brief Compute the closest intersection of each active path. Paths that
+/// miss the world are marked with an infinite line parameter.
+///
+void Wavefront::Intersect(const Tracer &tracer, Stats &stats)
+{
+    for (auto i : m_active) {
+        Ray ray{{m_ox[i], m_oy[i], m_oz[i]}, {m_dx[i], m_dy[i], m_dz[i]}};
+        if (!tracer.Intersect(ray, 0, kRealMax, m_t[i], m_id[i], &stats)) {
+            m_t[i] = kRealMax;
+        }
+        STATS_ADD(&stats, num_camera_rays, m_depth[i] == 1);
+        STATS_ADD(&stats, num_secondary_rays, m_depth[i] > 1);
+    }
+    stats.num_rays += m_active.size();
+}
+
+///
+/// @brief Add the background radiance of each path that missed the world to
+/// the path radiance, and terminate the path.
+///
+void Wavefront::Miss(const Tracer &tracer, Stats &stats)
+{
+    for (auto i : m_active) {
+        if (m_t[i] == kRealMax) {
+            Ray ray{{m_ox[i], m_oy[i], m_oz[i]}, {m_dx[i], m_dy[i], m_dz[i]}};
+            m_L[i] += m_beta[i] * tracer.Background(ray);
+            STATS_PATH(&stats, m_depth[i]);
+            m_depth[i] = 0;
+        }
+    }
+}
+
+///
+/// @brief Sort the hits of the active paths into queues by material type.
+///
+void Wavefront::Sort(const Tracer &tracer, Stats &stats)
+{
+    for (auto &queue : m_queues) {
+        queue.clear();
+    }
+    for (auto i : m_active) {
+        if (m_depth[i] > 0) {
+            uint32_t material = tracer.mScene.material(m_id[i]);
+            m_queues[tracer.mScene.m_materials[material].type].push_back(i);
+        }
+    }
+    for (uint32_t type = 0; type < Material::NumTypes; ++type) {
+        STATS_ADD(&stats, num_hits[type], m_queues[type].size());
+    }
+}
+
+///
+/// @brief Scatter the hits in the queue of the specified material type and
+/// spawn the next ray of each path. Paths that cannot scatter, or that exceed
+/// the maximum path depth, are terminated.
+///
+/// Emitter hits add their radiance to the path, weighted against light
+/// sampling as in the path integrator. Diffuse hits sample the direct light
+/// of an emitter and queue the shadow ray for the shadow stage.
+///
+void Wavefront::Shade(
+    const Tracer &tracer,
+    const uint32_t type,
+    Sampler &sampler,
+    Stats &stats)
+{
+    using ScatterFunction = bool (*)(
+        const Isect &,
+        const Material &,
+        const Vec2 &,
+        const Vec3 &,
+        Vec3 &,
+        Color &,
+        Real &);
+    static const ScatterFunction kScatter[Material::NumTypes] = {
+        Isect::ScatterDiffuse,
+        Isect::ScatterConductor,
+        Isect::ScatterDielectric,
+        Isect::ScatterEmitter};
+    const ScatterFunction scatter = kScatter[type];
+
+    for (auto i : m_queues[type]) {
+        // Compute the shading point of the closest hit.
+        Ray ray{{m_ox[i], m_oy[i], m_oz[i]}, {m_dx[i], m_dy[i], m_dz[i]}};
+        Isect isect;
+        tracer.mScene.get_isect(m_id[i], ray, m_t[i], isect);
+        const Material &material = tracer.mScene.m_materials[isect.material];
+
+        // Add the radiance emitted by the hit towards the path.
+        if (type == Material::Emitter) {
+            Real w = m_weighted[i]
+                ? tracer.EmitterWeight(ray.o, m_pdf[i], m_id[i])
+                : 1;
+            m_L[i] += m_beta[i] * material.Le * w;
+        }
+
+        // Compute scattering direction and corresponding bsdf, resuming the
+        // sample of the path at the dimensions of its bounce.
+        const uint32_t bounce = m_dimension[i];
+        sampler.start(
+            m_x[i] + (uint64_t) m_y[i] * tracer.mDesc.FilmWidth, m_pass);
+        sampler.seek(bounce);
+        Vec2 u = sampler.Rand2d();
+        Vec3 wo = isect.wo;
+        Vec3 wi;
+        Color bsdf;
+        Real pdf;
+        if (!scatter(isect, material, u, wo, wi, bsdf, pdf)) {
+            STATS_PATH(&stats, m_depth[i]);
+            m_depth[i] = 0;
+            continue;
+        }
+
+        // Sample the direct light of an emitter at diffuse hits.
+        const bool direct =
+            tracer.mDesc.DirectLighting && type == Material::Diffuse;
+        if (direct) {
+            Ray shadow;
+            Real t_max;
+            Color Ld;
+            sampler.seek(bounce + 3);
+            if (tracer.SampleLight(isect, material, sampler, shadow, t_max, Ld)) {
+                m_shadow_rays.push_back(shadow);
+                m_shadow_t.push_back(t_max);
+                m_shadow_Ld.push_back(m_beta[i] * Ld);
+                m_shadow_path.push_back(i);
+            }
+        }
+        m_beta[i] *= bsdf * (Isect::AbsDot(isect.n, wi) / pdf);
+
+        // Spawn a ray in the direction oposite the incident direction.
+        ray = Isect::Spawn(isect, wi);
+        m_ox[i] = ray.o.x;
+        m_oy[i] = ray.o.y;
+        m_oz[i] = ray.o.z;
+        m_dx[i] = ray.d.x;
+        m_dy[i] = ray.d.y;
+        m_dz[i] = ray.d.z;
+        m_pdf[i] = pdf;
+        m_weighted[i] = direct;
+
+        // Stop path tracing if we exceed the maximum path depth, or if the
+        // path does not survive russian roulette. The path keeps the radiance
+        // it gathered, and its queued shadow ray.
+        if (++m_depth[i] >= tracer.mDesc.MaxSampleDepth) {
+            STATS_ADD(&stats, num_depth_cap, 1);
+            STATS_PATH(&stats, m_depth[i]);
+            m_depth[i] = 0;
+        } else {
+            sampler.seek(bounce + 2);
+            if (!tracer.Roulette(m_depth[i], m_beta[i], sampler)) {
+                STATS_PATH(&stats, m_depth[i]);
+                m_depth[i] = 0;
+            }
+        }
+        m_dimension[i] += kBounceDimensions;
+    }
+}
+
+///
+/// @brief Trace the queued shadow rays, and add the light contribution of
+/// each unoccluded ray to its path radiance.
+///
+void Wavefront::Shadow(const Tracer &tracer, Stats &stats)
+{
+    for (size_t k = 0; k < m_shadow_rays.size(); ++k) {
+        if (!tracer.Occluded(m_shadow_rays[k], 0, m_shadow_t[k], &stats)) {
+            m_L[m_shadow_path[k]] += m_shadow_Ld[k];
+        }
+    }
+    stats.num_rays += m_shadow_rays.size();
+    STATS_ADD(&stats, num_shadow_rays, m_shadow_rays.size());
+}
+
+///
+/// @brief Remove the terminated paths from the active paths, keeping the order
+/// of the remaining ones.
+///
+void Wavefront::Compact()
+{
+    size_t count = 0;
+    for (auto i : m_active) {
+        if (m_depth[i] > 0) {
+            m_active[count++] = i;
+        }
+    }
+    m_active.resize(count);
+}
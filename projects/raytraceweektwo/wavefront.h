@@ -0,0 +1,97 @@
+//
+// wavefront.h
+//
+// Copyright (c) 2020 Carlos Braga
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the MIT License. See accompanying LICENSE.md or
+// https://opensource.org/licenses/MIT.
+//
+
+#ifndef WAVEFRONT_H_
+#define WAVEFRONT_H_
+
+#include <vector>
+#include "common.h"
+#include "color.h"
+#include "film.h"
+#include "material.h"
+#include "sampler.h"
+#include "stats.h"
+
+struct Tracer;
+
+///
+/// @brief Wavefront path integrator. Rather than tracing one path at a time,
+/// keep the state of every path in a tile in structure-of-arrays buffers and
+/// advance all paths together, one stage at a time:
+///  - generate the camera rays of every pixel in the tile,
+///  - compute the closest intersection of every active path,
+///  - terminate the paths that miss the world,
+///  - sort the hits by material type,
+///  - scatter the hits of each material type in its own loop,
+///  - compact the active paths, removing the terminated ones.
+/// Once every path has terminated, its radiance is added to its pixel as a
+/// single film sample. Converged pixels of the film are skipped.
+///
+struct Wavefront {
+    // Path state.
+    std::vector<Real> m_ox;                 // ray origin
+    std::vector<Real> m_oy;
+    std::vector<Real> m_oz;
+    std::vector<Real> m_dx;                 // ray direction
+    std::vector<Real> m_dy;
+    std::vector<Real> m_dz;
+    std::vector<Color> m_beta;              // path attenuation coefficient
+    std::vector<Color> m_L;                 // path radiance
+    std::vector<uint32_t> m_x;              // film pixel
+    std::vector<uint32_t> m_y;
+    std::vector<uint32_t> m_depth;          // path depth
+    std::vector<uint32_t> m_dimension;      // next sampler dimension
+    std::vector<Real> m_pdf;                // bsdf pdf of the path ray
+    std::vector<uint8_t> m_weighted;        // weight the emission of the hit
+
+    // Closest hit state.
+    std::vector<Real> m_t;                  // line parameter
+    std::vector<uint32_t> m_id;             // primitive index
+
+    // Active path and material queues.
+    std::vector<uint32_t> m_active;
+    std::vector<uint32_t> m_queues[Material::NumTypes];
+
+    // Shadow ray queue, with the path and the unoccluded light contribution.
+    std::vector<Ray> m_shadow_rays;
+    std::vector<Real> m_shadow_t;
+    std::vector<Color> m_shadow_Ld;
+    std::vector<uint32_t> m_shadow_path;
+
+    // Sample pass of the paths.
+    uint32_t m_pass;
+
+    // Trace a sample of the pass for each pixel in the tile of the film.
+    void Trace(
+        Tracer &tracer,
+        Film &film,
+        const Tile &tile,
+        const size_t pass,
+        Sampler &sampler,
+        Stats &stats);
+
+    // Wavefront stages.
+    void Generate(
+        const Tracer &tracer,
+        const Film &film,
+        const Tile &tile,
+        Sampler &sampler);
+    void Intersect(const Tracer &tracer, Stats &stats);
+    void Miss(const Tracer &tracer, Stats &stats);
+    void Sort(const Tracer &tracer, Stats &stats);
+    void Shade(
+        const Tracer &tracer,
+        const uint32_t type,
+        Sampler &sampler,
+        Stats &stats);
+    void Shadow(const Tracer &tracer, Stats &stats);
+    void Compact();
+};
+
+#endif // WAVEFRONT_H_